@@ -1,64 +1,225 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <cctype>
+#include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "cartridge.hpp"
 #include "util.hpp"
 
-int main(int argc, char *argv[]) {
-  util::init_log_level();
+namespace po = boost::program_options;
+namespace fs = std::filesystem;
 
-  if (argc < 2) {
-    exit(1);
-  }
+const char *help_msg =
+    "Usage:\n"
+    "  nesemu-cartridge <ROM>\n"
+    "    Print the mapper number, then PRG ROM and CHR ROM as hex.\n"
+    "  nesemu-cartridge --index <DIR> [--jobs N] [--output FILE]\n"
+    "    Recursively scan DIR for .nes files and write one JSON object per\n"
+    "    ROM (header fields and PRG/CHR CRC32 and SHA-1), sorted by path.\n";
 
-  std::ifstream in(argv[1]);
+std::vector<uint8_t> read_file(const fs::path &path) {
+  std::ifstream in(path, std::ios::binary);
   if (!in.is_open()) {
-    exit(1);
+    throw std::runtime_error("could not open file");
   }
+  std::vector<uint8_t> data(fs::file_size(path));
+  if (!in.read(reinterpret_cast<char *>(data.data()), data.size())) {
+    throw std::runtime_error("could not read file");
+  }
+  return data;
+}
 
-  uint8_t header[16];
-  if (!in.read(reinterpret_cast<char *>(header), 16)) {
-    throw std::runtime_error("failed to read header from iNES ROM");
+// Write bytes as uppercase hex with a single write rather than formatting each
+// byte separately
+void print_hex(std::span<const uint8_t> bytes) {
+  static constexpr char kDigits[] = "0123456789ABCDEF";
+  std::string out(bytes.size() * 2 + 1, '\n');
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    out[i * 2] = kDigits[bytes[i] >> 4];
+    out[i * 2 + 1] = kDigits[bytes[i] & 0x0F];
   }
+  std::cout.write(out.data(), out.size());
+}
 
-  // "NES\n"
-  if (!(header[0] == 0x4E && header[1] == 0x45 && header[2] == 0x53 &&
-        header[3] == 0x1A)) {
-    exit(1);
+int dump_rom(const std::string &path) {
+  auto image = cartridge::RomImage::load(path);
+  auto rom = image->bytes();
+  auto header = cartridge::parse_header(rom);
+  if (rom.size() < header.chr_offset() + header.chr_rom_size) {
+    return 1;
   }
 
-  std::size_t prg_rom_size_ = 16 * (1 << 10) * header[4];
-  std::size_t chr_rom_size_ = 8 * (1 << 10) * header[5];
+  std::cout << unsigned(header.mapper) << "\n";
+  print_hex(rom.subspan(header.prg_offset(), header.prg_rom_size));
+  print_hex(rom.subspan(header.chr_offset(), header.chr_rom_size));
+  return 0;
+}
 
-  bool has_trainer = (header[6] & 0b00000100) > 0;
-  if (has_trainer) {
-    char trainer[512];
-    in.read(trainer, 512);
-    // discard >:3
+std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += std::format("\\u{:04x}", static_cast<unsigned>(c));
+        } else {
+          out += c;
+        }
+    }
   }
+  return out + "\"";
+}
 
-  std::vector<uint8_t> prg_rom(prg_rom_size_);
-  std::vector<uint8_t> chr_rom(chr_rom_size_);
-
-  if (!in.read(reinterpret_cast<char *>(prg_rom.data()), prg_rom.size())) {
-    exit(1);
+std::string hex_string(std::span<const uint8_t> bytes) {
+  std::string out;
+  for (uint8_t b : bytes) {
+    out += std::format("{:02x}", b);
   }
-  if (!in.read(reinterpret_cast<char *>(chr_rom.data()), chr_rom.size())) {
-    exit(1);
+  return out;
+}
+
+const char *mirroring_name(cartridge::Mirroring mirroring) {
+  switch (mirroring) {
+    case cartridge::Mirroring::kHorizontal:
+      return "horizontal";
+    case cartridge::Mirroring::kVertical:
+      return "vertical";
+    case cartridge::Mirroring::kSingleScreenLower:
+    case cartridge::Mirroring::kSingleScreenUpper:
+      return "single-screen";
+    case cartridge::Mirroring::kFourScreen:
+      return "four-screen";
   }
+  return "unknown";
+}
 
-  uint8_t mapper_number = (header[6] >> 4) || (header[7] && 0xFF00);
+// One line of the index: the ROM's info, or the reason it couldn't be read
+std::string index_entry(const fs::path &path) {
+  std::string entry = "{\"path\":" + json_string(path.string());
+  try {
+    std::vector<uint8_t> rom = read_file(path);
+    cartridge::RomInfo info = cartridge::describe_rom(rom);
+    const cartridge::Header &h = info.header;
+    entry += std::format(
+        ",\"format\":\"{}\",\"mapper\":{},\"submapper\":{},"
+        "\"mirroring\":\"{}\",\"battery\":{},\"trainer\":{},"
+        "\"prg_rom_size\":{},\"chr_rom_size\":{},\"prg_ram_size\":{},"
+        "\"prg_nvram_size\":{},\"chr_ram_size\":{},\"chr_nvram_size\":{},"
+        "\"prg_crc32\":\"{:08x}\",\"chr_crc32\":\"{:08x}\","
+        "\"prg_sha1\":\"{}\",\"chr_sha1\":\"{}\"}}",
+        h.format == cartridge::Header::kNES2 ? "NES 2.0" : "iNES", h.mapper,
+        h.submapper, mirroring_name(h.mirroring), h.has_battery, h.has_trainer,
+        h.prg_rom_size, h.chr_rom_size, h.prg_ram_size, h.prg_nvram_size,
+        h.chr_ram_size, h.chr_nvram_size, info.prg_crc32, info.chr_crc32,
+        hex_string(info.prg_sha1), hex_string(info.chr_sha1));
+  } catch (const std::exception &e) {
+    entry += ",\"error\":" + json_string(e.what()) + "}";
+  }
+  return entry;
+}
 
-  std::cout << unsigned(mapper_number) << "\n";
-  for (std::size_t i = 0; i < prg_rom_size_; i++) {
-    std::cout << std::format("{:02X}", prg_rom[i]);
+int index_roms(const std::string &dir, unsigned jobs, std::ostream &out) {
+  std::vector<fs::path> paths;
+  for (const auto &file : fs::recursive_directory_iterator(
+           dir, fs::directory_options::skip_permission_denied)) {
+    std::string ext = file.path().extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (file.is_regular_file() && ext == ".nes") {
+      paths.push_back(file.path());
+    }
   }
-  std::cout << "\n";
+  std::sort(paths.begin(), paths.end());
 
-  for (std::size_t i = 0; i < chr_rom_size_; i++) {
-    std::cout << std::format("{:02X}", chr_rom[i]);
+  // Workers claim the next unprocessed ROM until there are none left. Each
+  // result has its own slot, so output order doesn't depend on scheduling.
+  std::vector<std::string> entries(paths.size());
+  std::atomic<std::size_t> next = 0;
+  auto worker = [&]() {
+    for (std::size_t i = next++; i < paths.size(); i = next++) {
+      entries[i] = index_entry(paths[i]);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned i = 0; i < std::min<std::size_t>(jobs, paths.size()); i++) {
+    pool.emplace_back(worker);
+  }
+  for (auto &thread : pool) {
+    thread.join();
   }
-  std::cout << "\n";
 
+  for (const auto &entry : entries) {
+    out << entry << "\n";
+  }
   return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+  util::init_log_level();
+
+  po::options_description desc("Allowed options");
+  desc.add_options()("help,h", "produce help message")("input-file",
+                                                       "ROM to dump")(
+      "index", po::value<std::string>(), "directory of ROMs to index")(
+      "jobs,j",
+      po::value<unsigned>()->default_value(
+          std::max(1u, std::thread::hardware_concurrency())),
+      "number of ROMs to index in parallel")(
+      "output,o", po::value<std::string>(), "write the index to a file");
+
+  po::positional_options_description p;
+  p.add("input-file", 1);
+
+  po::variables_map vm;
+  try {
+    po::store(
+        po::command_line_parser(argc, argv).options(desc).positional(p).run(),
+        vm);
+    po::notify(vm);
+  } catch (const po::error &e) {
+    std::cerr << e.what() << "\n" << help_msg;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << help_msg;
+    return 1;
+  }
+
+  try {
+    if (vm.count("index")) {
+      unsigned jobs = std::max(1u, vm["jobs"].as<unsigned>());
+      if (vm.count("output")) {
+        std::ofstream out(vm["output"].as<std::string>());
+        if (!out.is_open()) {
+          std::cerr << "could not open output file\n";
+          return 1;
+        }
+        return index_roms(vm["index"].as<std::string>(), jobs, out);
+      }
+      return index_roms(vm["index"].as<std::string>(), jobs, std::cout);
+    }
+    if (vm.count("input-file")) {
+      return dump_rom(vm["input-file"].as<std::string>());
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+
+  std::cout << help_msg;
+  return 1;
+}
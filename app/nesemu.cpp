@@ -2,22 +2,53 @@
 
 #include <boost/log/trivial.hpp>
 #include <boost/program_options.hpp>
+#include <cmath>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 
+#include "apu.hpp"
 #include "cartridge.hpp"
 #include "controller.hpp"
 #include "cpu.hpp"
 #include "debugger.hpp"
+#include "pacing.hpp"
 #include "ppu.hpp"
+#include "profiler.hpp"
+#include "savestate.hpp"
 #include "util.hpp"
+#include "video.hpp"
 
 constexpr char help_msg[] =
     "Usage: nesemu <FILE> [FLAGS]... \n"
     "Supported flags: \n"
     "\t-D, --debug \texecution breaks on the first instruction \n"
+    "\t-H, --headless \trun without a window \n"
+    "\t--frames <N> \trun N frames as fast as possible, then exit \n"
+    "\t--record <PATH> \tstream every frame to PATH (\"-\" for stdout) \n"
+    "\t--record-format <y4m|rgb> \tformat of the recording (default y4m) "
+    "\n"
+    "\t--record-drop-duplicates \tskip frames identical to the previous one "
+    "\n"
+    "\t--hash-log <PATH> \twrite a hash of every frame to PATH \n"
+    "\t--rewind-seconds <S> \tseconds of rewind history (default 60, 0 "
+    "disables) \n"
+    "\t--rewind-memory <MB> \tmemory for rewind history (default 16) \n"
+    "\t--rewind-interval <N> \tframes between rewind snapshots (default 1) "
+    "\n"
+    "\t--run-ahead <N> \trun N frames ahead of the one shown to cut input "
+    "latency \n"
+    "\t--movie <PATH> \tplay controller input back from a movie \n"
+    "\t--record-movie <PATH> \trecord controller input to a movie \n"
+    "\t--record-audio <PATH> \twrite the sound to a WAV file \n"
+    "\t--frame-stats \tprint a histogram of frame times on exit \n"
+    "\t--debug-socket <PATH> \tdebug over a Unix socket at PATH instead of "
+    "stdin \n"
+    "\t--profile <PATH> \tprofile the game's code, writing its call stacks to "
+    "PATH for a flame graph on exit. F9 pauses and resumes \n"
+    "\t--symbols <PATH> \tname code in profiles with an ld65 label file \n"
     "\t-h \t\tprints this message \n"
     "Emulate a Nintendo Entertainment System that has loaded a cartridge from "
     "FILE, \n"
@@ -27,7 +58,8 @@ constexpr char help_msg[] =
     "'B' button: Z \n"
     "'A' button: X \n"
     "'Select' button: A \n"
-    "'Start' button: S \n";
+    "'Start' button: S \n"
+    "Hold Backspace to rewind. \n";
 
 // For argument parsing
 namespace po = boost::program_options;
@@ -73,7 +105,8 @@ GLFWwindow* init_window() {
 
   glDisable(GL_DEPTH_TEST);
 
-  // Create callback to close the window when expected (clicking the x)
+  // Create callback to close the window when expected (clicking the x).
+  // Paced runs replace it to shut down cleanly instead.
   glfwSetWindowCloseCallback(window, [](GLFWwindow*) {
     BOOST_LOG_TRIVIAL(debug) << "Exiting\n";
     exit(0);
@@ -88,7 +121,31 @@ int main(int argc, char* argv[]) {
   po::options_description desc("Allowed options");
   desc.add_options()("help,h", "produce help message")(
       "debug,D", "run in debug mode")("input-file", "input file")(
-      "headless,H", "run in headless mode");
+      "headless,H", "run in headless mode")(
+      "frames", po::value<std::size_t>(), "number of frames to run")(
+      "record", po::value<std::string>(), "stream frames to a file or pipe")(
+      "record-format", po::value<std::string>()->default_value("y4m"),
+      "recording format: y4m or rgb")("record-drop-duplicates",
+                                       "skip frames identical to the last")(
+      "hash-log", po::value<std::string>(), "write frame hashes to a file")(
+      "rewind-seconds", po::value<std::size_t>()->default_value(60),
+      "seconds of rewind history")(
+      "rewind-memory", po::value<std::size_t>()->default_value(16),
+      "megabytes of rewind history")(
+      "rewind-interval", po::value<std::size_t>()->default_value(1),
+      "frames between rewind snapshots")(
+      "run-ahead", po::value<std::size_t>()->default_value(0),
+      "frames to run ahead of the one shown")(
+      "movie", po::value<std::string>(), "play input back from a movie")(
+      "record-movie", po::value<std::string>(), "record input to a movie")(
+      "record-audio", po::value<std::string>(),
+      "write the sound to a WAV file")(
+      "frame-stats", "print a histogram of frame times on exit")(
+      "debug-socket", po::value<std::string>(),
+      "debug over a Unix socket instead of stdin")(
+      "profile", po::value<std::string>(),
+      "profile the game's code, writing call stacks to a file")(
+      "symbols", po::value<std::string>(), "ld65 label file for profiles");
 
   // Add the file to load as a positional argument
   po::positional_options_description p;
@@ -119,7 +176,12 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  if (vm.count("debug")) {
+  if (vm.count("record") && vm["record"].as<std::string>() == "-") {
+    // stdout carries the video stream
+    util::log_to_stderr();
+  }
+
+  if (vm.count("debug") || vm.count("debug-socket")) {
     BOOST_LOG_TRIVIAL(info) << "Running in debug mode.\n";
     debug_mode = true;
   }
@@ -133,27 +195,116 @@ int main(int argc, char* argv[]) {
 
   GLFWwindow* window_handle = nullptr;
 
-  std::ifstream in(input_filename);
-  if (!in.is_open()) {
-    BOOST_LOG_TRIVIAL(fatal)
-        << "input file cannot be found: " << input_filename;
+  std::shared_ptr<const cartridge::RomImage> rom;
+  try {
+    rom = cartridge::RomImage::load(input_filename);
+  } catch (const cartridge::cartridge_error& e) {
+    BOOST_LOG_TRIVIAL(fatal) << e.what();
     return 1;
   }
-  cartridge::Cartridge cart(in);
+  cartridge::Cartridge cart(rom);
+  try {
+    cart.attach_save_file(cartridge::save_file_path(input_filename));
+  } catch (const cartridge::cartridge_error& e) {
+    // The game still runs, it just won't keep its saves
+    BOOST_LOG_TRIVIAL(error) << e.what();
+  }
   std::shared_ptr<cpu::CPU> cpu;
   std::shared_ptr<ppu::PPU> ppu;
   std::shared_ptr<controller::Controller> controller;
+  std::unique_ptr<controller::KeyboardInput> keyboard;
+  std::unique_ptr<controller::MoviePlayer> movie;
+  std::unique_ptr<controller::MovieRecorder> movie_recorder;
+  std::unique_ptr<controller::InputLog> input_log;
+  std::unique_ptr<video::StreamSink> recorder;
+  std::unique_ptr<video::HashSink> hasher;
+  // The sink must outlive the output whose thread writes to it
+  std::unique_ptr<apu::WavSink> wav;
+  std::unique_ptr<apu::AudioOutput> audio;
+  apu::APU apu(cart);
 
   if (!headless_mode) {
     BOOST_LOG_TRIVIAL(debug) << "Creating window + CPU";
     window_handle = init_window();
-    ppu = std::make_shared<ppu::PPU>(*window_handle);
-    controller = std::make_shared<controller::Controller>(*window_handle);
-    cpu =
-        std::make_shared<cpu::CPU>(cart, std::ref(*ppu), std::ref(*controller));
+    ppu = std::make_shared<ppu::PPU>(cart, std::ref(*window_handle));
+    keyboard = std::make_unique<controller::KeyboardInput>(*window_handle);
   } else {
     BOOST_LOG_TRIVIAL(debug) << "Creating CPU (no window)";
-    cpu = std::make_shared<cpu::CPU>(cart);
+    ppu = std::make_shared<ppu::PPU>(cart);
+  }
+
+  // Movies replace or tap the keyboard. Headless runs only have a controller
+  // when playing one.
+  controller::InputSource* input = keyboard.get();
+  try {
+    if (vm.count("movie")) {
+      movie = std::make_unique<controller::MoviePlayer>(
+          vm["movie"].as<std::string>(), rom->hash());
+      input = movie.get();
+    }
+    if (vm.count("record-movie")) {
+      if (input == nullptr) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Nothing to record: headless runs need --movie for input";
+        return 1;
+      }
+      movie_recorder = std::make_unique<controller::MovieRecorder>(
+          *input, vm["record-movie"].as<std::string>(), rom->hash());
+      input = movie_recorder.get();
+    }
+  } catch (const controller::input_error& e) {
+    BOOST_LOG_TRIVIAL(fatal) << e.what();
+    return 1;
+  }
+  if (input != nullptr && debug_mode) {
+    // Going back in the debugger plays the same input again
+    input_log = std::make_unique<controller::InputLog>(*input);
+    input = input_log.get();
+  }
+  if (input != nullptr) {
+    controller = std::make_shared<controller::Controller>(*input);
+    cpu = std::make_shared<cpu::CPU>(cart, std::ref(*ppu),
+                                     std::ref(*controller), std::ref(apu));
+  } else {
+    cpu = std::make_shared<cpu::CPU>(cart, std::ref(*ppu), std::nullopt,
+                                     std::ref(apu));
+  }
+
+  if (vm.count("record-audio")) {
+    try {
+      wav =
+          std::make_unique<apu::WavSink>(vm["record-audio"].as<std::string>());
+    } catch (const apu::audio_error& e) {
+      BOOST_LOG_TRIVIAL(fatal) << e.what();
+      return 1;
+    }
+    audio = std::make_unique<apu::AudioOutput>(*wav);
+    apu.attach_output(audio.get());
+  }
+
+  if (vm.count("record")) {
+    try {
+      recorder = std::make_unique<video::StreamSink>(
+          vm["record"].as<std::string>(),
+          video::StreamSink::format_from_string(
+              vm["record-format"].as<std::string>()),
+          vm.count("record-drop-duplicates") > 0);
+    } catch (const video::video_error& e) {
+      BOOST_LOG_TRIVIAL(fatal) << e.what();
+      return 1;
+    }
+    ppu->add_frame_sink(*recorder);
+  }
+
+  if (vm.count("hash-log")) {
+    try {
+      hasher =
+          std::make_unique<video::HashSink>(vm["hash-log"].as<std::string>());
+    } catch (const video::video_error& e) {
+      BOOST_LOG_TRIVIAL(fatal) << e.what();
+      return 1;
+    }
+    ppu->add_frame_sink(*hasher);
   }
 
   if (cpu == nullptr) {
@@ -163,17 +314,142 @@ int main(int argc, char* argv[]) {
     BOOST_LOG_TRIVIAL(debug) << "Created CPU";
   }
 
+  // The debugger can switch profiling on, so it always has a profiler
+  std::unique_ptr<profiler::Profiler> profiler;
+  if (vm.count("profile") || debug_mode) {
+    profiler::SymbolMap symbols;
+    if (vm.count("symbols")) {
+      try {
+        symbols = profiler::SymbolMap::load(vm["symbols"].as<std::string>());
+      } catch (const profiler::symbol_error& e) {
+        BOOST_LOG_TRIVIAL(fatal) << e.what();
+        return 1;
+      }
+    }
+    profiler = std::make_unique<profiler::Profiler>(std::move(symbols));
+  }
+  bool profiling = vm.count("profile") > 0 && !debug_mode;
+  if (profiling) {
+    cpu->set_profiler(profiler.get());
+  }
+
   if (debug_mode) {
     // Only when the program was started in debug mode can it be debugged
-    debugger::Debugger debugger(cpu.get());
-    // Debugger runs infinite loop here
-    debugger.debug();
+    debugger::Debugger debugger(cpu.get(), input_log.get());
+    debugger.set_profiler(profiler.get());
+    if (vm.count("debug-socket")) {
+      debugger::DebugServer server(debugger);
+      try {
+        server.serve(vm["debug-socket"].as<std::string>());
+      } catch (debugger::socket_error& e) {
+        BOOST_LOG_TRIVIAL(fatal) << e.what();
+        return 1;
+      }
+    } else {
+      // Debugger runs infinite loop here
+      debugger.debug();
+    }
+  } else if (vm.count("frames")) {
+    // Fixed-length run: no frame pacing, useful for headless recording
+    std::size_t frames = vm["frames"].as<std::size_t>();
+    if (window_handle != nullptr) {
+      // As in the paced loop, closing the window ends the run
+      glfwSetWindowCloseCallback(window_handle, nullptr);
+    }
+    for (std::size_t frame = 0; frame < frames; ++frame) {
+      cpu->advance_frame();
+      if (window_handle != nullptr) {
+        // Keeps the keyboard's input fresh and the window responsive
+        glfwPollEvents();
+        if (glfwWindowShouldClose(window_handle)) {
+          break;
+        }
+      }
+    }
+  } else if (!headless_mode) {
+    // Rewind and run-ahead replay frames, which would desync a movie and be
+    // counted twice by the profiler
+    const char* replay_conflict = movie != nullptr            ? "--movie"
+                                  : movie_recorder != nullptr ? "--record-movie"
+                                  : profiler != nullptr       ? "--profile"
+                                                              : nullptr;
+    bool replays = replay_conflict == nullptr;
+    for (const char* option : {"run-ahead", "rewind-seconds", "rewind-interval",
+                               "rewind-memory"}) {
+      if (!replays && !vm[option].defaulted()) {
+        BOOST_LOG_TRIVIAL(warning) << "--" << option << " is ignored with "
+                                   << replay_conflict
+                                   << ", since it replays frames";
+      }
+    }
+    savestate::RunAhead run_ahead(
+        *cpu, *ppu, replays ? vm["run-ahead"].as<std::size_t>() : 0,
+        std::ref(apu));
+    std::optional<savestate::Rewinder> rewinder;
+    if (replays && vm["rewind-seconds"].as<std::size_t>() > 0) {
+      std::size_t interval = std::max<std::size_t>(
+          1, vm["rewind-interval"].as<std::size_t>());
+      std::size_t snapshots = vm["rewind-seconds"].as<std::size_t>() *
+                              std::ceil(cpu::CPU::kFramerate) / interval;
+      rewinder.emplace(*cpu, interval,
+                       vm["rewind-memory"].as<std::size_t>() << 20, snapshots,
+                       [&]() { run_ahead.advance_frame(); });
+    }
+    pacing::Pacer pacer(cpu::CPU::kFramerate);
+    bool profile_key_held = false;
+    // Closing the window ends the loop rather than the process, so recordings
+    // are finished properly
+    glfwSetWindowCloseCallback(window_handle, nullptr);
+    cpu->begin_cpu_loop(
+        [&]() {
+          // Events are pumped once per frame shown, whether or not the frames
+          // run for it are drawn
+          glfwPollEvents();
+          if (glfwWindowShouldClose(window_handle)) {
+            pacer.stop();
+            return;
+          }
+          bool profile_key =
+              glfwGetKey(window_handle, GLFW_KEY_F9) == GLFW_PRESS;
+          if (profiler != nullptr && profile_key && !profile_key_held) {
+            profiling = !profiling;
+            cpu->set_profiler(profiling ? profiler.get() : nullptr);
+            BOOST_LOG_TRIVIAL(info)
+                << "Profiling " << (profiling ? "resumed" : "paused");
+          }
+          profile_key_held = profile_key;
+          if (rewinder) {
+            rewinder->advance_frame(
+                glfwGetKey(window_handle, GLFW_KEY_BACKSPACE) == GLFW_PRESS);
+          } else {
+            run_ahead.advance_frame();
+          }
+        },
+        &pacer);
+    if (vm.count("frame-stats")) {
+      pacer.histogram().print(std::cerr);
+      std::cerr << pacer.late_frames() << " late, " << pacer.dropped_frames()
+                << " dropped\n";
+    }
   } else {
     cpu->begin_cpu_loop();
   }
 
+  if (vm.count("profile") && !debug_mode) {
+    std::string path = vm["profile"].as<std::string>();
+    std::ofstream out(path);
+    profiler->write_collapsed(out);
+    out.close();
+    if (!out) {
+      BOOST_LOG_TRIVIAL(error) << "Could not write the profile to " << path;
+    }
+    profiler->print_report(std::cerr);
+  }
+
   // Cleanup
   if (!headless_mode) {
+    // Releases the window's key callback
+    keyboard.reset();
     glfwTerminate();
   }
   return 0;
@@ -1,4 +1,8 @@
 #include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
 
 #include "cartridge.hpp"
 
@@ -37,4 +41,360 @@ TEST_CASE("Basic cartridge read/write") {
     cart.cpu_write(i, i);
     REQUIRE(cart.cpu_read(i) == i);
   }
-}
\ No newline at end of file
+}
+TEST_CASE("Nametable mirroring from iNES header") {
+  using cartridge::Mirroring;
+  auto [flags6, mirroring] = GENERATE(
+      std::make_pair(0b0000, Mirroring::kHorizontal),
+      std::make_pair(0b0001, Mirroring::kVertical),
+      std::make_pair(0b1000, Mirroring::kFourScreen),
+      std::make_pair(0b1001, Mirroring::kFourScreen));
+
+  // Mapper 0 with 16KB PRG and 8KB CHR, all zeros
+  std::string rom = {'N', 'E', 'S', 0x1A, 1, 1, static_cast<char>(flags6)};
+  rom.resize(16 + 16 * 1024 + 8 * 1024, 0);
+  std::istringstream in(rom);
+  cartridge::Cartridge cart(in);
+  REQUIRE(cart.mirroring() == mirroring);
+
+  uint8_t ciram[0x800];
+  cart.attach_ciram(ciram);
+  const auto &banks = cart.nametable_banks();
+  uint8_t *lower = ciram;
+  uint8_t *upper = ciram + 0x400;
+  switch (mirroring) {
+    case Mirroring::kHorizontal:
+      CHECK(banks == cartridge::Mapper::nametable_banks_t{lower, lower, upper,
+                                                          upper});
+      break;
+    case Mirroring::kVertical:
+      CHECK(banks == cartridge::Mapper::nametable_banks_t{lower, upper, lower,
+                                                          upper});
+      break;
+    default:
+      // Two nametables in CIRAM, two on the cartridge
+      CHECK(banks[0] == lower);
+      CHECK(banks[1] == upper);
+      CHECK(banks[2] != nullptr);
+      CHECK(banks[3] == banks[2] + 0x400);
+      CHECK((banks[2] < ciram || banks[2] >= ciram + 0x800));
+      break;
+  }
+}
+
+TEST_CASE("ROM images are shared") {
+  // Mapper 0 with 16KB PRG and no CHR, PRG filled with a pattern
+  std::string rom = {'N', 'E', 'S', 0x1A, 1, 0, 0};
+  rom.resize(16, 0);
+  for (int i = 0; i < 16 * 1024; i++) {
+    rom.push_back(static_cast<char>(i * 7));
+  }
+
+  auto dir = std::filesystem::temp_directory_path();
+  auto path_a = dir / "nesemu-test-rom-a.nes";
+  auto path_b = dir / "nesemu-test-rom-b.nes";
+  for (const auto &path : {path_a, path_b}) {
+    std::ofstream out(path, std::ios::binary);
+    out << rom;
+  }
+
+  std::size_t before = cartridge::RomImage::cached_images();
+  {
+    auto image = cartridge::RomImage::load(path_a);
+    // Same file, a copy of it and the same bytes from a stream all share the
+    // one image
+    CHECK(cartridge::RomImage::load(path_a) == image);
+    CHECK(cartridge::RomImage::load(path_b) == image);
+    std::istringstream in(rom);
+    CHECK(cartridge::RomImage::read(in) == image);
+    CHECK(cartridge::RomImage::cached_images() == before + 1);
+
+    cartridge::Cartridge cart1(image);
+    cartridge::Cartridge cart2(cartridge::RomImage::load(path_b));
+    for (uint16_t addr = 0x8000; addr < 0x8100; addr++) {
+      uint8_t expected = (addr - 0x8000) * 7;
+      REQUIRE(cart1.cpu_read(addr) == expected);
+      // Mirrored 16KB PRG
+      REQUIRE(cart2.cpu_read(addr + 0x4000) == cart1.cpu_read(addr));
+    }
+    // PRG is ROM
+    cart1.cpu_write(0x8000, 0xFF);
+    CHECK(cart2.cpu_read(0x8000) == 0);
+    // CHR RAM is per cartridge
+    cart1.ppu_write(0x10, 0x42);
+    CHECK(cart1.ppu_read(0x10) == 0x42);
+    CHECK(cart2.ppu_read(0x10) == 0);
+  }
+  // Released once the last cartridge using it is gone
+  CHECK(cartridge::RomImage::cached_images() == before);
+
+  std::filesystem::remove(path_a);
+  std::filesystem::remove(path_b);
+}
+
+TEST_CASE("iNES and NES 2.0 header parsing") {
+  SECTION("iNES") {
+    std::vector<uint8_t> rom = {'N', 'E', 'S', 0x1A, 2, 0, 0x13, 0x40,
+                                0,   0,   0,   0,    0, 0, 0,    0};
+    auto header = cartridge::parse_header(rom);
+    CHECK(header.format == cartridge::Header::kINES);
+    CHECK(header.mapper == 0x41);
+    CHECK(header.mirroring == cartridge::Mirroring::kVertical);
+    CHECK(header.has_battery);
+    CHECK_FALSE(header.has_trainer);
+    CHECK(header.prg_rom_size == 32 * 1024);
+    CHECK(header.chr_rom_size == 0);
+    CHECK(header.prg_nvram_size == 8 * 1024);
+    CHECK(header.chr_ram_size == 8 * 1024);
+    CHECK(header.prg_offset() == 16);
+
+    // Junk left in bytes 7-15 by old tools: byte 7 isn't the mapper
+    rom[7] = 'D';
+    rom[12] = 'D';
+    CHECK(cartridge::parse_header(rom).mapper == 0x01);
+  }
+
+  SECTION("NES 2.0") {
+    std::vector<uint8_t> rom = {'N',  'E',  'S', 0x1A, 0x10, 0x01, 0x4C, 0x18,
+                                0x21, 0x00, 0x70, 0x07, 0,    0,    0,    0};
+    auto header = cartridge::parse_header(rom);
+    CHECK(header.format == cartridge::Header::kNES2);
+    CHECK(header.mapper == 0x114);
+    CHECK(header.submapper == 2);
+    CHECK(header.mirroring == cartridge::Mirroring::kFourScreen);
+    CHECK(header.has_trainer);
+    CHECK(header.prg_rom_size == 256 * 1024);
+    CHECK(header.chr_rom_size == 8 * 1024);
+    CHECK(header.prg_ram_size == 0);
+    CHECK(header.prg_nvram_size == 8 * 1024);
+    CHECK(header.chr_ram_size == 8 * 1024);
+    CHECK(header.prg_offset() == 16 + 512);
+    CHECK(header.chr_offset() == 16 + 512 + 256 * 1024);
+
+    // Exponent-multiplier PRG size: 2^4 * (1 * 2 + 1)
+    rom[9] = 0x0F;
+    rom[4] = (4 << 2) | 1;
+    CHECK(cartridge::parse_header(rom).prg_rom_size == 48);
+  }
+
+  SECTION("Not a ROM") {
+    std::vector<uint8_t> rom(16, 0);
+    CHECK_THROWS_AS(cartridge::parse_header(rom), cartridge::cartridge_error);
+    rom.resize(8);
+    CHECK_THROWS_AS(cartridge::parse_header(rom), cartridge::cartridge_error);
+  }
+}
+
+TEST_CASE("ROM checksums") {
+  std::string abc = "abc";
+  auto digest = cartridge::sha1(
+      std::span(reinterpret_cast<const uint8_t *>(abc.data()), abc.size()));
+  cartridge::RomInfo::sha1_t expected = {
+      0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+      0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d};
+  CHECK(digest == expected);
+
+  // 16KB of PRG, 8KB of CHR, both zero
+  std::vector<uint8_t> rom = {'N', 'E', 'S', 0x1A, 1, 1};
+  rom.resize(16 + 24 * 1024, 0);
+  auto info = cartridge::describe_rom(rom);
+  CHECK(info.prg_crc32 == 0xab54d286);
+  CHECK(info.chr_crc32 == 0xd8f49994);
+  rom.pop_back();
+  CHECK_THROWS_AS(cartridge::describe_rom(rom), cartridge::cartridge_error);
+}
+
+/**
+ * @brief Build an iNES ROM where every byte of 8KB PRG bank n is n, and every
+ * byte of 1KB CHR bank n is n.
+ */
+std::unique_ptr<cartridge::Cartridge> make_cart(uint8_t mapper,
+                                                uint8_t prg_16k,
+                                                uint8_t chr_8k) {
+  std::string rom = {'N', 'E', 'S', 0x1A, static_cast<char>(prg_16k),
+                     static_cast<char>(chr_8k), static_cast<char>(mapper << 4),
+                     static_cast<char>(mapper & 0xF0)};
+  rom.resize(16, 0);
+  for (int bank = 0; bank < prg_16k * 2; bank++) {
+    rom.append(0x2000, static_cast<char>(bank));
+  }
+  for (int bank = 0; bank < chr_8k * 8; bank++) {
+    rom.append(0x400, static_cast<char>(bank));
+  }
+  std::istringstream in(rom);
+  return std::make_unique<cartridge::Cartridge>(in);
+}
+
+TEST_CASE("NROM") {
+  auto cart = make_cart(0, 1, 0);
+  // 16KB PRG mirrored
+  CHECK(cart->cpu_read(0x8000) == 0);
+  CHECK(cart->cpu_read(0xA000) == 1);
+  CHECK(cart->cpu_read(0xC000) == 0);
+  CHECK(cart->cpu_read(0xFFFF) == 1);
+  // PRG RAM
+  cart->cpu_write(0x6123, 0x42);
+  CHECK(cart->cpu_read(0x6123) == 0x42);
+  // CHR RAM
+  cart->ppu_write(0x1FFF, 0x24);
+  CHECK(cart->ppu_read(0x1FFF) == 0x24);
+}
+
+TEST_CASE("UxROM") {
+  auto cart = make_cart(2, 8, 0);
+  CHECK(cart->cpu_read(0x8000) == 0);
+  CHECK(cart->cpu_read(0xC000) == 14);
+  cart->cpu_write(0x8000, 3);
+  CHECK(cart->cpu_read(0x8000) == 6);
+  CHECK(cart->cpu_read(0xA000) == 7);
+  CHECK(cart->cpu_read(0xE000) == 15);
+  // Direct page access sees the switched bank
+  CHECK(cart->cpu_page(0x8100)[0] == 6);
+}
+
+TEST_CASE("CNROM") {
+  auto cart = make_cart(3, 2, 4);
+  CHECK(cart->ppu_read(0x0000) == 0);
+  cart->cpu_write(0x8000, 2);
+  CHECK(cart->ppu_read(0x0000) == 16);
+  CHECK(cart->ppu_read(0x1C00) == 23);
+  // CHR ROM can't be written
+  cart->ppu_write(0x0000, 0xFF);
+  CHECK(cart->ppu_read(0x0000) == 16);
+}
+
+TEST_CASE("MMC1") {
+  auto cart = make_cart(1, 8, 4);
+  uint8_t ciram[0x800];
+  cart->attach_ciram(ciram);
+
+  // Serial writes: 5 bits, LSB first
+  auto write_register = [&](uint16_t addr, uint8_t value) {
+    for (int i = 0; i < 5; i++) {
+      cart->cpu_write(addr, (value >> i) & 1);
+    }
+  };
+
+  // Power on: last bank fixed at $C000
+  CHECK(cart->cpu_read(0xC000) == 14);
+
+  // Switch $8000
+  write_register(0xE000, 5);
+  CHECK(cart->cpu_read(0x8000) == 10);
+  CHECK(cart->cpu_read(0xA000) == 11);
+  CHECK(cart->cpu_read(0xE000) == 15);
+
+  // 32KB mode, vertical mirroring, 4KB CHR
+  write_register(0x8000, 0b1'00'10);
+  CHECK(cart->mirroring() == cartridge::Mirroring::kVertical);
+  CHECK(cart->cpu_read(0x8000) == 8);
+  CHECK(cart->cpu_read(0xE000) == 11);
+  write_register(0xA000, 3);
+  write_register(0xC000, 6);
+  CHECK(cart->ppu_read(0x0000) == 12);
+  CHECK(cart->ppu_read(0x1000) == 24);
+
+  // A write with bit 7 set resets the shift register and the PRG mode
+  cart->cpu_write(0x8000, 1);
+  cart->cpu_write(0x8000, 0x80);
+  CHECK(cart->cpu_read(0xC000) == 14);
+  write_register(0xE000, 1);
+  CHECK(cart->cpu_read(0x8000) == 2);
+}
+
+TEST_CASE("MMC3") {
+  auto cart = make_cart(4, 8, 8);
+  uint8_t ciram[0x800];
+  cart->attach_ciram(ciram);
+
+  // Last bank always fixed at $E000, second to last at $C000 by default
+  CHECK(cart->cpu_read(0xE000) == 15);
+  CHECK(cart->cpu_read(0xC000) == 14);
+
+  cart->cpu_write(0x8000, 6);
+  cart->cpu_write(0x8001, 3);
+  cart->cpu_write(0x8000, 7);
+  cart->cpu_write(0x8001, 9);
+  CHECK(cart->cpu_read(0x8000) == 3);
+  CHECK(cart->cpu_read(0xA000) == 9);
+  // PRG mode 1 swaps $8000 and $C000
+  cart->cpu_write(0x8000, 0x46);
+  CHECK(cart->cpu_read(0x8000) == 14);
+  CHECK(cart->cpu_read(0xC000) == 3);
+
+  // 2KB bank R0 and 1KB bank R2, then with CHR inversion
+  cart->cpu_write(0x8000, 0);
+  cart->cpu_write(0x8001, 10);
+  cart->cpu_write(0x8000, 2);
+  cart->cpu_write(0x8001, 33);
+  CHECK(cart->ppu_read(0x0000) == 10);
+  CHECK(cart->ppu_read(0x0400) == 11);
+  CHECK(cart->ppu_read(0x1000) == 33);
+  cart->cpu_write(0x8000, 0x80);
+  CHECK(cart->ppu_read(0x1000) == 10);
+  CHECK(cart->ppu_read(0x0000) == 33);
+
+  // Mirroring
+  cart->cpu_write(0xA000, 1);
+  CHECK(cart->mirroring() == cartridge::Mirroring::kHorizontal);
+
+  // PRG RAM write protect
+  cart->cpu_write(0x6000, 1);
+  cart->cpu_write(0xA001, 0xC0);
+  cart->cpu_write(0x6000, 2);
+  CHECK(cart->cpu_read(0x6000) == 1);
+
+  // IRQ after latch + 1 scanlines (the first clock reloads the counter)
+  cart->cpu_write(0xC000, 3);
+  cart->cpu_write(0xC001, 0);
+  cart->cpu_write(0xE001, 0);
+  for (int line = 0; line < 3; line++) {
+    cart->clock_scanline();
+    CHECK_FALSE(cart->irq());
+  }
+  cart->clock_scanline();
+  CHECK(cart->irq());
+  // Acknowledged by disabling
+  cart->cpu_write(0xE000, 0);
+  CHECK_FALSE(cart->irq());
+}
+
+TEST_CASE("Battery-backed PRG RAM") {
+  auto path = std::filesystem::temp_directory_path() / "nesemu-test.sav";
+  std::filesystem::remove(path);
+  // MMC1 with 32KB PRG, CHR RAM and a battery
+  std::string rom = {'N', 'E', 'S', 0x1A, 2, 0, 0x12, 0};
+  rom.resize(16 + 32 * 1024, 0);
+
+  {
+    std::istringstream in(rom);
+    cartridge::Cartridge cart(in);
+    REQUIRE(cart.attach_save_file(path));
+    cart.cpu_write(0x6000, 0x12);
+    cart.cpu_write(0x7FFF, 0x34);
+    CHECK(cart.cpu_read(0x6000) == 0x12);
+  }
+  REQUIRE(std::filesystem::file_size(path) == 0x2000);
+
+  // A new session starts with the saved RAM
+  std::istringstream in(rom);
+  cartridge::Cartridge cart(in);
+  REQUIRE(cart.attach_save_file(path));
+  CHECK(cart.cpu_read(0x6000) == 0x12);
+  CHECK(cart.cpu_read(0x7FFF) == 0x34);
+
+  // PRG RAM disable still applies to the file-backed RAM
+  for (int i = 0; i < 5; i++) {
+    cart.cpu_write(0xE000, i == 4 ? 1 : 0);
+  }
+  CHECK(cart.cpu_read(0x6000) == 0xAA);
+
+  // No battery: no save file
+  std::string no_battery = rom;
+  no_battery[6] = 0x10;
+  std::istringstream in2(no_battery);
+  cartridge::Cartridge plain(in2);
+  CHECK_FALSE(plain.attach_save_file(path.string() + ".unused"));
+  CHECK_FALSE(std::filesystem::exists(path.string() + ".unused"));
+  std::filesystem::remove(path);
+}
@@ -1,10 +1,20 @@
 #include <bitset>
 #include <catch2/catch.hpp>
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#include "apu.hpp"
 #include "cartridge.hpp"
 #include "cpu.hpp"
+#include "debugger.hpp"
+#include "pacing.hpp"
+#include "profiler.hpp"
 #include "util.hpp"
 
 using namespace util;
@@ -6064,3 +6074,844 @@ TEST_CASE("instruction printer") {
     CHECK(cpu.print_instruction() == expected);
   }
 }
+
+TEST_CASE("OAM DMA") {
+  uint8_t page = GENERATE(0x02, 0x80);
+  // clang-format off
+  std::vector<uint8_t> bytecode = {
+      kLDA_IMM, page,           // 2 cycles
+      kSTA_ABS, U16(0x4014),    // 4 cycles, then the DMA stall
+      kLDA_IMM, 0x05,           // 2 cycles
+  };  // clang-format on
+
+  std::unique_ptr<VectorMapper> mapper(new VectorMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  ppu::PPU ppu(cart);
+  CPU cpu(cart, std::ref(ppu));
+
+  for (uint16_t i = 0; i < 0x100; i++) {
+    cpu.write(0x0200 + i, i ^ 0x5A);
+  }
+
+  // Start OAM at 4 to check that the copy wraps around
+  cpu.write(0x2003, 0x04);
+
+  cpu.advance_cycles(6);
+  // The DMA was started on an even cycle, so the stall is 513 cycles
+  cpu.advance_cycles(513 + 1);
+  REQUIRE(cpu.A() == page);
+  cpu.advance_cycles(1);
+  REQUIRE(cpu.A() == 0x05);
+
+  for (uint16_t i = 0; i < 0x100; i++) {
+    cpu.write(0x2003, (i + 4) & 0xFF);
+    uint16_t src = (page << 8) + i;
+    REQUIRE(cpu.read(0x2004) == cpu.read(src));
+  }
+}
+
+// Every CHR byte is 0xFF, so every tile and sprite pixel is opaque
+class SolidChrMapper : public VectorMapper {
+ public:
+  using VectorMapper::VectorMapper;
+  uint8_t chr_read(uint16_t addr) override {
+    (void)addr;  // explicitly unused
+    return 0xFF;
+  }
+};
+
+TEST_CASE("Sprite 0 hit and overflow") {
+  bool show_background = GENERATE(true, false);
+  std::vector<uint8_t> bytecode = {
+      kJMP_ABS, U16(0x8000),  // spin
+  };
+
+  std::unique_ptr<SolidChrMapper> mapper(new SolidChrMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  ppu::PPU ppu(cart);
+  CPU cpu(cart, std::ref(ppu));
+
+  // Sprite 0 at (20, 10), sprites 1-9 all on lines 51-58
+  cpu.write(0x2003, 0x00);
+  for (uint8_t sprite = 0; sprite < 64; sprite++) {
+    uint8_t y = sprite == 0 ? 9 : sprite <= 9 ? 50 : 0xF0;
+    for (uint8_t byte : {y, uint8_t{0}, uint8_t{0}, uint8_t{20}}) {
+      cpu.write(0x2004, byte);
+    }
+  }
+  // Show sprites (and maybe background), including the leftmost 8 pixels
+  cpu.write(0x2001, show_background ? 0b0001'1110 : 0b0001'0110);
+
+  cpu.advance_frame();
+  CHECK(ppu.sprite_zero_hit() == show_background);
+  CHECK(ppu.sprite_overflow());
+
+  // Both flags are cleared at the start of the next frame
+  cpu.write(0x2001, 0);
+  cpu.advance_frame();
+  CHECK_FALSE(ppu.sprite_zero_hit());
+  CHECK_FALSE(ppu.sprite_overflow());
+}
+
+// Tile 1 is solid (color 3), every other tile is blank
+class OneTileChrMapper : public VectorMapper {
+ public:
+  using VectorMapper::VectorMapper;
+  uint8_t chr_read(uint16_t addr) override {
+    return (addr >= 16 && addr < 32) ? 0xFF : 0x00;
+  }
+};
+
+TEST_CASE("Background scrolling") {
+  uint8_t scroll_x = GENERATE(0, 3, 8);
+  uint8_t scroll_y = GENERATE(0, 5, 8);
+  std::vector<uint8_t> bytecode;
+  std::unique_ptr<OneTileChrMapper> mapper(new OneTileChrMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  ppu::PPU ppu(cart);
+  CPU cpu(cart, std::ref(ppu));
+
+  // Black background, white color 3
+  cpu.write(0x2006, 0x3F);
+  cpu.write(0x2006, 0x00);
+  for (uint8_t color : {0x0F, 0x00, 0x00, 0x30}) {
+    cpu.write(0x2007, color);
+  }
+  // The solid tile covers pixels (8, 8) to (15, 15) before scrolling
+  cpu.write(0x2006, 0x20);
+  cpu.write(0x2006, 0x21);
+  cpu.write(0x2007, 0x01);
+
+  cpu.read(0x2002);  // reset the write toggle
+  cpu.write(0x2005, scroll_x);
+  cpu.write(0x2005, scroll_y);
+  cpu.write(0x2000, 0x00);
+  cpu.write(0x2001, 0b0000'1010);  // background, including leftmost 8 pixels
+
+  std::unique_ptr<ppu::PPU::frame_t> frame =
+      std::make_unique<ppu::PPU::frame_t>();
+  ppu.render_to_framebuffer(*frame);
+  auto pixel = [&](int x, int y) {
+    return (*frame)[(y * ppu::PPU::kScreenWidth + x) * 3];
+  };
+
+  int left = 8 - scroll_x;
+  int top = 8 - scroll_y;
+  CHECK(pixel(left, top) == 0xFF);
+  CHECK(pixel(left + 7, top + 7) == 0xFF);
+  CHECK(pixel(left + 8, top) == 0x00);
+  CHECK(pixel(left, top + 8) == 0x00);
+  if (left > 0) {
+    CHECK(pixel(left - 1, top) == 0x00);
+  }
+  if (top > 0) {
+    CHECK(pixel(left, top - 1) == 0x00);
+  }
+}
+
+// Lets tests drive the cartridge IRQ line
+class IrqMapper : public VectorMapper {
+ public:
+  using VectorMapper::VectorMapper;
+  void set_irq(bool level) { irq_line_ = level; }
+};
+
+TEST_CASE("Cartridge IRQ") {
+  std::vector<uint8_t> bytecode = {
+      kSEI,  // 2 cycles
+      kNOP,  // 2 cycles
+      kCLI,  // 2 cycles
+      kNOP,  //
+  };
+  uint16_t isr = 0x9000;
+  IrqMapper* irq_mapper = new IrqMapper(bytecode, isr);
+  std::unique_ptr<IrqMapper> mapper(irq_mapper);
+  cartridge::Cartridge cart(std::move(mapper));
+  CPU cpu(cart);
+
+  irq_mapper->set_irq(true);
+  // Masked while the interrupt disable flag is set
+  cpu.advance_cycles(4);
+  REQUIRE(cpu.PC() == 0x8002);
+  cpu.advance_cycles(2);
+  REQUIRE(cpu.PC() == 0x8003);
+
+  // Taken at the next instruction boundary, and takes 7 cycles
+  cpu.advance_cycles(7);
+  CHECK(cpu.PC() == isr);
+  CHECK(cpu.get_interrupt_disable());
+  CHECK((cpu.peek_stack() & 0b0001'0000) == 0);  // B flag clear
+  CHECK(cpu.read16(0x0100 | (cpu.SP() + 2)) == 0x8003);  // return address
+
+  // Not taken again while the handler runs with interrupts disabled
+  cpu.advance_cycles(2);
+  CHECK(cpu.PC() != isr);
+}
+
+TEST_CASE("Memory watcher") {
+  struct Accesses : public cpu::MemoryWatcher {
+    std::vector<std::pair<uint16_t, uint8_t>> reads;
+    std::vector<std::pair<uint16_t, uint8_t>> writes;
+    void on_read(uint16_t addr, uint8_t value) override {
+      reads.emplace_back(addr, value);
+    }
+    void on_write(uint16_t addr, uint8_t value) override {
+      writes.emplace_back(addr, value);
+    }
+  };
+
+  std::vector<uint8_t> bytecode = {
+      kLDA_IMM, 0x42,          //
+      kSTA_ABS, U16(0x0300),  // watched
+      kSTA_ABS, U16(0x0400),  // not watched
+      kLDX_ABS, U16(0x0300),  //
+      kJMP_ABS, U16(0x800B),
+  };
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(bytecode));
+  CPU cpu(cart);
+  Accesses accesses;
+  cpu.set_memory_watcher(&accesses);
+  cpu.watch_page(0x03, kWatchWrite);
+
+  cpu.advance_cycles(2 + 4 + 4 + 4);
+  REQUIRE(cpu.X() == 0x42);
+  CHECK(accesses.writes == decltype(accesses.writes){{0x0300, 0x42}});
+  CHECK(accesses.reads.empty());
+
+  cpu.watch_page(0x03, kWatchRead | kWatchWrite);
+  cpu.write(0x0310, 0x10);
+  CHECK(cpu.read(0x0310) == 0x10);
+  CHECK(accesses.writes.back() == std::pair<uint16_t, uint8_t>{0x0310, 0x10});
+  CHECK(accesses.reads == decltype(accesses.reads){{0x0310, 0x10}});
+
+  // Removing the watcher unwatches every page
+  cpu.set_memory_watcher(nullptr);
+  cpu.write(0x0300, 0);
+  cpu.read(0x0300);
+  CHECK(accesses.writes.size() == 2);
+  CHECK(accesses.reads.size() == 1);
+}
+
+TEST_CASE("Debugger expressions") {
+  using debugger::Expression;
+  std::vector<uint8_t> bytecode = {
+      kLDA_IMM, 0x10,          //
+      kLDX_IMM, 0x03,          //
+      kSTX_ABS, U16(0x0300),  //
+  };
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(bytecode));
+  CPU cpu(cart);
+  cpu.advance_cycles(2 + 2 + 4);
+
+  CHECK(Expression("A == $10 && [$0300] > 2").evaluate(cpu) == 1);
+  CHECK(Expression("A == $10 && [$0300] > 4").evaluate(cpu) == 0);
+  CHECK(Expression("x == 3 || 0").evaluate(cpu) == 1);
+  CHECK(Expression("PC").evaluate(cpu) == 0x8007);
+  CHECK(Expression("A + X - 1").evaluate(cpu) == 0x10 + 3 - 1);
+  CHECK(Expression("[$0300 - X + 3] & 1").evaluate(cpu) == 1);
+  CHECK(Expression("(A | X) ^ 1").evaluate(cpu) == 0x12);
+  CHECK(Expression("!(A <= 15) && -X < 0 && A >= 16").evaluate(cpu) == 1);
+  CHECK(Expression("A!=$10").evaluate(cpu) == 0);
+
+  CHECK_THROWS_AS(Expression(""), debugger::expression_error);
+  CHECK_THROWS_AS(Expression("A =="), debugger::expression_error);
+  CHECK_THROWS_AS(Expression("[A"), debugger::expression_error);
+  CHECK_THROWS_AS(Expression("B > 1"), debugger::expression_error);
+  CHECK_THROWS_AS(Expression("A 1"), debugger::expression_error);
+  CHECK_THROWS_AS(Expression("A * 2"), debugger::expression_error);
+  // Needs more than the evaluation stack holds
+  std::string deep = "1";
+  for (int i = 0; i < 40; i++) {
+    deep = "1 + (" + deep + ")";
+  }
+  CHECK_THROWS_AS(Expression(deep), debugger::expression_error);
+  CHECK_THROWS_AS(Expression(std::string(1000, '(') + "1"),
+                  debugger::expression_error);
+
+  debugger::TraceFormat trace("A={A} [$0300]={[$0300]} PC={PC}!");
+  CHECK(trace.format(cpu) == "A=$10 [$0300]=$03 PC=$8007!");
+  CHECK(debugger::TraceFormat("no fields").format(cpu) == "no fields");
+  CHECK_THROWS_AS(debugger::TraceFormat("X={X"), debugger::expression_error);
+
+  // Memory is peeked: testing VBlank doesn't acknowledge it
+  std::vector<uint8_t> spin = {kJMP_ABS, U16(0x8000)};
+  cartridge::Cartridge io_cart(std::make_unique<VectorMapper>(spin));
+  ppu::PPU ppu(io_cart);
+  CPU io(io_cart, std::ref(ppu));
+  io.advance_frame();
+  REQUIRE(ppu.in_vblank());
+  CHECK(Expression("[$2002] & $80").evaluate(io) == 0x80);
+  CHECK(Expression("[$2002] & $80").evaluate(io) == 0x80);
+  CHECK(ppu.in_vblank());
+}
+
+TEST_CASE("Debugger protocol") {
+  std::vector<uint8_t> bytecode = {
+      kLDX_IMM, 0x00,          //
+      kINX,                    // $8002
+      kSTX_ABS, U16(0x0300),  // $8003
+      kJMP_ABS, U16(0x8002),  // $8006
+  };
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(bytecode));
+  CPU cpu(cart);
+  debugger::Debugger debugger(&cpu);
+  debugger::DebugServer server(debugger);
+
+  CHECK(server.handle(R"({"id": 1, "cmd": "registers"})")
+            .starts_with(R"({"id":1,"ok":true,"pc":32768,)"));
+  CHECK(server.handle(R"({"cmd": "step", "count": 2})") ==
+        R"({"ok":true,"stop":"limit","instructions":2,"pc":32771})");
+
+  // The condition is checked every time $8003 is reached
+  CHECK(server.handle(R"({"cmd": "break", "addr": 32771, "if": "X == 3"})") ==
+        R"({"ok":true})");
+  CHECK(server.handle(R"({"id": "c", "cmd": "continue"})") ==
+        R"({"id":"c","ok":true,"stop":"breakpoint","instructions":6,)"
+        R"("pc":32771})");
+  CHECK(cpu.X() == 3);
+
+  CHECK(server.handle(R"([{"cmd": "read", "addr": 768, "len": 2},)"
+                      R"( {"cmd": "write", "addr": 768, "data": "aB10"},)"
+                      R"( {"cmd": "read", "addr": 768, "len": 2}])") ==
+        R"([{"ok":true,"data":"0200"},{"ok":true},)"
+        R"({"ok":true,"data":"ab10"}])");
+  CHECK(server.handle(
+            R"({"cmd": "read", "addr": 768, "side_effects": true})") ==
+        R"({"ok":true,"data":"ab"})");
+
+  CHECK(server.handle(R"({"cmd": "delete", "addr": 32771})") ==
+        R"({"ok":true,"deleted":true})");
+  CHECK(server.handle(
+            R"({"cmd": "trace", "addr": 32774, "message": "X={X}"})") ==
+        R"({"ok":true})");
+  CHECK(server.handle(R"({"cmd": "continue", "limit": 6})") ==
+        R"({"ok":true,"stop":"limit","instructions":6,"pc":32771,)"
+        R"("trace":["$8006: X=$03","$8006: X=$04"]})");
+  CHECK(server.handle(R"({"cmd": "list"})") ==
+        R"({"ok":true,"breakpoints":[{"addr":32774,"message":"X={X}"}],)"
+        R"("watchpoints":[]})");
+
+  CHECK(server.handle(R"({"cmd": "watch", "addr": 768})") == R"({"ok":true})");
+  CHECK(server.handle(R"({"cmd": "continue"})") ==
+        R"({"ok":true,"stop":"watchpoint","instructions":1,"pc":32774,)"
+        R"("watch":{"addr":768,"value":5,"write":true}})");
+  CHECK(server.handle(R"({"cmd": "set", "pc": 32768, "x": 16})") ==
+        R"({"ok":true})");
+  CHECK(cpu.PC() == 0x8000);
+  CHECK(cpu.X() == 0x10);
+
+  auto error = [&](std::string_view request) {
+    return server.handle(request).starts_with(R"({"ok":false,"error":)");
+  };
+  CHECK(error("{"));
+  CHECK(error(R"({"cmd": "step"} x)"));
+  CHECK(error(R"({"cmd": "step", "count": 1.5})"));
+  CHECK(error(R"({"cmd": "fly"})"));
+  CHECK(error(R"({"cmd": "read"})"));
+  CHECK(error(R"({"cmd": "read", "addr": 65536})"));
+  CHECK(error(R"({"cmd": "read", "addr": 0, "side_effects": 1})"));
+  CHECK(error(R"({"cmd": "write", "addr": 0, "data": "abc"})"));
+  CHECK(error(R"({"cmd": "break", "addr": 0, "if": "A =="})"));
+  CHECK(error(R"({"cmd": "set", "pc": 0, "a": 256})"));
+  CHECK(cpu.PC() == 0x8000);
+  CHECK(server.handle(R"({"id": 9, "cmd": "fly"})")
+            .starts_with(R"({"id":9,"ok":false,)"));
+
+  CHECK_FALSE(server.exiting());
+  CHECK(server.handle(R"({"cmd": "exit"})") == R"({"ok":true})");
+  CHECK(server.exiting());
+}
+
+TEST_CASE("Debugger goes back") {
+  using debugger::Debugger;
+  std::vector<uint8_t> bytecode = {
+      kLDX_IMM, 0x00,          //
+      kINX,                    // $8002
+      kSTX_ABS, U16(0x0300),  // $8003
+      kJMP_ABS, U16(0x8002),  // $8006
+  };
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(bytecode));
+  CPU cpu(cart);
+  Debugger debugger(&cpu);
+  auto state = [&] {
+    std::vector<uint8_t> state(cpu.state_size());
+    cpu.save_state(state);
+    return state;
+  };
+
+  debugger.run(12345, false);
+  std::vector<uint8_t> then = state();
+  // Past a checkpoint
+  debugger.run(Debugger::kCheckpointInterval, false);
+  Debugger::RunResult result = debugger.back(Debugger::kCheckpointInterval);
+  CHECK(result.stop == Debugger::kStopLimit);
+  CHECK(result.instructions == Debugger::kCheckpointInterval);
+  CHECK(debugger.position() == 12345);
+  CHECK(state() == then);
+  debugger.run(1, false);
+  debugger.back();
+  CHECK(state() == then);
+
+  SECTION("Reverse continue") {
+    debugger.set_breakpoint(0x8006, debugger::Expression("X == $10"));
+    result = debugger.reverse_run();
+    CHECK(result.stop == Debugger::kStopBreakpoint);
+    CHECK(cpu.PC() == 0x8006);
+    CHECK(cpu.X() == 0x10);
+    // X comes round again every 256 loops of 3 instructions
+    result = debugger.reverse_run();
+    CHECK(result.stop == Debugger::kStopBreakpoint);
+    CHECK(result.instructions == 256 * 3);
+    CHECK(cpu.X() == 0x10);
+
+    // Going forwards finds the breakpoint that was left
+    CHECK(debugger.run().instructions == 256 * 3);
+
+    debugger.delete_breakpoint(0x8006);
+    debugger.set_watchpoint(0x0300, kWatchWrite);
+    result = debugger.reverse_run();
+    CHECK(result.stop == Debugger::kStopWatchpoint);
+    CHECK(result.instructions == 3);
+    REQUIRE(debugger.watch_hit());
+    CHECK(debugger.watch_hit()->value == 0x0F);
+    CHECK(cpu.X() == 0x0F);
+  }
+
+  SECTION("Start of the history") {
+    result = debugger.back(UINT64_MAX);
+    CHECK(result.stop == Debugger::kStopHistoryStart);
+    CHECK(result.instructions == 12345);
+    CHECK(cpu.PC() == 0x8000);
+    result = debugger.reverse_run();
+    CHECK(result.stop == Debugger::kStopHistoryStart);
+    CHECK(result.instructions == 0);
+  }
+
+  SECTION("Changes restart the history") {
+    debugger.write(0x0300, std::vector<uint8_t>{0x42});
+    CHECK(debugger.history_start() == 12345);
+    CHECK(debugger.back().stop == Debugger::kStopHistoryStart);
+    CHECK(cpu.read(0x0300) == 0x42);
+    debugger.run(10, false);
+    debugger.set_register(Debugger::kRegX, 0);
+    CHECK(debugger.history_start() == 12355);
+  }
+
+  SECTION("Reading memory keeps the history unless it has side effects") {
+    std::vector<uint8_t> bytes(0x40);
+    debugger.read(0x1FF0, bytes);
+    CHECK(debugger.history_start() == 0);
+    debugger.read(0x1FF0, bytes, true);
+    CHECK(debugger.history_start() == 12345);
+  }
+}
+
+TEST_CASE("Profiler") {
+  std::vector<uint8_t> bytecode = {
+      kLDX_IMM, 0x00,          //
+      kJSR_ABS, U16(0x800A),  // $8002
+      kJMP_ABS, U16(0x8002),  // $8005
+      kNOP,     kNOP,          //
+      kINX,                    // $800A: outer
+      kJSR_ABS, U16(0x8010),  // $800B
+      kRTS,                    // $800E
+      kNOP,                    //
+      kNOP,                    // $8010: inner
+      kRTS,                    // $8011
+  };
+  bytecode.resize(0x20, kNOP);
+  bytecode.push_back(kNOP);  // $8020: irq
+  bytecode.push_back(kRTI);
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(bytecode, 0x8020));
+  CPU cpu(cart);
+
+  std::string path =
+      (std::filesystem::temp_directory_path() / "nesemu-test-labels.txt")
+          .string();
+  {
+    std::ofstream labels(path);
+    labels << "al 008000 .__STARTUP_LOAD__\n"
+              "al 00800A .outer\n"
+              "al 008010 .inner\n"
+              "al 008020 .irq\n";
+  }
+  profiler::Profiler profiler(profiler::SymbolMap::load(path));
+  std::filesystem::remove(path);
+  CHECK(profiler.symbols().size() == 3);
+  CHECK(profiler.symbols().name(0x8010) == "inner");
+  CHECK(profiler.symbols().name(0x8000) == "$8000");
+  CHECK(profiler.symbols().locate(0x800E) == "outer+4");
+  CHECK_THROWS_AS(profiler::SymbolMap::load(path), profiler::symbol_error);
+
+  cpu.set_profiler(&profiler);
+  // LDX, then 10 loops of 31 cycles, up to the start of the 11th
+  cpu.advance_cycles(2 + 10 * 31 + 1);
+  CHECK(profiler.total_cycles() == 2 + 10 * 31);
+  CHECK(profiler.cycles(0x8002) == 10 * 6);
+  CHECK(profiler.cycles(0x800E) == 10 * 6);
+  CHECK(profiler.cycles(0x8010) == 10 * 2);
+  std::ostringstream collapsed;
+  profiler.write_collapsed(collapsed);
+  CHECK(collapsed.str() ==
+        "(root) 92\n"
+        "(root);outer 140\n"
+        "(root);outer;inner 80\n");
+
+  // The IRQ cuts in before the JSR runs, which runs again after the RTI
+  cpu.trigger_irq();
+  cpu.advance_cycles(6 + 2 + 6 + 31);
+  collapsed.str("");
+  profiler.write_collapsed(collapsed);
+  CHECK(collapsed.str().find("(root);irq ") != std::string::npos);
+  CHECK(collapsed.str().find("(root);irq;") == std::string::npos);
+  CHECK(collapsed.str().find("(root);outer;inner ") != std::string::npos);
+
+  std::ostringstream report;
+  profiler.print_report(report);
+  CHECK(report.str().find("outer") != std::string::npos);
+
+  // Detached, nothing is counted
+  uint64_t total = profiler.total_cycles();
+  cpu.set_profiler(nullptr);
+  cpu.advance_cycles(100);
+  CHECK(profiler.total_cycles() == total);
+  profiler.reset();
+  CHECK(profiler.total_cycles() == 0);
+  CHECK(profiler.cycles(0x8002) == 0);
+}
+
+TEST_CASE("APU status and frame IRQ") {
+  std::vector<uint8_t> bytecode = {
+      kCLI,                   //
+      kJMP_ABS, U16(0x8001),  // spin
+  };
+  uint16_t isr = 0x9000;
+  std::unique_ptr<VectorMapper> mapper(new VectorMapper(bytecode, isr));
+  cartridge::Cartridge cart(std::move(mapper));
+  apu::APU apu(cart);
+  CPU cpu(cart, std::nullopt, std::nullopt, std::ref(apu));
+
+  // Loading a length counter shows in $4015 until the channel is disabled
+  cpu.write(0x4015, 0b0000'0101);
+  cpu.write(0x4003, 0x08);
+  cpu.write(0x400B, 0x08);
+  cpu.write(0x400F, 0x08);  // noise is disabled, so this doesn't load
+  CHECK((cpu.read(0x4015) & 0b1111) == 0b0101);
+  cpu.write(0x4015, 0b0000'0001);
+  CHECK((cpu.read(0x4015) & 0b1111) == 0b0001);
+
+  // In 4-step mode, the IRQ flag is raised 29829 clocks into the sequence
+  apu.write(0x4017, 0x00, 100);
+  CHECK((apu.read_status(100 + 29828) & 0x40) == 0);
+  CHECK((apu.read_status(100 + 29829) & 0x40) != 0);
+  // and reading the status acknowledges it
+  CHECK((apu.read_status(100 + 29830) & 0x40) == 0);
+  CHECK_FALSE(apu.irq());
+
+  // The CPU takes the interrupt
+  cpu.advance_cycles(3 * 29830);
+  CHECK(cpu.get_interrupt_disable());
+  CHECK(apu.irq());
+
+  // 5-step mode never raises it
+  cpu.write(0x4017, 0x80);
+  cpu.read(0x4015);
+  cpu.advance_cycles(2 * 37282);
+  CHECK_FALSE(apu.irq());
+}
+
+// Keeps every sample it is given
+class CaptureSink : public apu::AudioSink {
+ public:
+  void consume(std::span<const int16_t> samples) override {
+    samples_.insert(samples_.end(), samples.begin(), samples.end());
+  }
+  const std::vector<int16_t>& samples() const { return samples_; }
+
+ private:
+  std::vector<int16_t> samples_;
+};
+
+TEST_CASE("APU synthesizes a pulse tone") {
+  std::vector<uint8_t> bytecode = {
+      kJMP_ABS, U16(0x8000),  // spin
+  };
+  std::unique_ptr<VectorMapper> mapper(new VectorMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  apu::APU apu(cart);
+  CaptureSink sink;
+  int frames = 60;
+  {
+    apu::AudioOutput output(sink);
+    apu.attach_output(&output);
+    CPU cpu(cart, std::nullopt, std::nullopt, std::ref(apu));
+
+    // 440Hz at full constant volume, 50% duty, length counter halted
+    int period = 253;  // 1789773 / (16 * 440) - 1
+    cpu.write(0x4015, 0x01);
+    cpu.write(0x4000, 0b1011'1111);
+    cpu.write(0x4002, period & 0xFF);
+    cpu.write(0x4003, period >> 8);
+    for (int frame = 0; frame < frames; frame++) {
+      cpu.advance_frame();
+    }
+    apu.attach_output(nullptr);
+  }
+
+  // A frame's worth of samples per frame
+  std::size_t frame_cycles = static_cast<std::size_t>(CPU::kRenderCycles) +
+                             static_cast<std::size_t>(CPU::kVBlankCycles);
+  double seconds = frames * frame_cycles / apu::kClockRate;
+  const std::vector<int16_t>& samples = sink.samples();
+  CHECK(samples.size() == Approx(seconds * apu::kSampleRate).margin(2));
+
+  // Two zero crossings per cycle, once the first step's ringing is over
+  std::size_t settle = apu::kSampleRate / 100;
+  int crossings = 0;
+  for (std::size_t i = settle; i < samples.size(); i++) {
+    crossings += (samples[i - 1] < 0) != (samples[i] < 0);
+  }
+  CHECK(crossings == Approx(2 * 440 * (seconds - 0.01)).margin(4));
+  int16_t peak = *std::max_element(samples.begin(), samples.end());
+  CHECK(peak > 15 * apu::kPulseWeight * 32767 * 0.4);
+}
+
+TEST_CASE("Sample buffer steps are band-limited") {
+  // Steps at the start of a sample and half a sample later
+  auto step_at = [](uint64_t clock) {
+    apu::SampleBuffer buffer(apu::kClockRate, apu::kSampleRate, 256);
+    buffer.add_delta(clock, 0.5f);
+    buffer.end_frame(1000);
+    std::vector<int16_t> out(24);
+    REQUIRE(buffer.read_samples(out) == out.size());
+    return out;
+  };
+  std::vector<int16_t> early = step_at(0);
+  std::vector<int16_t> late = step_at(19);
+  int16_t level = 0.5 * 32767;
+
+  // Rises in the middle of the kernel, ringing only a little around it
+  for (int i = 0; i < 6; i++) {
+    CHECK(std::abs(early[i]) < level / 20);
+  }
+  CHECK(early[7] > level * 9 / 10);
+  for (int16_t sample : early) {
+    CHECK(sample < level * 11 / 10);
+  }
+  // A step between two samples is halfway up at the first
+  CHECK(late[7] > level / 4);
+  CHECK(late[7] < level * 3 / 4);
+  CHECK(late[8] > level * 9 / 10);
+}
+
+TEST_CASE("Sample ring wraps around") {
+  apu::SampleRing ring(5);
+  REQUIRE(ring.capacity() == 8);
+
+  std::vector<int16_t> in = {1, 2, 3, 4, 5, 6};
+  std::vector<int16_t> out(8);
+  CHECK(ring.push(in) == 6);
+  CHECK(ring.pop(std::span(out).first(4)) == 4);
+  CHECK(out[3] == 4);
+  // Only 6 of the 7 fit
+  in.push_back(7);
+  CHECK(ring.push(in) == 6);
+  CHECK(ring.size() == 8);
+  CHECK(ring.pop(out) == 8);
+  CHECK(out == std::vector<int16_t>{5, 6, 1, 2, 3, 4, 5, 6});
+  CHECK(ring.pop(out) == 0);
+}
+
+TEST_CASE("APU state round trip") {
+  std::vector<uint8_t> bytecode = {
+      kJMP_ABS, U16(0x8000),  // spin
+  };
+  std::unique_ptr<VectorMapper> mapper(new VectorMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  apu::APU apu(cart);
+  CPU cpu(cart, std::nullopt, std::nullopt, std::ref(apu));
+  // Loading a state makes the synthesizer start over from it
+  CaptureSink sink;
+  auto output = std::make_unique<apu::AudioOutput>(sink);
+  apu.attach_output(output.get());
+
+  // Every channel busy, with a decaying envelope and a sweep
+  cpu.write(0x4015, 0x0F);
+  cpu.write(0x4000, 0b0100'0011);
+  cpu.write(0x4001, 0b1001'0010);
+  cpu.write(0x4002, 0x80);
+  cpu.write(0x4003, 0x21);
+  cpu.write(0x4008, 0x7F);
+  cpu.write(0x400A, 0x40);
+  cpu.write(0x400B, 0x01);
+  cpu.write(0x400C, 0x05);
+  cpu.write(0x400E, 0x83);
+  cpu.write(0x400F, 0x30);
+  cpu.advance_cycles(10000);
+
+  std::vector<uint8_t> saved(cpu.state_size());
+  cpu.save_state(saved);
+  for (int frame = 0; frame < 5; frame++) {
+    cpu.advance_frame();
+  }
+  std::vector<uint8_t> expected(cpu.state_size());
+  cpu.save_state(expected);
+  uint8_t expected_status = cpu.read(0x4015);
+
+  cpu.load_state(saved);
+  for (int frame = 0; frame < 5; frame++) {
+    cpu.advance_frame();
+  }
+  std::vector<uint8_t> state(cpu.state_size());
+  cpu.save_state(state);
+  CHECK(state == expected);
+  CHECK(cpu.read(0x4015) == expected_status);
+
+  apu.attach_output(nullptr);
+  output.reset();
+  CHECK(sink.samples().size() > 10 * 700);
+}
+
+// Not run by default: test-cpu "[benchmark]"
+TEST_CASE("APU synthesis speed", "[.benchmark]") {
+  std::vector<uint8_t> bytecode;
+  std::unique_ptr<VectorMapper> mapper(new VectorMapper(bytecode));
+  cartridge::Cartridge cart(std::move(mapper));
+  apu::APU apu(cart);
+  // Discards everything, so only synthesis is timed
+  class NullSink : public apu::AudioSink {
+   public:
+    void consume(std::span<const int16_t> samples) override {
+      count += samples.size();
+    }
+    std::size_t count = 0;
+  } sink;
+  apu::AudioOutput output(sink);
+  apu.attach_output(&output);
+
+  // Both pulses, the triangle and noise all busy, the worst common case
+  uint64_t clock = 0;
+  for (auto [addr, data] : std::vector<std::pair<uint16_t, uint8_t>>{
+           {0x4015, 0x0F}, {0x4000, 0xBF}, {0x4002, 0x40}, {0x4003, 0x01},
+           {0x4004, 0x7F}, {0x4006, 0x90}, {0x4007, 0x00}, {0x4008, 0xFF},
+           {0x400A, 0x80}, {0x400B, 0x00}, {0x400C, 0x3F}, {0x400E, 0x04},
+           {0x400F, 0x00}}) {
+    apu.write(addr, data, clock);
+  }
+
+  constexpr int kFrames = 60 * 60;
+  constexpr uint64_t kFrameClocks = 29781;
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < kFrames; frame++) {
+    clock += kFrameClocks;
+    apu.end_frame(clock);
+  }
+  // Waits for the synthesizer to finish
+  apu.attach_output(nullptr);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  double samples = kFrames * kFrameClocks / apu::kClockRate * apu::kSampleRate;
+  WARN(std::format("{:.0f} samples/s ({:.0f}x real time)",
+                   samples / elapsed.count(),
+                   samples / elapsed.count() / apu::kSampleRate));
+}
+
+TEST_CASE("Frame time histogram") {
+  using std::chrono::microseconds;
+  pacing::FrameTimeHistogram histogram;
+  REQUIRE(histogram.percentile(0.5) == pacing::Clock::duration::zero());
+
+  for (int i = 0; i < 98; i++) {
+    histogram.add(microseconds(16600));
+  }
+  histogram.add(microseconds(33300));
+  histogram.add(microseconds(80000));  // past the last bucket
+
+  REQUIRE(histogram.count() == 100);
+  REQUIRE(histogram.max() == microseconds(80000));
+  // Percentiles round up to the end of their bucket
+  REQUIRE(histogram.percentile(0.5) == microseconds(16750));
+  REQUIRE(histogram.percentile(0.99) == microseconds(33500));
+  REQUIRE(histogram.percentile(1.0) == microseconds(80000));
+  REQUIRE(histogram.mean() == microseconds((98 * 16600 + 33300 + 80000) / 100));
+
+  std::ostringstream out;
+  histogram.print(out);
+  std::string printed = out.str();
+  REQUIRE(printed.starts_with("100 frames: mean 17.40ms"));
+  REQUIRE(printed.find("16.50ms      98 ") != std::string::npos);
+  REQUIRE(printed.find(">50.00ms       1 #") != std::string::npos);
+}
+
+// Hidden: a stall of a few milliseconds, as on a busy machine, drops frames
+TEST_CASE("Pacer keeps an absolute timeline", "[.timing]") {
+  using std::chrono::milliseconds;
+  constexpr int kFrames = 40;
+  pacing::Pacer pacer(500.0);  // 2ms frames
+  pacer.wait();
+  auto start = pacing::Clock::now();
+  for (int frame = 1; frame <= kFrames; frame++) {
+    if (frame == 10) {
+      // An overrun of two frames is made up by the frames after it
+      std::this_thread::sleep_for(milliseconds(5));
+    }
+    pacer.wait();
+  }
+  auto elapsed = pacing::Clock::now() - start;
+  REQUIRE(elapsed >= milliseconds(2 * kFrames));
+  // Only a sanity limit: catching up shouldn't take as long as the frames
+  REQUIRE(elapsed < milliseconds(2 * kFrames * 4));
+  REQUIRE(pacer.dropped_frames() == 0);
+  REQUIRE(pacer.histogram().count() == kFrames);
+
+  SECTION("Falling too far behind drops frames") {
+    std::this_thread::sleep_for(milliseconds(30));
+    pacer.wait();
+    REQUIRE(pacer.dropped_frames() >= 10);
+    // Back on schedule from here
+    auto resumed = pacing::Clock::now();
+    for (int frame = 0; frame < 10; frame++) {
+      pacer.wait();
+    }
+    REQUIRE(pacing::Clock::now() - resumed >= milliseconds(19));
+    REQUIRE(pacer.dropped_frames() < 16);
+  }
+}
+
+TEST_CASE("Pacer stops and follows rate control") {
+  pacing::Pacer pacer(500.0);
+  REQUIRE(!pacer.stopped());
+
+  // A full consumer buffer stretches every frame
+  pacer.set_rate_control([]() { return 1.0; });
+  pacer.wait();
+  auto start = pacing::Clock::now();
+  for (int frame = 0; frame < 100; frame++) {
+    pacer.wait();
+  }
+  // 100 frames of 2ms, each 0.5% longer
+  REQUIRE(pacing::Clock::now() - start >= std::chrono::microseconds(201000));
+
+  std::thread stopper([&]() { pacer.stop(); });
+  stopper.join();
+  REQUIRE(pacer.stopped());
+}
+
+TEST_CASE("Debugger expression speed", "[.benchmark]") {
+  cartridge::Cartridge cart(std::make_unique<VectorMapper>(
+      std::vector<uint8_t>{kJMP_ABS, U16(0x8000)}));
+  CPU cpu(cart);
+  debugger::Expression condition("A == $10 && [$0300] > 4");
+
+  constexpr int kEvaluations = 10'000'000;
+  int32_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kEvaluations; i++) {
+    hits += condition.evaluate(cpu);
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  CHECK(hits == 0);
+  WARN(std::format("{:.1f}ns per evaluation", elapsed.count() / kEvaluations));
+}
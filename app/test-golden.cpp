@@ -0,0 +1,396 @@
+#include <catch2/catch.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "controller.hpp"
+#include "cpu.hpp"
+#include "debugger.hpp"
+#include "ppu.hpp"
+#include "savestate.hpp"
+#include "video.hpp"
+
+// Golden hash logs are generated with
+//   nesemu <rom> --headless --frames <N> --hash-log <log>
+// and must be regenerated (and reviewed!) whenever rendering intentionally
+// changes.
+
+#ifndef NESEMU_SOURCE_DIR
+#define NESEMU_SOURCE_DIR "."
+#endif
+
+// The ROM the tests run, unless they say otherwise
+std::string test_rom() {
+  return std::string(NESEMU_SOURCE_DIR) +
+         "/vendor/color_test_nosprites/color_test_nosprites.nes";
+}
+
+// Presses a different combination of buttons every frame
+class Script : public controller::InputSource {
+ public:
+  uint8_t next_frame() override { return frame_++ * 37; }
+
+ private:
+  uint8_t frame_ = 0;
+};
+
+/**
+ * @brief Run the ROM headless for as many frames as the golden log has and
+ * return the hashes of the rendered frames.
+ */
+std::vector<uint64_t> run_rom(const std::string& rom_path, std::size_t frames) {
+  cartridge::Cartridge cart(cartridge::RomImage::load(rom_path));
+  ppu::PPU ppu(cart);
+  video::HashSink hasher;
+  ppu.add_frame_sink(hasher);
+  cpu::CPU cpu(cart, std::ref(ppu));
+
+  for (std::size_t frame = 0; frame < frames; ++frame) {
+    cpu.advance_frame();
+  }
+  return hasher.hashes();
+}
+
+void check_golden(const std::string& rom, const std::string& golden) {
+  std::ifstream log(std::string(NESEMU_SOURCE_DIR) + "/" + golden);
+  REQUIRE(log.is_open());
+  std::vector<uint64_t> expected = video::read_hash_log(log);
+  REQUIRE(!expected.empty());
+
+  std::vector<uint64_t> actual =
+      run_rom(std::string(NESEMU_SOURCE_DIR) + "/" + rom, expected.size());
+  REQUIRE(actual.size() == expected.size());
+
+  for (std::size_t frame = 0; frame < expected.size(); ++frame) {
+    if (actual[frame] != expected[frame]) {
+      FAIL(std::format("first mismatching frame: {} (expected {:016x}, got "
+                       "{:016x})",
+                       frame, expected[frame], actual[frame]));
+    }
+  }
+}
+
+TEST_CASE("color_test_nosprites golden frames") {
+  check_golden("vendor/color_test_nosprites/color_test_nosprites.nes",
+               "vendor/golden/color_test_nosprites.log");
+}
+
+TEST_CASE("Save states fork a session") {
+  auto image = cartridge::RomImage::load(test_rom());
+  cartridge::Cartridge cart(image);
+  ppu::PPU ppu(cart);
+  video::HashSink hasher;
+  ppu.add_frame_sink(hasher);
+  cpu::CPU cpu(cart, std::ref(ppu));
+  for (int frame = 0; frame < 20; ++frame) {
+    cpu.advance_frame();
+  }
+
+  std::vector<uint8_t> state(cpu.state_size());
+  REQUIRE(cpu.save_state(state) == state.size());
+  for (int frame = 0; frame < 20; ++frame) {
+    cpu.advance_frame();
+  }
+  std::vector<uint8_t> end_state(state.size());
+  cpu.save_state(end_state);
+
+  // A second machine on the same ROM image picks up where the first was
+  cartridge::Cartridge fork_cart(image);
+  ppu::PPU fork_ppu(fork_cart);
+  video::HashSink fork_hasher;
+  fork_ppu.add_frame_sink(fork_hasher);
+  cpu::CPU fork(fork_cart, std::ref(fork_ppu));
+  fork.load_state(state);
+  for (int frame = 0; frame < 20; ++frame) {
+    fork.advance_frame();
+  }
+  std::vector<uint64_t> tail(hasher.hashes().begin() + 20,
+                             hasher.hashes().end());
+  CHECK(fork_hasher.hashes() == tail);
+  std::vector<uint8_t> fork_state(state.size());
+  fork.save_state(fork_state);
+  CHECK(fork_state == end_state);
+
+  // Bad states are rejected
+  std::vector<uint8_t> small(state.size() - 1);
+  CHECK_THROWS_AS(cpu.save_state(small), savestate::savestate_error);
+  CHECK_THROWS_AS(fork.load_state(std::span(state).first(100)),
+                  savestate::savestate_error);
+  cpu::CPU headless(fork_cart);
+  CHECK_THROWS_AS(headless.load_state(state), savestate::savestate_error);
+}
+
+TEST_CASE("Rewind buffer") {
+  constexpr std::size_t kStateSize = 4096;
+  auto make_state = [](int i) {
+    std::vector<uint8_t> state(kStateSize, 0x55);
+    // A few bytes change per snapshot, as a few bytes of RAM do per frame
+    for (int j = 0; j < 16; j++) {
+      state[(i * 37 + j * 101) % kStateSize] = i + j;
+    }
+    return state;
+  };
+
+  SECTION("Snapshots come back newest first") {
+    savestate::RewindBuffer buffer(kStateSize, 1 << 20, 100);
+    for (int i = 0; i < 50; i++) {
+      buffer.push(make_state(i));
+    }
+    CHECK(buffer.size() == 50);
+    // Only the first snapshot is stored whole
+    CHECK(buffer.memory_used() < kStateSize + 50 * 100);
+    std::vector<uint8_t> out(kStateSize);
+    for (int i = 49; i >= 0; i--) {
+      REQUIRE(buffer.pop(out));
+      REQUIRE(out == make_state(i));
+    }
+    CHECK_FALSE(buffer.pop(out));
+  }
+
+  SECTION("Oldest snapshots are dropped when full") {
+    savestate::RewindBuffer by_count(kStateSize, 1 << 20, 10);
+    savestate::RewindBuffer by_memory(kStateSize, 8192, 1000);
+    for (int i = 0; i < 500; i++) {
+      by_count.push(make_state(i));
+      by_memory.push(make_state(i));
+    }
+    CHECK(by_count.size() == 10);
+    CHECK(by_memory.memory_used() <= 8192);
+    std::vector<uint8_t> out(kStateSize);
+    int popped = 0;
+    while (by_memory.pop(out)) {
+      REQUIRE(out == make_state(499 - popped));
+      popped++;
+    }
+    CHECK(popped > 10);
+    // Pushing again continues from the restored history
+    by_count.pop(out);
+    by_count.push(make_state(1000));
+    REQUIRE(by_count.pop(out));
+    CHECK(out == make_state(1000));
+    REQUIRE(by_count.pop(out));
+    CHECK(out == make_state(498));
+  }
+
+  SECTION("Deltas of mixed sizes wrap around the arena") {
+    // Small and large deltas leave the previous lap's entries behind the
+    // wrap point, which must be dropped before being written over
+    constexpr std::size_t kCapacity = 1500;
+    savestate::RewindBuffer buffer(kStateSize, kCapacity, 1000);
+    std::mt19937 rng(1);
+    std::vector<std::vector<uint8_t>> pushed;
+    // An empty buffer's deltas are against zeros
+    std::vector<uint8_t> state(kStateSize, 0);
+    std::vector<uint8_t> out(kStateSize);
+    for (int i = 0; i < 2000; i++) {
+      if (rng() % 4 == 0) {
+        if (buffer.pop(out)) {
+          REQUIRE(out == pushed.back());
+          pushed.pop_back();
+          state = out;
+        } else {
+          pushed.clear();
+        }
+        continue;
+      }
+      int changes = rng() % 2 == 0 ? 1 + rng() % 4 : 50 + rng() % 200;
+      for (int j = 0; j < changes; j++) {
+        state[rng() % kStateSize] = rng();
+      }
+      buffer.push(state);
+      pushed.push_back(state);
+      REQUIRE(buffer.memory_used() <= kCapacity);
+    }
+    while (buffer.pop(out)) {
+      REQUIRE(out == pushed.back());
+      pushed.pop_back();
+    }
+  }
+}
+
+TEST_CASE("Rewind") {
+  cartridge::Cartridge cart(cartridge::RomImage::load(test_rom()));
+  ppu::PPU ppu(cart);
+  video::HashSink hasher;
+  ppu.add_frame_sink(hasher);
+  cpu::CPU cpu(cart, std::ref(ppu));
+  savestate::Rewinder rewinder(cpu, 1, 1 << 20, 600);
+
+  std::vector<std::vector<uint8_t>> states;
+  for (int frame = 0; frame < 30; frame++) {
+    rewinder.advance_frame(false);
+    states.emplace_back(cpu.state_size());
+    cpu.save_state(states.back());
+  }
+  CHECK(rewinder.buffer().size() == 30);
+
+  // Each rewound frame goes back to, and shows, the frame before
+  std::vector<uint8_t> state(cpu.state_size());
+  for (int frame = 28; frame >= 20; frame--) {
+    rewinder.advance_frame(true);
+    cpu.save_state(state);
+    CHECK(state == states[frame]);
+    CHECK(hasher.hashes().back() == hasher.hashes()[frame]);
+  }
+  CHECK(rewinder.buffer().size() == 20);
+
+  // Running forwards again records from there
+  rewinder.advance_frame(false);
+  CHECK(rewinder.buffer().size() == 21);
+}
+
+TEST_CASE("Run-ahead") {
+  std::string rom = test_rom();
+  std::vector<uint64_t> expected = run_rom(rom, 30);
+
+  cartridge::Cartridge cart(cartridge::RomImage::load(rom));
+  ppu::PPU ppu(cart);
+  video::HashSink hasher;
+  ppu.add_frame_sink(hasher);
+  cpu::CPU cpu(cart, std::ref(ppu));
+  cartridge::Cartridge plain_cart(cartridge::RomImage::load(rom));
+  ppu::PPU plain_ppu(plain_cart);
+  cpu::CPU plain(plain_cart, std::ref(plain_ppu));
+  savestate::RunAhead run_ahead(cpu, ppu, 2);
+
+  std::vector<uint8_t> state(cpu.state_size());
+  std::vector<uint8_t> plain_state(state.size());
+  for (int frame = 0; frame < 20; frame++) {
+    run_ahead.advance_frame();
+    plain.advance_frame();
+    // Only the frame two ahead is shown, and the machine stays on the real one
+    REQUIRE(hasher.hashes().size() == static_cast<std::size_t>(frame + 1));
+    CHECK(hasher.hashes().back() == expected[frame + 2]);
+    cpu.save_state(state);
+    plain.save_state(plain_state);
+    CHECK(state == plain_state);
+  }
+}
+
+TEST_CASE("Run-ahead doesn't disturb the sound") {
+  // Keeps every sample it is given
+  class CaptureSink : public apu::AudioSink {
+   public:
+    void consume(std::span<const int16_t> samples) override {
+      samples_.insert(samples_.end(), samples.begin(), samples.end());
+    }
+    std::vector<int16_t> samples_;
+  };
+
+  std::string rom = test_rom();
+  auto play = [&](std::size_t frames_ahead) {
+    cartridge::Cartridge cart(cartridge::RomImage::load(rom));
+    ppu::PPU ppu(cart);
+    apu::APU apu(cart);
+    cpu::CPU cpu(cart, std::ref(ppu), std::nullopt, std::ref(apu));
+    CaptureSink sink;
+    auto output = std::make_unique<apu::AudioOutput>(sink);
+    apu.attach_output(output.get());
+    savestate::RunAhead run_ahead(cpu, ppu, frames_ahead, std::ref(apu));
+
+    // A pulse and noise that change every frame
+    cpu.write(0x4015, 0b0000'1001);
+    cpu.write(0x4000, 0b1011'1111);
+    cpu.write(0x400C, 0b0011'1111);
+    for (int frame = 0; frame < 30; frame++) {
+      cpu.write(0x4002, frame * 7);
+      cpu.write(0x4003, 0x01);
+      cpu.write(0x400E, frame & 0x0F);
+      cpu.write(0x400F, 0x00);
+      run_ahead.advance_frame();
+    }
+    apu.attach_output(nullptr);
+    output.reset();
+    return sink.samples_;
+  };
+
+  // The frames run ahead are never heard, and the real ones are heard once
+  std::vector<int16_t> plain = play(0);
+  REQUIRE(plain.size() > 30 * 700);
+  CHECK(play(2) == plain);
+}
+
+TEST_CASE("Movies replay a session") {
+  auto image = cartridge::RomImage::load(test_rom());
+  std::string path =
+      (std::filesystem::temp_directory_path() / "nesemu-test-movie.nesm")
+          .string();
+
+  std::vector<uint8_t> recorded_state;
+  {
+    Script script;
+    controller::MovieRecorder recorder(script, path, image->hash());
+    cartridge::Cartridge cart(image);
+    ppu::PPU ppu(cart);
+    controller::Controller controller(recorder);
+    cpu::CPU cpu(cart, std::ref(ppu), std::ref(controller));
+    for (int frame = 0; frame < 60; frame++) {
+      cpu.advance_frame();
+    }
+    CHECK(recorder.frames() == 60);
+    recorded_state.resize(cpu.state_size());
+    cpu.save_state(recorded_state);
+  }
+
+  controller::MoviePlayer movie(path, image->hash());
+  CHECK(movie.frames() == 60);
+  cartridge::Cartridge cart(image);
+  ppu::PPU ppu(cart);
+  controller::Controller controller(movie);
+  cpu::CPU cpu(cart, std::ref(ppu), std::ref(controller));
+  for (int frame = 0; frame < 60; frame++) {
+    cpu.advance_frame();
+  }
+  CHECK(movie.finished());
+  std::vector<uint8_t> state(cpu.state_size());
+  cpu.save_state(state);
+  CHECK(state == recorded_state);
+  // Past the end, no buttons are held
+  CHECK(movie.next_frame() == 0);
+
+  CHECK_THROWS_AS(controller::MoviePlayer(path, image->hash() + 1),
+                  controller::input_error);
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Debugger re-executes the past exactly") {
+  auto image = cartridge::RomImage::load(test_rom());
+  Script script;
+  controller::InputLog log(script);
+  cartridge::Cartridge cart(image);
+  ppu::PPU ppu(cart);
+  apu::APU apu(cart);
+  controller::Controller controller(log);
+  cpu::CPU cpu(cart, std::ref(ppu), std::ref(controller), std::ref(apu));
+  debugger::Debugger debugger(&cpu, &log);
+  auto state = [&] {
+    std::vector<uint8_t> state(cpu.state_size());
+    cpu.save_state(state);
+    return state;
+  };
+
+  // Several frames, so input and NMIs are replayed too
+  debugger.run(100000, false);
+  std::vector<uint8_t> then = state();
+  std::size_t frames = log.position();
+  debugger.run(50000, false);
+  REQUIRE(log.position() > frames);
+
+  debugger.back(50000);
+  CHECK(debugger.position() == 100000);
+  CHECK(log.position() == frames);
+  CHECK(state() == then);
+
+  // Running forwards again plays the kept input rather than asking for more
+  std::size_t kept = log.frames();
+  debugger.run(50000, false);
+  CHECK(log.frames() == kept);
+  debugger.back(50000);
+  CHECK(state() == then);
+}
@@ -0,0 +1,620 @@
+#ifndef APU_HPP
+#define APU_HPP
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "cartridge.hpp"
+#include "savestate.hpp"
+
+namespace apu {
+
+using audio_error = std::runtime_error;
+
+// CPU clock (NTSC), which the APU runs from
+constexpr double kClockRate = 1789773.0;  // Hz
+constexpr int kSampleRate = 48000;        // Hz
+
+/**
+ * @brief A consumer of the APU's output: mono signed 16-bit samples at
+ * kSampleRate. Called on the audio thread of the AudioOutput it is attached
+ * to, never on the emulation thread.
+ */
+class AudioSink {
+ public:
+  virtual ~AudioSink() = default;
+  virtual void consume(std::span<const int16_t> samples) = 0;
+};
+
+/**
+ * @brief Writes every sample it is given to a WAV file. The sizes in the
+ * header are filled in when the sink is destroyed.
+ */
+class WavSink : public AudioSink {
+ public:
+  // Throws audio_error if the file can't be opened
+  explicit WavSink(const std::string& path, int sample_rate = kSampleRate);
+  ~WavSink() override;
+
+  WavSink(const WavSink&) = delete;
+  WavSink(WavSink&&) = delete;
+  WavSink& operator=(const WavSink&) = delete;
+  WavSink& operator=(WavSink&&) = delete;
+
+  void consume(std::span<const int16_t> samples) override;
+
+  std::size_t samples_written() const;
+
+ private:
+  std::FILE* out_;
+  int sample_rate_;
+  std::size_t samples_written_;
+
+  void write_header();
+};
+
+/**
+ * @brief Lock-free single producer, single consumer ring. The producer and
+ * consumer may each be on their own thread; neither ever blocks or
+ * allocates.
+ */
+template <typename T>
+class Ring {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  // Capacity is rounded up to a power of two
+  explicit Ring(std::size_t capacity)
+      : buf_(std::bit_ceil(capacity)),
+        mask_(buf_.size() - 1),
+        head_(0),
+        tail_(0) {}
+
+  // Producer: append as many items as fit, returning how many did
+  std::size_t push(std::span<const T> items) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    std::size_t count = std::min(items.size(), buf_.size() - (head - tail));
+    // At most two copies: up to the end of the buffer, then from the start
+    std::size_t first = std::min(count, buf_.size() - (head & mask_));
+    std::copy_n(items.data(), first, &buf_[head & mask_]);
+    std::copy_n(items.data() + first, count - first, buf_.data());
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer: take up to out.size() items, returning how many were taken
+  std::size_t pop(std::span<T> out) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t count = std::min(out.size(), head - tail);
+    std::size_t first = std::min(count, buf_.size() - (tail & mask_));
+    std::copy_n(&buf_[tail & mask_], first, out.data());
+    std::copy_n(buf_.data(), count - first, out.data() + first);
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  std::size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+  std::size_t capacity() const { return buf_.size(); }
+
+ private:
+  std::vector<T> buf_;
+  std::size_t mask_;
+  // Free-running counts, on their own cache lines so the threads don't share
+  alignas(64) std::atomic<std::size_t> head_;  // written by the producer
+  alignas(64) std::atomic<std::size_t> tail_;  // written by the consumer
+};
+
+using SampleRing = Ring<int16_t>;
+
+/**
+ * @brief Hands the APU's output to a sink on a thread of its own, through a
+ * SampleRing, so a slow sink (e.g. disk) never stalls emulation unless the
+ * ring fills up.
+ */
+class AudioOutput {
+ public:
+  static constexpr std::size_t kDefaultCapacity = 1 << 16;  // ~1.4s
+
+  explicit AudioOutput(AudioSink& sink,
+                       std::size_t capacity = kDefaultCapacity);
+  // Hands everything still in the ring to the sink before returning
+  ~AudioOutput();
+
+  AudioOutput(const AudioOutput&) = delete;
+  AudioOutput(AudioOutput&&) = delete;
+  AudioOutput& operator=(const AudioOutput&) = delete;
+  AudioOutput& operator=(AudioOutput&&) = delete;
+
+  /**
+   * @brief Queue samples for the sink. Waits for the sink while the ring is
+   * full, so no samples are lost.
+   */
+  void write(std::span<const int16_t> samples);
+
+  /**
+   * @brief How full the ring is, 0 to 1. For a sink that plays in real time
+   * this is how far ahead of the sound card emulation is, which a
+   * pacing::Pacer can use for rate control.
+   */
+  double fill() const;
+
+ private:
+  AudioSink& sink_;
+  SampleRing ring_;
+  // Bumped (and notified) after every push and every pop, to wait on
+  std::atomic<uint32_t> pushes_;
+  std::atomic<uint32_t> pops_;
+  std::atomic<bool> done_;
+  std::thread thread_;
+
+  void run();
+};
+
+/**
+ * @brief Collects amplitude changes at CPU clock timestamps and turns them
+ * into band-limited samples at the output rate, in the style of blip_buf.
+ *
+ * Every change is a step, and rather than the step itself the buffer gets its
+ * band-limited derivative: a windowed sinc kKernelWidth samples wide, placed
+ * at the change's position to 1/32 of a sample (interpolating between the
+ * two nearest of the precomputed phases). Reading samples integrates them
+ * back into the signal. Steps therefore come out free of aliasing, the cost
+ * is per change rather than per clock, and adding a kernel is a fixed-width
+ * loop that compiles to vector instructions. A high pass filter (like the
+ * NES's own, at 90Hz) removes the DC offset.
+ *
+ * The output lags the input by kKernelWidth / 2 samples.
+ */
+class SampleBuffer {
+ public:
+  static constexpr std::size_t kKernelWidth = 16;
+
+  /**
+   * @param capacity Samples that can be buffered between reads
+   */
+  SampleBuffer(double clock_rate, int sample_rate, std::size_t capacity);
+
+  // Add a change in amplitude (1.0 is full scale) at an absolute clock,
+  // from the last end_frame() up to clock_limit()
+  void add_delta(uint64_t clock, float delta);
+
+  // Make the samples before clock available to read
+  void end_frame(uint64_t clock);
+
+  // Latest clock the buffer has room for until samples are read
+  uint64_t clock_limit() const;
+
+  std::size_t samples_avail() const;
+  std::size_t read_samples(std::span<int16_t> out);
+
+  // Drop everything buffered and start again at clock, with the output
+  // settled at level
+  void clear(uint64_t clock, float level);
+
+ private:
+  uint64_t factor_;       // samples per clock, 32.32 fixed point
+  uint64_t offset_;       // samples (32.32) at clock start_clock_
+  uint64_t start_clock_;  // clock of the last end_frame()
+  // Derivative of the output; the last kKernelWidth are room for the tails
+  // of kernels that start in the final sample
+  std::vector<float> deltas_;
+  float level_;    // running sum of deltas
+  float hp_in_;    // last input to the high pass filter
+  float hp_out_;   // last output of the high pass filter
+  float hp_coef_;  // high pass pole
+};
+
+// Weight of one step of each channel's output in the mix (1.0 is full
+// scale). The real mixer is nonlinear; these are its linear approximation.
+constexpr float kPulseWeight = 0.00752f;
+constexpr float kTriangleWeight = 0.00851f;
+constexpr float kNoiseWeight = 0.00494f;
+constexpr float kDMCWeight = 0.00335f;
+
+// Length counter load values, indexed by bits 3-7 of $4003/$4007/$400B/$400F
+constexpr std::array<uint8_t, 32> kLengthTable = {
+    10, 254, 20,  2,  40, 4,  80, 6,  160, 8,  60, 10, 14, 12, 26, 14,
+    12, 16,  24,  18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30};
+
+/**
+ * @brief Volume envelope of the pulse and noise channels, clocked every
+ * quarter frame.
+ */
+struct Envelope {
+  bool start = false;
+  bool loop = false;  // also halts the length counter
+  bool constant = false;
+  uint8_t period = 0;  // also the constant volume
+  uint8_t divider = 0;
+  uint8_t decay = 0;
+
+  void clock();
+  uint8_t volume() const { return constant ? period : decay; }
+
+  bool operator==(const Envelope&) const = default;
+
+  template <typename F>
+  void fields(F&& f) {
+    f(start, loop, constant, period, divider, decay);
+  }
+};
+
+/**
+ * @brief Square wave channel ($4000-$4003, $4004-$4007), with a sweep unit
+ * that bends its period every half frame.
+ */
+struct Pulse {
+  explicit Pulse(bool second) : ones_complement(!second) {}
+
+  bool ones_complement;  // pulse 1 negates the sweep with one's complement
+  bool enabled = false;
+  uint8_t duty = 0;
+  uint8_t step = 0;
+  uint16_t period = 0;   // timer period in APU clocks, minus one
+  uint32_t timer = 0;    // CPU clocks until the next step
+  uint8_t length = 0;
+  Envelope envelope;
+  bool sweep_enabled = false;
+  bool sweep_negate = false;
+  bool sweep_reload = false;
+  uint8_t sweep_period = 0;
+  uint8_t sweep_shift = 0;
+  uint8_t sweep_divider = 0;
+  int amp = 0;  // output level last given to the buffer
+
+  void write(int reg, uint8_t data);
+  void clock_half_frame();
+  uint16_t sweep_target() const;
+  bool muted() const;
+  // Run from clock start to end, giving out every change in output. With no
+  // out the channel only keeps time, in a few operations however long the
+  // run (the same goes for the other channels).
+  void run(uint64_t start, uint64_t end, SampleBuffer* out);
+
+  bool operator==(const Pulse&) const = default;
+
+  template <typename F>
+  void fields(F&& f) {
+    envelope.fields(f);
+    f(enabled, duty, step, period, timer, length, sweep_enabled, sweep_negate,
+      sweep_reload, sweep_period, sweep_shift, sweep_divider, amp);
+  }
+};
+
+/**
+ * @brief Triangle wave channel ($4008-$400B), gated by a linear counter
+ * clocked every quarter frame.
+ */
+struct Triangle {
+  bool enabled = false;
+  bool control = false;  // also halts the length counter
+  bool linear_reload = false;
+  uint8_t linear_period = 0;
+  uint8_t linear = 0;
+  uint8_t step = 0;
+  uint16_t period = 0;  // timer period in CPU clocks, minus one
+  uint32_t timer = 0;
+  uint8_t length = 0;
+  int amp = 0;
+
+  void write(int reg, uint8_t data);
+  void clock_quarter_frame();
+  void run(uint64_t start, uint64_t end, SampleBuffer* out);
+
+  bool operator==(const Triangle&) const = default;
+
+  template <typename F>
+  void fields(F&& f) {
+    f(enabled, control, linear_reload, linear_period, linear, step, period,
+      timer, length, amp);
+  }
+};
+
+/**
+ * @brief Pseudo-random noise channel ($400C-$400F).
+ */
+struct Noise {
+  bool enabled = false;
+  bool mode = false;  // short (93 step) sequence
+  uint16_t period = 4;  // in CPU clocks
+  uint32_t timer = 0;
+  uint16_t shift = 1;
+  uint8_t length = 0;
+  Envelope envelope;
+  int amp = 0;
+
+  void write(int reg, uint8_t data);
+  void run(uint64_t start, uint64_t end, SampleBuffer* out);
+
+  bool operator==(const Noise&) const = default;
+
+  template <typename F>
+  void fields(F&& f) {
+    envelope.fields(f);
+    f(enabled, mode, period, timer, shift, length, amp);
+  }
+};
+
+// Reads a byte of CPU memory, for the DMC
+using Memory = std::function<uint8_t(uint16_t)>;
+
+/**
+ * @brief Delta modulation channel ($4010-$4013): plays 1-bit delta samples
+ * that it reads from $C000-$FFFF itself.
+ */
+struct DMC {
+  bool irq_enabled = false;
+  bool loop = false;
+  bool irq = false;
+  uint16_t period = 428;  // in CPU clocks
+  uint32_t timer = 0;
+  uint8_t level = 0;
+  uint16_t sample_address = 0xC000;
+  uint16_t sample_length = 1;
+  uint16_t address = 0xC000;
+  uint16_t bytes_remaining = 0;
+  uint8_t buffer = 0;
+  bool buffer_full = false;
+  uint8_t shift = 0;
+  uint8_t bits_remaining = 8;
+  bool silence = true;
+  int amp = 0;
+
+  void write(int reg, uint8_t data);
+  void restart();
+  // Fill the sample buffer if it is empty and bytes remain
+  void fetch(const Memory& memory);
+  // Clock at which the next byte will be fetched, if any
+  uint64_t next_fetch(uint64_t now) const;
+  void run(uint64_t start, uint64_t end, SampleBuffer* out,
+           const Memory& memory);
+
+  bool operator==(const DMC&) const = default;
+
+  template <typename F>
+  void fields(F&& f) {
+    f(irq_enabled, loop, irq, period, timer, level, sample_address,
+      sample_length, address, bytes_remaining, buffer, buffer_full, shift,
+      bits_remaining, silence, amp);
+  }
+};
+
+
+/**
+ * @brief The state of the APU: its channels and frame counter, run in batches
+ * up to a clock. Owns nothing, so copies of it can run on other threads.
+ */
+class Core {
+ public:
+  Core();
+
+  /**
+   * @brief Run the channels and frame counter up to clock, synthesizing into
+   * out if it isn't nullptr, in which case clock must be within
+   * out->clock_limit().
+   */
+  void run_until(uint64_t clock, const Memory& memory, SampleBuffer* out);
+  // $4000-$4013, $4015 and $4017, at the clock last run to
+  void write(uint16_t addr, uint8_t data, const Memory& memory);
+
+  // $4015, without the side effect of reading it
+  uint8_t status() const;
+  void acknowledge_frame_irq() { frame_irq_ = false; }
+  bool irq() const { return frame_irq_ || dmc_.irq; }
+
+  // Clock run to
+  uint64_t synced() const { return synced_; }
+  // Clock at which the next frame counter step or DMC fetch is due
+  uint64_t next_event() const { return next_event_; }
+  // Output level of all channels mixed
+  float mix() const;
+
+  bool operator==(const Core&) const = default;
+
+  void save_state(savestate::StateWriter& out);
+  void load_state(savestate::StateReader& in);
+
+ private:
+  Pulse pulse1_;
+  Pulse pulse2_;
+  Triangle triangle_;
+  Noise noise_;
+  DMC dmc_;
+
+  bool five_step_;
+  bool irq_inhibit_;
+  bool frame_irq_;
+  int frame_step_;          // next step of the frame counter sequence
+  uint64_t frame_start_;    // clock the sequence was last (re)started at
+  uint64_t next_frame_step_;
+
+  uint64_t synced_;  // clock the channels have run to
+  uint64_t next_event_;
+
+  template <typename F>
+  void fields(F&& f) {
+    pulse1_.fields(f);
+    pulse2_.fields(f);
+    triangle_.fields(f);
+    noise_.fields(f);
+    dmc_.fields(f);
+    f(five_step_, irq_inhibit_, frame_irq_, frame_step_, frame_start_,
+      next_frame_step_, synced_);
+  }
+
+  void run_channels(uint64_t clock, const Memory& memory, SampleBuffer* out);
+  void clock_frame_counter();
+  void clock_quarter_frame();
+  void clock_half_frame();
+  void schedule();
+};
+
+/**
+ * @brief Synthesizes the APU's sound on a thread of its own.
+ *
+ * The emulation thread describes everything that happens to the APU as
+ * timestamped events (register writes, $4015 reads, the bytes the DMC read
+ * and frame ends) and queues them on a lock-free ring. The thread replays
+ * them on its own copy of the Core, synthesizing as it goes, and hands each
+ * frame's samples to the output. It is woken once per frame, not per event.
+ */
+class Synthesizer {
+ public:
+  // Starts from a copy of core
+  Synthesizer(const Core& core, AudioOutput& output);
+  // Synthesizes everything still queued before returning
+  ~Synthesizer();
+
+  Synthesizer(const Synthesizer&) = delete;
+  Synthesizer(Synthesizer&&) = delete;
+  Synthesizer& operator=(const Synthesizer&) = delete;
+  Synthesizer& operator=(Synthesizer&&) = delete;
+
+  void write(uint16_t addr, uint8_t data, uint64_t clock);
+  void read_status(uint64_t clock);
+  // The DMC's next byte, in the order the DMC read them
+  void dmc_byte(uint8_t data);
+  void end_frame(uint64_t clock);
+
+  /**
+   * @brief Wait for the thread to replay everything queued, then start over
+   * from a copy of core (e.g. after loading a state).
+   */
+  void reset(const Core& core);
+
+ private:
+  struct Event {
+    enum Kind : uint8_t { kWrite, kReadStatus, kDMCByte, kEndFrame };
+    uint64_t clock;
+    uint16_t addr;
+    uint8_t data;
+    Kind kind;
+  };
+
+  AudioOutput& output_;
+  Ring<Event> events_;
+  uint32_t pushed_;  // only touched by the emulation thread
+  // Events replayed so far, to wait on
+  std::atomic<uint32_t> replayed_;
+  // Bumped (and notified) to wake the thread
+  std::atomic<uint32_t> wakeups_;
+  std::atomic<bool> done_;
+
+  // Only touched by the thread, or while it is idle
+  Core core_;
+  std::deque<uint8_t> dmc_bytes_;
+  Memory memory_;
+  SampleBuffer buffer_;
+  std::vector<int16_t> samples_;  // one read of buffer_
+
+  std::thread thread_;
+
+  void push(const Event& event);
+  void wake();
+  void run();
+  void replay(const Event& event);
+  void run_until(uint64_t clock);
+  void flush();
+};
+
+/**
+ * @brief The 2A03's audio processing unit: two pulse channels, triangle,
+ * noise and DMC, the frame counter and the status register ($4015).
+ *
+ * The APU doesn't tick with the CPU. It is told the CPU clock on every
+ * register access and catches up then, in one batch. The only other times it
+ * runs are scheduled events (frame counter steps and DMC fetches, see
+ * next_event()) and the end of every frame.
+ *
+ * On the emulation thread the APU only keeps time: its Core runs without
+ * synthesis, which makes every channel's run a few operations, and is enough
+ * to answer $4015 and raise IRQs exactly. While an output is attached, a
+ * Synthesizer makes the sound from the same events on another thread, so
+ * synthesis stays off the emulation's critical path.
+ *
+ * DMC fetches don't stall the CPU, and the $4017 write delay and the
+ * nonlinear mixer are approximated (the mixer linearly).
+ */
+class APU {
+ public:
+  explicit APU(cartridge::Cartridge& cart);
+  ~APU();
+
+  APU(const APU&) = delete;
+  APU(APU&&) = delete;
+  APU& operator=(const APU&) = delete;
+  APU& operator=(APU&&) = delete;
+
+  // $4000-$4013, $4015 and $4017, at the given CPU clock
+  void write(uint16_t addr, uint8_t data, uint64_t clock);
+  // $4015, at the given CPU clock. Acknowledges the frame IRQ.
+  uint8_t read_status(uint64_t clock);
+
+  // Clock at which the APU next needs to run (see sync)
+  uint64_t next_event() const { return core_.next_event(); }
+  // Catch up if an event is due. Cheap enough to call every instruction.
+  void sync(uint64_t clock) {
+    if (clock >= core_.next_event()) {
+      core_.run_until(clock, memory_, nullptr);
+    }
+  }
+  // Frame counter or DMC interrupt pending, as of the last sync
+  bool irq() const { return core_.irq(); }
+
+  /**
+   * @brief Catch up to the end of a frame and have its samples synthesized
+   * for the attached output.
+   */
+  void end_frame(uint64_t clock);
+
+  /**
+   * @brief Send samples to output from now on (nullptr to stop, which waits
+   * for the samples still being synthesized). The output must outlive the
+   * APU or be detached first.
+   */
+  void attach_output(AudioOutput* output);
+
+  /**
+   * @brief While output is suppressed the APU runs as usual but synthesizes
+   * nothing, e.g. for frames that are run but never shown (run-ahead).
+   */
+  void suppress_output(bool suppress);
+
+  void save_state(savestate::StateWriter& out);
+  void load_state(savestate::StateReader& in);
+
+ private:
+  cartridge::Cartridge& cart_;
+  Core core_;
+  // Reads the cartridge, passing the bytes on to the synthesizer
+  Memory memory_;
+  std::unique_ptr<Synthesizer> synth_;
+  bool suppressed_;
+  // Where the synthesizer was left when output was suppressed
+  Core resumes_at_;
+
+  // The synthesizer, if it should be told what happens
+  Synthesizer* listener() { return suppressed_ ? nullptr : synth_.get(); }
+};
+
+}  // namespace apu
+#endif  // APU_HPP
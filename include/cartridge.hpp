@@ -1,31 +1,620 @@
 #ifndef CARTRIDGE_HPP
 #define CARTRIDGE_HPP
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <ios>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
+#include "savestate.hpp"
+
 namespace cartridge {
 
 using cartridge_error = std::runtime_error;
 
+// How the four logical nametables map onto nametable RAM, see
+// https://www.nesdev.org/wiki/Mirroring#Nametable_Mirroring
+enum class Mirroring {
+  kHorizontal,         // $2000 = $2400, $2800 = $2C00 (vertical scrolling)
+  kVertical,           // $2000 = $2800, $2400 = $2C00 (horizontal scrolling)
+  kSingleScreenLower,  // all four are the first 1KB of CIRAM
+  kSingleScreenUpper,  // all four are the second 1KB of CIRAM
+  kFourScreen,         // four distinct nametables, the extra 2KB on the cart
+};
+
+/**
+ * @brief The iNES / NES 2.0 file header, see
+ * https://www.nesdev.org/wiki/INES and https://www.nesdev.org/wiki/NES_2.0
+ *
+ * Sizes are in bytes. Fields only NES 2.0 can express (submapper, exact RAM
+ * sizes) get their iNES defaults for iNES files.
+ */
+struct Header {
+  static constexpr std::size_t kSize = 16;
+  static constexpr std::size_t kTrainerSize = 512;
+
+  enum Format {
+    kINES,
+    kNES2,
+  };
+
+  Format format;
+  uint16_t mapper;
+  uint8_t submapper;
+  Mirroring mirroring;
+  bool has_battery;
+  bool has_trainer;
+  std::size_t prg_rom_size;
+  std::size_t chr_rom_size;
+  std::size_t prg_ram_size;
+  std::size_t prg_nvram_size;  // battery-backed
+  std::size_t chr_ram_size;
+  std::size_t chr_nvram_size;  // battery-backed
+
+  // Offsets of PRG and CHR ROM in the file
+  std::size_t prg_offset() const;
+  std::size_t chr_offset() const;
+};
+
+/**
+ * @brief Parse the header at the start of a ROM file. Throws cartridge_error
+ * if the data is too short or isn't an iNES file. Does not check that the
+ * file is long enough to hold the PRG and CHR ROM.
+ */
+Header parse_header(std::span<const uint8_t> rom);
+
+/**
+ * @brief A ROM's header and checksums of its PRG and CHR ROM, as used by ROM
+ * databases to identify dumps.
+ */
+struct RomInfo {
+  using sha1_t = std::array<uint8_t, 20>;
+
+  Header header;
+  uint32_t prg_crc32;
+  uint32_t chr_crc32;
+  sha1_t prg_sha1;
+  sha1_t chr_sha1;
+};
+
+/**
+ * @brief Parse and checksum a whole ROM file. Throws cartridge_error if the
+ * header is invalid or the file is truncated.
+ */
+RomInfo describe_rom(std::span<const uint8_t> rom);
+
+RomInfo::sha1_t sha1(std::span<const uint8_t> data);
+
+/**
+ * @brief The read-only bytes of a ROM file, shared by every cartridge loaded
+ * from the same content.
+ *
+ * Images are memory-mapped rather than read, so loading one does not copy the
+ * ROM and pages are only faulted in when touched. A process-wide cache keyed by
+ * content hash hands out the same image to every session running the same ROM
+ * for as long as one of them holds it, so hundreds of sessions of one game pay
+ * for the ROM once. A repeated load of an unchanged file is found by its path
+ * and stat info without hashing it again.
+ */
+class RomImage {
+ public:
+  /**
+   * @brief Map the ROM file at path, or return the cached image with the
+   * same content. Throws cartridge_error if the file can't be opened or mapped.
+   */
+  static std::shared_ptr<const RomImage> load(const std::string &path);
+
+  /**
+   * @brief Read a whole stream into an image, or return the cached image with
+   * the same content.
+   */
+  static std::shared_ptr<const RomImage> read(std::istream &in);
+
+  ~RomImage();
+
+  RomImage(const RomImage &) = delete;
+  RomImage(RomImage &&) = delete;
+  RomImage &operator=(const RomImage &) = delete;
+  RomImage &operator=(RomImage &&) = delete;
+
+  std::span<const uint8_t> bytes() const;
+  uint64_t hash() const;
+
+  // Number of distinct images currently alive (for tests and diagnostics)
+  static std::size_t cached_images();
+
+ private:
+  struct Private;  // passkey so only load/read can construct images
+
+  const uint8_t *data_;
+  std::size_t size_;
+  uint64_t hash_;
+  bool mapped_;                 // munmap on destruction
+  std::vector<uint8_t> owned_;  // backing store for images read from streams
+
+ public:
+  RomImage(Private, const uint8_t *data, std::size_t size, bool mapped,
+           std::vector<uint8_t> &&owned);
+};
+
+/**
+ * @brief Battery-backed RAM kept in a save file.
+ *
+ * The file is memory-mapped shared, so the emulated RAM is the file's page
+ * cache: a write by the game is a plain store, with no system call and no
+ * copy. A background thread writes dirty pages back to disk every
+ * kFlushInterval, and the destructor does a final synchronous flush. If the
+ * process dies, whatever the game wrote is still in the page cache and reaches
+ * the file anyway.
+ */
+class SaveFile {
+ public:
+  static constexpr std::chrono::milliseconds kFlushInterval{1000};
+
+  /**
+   * @brief Open (creating if needed) the save file at path and map its first
+   * size bytes. A new or short file is zero-filled up to size. Throws
+   * cartridge_error if the file can't be opened or mapped.
+   */
+  SaveFile(const std::string &path, std::size_t size);
+  ~SaveFile();
+
+  SaveFile(const SaveFile &) = delete;
+  SaveFile(SaveFile &&) = delete;
+  SaveFile &operator=(const SaveFile &) = delete;
+  SaveFile &operator=(SaveFile &&) = delete;
+
+  uint8_t *data() const;
+  std::size_t size() const;
+
+  // Write dirty pages to disk now, blocking until they are written
+  void flush();
+
+ private:
+  std::string path_;
+  uint8_t *data_;
+  std::size_t size_;
+
+  std::mutex mutex_;
+  std::condition_variable stop_cv_;
+  bool stopping_;
+  std::thread flusher_;
+
+  void flush_loop();
+};
+
+// The save file for a ROM: the same path with a .sav extension
+std::string save_file_path(const std::string &rom_path);
+
+/**
+ * @brief Cartridge hardware: PRG/CHR banking, RAM, mirroring and IRQs.
+ *
+ * Mappers describe memory as tables of bank pointers: 8KB banks over CPU
+ * space and 1KB banks over the pattern tables. The cartridge reads through
+ * these directly, so a bank-switched read costs the same as an NROM read, and
+ * a bank switch only rewrites a few pointers. Address ranges without a bank
+ * (and mappers that don't use the tables, like test doubles) fall back to the
+ * virtual prg_read/chr_read.
+ */
 class Mapper {
  public:
+  static constexpr std::size_t kNametableSize = 0x400;
+  static constexpr std::size_t kCPUBankSize = 0x2000;  // 8KB
+  static constexpr std::size_t kCHRBankSize = 0x400;   // 1KB
+  // One pointer to a 1KB nametable per logical nametable ($2000, $2400,
+  // $2800, $2C00)
+  using nametable_banks_t = std::array<uint8_t *, 4>;
+  // CPU $0000-$FFFF in 8KB slots. Only $6000-$7FFF (PRG RAM) and $8000-$FFFF
+  // (PRG ROM) are ever mapped.
+  using cpu_banks_t = std::array<const uint8_t *, 8>;
+  // PPU $0000-$1FFF in 1KB slots
+  using chr_banks_t = std::array<const uint8_t *, 8>;
+  using chr_write_banks_t = std::array<uint8_t *, 8>;
+
+  Mapper();
   virtual ~Mapper() = default;
 
   virtual uint8_t prg_read(uint16_t addr) = 0;
   virtual void prg_write(uint16_t addr, uint8_t data) = 0;
 
-  // virtual uint8_t chr_read(uint16_t addr) = 0;
-  // virtual void chr_write(uint16_t addr, uint8_t data) = 0;
+  /**
+   * @brief Direct pointer to the 256 byte page starting at addr (which must be
+   * page aligned), for bulk copies such as OAM DMA.
+   *
+   * @return nullptr if the page isn't plain memory, in which case callers have
+   * to fall back to prg_read. This is the default.
+   */
+  virtual const uint8_t *prg_page(uint16_t addr);
+
+  /**
+   * @brief Access the pattern tables ($0000-$1FFF of PPU memory). Mappers
+   * without CHR (e.g. CPU-only test mappers) can rely on the defaults, which
+   * read 0 and ignore writes.
+   */
+  virtual uint8_t chr_read(uint16_t addr);
+  virtual void chr_write(uint16_t addr, uint8_t data);
+
+  /**
+   * @brief Give the mapper the console's 2KB of nametable RAM (CIRAM), which
+   * the nametable banks point into. Must outlive the mapper.
+   */
+  void attach_ciram(uint8_t *ciram);
+  const nametable_banks_t &nametable_banks() const;
+  Mirroring mirroring() const;
+
+  /**
+   * @brief Called once per scanline while the PPU is rendering, for mappers
+   * that count scanlines (e.g. MMC3 IRQs). The default does nothing.
+   */
+  virtual void clock_scanline() {}
+
+  /**
+   * @brief Back battery-backed PRG RAM with the save file at path, replacing
+   * the current contents of PRG RAM with the file's. Should be called before
+   * the game runs. Throws cartridge_error if the file can't be used.
+   *
+   * @return false if the cartridge has no battery-backed RAM (the default), in
+   * which case the file isn't touched.
+   */
+  virtual bool attach_save_file(const std::string &path);
+
+  /**
+   * @brief Save or restore the mapper's state: registers, bank mapping and
+   * RAM. The base class handles mirroring, the IRQ line and four-screen RAM;
+   * mappers with more state override these and call the base.
+   */
+  virtual void save_state(savestate::StateWriter &out) const;
+  virtual void load_state(savestate::StateReader &in);
+
+  // Level of the cartridge's IRQ line: true while an IRQ is pending
+  bool irq() const { return irq_line_; }
+
+  // Bank tables, nullptr where unmapped
+  const uint8_t *cpu_bank(uint16_t addr) const {
+    return cpu_banks_[addr / kCPUBankSize];
+  }
+  uint8_t *prg_ram_write_bank() const { return prg_ram_write_bank_; }
+  const uint8_t *chr_bank(uint16_t addr) const {
+    return chr_banks_[(addr / kCHRBankSize) % chr_banks_.size()];
+  }
+  uint8_t *chr_write_bank(uint16_t addr) const {
+    return chr_write_banks_[(addr / kCHRBankSize) % chr_write_banks_.size()];
+  }
+  const chr_banks_t &chr_banks() const { return chr_banks_; }
 
   void print_debug(std::ostream &out);  // for nesemu-cartridge
+
+ protected:
+  cpu_banks_t cpu_banks_;
+  uint8_t *prg_ram_write_bank_;  // $6000-$7FFF when writable
+  chr_banks_t chr_banks_;
+  chr_write_banks_t chr_write_banks_;  // only set for CHR RAM
+  bool irq_line_;
+
+  // Point the nametable banks at CIRAM (or the cartridge's own RAM for four
+  // screen mirroring). Mappers with switchable mirroring call this on
+  // register writes.
+  void set_mirroring(Mirroring mirroring);
+
+ private:
+  Mirroring mirroring_;
+  uint8_t *ciram_;
+  std::vector<uint8_t> four_screen_ram_;  // only allocated when used
+  nametable_banks_t nametable_banks_;
+};
+
+/**
+ * @brief Common base for mappers backed by a ROM image: owns PRG RAM and CHR
+ * RAM, and maps windows of PRG/CHR into the bank tables. Subclasses only
+ * decode their registers and call map_prg/map_chr.
+ *
+ * Derived must provide write_register(addr, data), which handles a CPU write
+ * to $8000-$FFFF. It is called directly rather than virtually, so when the
+ * cartridge knows the concrete mapper the whole write path can be inlined.
+ */
+template <typename Derived>
+class BankedMapper : public Mapper {
+ public:
+  // Only reached for unmapped addresses: $4020-$5FFF, or disabled PRG RAM
+  uint8_t prg_read(uint16_t addr) override {
+    (void)addr;  // explicitly unused
+    return 0xAA;
+  };
+  void prg_write(uint16_t addr, uint8_t data) override {
+    // PRG ROM can't be written, so on most boards these writes are decoded as
+    // mapper registers
+    if (addr >= 0x8000) {
+      static_cast<Derived *>(this)->write_register(addr, data);
+    }
+    // Otherwise unmapped or write-protected PRG RAM: ignored
+  };
+
+  bool attach_save_file(const std::string &path) override {
+    if (!battery_ || prg_ram_.empty()) {
+      return false;
+    }
+    // Keep the current enable/protect state while moving RAM into the file
+    bool readable = cpu_banks_[3] != nullptr;
+    bool writable = prg_ram_write_bank_ != nullptr;
+    save_file_ = std::make_unique<SaveFile>(path, prg_ram_.size());
+    prg_ram_ = {save_file_->data(), save_file_->size()};
+    prg_ram_storage_.clear();
+    prg_ram_storage_.shrink_to_fit();
+    map_prg_ram(readable, writable);
+    return true;
+  }
+
+  void save_state(savestate::StateWriter &out) const override {
+    // ROM contents aren't saved, only which ROM the state belongs to
+    out.write(image_->hash());
+    Mapper::save_state(out);
+    for (const uint8_t *bank : cpu_banks_) {
+      out.write(encode_bank(bank));
+    }
+    out.write(encode_bank(prg_ram_write_bank_));
+    for (const uint8_t *bank : chr_banks_) {
+      out.write(encode_bank(bank));
+    }
+    out.write_bytes(prg_ram_.data(), prg_ram_.size());
+    out.write_bytes(chr_ram_.data(), chr_ram_.size());
+    static_cast<const Derived *>(this)->save_registers(out);
+  }
+
+  void load_state(savestate::StateReader &in) override {
+    if (in.read<uint64_t>() != image_->hash()) {
+      throw savestate::savestate_error("save state is for a different ROM");
+    }
+    Mapper::load_state(in);
+    for (const uint8_t *&bank : cpu_banks_) {
+      bank = decode_bank(in.read<uint32_t>());
+    }
+    prg_ram_write_bank_ = mutable_bank(decode_bank(in.read<uint32_t>()));
+    for (std::size_t i = 0; i < chr_banks_.size(); i++) {
+      chr_banks_[i] = decode_bank(in.read<uint32_t>());
+      chr_write_banks_[i] =
+          chr_ram_.empty() ? nullptr : mutable_bank(chr_banks_[i]);
+    }
+    in.read_bytes(prg_ram_.data(), prg_ram_.size());
+    in.read_bytes(chr_ram_.data(), chr_ram_.size());
+    static_cast<Derived *>(this)->load_registers(in);
+  }
+
+ protected:
+  BankedMapper(std::shared_ptr<const RomImage> image, const Header &header)
+      : image_(std::move(image)),
+        prg_rom_(image_->bytes().subspan(header.prg_offset(),
+                                         header.prg_rom_size)),
+        chr_rom_(image_->bytes().subspan(header.chr_offset(),
+                                         header.chr_rom_size)),
+        chr_ram_(),
+        prg_ram_storage_(header.prg_ram_size + header.prg_nvram_size),
+        prg_ram_(prg_ram_storage_),
+        battery_(header.has_battery),
+        save_file_() {
+    if (chr_rom_.empty()) {
+      // No CHR ROM means the board has CHR RAM instead (8KB unless the NES
+      // 2.0 header says otherwise)
+      std::size_t size = header.chr_ram_size + header.chr_nvram_size;
+      chr_ram_.resize(size == 0 ? 0x2000 : size);
+    }
+    set_mirroring(header.mirroring);
+    map_prg_ram(true, true);
+  }
+
+  /**
+   * @brief Map a window of size bytes (a multiple of 8KB) of CPU space starting
+   * at addr to PRG ROM bank number bank (in units of size). Bank numbers wrap
+   * around the ROM size, so -1 is the last bank.
+   */
+  void map_prg(uint16_t addr, std::size_t size, int bank) {
+    std::size_t offset = wrap_bank(bank, size, prg_rom_.size()) * size;
+    for (std::size_t i = 0; i < size; i += kCPUBankSize) {
+      cpu_banks_[(addr + i) / kCPUBankSize] =
+          prg_rom_.data() + (offset + i) % prg_rom_.size();
+    }
+  }
+
+  /**
+   * @brief Map a window of size bytes (a multiple of 1KB) of PPU space starting
+   * at addr to CHR ROM (or RAM) bank number bank, as for map_prg.
+   */
+  void map_chr(uint16_t addr, std::size_t size, int bank) {
+    bool is_ram = !chr_ram_.empty();
+    const uint8_t *chr = is_ram ? chr_ram_.data() : chr_rom_.data();
+    std::size_t chr_size = is_ram ? chr_ram_.size() : chr_rom_.size();
+    std::size_t offset = wrap_bank(bank, size, chr_size) * size;
+    for (std::size_t i = 0; i < size; i += kCHRBankSize) {
+      std::size_t slot = (addr + i) / kCHRBankSize;
+      std::size_t bank_offset = (offset + i) % chr_size;
+      chr_banks_[slot] = chr + bank_offset;
+      chr_write_banks_[slot] = is_ram ? chr_ram_.data() + bank_offset : nullptr;
+    }
+  }
+
+  // Enable/disable reads and writes of PRG RAM ($6000-$7FFF)
+  void map_prg_ram(bool readable, bool writable) {
+    uint8_t *ram = prg_ram_.empty() ? nullptr : prg_ram_.data();
+    cpu_banks_[3] = readable ? ram : nullptr;
+    prg_ram_write_bank_ = writable ? ram : nullptr;
+  }
+
+  std::size_t prg_rom_size() const { return prg_rom_.size(); }
+
+  // Mappers with registers that aren't captured by the bank tables hide these
+  void save_registers(savestate::StateWriter &out) const { (void)out; }
+  void load_registers(savestate::StateReader &in) { (void)in; }
+
+ private:
+  std::shared_ptr<const RomImage> image_;
+  std::span<const uint8_t> prg_rom_;
+  std::span<const uint8_t> chr_rom_;
+  std::vector<uint8_t> chr_ram_;  // only used by boards without CHR ROM
+  std::vector<uint8_t> prg_ram_storage_;
+  std::span<uint8_t> prg_ram_;  // prg_ram_storage_ or the save file
+  bool battery_;
+  std::unique_ptr<SaveFile> save_file_;
+
+  static std::size_t wrap_bank(int bank, std::size_t size,
+                               std::size_t memory_size) {
+    int banks = std::max<int>(1, memory_size / size);
+    return ((bank % banks) + banks) % banks;
+  }
+
+  // Bank pointers are saved as a region (index into regions(), 0 for
+  // unmapped) in the top 8 bits and an offset into it, so states don't
+  // depend on where memory was allocated
+  std::array<std::span<const uint8_t>, 5> regions() const {
+    return {std::span<const uint8_t>(), prg_rom_, chr_rom_, chr_ram_,
+            prg_ram_};
+  }
+
+  uint32_t encode_bank(const uint8_t *bank) const {
+    auto memory = regions();
+    auto address = reinterpret_cast<std::uintptr_t>(bank);
+    for (uint32_t region = 1; region < memory.size(); region++) {
+      auto start = reinterpret_cast<std::uintptr_t>(memory[region].data());
+      if (address >= start && address - start < memory[region].size()) {
+        return (region << 24) | (address - start);
+      }
+    }
+    return 0;
+  }
+
+  const uint8_t *decode_bank(uint32_t code) const {
+    auto memory = regions();
+    uint32_t region = code >> 24;
+    uint32_t offset = code & 0xFFFFFF;
+    if (region == 0) {
+      return nullptr;
+    }
+    if (region >= memory.size() || offset >= memory[region].size()) {
+      throw savestate::savestate_error("save state is corrupt: bad bank");
+    }
+    return memory[region].data() + offset;
+  }
+
+  // Decoded banks in RAM are our own memory, so they can be written
+  static uint8_t *mutable_bank(const uint8_t *bank) {
+    return const_cast<uint8_t *>(bank);
+  }
+};
+
+// Mapper 0: no banking, 16KB PRG is mirrored into $C000-$FFFF
+// https://www.nesdev.org/wiki/NROM
+class NROM final : public BankedMapper<NROM> {
+ public:
+  NROM(std::shared_ptr<const RomImage> image, const Header &header);
+
+  void write_register(uint16_t addr, uint8_t data) {
+    (void)addr;  // PRG is ROM: writes are ignored
+    (void)data;
+  }
+};
+
+// Mapper 1: serial shift register interface, switchable mirroring, 16/32KB
+// PRG and 4/8KB CHR banking. https://www.nesdev.org/wiki/MMC1
+// Note: writes on consecutive CPU cycles (from read-modify-write
+// instructions) are not ignored as they are on hardware.
+class MMC1 final : public BankedMapper<MMC1> {
+ public:
+  MMC1(std::shared_ptr<const RomImage> image, const Header &header);
+
+  void write_register(uint16_t addr, uint8_t data);
+  void save_registers(savestate::StateWriter &out) const;
+  void load_registers(savestate::StateReader &in);
+
+ private:
+  static constexpr uint8_t kShiftReset = 0x10;
+
+  uint8_t shift_;
+  uint8_t control_;
+  uint8_t chr0_;
+  uint8_t chr1_;
+  uint8_t prg_;
+
+  void update_banks();
+};
+
+// Mapper 2: switchable 16KB PRG bank at $8000, last bank fixed at $C000
+// https://www.nesdev.org/wiki/UxROM
+class UxROM final : public BankedMapper<UxROM> {
+ public:
+  UxROM(std::shared_ptr<const RomImage> image, const Header &header);
+
+  void write_register(uint16_t addr, uint8_t data) {
+    (void)addr;  // any address in $8000-$FFFF
+    map_prg(0x8000, 0x4000, data);
+  }
+};
+
+// Mapper 3: switchable 8KB CHR bank, fixed PRG
+// https://www.nesdev.org/wiki/INES_Mapper_003
+class CNROM final : public BankedMapper<CNROM> {
+ public:
+  CNROM(std::shared_ptr<const RomImage> image, const Header &header);
+
+  void write_register(uint16_t addr, uint8_t data) {
+    (void)addr;  // any address in $8000-$FFFF
+    map_chr(0x0000, 0x2000, data);
+  }
+};
+
+// Mapper 4: 8KB PRG and 1/2KB CHR banking, switchable mirroring and a scanline
+// counter IRQ. https://www.nesdev.org/wiki/MMC3
+// The counter is clocked once per rendered scanline rather than by watching
+// PPU address line A12, which matches games using the usual pattern table
+// layout (background at $0000, sprites at $1000).
+class MMC3 final : public BankedMapper<MMC3> {
+ public:
+  MMC3(std::shared_ptr<const RomImage> image, const Header &header);
+
+  void write_register(uint16_t addr, uint8_t data);
+  void save_registers(savestate::StateWriter &out) const;
+  void load_registers(savestate::StateReader &in);
+
+  void clock_scanline() override {
+    if (irq_counter_ == 0 || irq_reload_) {
+      irq_counter_ = irq_latch_;
+      irq_reload_ = false;
+    } else {
+      irq_counter_--;
+    }
+    if (irq_counter_ == 0 && irq_enabled_) {
+      irq_line_ = true;
+    }
+  }
+
+ private:
+  uint8_t bank_select_;
+  std::array<uint8_t, 8> registers_;  // R0-R7
+  uint8_t irq_latch_;
+  uint8_t irq_counter_;
+  bool irq_reload_;
+  bool irq_enabled_;
+
+  void update_banks();
 };
 
 class Cartridge {
  public:
   Cartridge() = delete;
   explicit Cartridge(std::istream &in);
+  /**
+   * @brief Create the mapper for a ROM: NROM (0), MMC1 (1), UxROM (2), CNROM
+   * (3) or MMC3 (4). Throws cartridge_error for other mapper numbers. Mappers
+   * keep a reference to the image rather than copying PRG/CHR out of it.
+   */
+  explicit Cartridge(std::shared_ptr<const RomImage> image);
+  // Any other mapper, e.g. a test double. Calls into it are virtual.
   explicit Cartridge(
       std::unique_ptr<Mapper, std::default_delete<Mapper>> mapper);
 
@@ -38,13 +627,92 @@ class Cartridge {
 
   uint8_t cpu_read(uint16_t addr);
   void cpu_write(uint16_t addr, uint8_t data);
+  const uint8_t *cpu_page(uint16_t addr);
+
+  uint8_t ppu_read(uint16_t addr);
+  void ppu_write(uint16_t addr, uint8_t data);
+
+  void attach_ciram(uint8_t *ciram);
+  const Mapper::nametable_banks_t &nametable_banks() const;
+  const Mapper::chr_banks_t &chr_banks() const;
+  Mirroring mirroring() const;
+
+  // See Mapper::attach_save_file
+  bool attach_save_file(const std::string &path);
 
-  // uint8_t ppu_read(uint16_t addr);
-  // void ppu_write(uint16_t addr, uint8_t data);
+  void save_state(savestate::StateWriter &out);
+  void load_state(savestate::StateReader &in);
+
+  void clock_scanline();
+  bool irq() const;
 
  private:
-  std::unique_ptr<Mapper> mapper_;
+  // The built-in mappers are held by value and called through std::visit, so
+  // the compiler sees the concrete (final) type and can inline register
+  // writes and scanline clocks into the CPU and PPU. Other mappers are owned
+  // through the unique_ptr alternative.
+  std::variant<std::unique_ptr<Mapper>, NROM, MMC1, UxROM, CNROM, MMC3>
+      mapper_;
+  // Whichever mapper is in mapper_, for the bank tables and other non-virtual
+  // state shared by all mappers
+  Mapper *base_;
+
+  // Call f with the concrete mapper (or Mapper& for the unique_ptr case)
+  template <typename F>
+  decltype(auto) dispatch(F &&f) {
+    return std::visit(
+        [&f](auto &mapper) -> decltype(auto) {
+          using T = std::decay_t<decltype(mapper)>;
+          if constexpr (std::is_same_v<T, std::unique_ptr<Mapper>>) {
+            return f(*mapper);
+          } else {
+            return f(mapper);
+          }
+        },
+        mapper_);
+  }
 };
 
+// The hot paths are inline so that a banked access is a table lookup and a
+// load, without a call
+
+inline uint8_t Cartridge::cpu_read(uint16_t addr) {
+  if (const uint8_t *bank = base_->cpu_bank(addr)) {
+    return bank[addr % Mapper::kCPUBankSize];
+  }
+  return dispatch([addr](auto &mapper) { return mapper.prg_read(addr); });
+}
+
+inline void Cartridge::cpu_write(uint16_t addr, uint8_t data) {
+  if (addr / Mapper::kCPUBankSize == 3) {
+    if (uint8_t *bank = base_->prg_ram_write_bank()) {
+      bank[addr % Mapper::kCPUBankSize] = data;
+      return;
+    }
+  }
+  dispatch([addr, data](auto &mapper) { mapper.prg_write(addr, data); });
+}
+
+inline uint8_t Cartridge::ppu_read(uint16_t addr) {
+  if (const uint8_t *bank = base_->chr_bank(addr)) {
+    return bank[addr % Mapper::kCHRBankSize];
+  }
+  return dispatch([addr](auto &mapper) { return mapper.chr_read(addr); });
+}
+
+inline void Cartridge::ppu_write(uint16_t addr, uint8_t data) {
+  if (uint8_t *bank = base_->chr_write_bank(addr)) {
+    bank[addr % Mapper::kCHRBankSize] = data;
+    return;
+  }
+  dispatch([addr, data](auto &mapper) { mapper.chr_write(addr, data); });
+}
+
+inline void Cartridge::clock_scanline() {
+  dispatch([](auto &mapper) { mapper.clock_scanline(); });
+}
+
+inline bool Cartridge::irq() const { return base_->irq(); }
+
 }  // namespace cartridge
-#endif  // CARTRIDGE_HPP
\ No newline at end of file
+#endif  // CARTRIDGE_HPP
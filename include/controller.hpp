@@ -2,20 +2,189 @@
 #define CONTROLLER_HPP
 #include <GLFW/glfw3.h>
 
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "savestate.hpp"
 
 namespace controller {
+
+using input_error = std::runtime_error;
+
+// Buttons, as bits of an input mask. This is the order the controller shifts
+// them out in, so a mask is also the value latched into the shift register.
+constexpr uint8_t kButtonA = 1 << 0;
+constexpr uint8_t kButtonB = 1 << 1;
+constexpr uint8_t kButtonSelect = 1 << 2;
+constexpr uint8_t kButtonStart = 1 << 3;
+constexpr uint8_t kButtonUp = 1 << 4;
+constexpr uint8_t kButtonDown = 1 << 5;
+constexpr uint8_t kButtonLeft = 1 << 6;
+constexpr uint8_t kButtonRight = 1 << 7;
+
+/**
+ * @brief Where a controller's buttons come from.
+ */
+class InputSource {
+ public:
+  virtual ~InputSource() = default;
+
+  /**
+   * @brief The buttons held during the next frame, as a mask of kButton*
+   * bits. The controller calls this exactly once per emulated frame, whether
+   * or not the game reads the controller that frame, so frame N of a movie is
+   * always the Nth call.
+   */
+  virtual uint8_t next_frame() = 0;
+};
+
+/**
+ * @brief Reads the keyboard of a GLFW window (see the help text of nesemu for
+ * the key bindings).
+ *
+ * Key events update a button mask as they are pumped (glfwPollEvents), so
+ * sampling a frame is a single load. Takes over the window's key callback and
+ * user pointer for its lifetime.
+ */
+class KeyboardInput : public InputSource {
+ public:
+  explicit KeyboardInput(GLFWwindow& window);
+  ~KeyboardInput() override;
+
+  KeyboardInput(const KeyboardInput&) = delete;
+  KeyboardInput(KeyboardInput&&) = delete;
+  KeyboardInput& operator=(const KeyboardInput&) = delete;
+  KeyboardInput& operator=(KeyboardInput&&) = delete;
+
+  uint8_t next_frame() override;
+
+  // Apply a GLFW key event
+  void key_event(int key, int action);
+
+ private:
+  GLFWwindow& window_;
+  // Atomic so events may be pumped on another thread than the emulation's
+  std::atomic<uint8_t> buttons_;
+};
+
+/**
+ * @brief Plays back a movie written by MovieRecorder, then holds no buttons
+ * once it runs out.
+ *
+ * A movie is a 16 byte header (the magic "NESM", a version, and the hash of
+ * the ROM it was recorded on) followed by one input mask per frame. That is
+ * 60 bytes per second of play, so the whole movie is read up front and
+ * playback never touches the disk.
+ */
+class MoviePlayer : public InputSource {
+ public:
+  /**
+   * @brief Load the movie at path. Throws input_error if it can't be read or
+   * was recorded on a ROM other than the one with the given hash.
+   */
+  MoviePlayer(const std::string& path, uint64_t rom_hash);
+  uint8_t next_frame() override;
+
+  // Frames in the movie
+  std::size_t frames() const;
+  // Frames played so far
+  std::size_t position() const;
+  bool finished() const;
+
+ private:
+  std::vector<uint8_t> frames_;
+  std::size_t position_;
+};
+
+/**
+ * @brief Passes another source through, appending every frame of it to a
+ * movie file.
+ */
+class MovieRecorder : public InputSource {
+ public:
+  /**
+   * @brief Create (or truncate) the movie at path. Throws input_error if it
+   * can't be opened.
+   */
+  MovieRecorder(InputSource& source, const std::string& path,
+                uint64_t rom_hash);
+  ~MovieRecorder() override;
+
+  MovieRecorder(const MovieRecorder&) = delete;
+  MovieRecorder(MovieRecorder&&) = delete;
+  MovieRecorder& operator=(const MovieRecorder&) = delete;
+  MovieRecorder& operator=(MovieRecorder&&) = delete;
+
+  uint8_t next_frame() override;
+
+  std::size_t frames() const;
+
+ private:
+  InputSource& source_;
+  std::FILE* out_;
+  std::size_t frames_;
+};
+
+/**
+ * @brief Passes another source through, keeping every frame of it so the
+ * frames can be played again after seeking back, e.g. when the debugger
+ * re-executes from a checkpoint. Past the end of what was kept, frames come
+ * from the source again.
+ */
+class InputLog : public InputSource {
+ public:
+  explicit InputLog(InputSource& source);
+  uint8_t next_frame() override;
+
+  // Frames played so far
+  std::size_t position() const;
+  // Play the kept frames again from frame position, which must be no later
+  // than frames()
+  void seek(std::size_t position);
+  // Forget the frames after the current position, so the source is asked
+  // for them again
+  void truncate();
+  // Frames kept
+  std::size_t frames() const;
+
+ private:
+  InputSource& source_;
+  std::vector<uint8_t> frames_;
+  std::size_t position_;
+};
+
 class Controller {
  public:
-  Controller(GLFWwindow& window);
+  explicit Controller(InputSource& source);
   ~Controller();
   void write_strobe(uint8_t value);
   uint8_t read_joy1();
+  // The bit read_joy1 would return, without shifting it out
+  uint8_t peek_joy1() const;
+
+  /**
+   * @brief Called by the CPU at the end of every frame. Samples the input
+   * source if the game didn't poll the controller this frame, so the source
+   * advances exactly one frame per frame.
+   */
+  void end_frame();
+
+  void save_state(savestate::StateWriter& out) const;
+  void load_state(savestate::StateReader& in);
 
  private:
-  GLFWwindow& window_;
+  InputSource& source_;
   uint8_t joy1_register_;
   bool strobe_;
+  // Every poll within a frame sees the same buttons
+  uint8_t frame_input_;
+  bool frame_sampled_;
+
+  uint8_t frame_input();
 };
 }  // namespace controller
-#endif  // CONTROLLER_HPP
\ No newline at end of file
+#endif  // CONTROLLER_HPP
@@ -5,10 +5,15 @@
 #include <cstdint>
 #include <functional>
 #include <optional>
+#include <span>
 
+#include "apu.hpp"
 #include "cartridge.hpp"
 #include "controller.hpp"
+#include "pacing.hpp"
 #include "ppu.hpp"
+#include "profiler.hpp"
+#include "savestate.hpp"
 
 // Forward declaration to deal with circular dependency
 namespace debugger {
@@ -43,6 +48,24 @@ enum AddrMode {
 
 enum OpCode : uint8_t;
 
+// Flags for CPU::watch_page
+enum WatchFlags : uint8_t {
+  kWatchRead = 1 << 0,
+  kWatchWrite = 1 << 1,
+};
+
+/**
+ * @brief Told about memory accesses to watched pages, e.g. by a debugger
+ * implementing watchpoints.
+ */
+class MemoryWatcher {
+ public:
+  virtual ~MemoryWatcher() = default;
+  // Called after the access, with the value read or written
+  virtual void on_read(uint16_t addr, uint8_t value) = 0;
+  virtual void on_write(uint16_t addr, uint8_t value) = 0;
+};
+
 class CPU {
   // Debugger needs access to internal data to read/write memory and registers
   friend class debugger::Debugger;
@@ -51,6 +74,7 @@ class CPU {
   using Cartridge = cartridge::Cartridge;
   using PPU = ppu::PPU;
   using Controller = controller::Controller;
+  using APU = apu::APU;
 
   using time_point = class std::chrono::time_point<
       std::chrono::_V2::steady_clock,
@@ -73,7 +97,8 @@ class CPU {
   explicit CPU(Cartridge& cartridge,
                std::optional<std::reference_wrapper<PPU>> ppu = std::nullopt,
                std::optional<std::reference_wrapper<Controller>> controller =
-                   std::nullopt);
+                   std::nullopt,
+               std::optional<std::reference_wrapper<APU>> apu = std::nullopt);
 
   CPU() = delete;
   CPU(CPU&) = delete;
@@ -89,14 +114,20 @@ class CPU {
   uint8_t P() const;
 
   /**
-   * @brief Runs a blocking infinite loop
+   * @brief Runs a blocking loop
    *
-   * Once this function is run, it will loop until the program
-   * terminates. It handles running the clock at a consistent
+   * Once this function is run, it will loop until the pacer is
+   * stopped. It handles running the clock at a consistent
    * speed, invoking various components of the system at
    * appropriate times, and sleeping in between cycles.
+   *
+   * @param run_frame Runs one frame, advance_frame() if not given. Lets
+   * callers wrap each frame, e.g. to rewind.
+   * @param pacer Paces the frames, one at kFramerate if not given. Lets
+   * callers stop the loop and read its frame times.
    */
-  void begin_cpu_loop();
+  void begin_cpu_loop(std::function<void()> run_frame = nullptr,
+                      pacing::Pacer* pacer = nullptr);
 
   /**
    * @brief Executes the next cycle of the ALU.
@@ -138,6 +169,16 @@ class CPU {
   uint8_t read(uint16_t addr);
   // convenience function for reading 16-bit values
   uint16_t read16(uint16_t addr);
+  // read() without telling the memory watcher, e.g. for the watcher's own
+  // reads. Registers still have their side effects.
+  uint8_t read_bus(uint16_t addr);
+  /**
+   * @brief Read addr without side effects, e.g. for debugger conditions:
+   * PPUSTATUS isn't acknowledged and the controller isn't shifted. Registers
+   * that can't be read without changing them (PPUDATA, APU status) read as
+   * $AA.
+   */
+  uint8_t peek(uint16_t addr);
 
   /**
    * @brief Writes the given value to the absolute memory address
@@ -159,11 +200,58 @@ class CPU {
   // convenience function for writing 16-bit values
   bool write16(uint16_t addr, uint16_t value);
 
+  /**
+   * @brief Set who is told about accesses to watched pages, or nullptr for
+   * nobody. Must outlive the CPU or be replaced first.
+   */
+  void set_memory_watcher(MemoryWatcher* watcher);
+
+  /**
+   * @brief Set which accesses (WatchFlags) to the 256 byte page starting at
+   * page << 8 are reported to the memory watcher. Accesses to other pages
+   * only cost a table lookup.
+   */
+  void watch_page(uint8_t page, uint8_t flags);
+
+  /**
+   * @brief Set the profiler told about every instruction and interrupt, or
+   * nullptr (the default) to stop profiling, which leaves one branch per
+   * instruction. Attaching a profiler resumes it from the current state.
+   */
+  void set_profiler(profiler::Profiler* profiler);
+
   /**
    * @brief Execute an NMI: push PC and P onto stack and jump to 0xFFFA
    */
   void trigger_nmi();
 
+  /**
+   * @brief Execute an IRQ: push PC and P onto stack, set the interrupt disable
+   * flag and jump to the address at 0xFFFE. The cartridge's IRQ line is
+   * polled before each instruction, so this is only needed by tests.
+   */
+  void trigger_irq();
+
+  /**
+   * @brief Save the state of the whole machine (CPU, PPU, controller and
+   * cartridge) into out, without allocating. ROM contents aren't included.
+   *
+   * @return The number of bytes written. Throws savestate::savestate_error if
+   * out is smaller than state_size().
+   */
+  std::size_t save_state(std::span<uint8_t> out);
+  std::size_t state_size();
+
+  /**
+   * @brief Restore a state written by save_state on a machine running the
+   * same ROM with the same components (e.g. both with or both without a PPU).
+   * Throws savestate::savestate_error if the state is for another version,
+   * ROM or configuration, which is checked before anything is changed, or if
+   * it is truncated or corrupt, in which case the machine is left partially
+   * restored.
+   */
+  void load_state(std::span<const uint8_t> in);
+
   // Made public for testing purposes
   bool get_carry();
   bool get_zero();
@@ -188,6 +276,7 @@ class CPU {
  private:
   std::optional<std::reference_wrapper<PPU>> ppu_;
   std::optional<std::reference_wrapper<Controller>> controller_;
+  std::optional<std::reference_wrapper<APU>> apu_;
   Cartridge& cart_;
 
   // True iff the program was started in debug mode. If true, the
@@ -202,9 +291,25 @@ class CPU {
   uint8_t P_;    // processor status
 
   std::size_t cycles_todo_;  // cycles until the instruction is done
+  std::size_t stall_cycles_;  // cycles the CPU is halted for (e.g. OAM DMA)
+  uint64_t total_cycles_;     // cycles executed since power on
 
   std::array<uint8_t, 0x800> ram_;  // 2kb of RAM
 
+  MemoryWatcher* watcher_;
+  std::array<uint8_t, 0x100> watch_pages_;  // WatchFlags for every page
+
+  profiler::Profiler* profiler_;
+
+  // write() without the watch check
+  bool write_bus(uint16_t addr, uint8_t data);
+
+  void save_state(savestate::StateWriter& out);
+  void load_state(savestate::StateReader& in);
+
+  // Tell the controller and APU a frame is over
+  void end_frame();
+
   /**
    * @brief Execute the instruction with given opcode
    *
@@ -218,6 +323,17 @@ class CPU {
   uint16_t addr_fetch(AddrMode mode);
   uint8_t value_fetch(AddrMode mode);
 
+  /**
+   * @brief OAM DMA ($4014): copy page $XX00-$XXFF to PPU OAM and stall the CPU
+   * for 513 cycles (514 if started on an odd cycle).
+   *
+   * RAM and cartridge ROM pages are copied in bulk; only pages that aren't
+   * plain memory (e.g. I/O registers) go through read().
+   *
+   * @param page High byte of the source address
+   */
+  void oam_dma(uint8_t page);
+
   /**
    * @brief Pushes a byte onto the stack and updates the stack
    * pointer
@@ -1,15 +1,81 @@
 #ifndef DEBUGGER_HPP
 #define DEBUGGER_HPP
 
+#include <bitset>
 #include <cstdint>
+#include <deque>
 #include <map>
-#include <set>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "cpu.hpp"
 
 namespace debugger {
 
-class Debugger {
+using expression_error = std::runtime_error;
+using socket_error = std::runtime_error;
+
+/**
+ * @brief A debugger expression over the CPU's registers and memory, e.g.
+ * `A == $10 && [$0300] > 4`, compiled once into bytecode for a small stack
+ * machine so that evaluating it costs nanoseconds.
+ *
+ * Operands are numbers ($hex or decimal), the registers A, X, Y, SP, P and PC,
+ * and `[addr]` for the byte at addr, read with cpu::CPU::peek so evaluating
+ * never changes I/O registers. Operators, loosest binding first, are
+ * `||`, `&&`, comparisons (`== != < <= > >=`), bitwise `& | ^`, `+ -` and
+ * unary `! -`; parentheses group. Comparisons and logical operators give 1 or
+ * 0, and both sides of `&&` and `||` are always evaluated.
+ */
+class Expression {
+ public:
+  // Throws expression_error if source isn't a valid expression
+  explicit Expression(std::string_view source);
+
+  int32_t evaluate(cpu::CPU& cpu) const;
+  const std::string& source() const;
+
+ private:
+  enum Op : uint8_t;
+  struct Instruction {
+    Op op;
+    bool immediate;  // a binary operator's right operand is arg
+    int32_t arg;
+  };
+  class Parser;
+
+  static constexpr std::size_t kMaxDepth = 32;
+
+  std::string source_;
+  std::vector<Instruction> code_;
+};
+
+/**
+ * @brief A tracepoint's message: text with `{expression}` fields, e.g.
+ * `X={X} [$0300]={[$0300]}`, compiled once. Fields print in hex.
+ */
+class TraceFormat {
+ public:
+  // Throws expression_error if a field isn't a valid expression
+  explicit TraceFormat(std::string_view source);
+
+  std::string format(cpu::CPU& cpu) const;
+  const std::string& source() const;
+
+ private:
+  std::string source_;
+  // text_[i] comes before fields_[i], and text_ has one more entry
+  std::vector<std::string> text_;
+  std::vector<Expression> fields_;
+};
+
+class Debugger : public cpu::MemoryWatcher {
  public:
   using address_t = uint16_t;
 
@@ -27,8 +93,13 @@ class Debugger {
       {"X", kRegX},   {"Y", kRegY},   {"P", kRegP}};
 
   Debugger() = delete;
-  explicit Debugger(cpu::CPU* cpu);
-  ~Debugger() = default;
+  /**
+   * @param input The controller's input, which must pass through this log so
+   * that going back in time replays it. May be nullptr if the CPU has no
+   * controller.
+   */
+  explicit Debugger(cpu::CPU* cpu, controller::InputLog* input = nullptr);
+  ~Debugger() override;
 
   // prevent moves and copies
   Debugger(Debugger&) = delete;
@@ -36,12 +107,119 @@ class Debugger {
   Debugger& operator=(Debugger&) = delete;
   Debugger operator=(Debugger&&) = delete;
 
+  // A watched access, reported by the CPU
+  struct WatchHit {
+    address_t addr;
+    uint8_t value;
+    bool write;
+  };
+
+  // What happens when the program counter reaches a breakpoint
+  struct Breakpoint {
+    std::optional<Expression> condition;  // does nothing while this is 0
+    std::optional<TraceFormat> trace;     // printed instead of pausing
+  };
+
+  enum Stop {
+    kStopBreakpoint,
+    kStopWatchpoint,
+    kStopLimit,  // ran as many instructions as asked
+    kStopHistoryStart,  // went back as far as the history goes
+  };
+
+  struct RunResult {
+    Stop stop;
+    uint64_t instructions;  // instructions run
+    bool frame_ended;       // the frame ended (and NMI may have run) on the way
+  };
+
   /**
    * @brief Pause program execution, listen for user input, and begin
    * interpreting their commands.
    */
   void debug();
 
+  /**
+   * @brief Run as fast as possible until limit instructions have run, an
+   * instruction accesses a watchpoint or, unless ignoring them, the program
+   * counter reaches a breakpoint. Leaves a breakpoint it starts on first.
+   * Exceptions from the CPU (e.g. invalid opcodes) are passed on.
+   */
+  RunResult run(uint64_t limit = UINT64_MAX, bool stop_at_breakpoints = true);
+
+  /**
+   * @brief Go back count instructions, or to the start of the history if it
+   * doesn't go back that far. Restores the newest checkpoint before the
+   * target and re-executes from there, so this costs at most
+   * kCheckpointInterval instructions.
+   */
+  RunResult back(uint64_t count = 1);
+
+  /**
+   * @brief Run backwards to the last point where run() would have stopped
+   * for a breakpoint or watchpoint, or to the start of the history. Each
+   * checkpoint interval searched is re-executed twice at most.
+   */
+  RunResult reverse_run();
+
+  // Instructions run since the debugger started
+  uint64_t position() const;
+  // The earliest position back() can reach
+  uint64_t history_start() const;
+
+  // The watched access that stopped the last run, if one did
+  const std::optional<WatchHit>& watch_hit() const;
+
+  // Where tracepoints print. std::cout unless set.
+  void set_trace_output(std::ostream& out);
+
+  /**
+   * @brief Create a breakpoint, or a tracepoint if trace is given, replacing
+   * any that was already at addr.
+   */
+  void set_breakpoint(address_t addr, std::optional<Expression> condition,
+                      std::optional<TraceFormat> trace = std::nullopt);
+  // Returns false if there was no breakpoint at addr
+  bool delete_breakpoint(address_t addr);
+  // The breakpoint at addr, or nullptr
+  const Breakpoint* breakpoint(address_t addr) const;
+  std::vector<address_t> breakpoints() const;
+
+  // Watch the accesses (cpu::WatchFlags) to addr; 0 removes the watchpoint
+  void set_watchpoint(address_t addr, uint8_t flags);
+  uint8_t watchpoint(address_t addr) const;
+  std::vector<address_t> watchpoints() const;
+
+  // Delete every breakpoint, tracepoint and watchpoint
+  void clear();
+
+  /**
+   * @brief Change the machine from the debugger. The past leading here can no
+   * longer be re-executed, so the history restarts at the current position.
+   */
+  void set_register(Register reg, uint16_t value);
+  // Write data to memory starting at addr, wrapping at $FFFF
+  void write(address_t addr, std::span<const uint8_t> data);
+  /**
+   * @brief Fill out from memory starting at addr, without triggering
+   * watchpoints. Memory is peeked (see cpu::CPU::peek) unless side_effects is
+   * set, in which case I/O registers are read as the CPU would (e.g. $2002
+   * acknowledges VBlank) and reading any restarts the history.
+   */
+  void read(address_t addr, std::span<uint8_t> out, bool side_effects = false);
+
+  cpu::CPU& cpu();
+
+  // The profiler the "profile" command switches on and off, or nullptr
+  void set_profiler(profiler::Profiler* profiler);
+
+  // Instructions between checkpoints, i.e. the most that going back
+  // re-executes
+  static constexpr uint64_t kCheckpointInterval = 10000;
+  // Checkpoints kept. States are 10-30KB, so that's up to ~30MB for around
+  // 20 seconds of history.
+  static constexpr std::size_t kMaxCheckpoints = 1000;
+
  private:
   static constexpr char help_msg_[] =
       "Use the following commands to interact with the debugger. Short \n"
@@ -52,15 +230,34 @@ class Debugger {
       "  Advance the CPU by one instruction. Optionally specify a number of \n"
       "  instructions to step\n"
       "continue (c)\n"
-      "  Continue execution until the next breakpoint \n"
-      "break <address> \n"
+      "  Continue execution, as fast as possible, until the next breakpoint \n"
+      "  or watchpoint \n"
+      "back (b) [num steps]\n"
+      "  Go back one instruction, or the given number of instructions \n"
+      "reverse-continue (rc)\n"
+      "  Run backwards to the last breakpoint or watchpoint, or as far back \n"
+      "  as the history goes \n"
+      "break <address> [if <condition>] \n"
       "  Pauses program execution when program counter contains <address> \n"
+      "  and the condition, if given, is true, e.g. \n"
+      "  break $C123 if A == $10 && [$0300] > 4 \n"
+      "  Conditions use the registers, [address] for memory, numbers and the \n"
+      "  operators || && == != < <= > >= & | ^ + - ! \n"
+      "trace <address> \"<message>\" [if <condition>] \n"
+      "  Prints the message, without pausing, when program counter contains \n"
+      "  <address>. {expression} in the message prints its value, e.g. \n"
+      "  trace $C000 \"X={X}\" \n"
       "delete <address> \n"
-      "  Removes the previously specified breakpoint at address \n"
+      "  Removes the breakpoint or tracepoint at address \n"
+      "watch <address> [r|w|rw] \n"
+      "  Pauses program execution after an instruction reads (r) and/or \n"
+      "  writes (w) <address>. Watches writes if not specified \n"
+      "unwatch <address> \n"
+      "  Removes the watchpoint at address \n"
       "list (l)\n"
-      "  Prints the addresses of all existing breakpoints \n"
+      "  Prints the addresses of all existing breakpoints and watchpoints \n"
       "clear \n"
-      "  Deletes all breakpoints \n"
+      "  Deletes all breakpoints and watchpoints \n"
       "read (r) <address> [bytes] \n"
       "  Prints the value in memory at the specified address in hexadecimal. \n"
       "  Optionally specify a number of bytes to read (default 1) \n"
@@ -78,25 +275,108 @@ class Debugger {
       "  - P (processor status flags, 8-bit) \n"
       "set <register> <value> \n"
       "  Set the specified register's value \n"
+      "profile <on|off|reset|report|save <path>> \n"
+      "  Count the cycles spent in each instruction and call stack while on. \n"
+      "  report prints the hottest functions and instructions, and save \n"
+      "  writes the call stacks for a flame graph \n"
       "exit\n"
       "  exit the program\n"
       "\n";
 
+  // The machine as it was at a position in the history
+  struct Checkpoint {
+    uint64_t position;
+    std::size_t cycles_todo_in_frame;
+    std::size_t input_position;
+    std::vector<uint8_t> state;
+  };
+
   cpu::CPU* cpu_;
+  controller::InputLog* input_;
+  profiler::Profiler* profiler_;
+  bool profiling_;
 
-  // Set of breakpoints. Not using unordered set for ease of iterating
-  std::set<address_t> breakpoints_;
+  // One bit per address, so checking for a breakpoint is a single lookup.
+  // The breakpoint itself is only looked up for addresses with a bit.
+  std::bitset<0x10000> breakpoints_;
+  std::unordered_map<address_t, Breakpoint> breakpoint_actions_;
+  std::bitset<0x10000> read_watches_;
+  std::bitset<0x10000> write_watches_;
+  // The first watched access since execution was last resumed
+  std::optional<WatchHit> watch_hit_;
+  std::ostream* trace_out_;
 
   std::size_t cycles_todo_in_frame_;
 
+  uint64_t position_;
+  // Ordered by position, one every kCheckpointInterval instructions
+  std::deque<Checkpoint> checkpoints_;
+
   cpu::CPU::time_point frame_start_;
   cpu::CPU::time_point frame_deadline_;
 
   /**
    * @brief Executes 1 cycle, correctly pausing on frame boundaries/vBlank
    *
+   * @param paced Whether to wait for the frame's deadline at the end of a
+   * frame, to keep the game running at its normal speed
+   * @return true iff a frame ended
+   */
+  bool smart_execute_cycle(bool paced = true);
+
+  /**
+   * @brief Executes cycles up to the start of the next instruction, taking a
+   * checkpoint if one is due.
+   *
+   * @return true iff a frame ended
+   */
+  bool run_instruction(bool paced);
+
+  // Save the machine at the current position to a checkpoint
+  void checkpoint();
+  void restore(const Checkpoint& checkpoint);
+  // Drop every checkpoint and kept input frame, then checkpoint the current
+  // position
+  void restart_history();
+
+  // Stop the PPU and APU producing output while the past is re-executed
+  void suppress_output(bool suppress);
+
+  /**
+   * @brief Re-execute up to target with no output, without stopping for
+   * breakpoints or watchpoints or printing traces.
+   *
+   * @return The last position before stops_before where run() would have
+   * stopped, if any, with watch_hit_ set if a watchpoint stopped it there
+   */
+  std::optional<uint64_t> replay(uint64_t target, uint64_t stops_before = 0);
+
+  /**
+   * @brief Go to target, re-executing from the newest checkpoint at or before
+   * it unless the current position is on the way.
+   */
+  void seek(uint64_t target);
+
+  void on_read(address_t addr, uint8_t value) override;
+  void on_write(address_t addr, uint8_t value) override;
+
+  // Tell the CPU whether anything in the page is watched
+  void update_watch_page(uint8_t page);
+
+  // Print where execution stopped for a watchpoint, if it did
+  void report_watch_hit();
+
+  /**
+   * @brief Run the breakpoint at the program counter: check its condition and
+   * print its trace to trace_out_.
+   *
+   * @return true iff execution should pause
    */
-  bool smart_execute_cycle();
+  bool hit_breakpoint();
+
+  // Whether the breakpoint at the program counter would pause, without
+  // printing its trace
+  bool breakpoint_pauses();
 
   /**
    * @brief Read line from stdin and parse it into a command.
@@ -129,16 +409,42 @@ class Debugger {
   void cmd_continue();
 
   /**
-   * @brief Create a new breakpoint at the specified address in program memory.
+   * @brief Go back one or more instructions (default 1).
+   */
+  void cmd_back(uint64_t num_to_step = 1);
+
+  /**
+   * @brief Run backwards to the previous breakpoint or watchpoint.
+   */
+  void cmd_reverse_continue();
+
+  // Print why a run stopped and the registers
+  void report_stop(const RunResult& result);
+
+  /**
+   * @brief Create a new breakpoint at the specified address in program memory,
+   * replacing any breakpoint or tracepoint that was already there.
    *
-   * Has no effect if there was already a breakpoint at the specified address.
+   * @param addr
+   * @param condition Only pause when this is true (nonzero)
+   */
+  void cmd_break(address_t addr,
+                 std::optional<Expression> condition = std::nullopt);
+
+  /**
+   * @brief Create a new tracepoint at the specified address in program
+   * memory, replacing any breakpoint or tracepoint that was already there.
    *
    * @param addr
+   * @param trace The message to print
+   * @param condition Only print when this is true (nonzero)
    */
-  void cmd_break(address_t addr);
+  void cmd_trace(address_t addr, TraceFormat trace,
+                 std::optional<Expression> condition = std::nullopt);
 
   /**
-   * @brief Delete the breakpoint at the specified memory address.
+   * @brief Delete the breakpoint or tracepoint at the specified memory
+   * address.
    *
    * Has no effect if there was no breakpoint at the specified address.
    *
@@ -147,12 +453,30 @@ class Debugger {
   void cmd_delete(address_t addr);
 
   /**
-   * @brief Print the addresses of all existing breakpoints.
+   * @brief Create a new watchpoint on the specified memory address, or change
+   * which accesses (cpu::WatchFlags) an existing one watches.
+   *
+   * @param addr
+   * @param flags
+   */
+  void cmd_watch(address_t addr, uint8_t flags);
+
+  /**
+   * @brief Delete the watchpoint on the specified memory address.
+   *
+   * Has no effect if there was no watchpoint on the specified address.
+   *
+   * @param addr
+   */
+  void cmd_unwatch(address_t addr);
+
+  /**
+   * @brief Print the addresses of all existing breakpoints and watchpoints.
    */
   void cmd_list();
 
   /**
-   * @brief Delete all breakpoints.
+   * @brief Delete all breakpoints and watchpoints.
    */
   void cmd_clear();
 
@@ -187,6 +511,54 @@ class Debugger {
    * bits.
    */
   void cmd_set(std::string reg_name, uint16_t value);
+
+  /**
+   * @brief Switch the profiler on or off, or reset, report or save it.
+   *
+   * @param action on, off, reset, report or save
+   * @param path Where save writes the collapsed stacks
+   */
+  void cmd_profile(const std::string& action, const std::string& path);
+};
+
+/**
+ * @brief Serves a Debugger to tools rather than people: one JSON request per
+ * line in, one JSON response per line out, over a Unix socket.
+ *
+ * A request is an object like {"id": 1, "cmd": "read", "addr": 768,
+ * "len": 256}. Its response carries the same id, "ok" and either the results
+ * or an "error" message. A line holding an array of requests is answered by
+ * an array of responses, so a batch costs one round trip. Memory is sent as a
+ * hex string. See the README for the commands.
+ */
+class DebugServer {
+ public:
+  explicit DebugServer(Debugger& debugger);
+  ~DebugServer();
+
+  DebugServer(const DebugServer&) = delete;
+  DebugServer(DebugServer&&) = delete;
+  DebugServer& operator=(const DebugServer&) = delete;
+  DebugServer& operator=(DebugServer&&) = delete;
+
+  // Answer a line of requests. Errors are reported in the response.
+  std::string handle(std::string_view line);
+
+  /**
+   * @brief Listen on a Unix socket at path, replacing any file there, and
+   * serve one client at a time until one sends an "exit" request. Throws
+   * socket_error if the socket can't be created.
+   */
+  void serve(const std::string& path);
+
+  // Whether an "exit" request has been handled
+  bool exiting() const;
+
+ private:
+  Debugger& debugger_;
+  // Tracepoint output from the current request
+  std::ostringstream traces_;
+  bool exiting_;
 };
 
 }  // namespace debugger
@@ -0,0 +1,105 @@
+#ifndef PACING_HPP
+#define PACING_HPP
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+
+namespace pacing {
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Counts frame times (from one frame's start to the next's) in 0.25ms
+ * buckets up to 50ms, with one more bucket for anything longer.
+ */
+class FrameTimeHistogram {
+ public:
+  static constexpr Clock::duration kBucketWidth =
+      std::chrono::microseconds(250);
+  static constexpr std::size_t kBuckets = 200;
+
+  void add(Clock::duration frame_time);
+
+  std::size_t count() const;
+  Clock::duration mean() const;
+  Clock::duration max() const;
+  /**
+   * @brief Frame time that the given fraction (0 to 1) of frames took at
+   * most, rounded up to the end of its bucket.
+   */
+  Clock::duration percentile(double fraction) const;
+
+  // Print a summary, then a bar for every bucket with frames in it
+  void print(std::ostream& out) const;
+
+ private:
+  std::array<std::size_t, kBuckets + 1> buckets_{};
+  std::size_t count_ = 0;
+  Clock::duration total_{};
+  Clock::duration max_{};
+};
+
+/**
+ * @brief Paces a loop to a fixed frame rate on an absolute timeline.
+ *
+ * Frame n is due at start + n * period however long the frames before it
+ * took, so time lost to a slow frame or a late wake-up is made up by the
+ * frames after it instead of pushing every later deadline back. Waiting
+ * sleeps until shortly before the deadline and spins the rest; how shortly
+ * adapts to how late the OS has been waking the thread up.
+ *
+ * A loop that falls behind runs the frames it owes back to back, up to
+ * max_catch_up of them. Beyond that (e.g. after the process was suspended)
+ * the lost time is dropped instead, rather than fast-forwarding the game.
+ */
+class Pacer {
+ public:
+  // The most rate control will stretch or shrink the period by
+  static constexpr double kMaxRateAdjust = 0.005;
+
+  explicit Pacer(double frame_rate, std::size_t max_catch_up = 4);
+
+  // Wait until the next frame is due. The first frame is due right away.
+  void wait();
+
+  /**
+   * @brief Pace to a consumer's clock rather than purely to the host's:
+   * fill reports how full the consumer's buffer is (0 to 1), e.g. the audio
+   * queued for a sound card, and the period is adjusted by up to
+   * kMaxRateAdjust to keep it half full. nullptr turns it off.
+   */
+  void set_rate_control(std::function<double()> fill);
+
+  // Ask the loop to stop at its next frame. Safe to call from any thread.
+  void stop();
+  bool stopped() const;
+
+  const FrameTimeHistogram& histogram() const;
+  // Frames given up on to get back on schedule
+  std::size_t dropped_frames() const;
+  // Frames started over a millisecond after they were due
+  std::size_t late_frames() const;
+
+ private:
+  Clock::duration period_;
+  std::size_t max_catch_up_;
+  bool started_;
+  Clock::time_point deadline_;    // when the frame being waited for is due
+  Clock::time_point last_start_;  // when the previous frame started
+  // How long before a deadline to stop sleeping and start spinning
+  Clock::duration spin_margin_;
+  std::function<double()> fill_;
+
+  FrameTimeHistogram histogram_;
+  std::size_t dropped_;
+  std::size_t late_;
+  std::atomic<bool> stopped_;
+
+  void sleep_until(Clock::time_point deadline);
+};
+
+}  // namespace pacing
+#endif  // PACING_HPP
@@ -1,14 +1,23 @@
 #include <GLFW/glfw3.h>
 
 #include <array>
+#include <bitset>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 
 #ifndef PPU_HPP
 #define PPU_HPP
+#include "cartridge.hpp"
+#include "savestate.hpp"
+
 namespace ppu {
 
+class FrameSink;
+
 class PPU {
  public:
   // Data structures to store PPU output as an intermediate representation
@@ -62,7 +71,17 @@ class PPU {
       {0x38, 0xE2E1AE}, {0x39, 0xD5E8AE}, {0x3A, 0xC9EBBB}, {0x3B, 0xC2EBCF},
       {0x3C, 0xC2E6E7}, {0x3D, 0xB8B8B8}, {0x3E, 0x000000}, {0x3F, 0x000000}};
 
-  PPU(GLFWwindow& window);
+  // Sprites per scanline the hardware can draw
+  static constexpr int kMaxSpritesPerLine = 8;
+
+  /**
+   * @brief Construct a PPU. Pattern tables are read from the cartridge.
+   * Without a window, frames are only handed to the attached frame sinks
+   * (headless mode).
+   */
+  explicit PPU(cartridge::Cartridge& cart,
+               std::optional<std::reference_wrapper<GLFWwindow>> window =
+                   std::nullopt);
   ~PPU();
 
   PPU(PPU&) = delete;
@@ -75,13 +94,45 @@ class PPU {
 
   /**
    * @brief Using the data currently visible from the CPU, renders a single
-   * frame into the given window. Use draw() to display the rendered
-   * frame, or get_frame_buffer() if you need to consume it in another way.
+   * frame into the internal frame buffer, draws it to the window (if there is
+   * one) and hands it to every attached frame sink.
+   *
+   * Equivalent to begin_frame(), render_scanline() for every visible line,
+   * then end_frame(), without giving the CPU a chance to run in between.
+   */
+  void render_frame();
+
+  /**
+   * @brief Start a new frame (the pre-render scanline): leave vblank and clear
+   * the sprite 0 hit and sprite overflow flags.
+   */
+  void begin_frame();
+
+  /**
+   * @brief Render one visible scanline (0 to 239) with the current PPU state,
+   * setting the sprite 0 hit and overflow flags as it goes. Interleave calls
+   * with CPU execution so mid-frame register writes take effect.
+   */
+  void render_scanline(int line);
+
+  /**
+   * @brief Finish the frame: enter vblank, then draw the frame to the window
+   * (if there is one) and hand it to every attached frame sink. Window events
+   * are not processed here: whoever runs frames pumps them (see
+   * glfwPollEvents), so input stays fresh when frames aren't drawn.
    */
-  void render_to_window();
+  void end_frame();
+
+  bool has_window() const;
 
   /**
-   * @brief Like render_to_window except writes the result to a buffer.
+   * @brief Attach a consumer that is given every rendered frame. The sink
+   * must outlive the PPU (or at least the last call to render_frame).
+   */
+  void add_frame_sink(FrameSink& sink);
+
+  /**
+   * @brief Like render_frame except only writes the result to a buffer.
    *
    * @param out Overwritten with the resulting buffer
    */
@@ -95,49 +146,179 @@ class PPU {
   void set_PPUCTRL(uint8_t val);
   void set_PPUMASK(uint8_t val);
   uint8_t get_PPUSTATUS();
+  // PPUSTATUS without the side effects of reading it, for the debugger
+  uint8_t peek_PPUSTATUS() const;
   void set_OAMADDR(uint8_t val);
   void set_OAMDATA(uint8_t val);
   uint8_t get_OAMDATA();
+  /**
+   * @brief OAM DMA ($4014): copy a whole 256 byte page into OAM, starting at
+   * OAMADDR and wrapping around.
+   */
+  void write_OAMDMA(const uint8_t* page);
+  /**
+   * @brief PPUSCROLL and PPUADDR are both written twice (first/second write
+   * toggled by the shared w latch) and both update the t register, see
+   * https://www.nesdev.org/wiki/PPU_scrolling#Register_controls
+   */
   void set_PPUSCROLL(uint8_t val);
   void set_PPUADDR(uint8_t val);
   uint8_t get_PPUDATA();
   void set_PPUDATA(uint8_t val);
 
+  /**
+   * @brief While output is suppressed, frames only update what the CPU can
+   * observe (status flags, scrolling, mapper scanline counters). Nothing is
+   * composited, converted to RGB, handed to frame sinks or drawn, and pixels
+   * are only rendered on lines that could have a sprite 0 hit. Used to run
+   * frames that are never shown, e.g. for run-ahead.
+   */
+  void suppress_output(bool suppress);
+
+  /**
+   * @brief Save or restore registers, nametable RAM, palette RAM and OAM.
+   * Caches derived from them (the background canvas and sprite evaluation)
+   * are rebuilt on demand after a load.
+   */
+  void save_state(savestate::StateWriter& out) const;
+  void load_state(savestate::StateReader& in);
+
   // Helpers to get common attributes from ppu registers
   bool greyscale();
   bool show_background();
   bool in_vblank();
   bool is_nmi_enabled();
+  bool show_sprites();
+  bool sprite_zero_hit();
+  bool sprite_overflow();
 
  private:
   // Instead of storing whole ram array, since much of it is unused, only
   // storing used parts: nametables and palette ram indices.
 
   static constexpr size_t kNametableSize_ = 0x0400;  // size of one nametable
-  std::array<uint8_t, kNametableSize_ * 4> nametables_;
+  // The console's 2KB of nametable RAM. The cartridge decides how the four
+  // logical nametables map onto it (mirroring), through nametable_banks_.
+  std::array<uint8_t, kNametableSize_ * 2> ciram_;
   std::array<uint8_t, 0x0020> palette_ram_;
+  // Object attribute memory: 64 sprites of 4 bytes each
+  static constexpr size_t kOAMSize_ = 0x100;
+  std::array<uint8_t, kOAMSize_> oam_;
 
   // Internal buffer to which frames are rendered when rendering to window.
   // Stored in a private variable to avoid having to reallocate the whole
-  // frame array every frame. Only allocated on first render_to_window.
+  // frame array every frame. Only allocated on first render_frame.
   std::unique_ptr<frame_t> internal_frame_buf_;
 
-  GLFWwindow& window_;
+  // The frame being rendered, as NES colors (palette entries). Converted to
+  // RGB once per frame in end_frame.
+  std::array<pixel_t, kScreenWidth * kScreenHeight> screen_;
+
+  // One bit per pixel of a scanline, e.g. which pixels are opaque
+  using line_mask_t = std::bitset<kScreenWidth>;
+
+  // The four logical nametables assembled into one 512x480 background, as
+  // palette indices (palette << 2 | pixel, 0 for transparent pixels), so that
+  // a scrolled scanline is at most two span copies out of one canvas row.
+  // Rebuilt lazily one tile row (8 canvas rows of one nametable) at a time.
+  static constexpr int kCanvasWidth_ = kScreenWidth * 2;
+  static constexpr int kCanvasHeight_ = kScreenHeight * 2;
+  static constexpr int kTileRows_ = kScreenHeight / 8;  // per nametable
+  std::array<uint8_t, kCanvasWidth_ * kCanvasHeight_> canvas_;
+  // Bit nametable * kTileRows_ + row is set when that tile row is stale
+  std::bitset<4 * kTileRows_> canvas_dirty_;
+  // The nametable layout and background CHR banks the canvas was built with
+  cartridge::Mapper::nametable_banks_t canvas_banks_;
+  std::array<const uint8_t*, 4> canvas_chr_banks_;
+
+  // Sprite evaluation results, bit i is set iff sprite i is on that scanline.
+  // Rebuilt in a single pass over OAM whenever OAM or the sprite size changes,
+  // so evaluating a scanline is a table lookup rather than 64 comparisons.
+  std::array<uint64_t, kScreenHeight> sprite_lines_;
+  bool sprite_lines_dirty_;
+
+  // Sprites selected for the current scanline (4 bytes each, as in OAM)
+  std::array<uint8_t, kMaxSpritesPerLine * 4> secondary_oam_;
+
+  cartridge::Cartridge& cart_;
+  // Owned by the cartridge's mapper, which updates it on mirroring changes
+  const cartridge::Mapper::nametable_banks_t& nametable_banks_;
+  std::optional<std::reference_wrapper<GLFWwindow>> window_;
+  std::vector<FrameSink*> frame_sinks_;
 
   // Registers
   uint8_t PPUCTRL_;    // w
   uint8_t PPUMASK_;    // w
   uint8_t PPUSTATUS_;  // r
-  uint8_t OAMADDR_;    // w (unused)
-  uint8_t OAMDATA_;    // r/w (unused)
-  uint8_t PPUSCROLL_;  // w (unused)
-  uint16_t PPUADDR_;   // w (note: written one byte at a time)
+  uint8_t OAMADDR_;    // w
   // uint8_t PPUDATA_;    // r/w
 
+  // Internal scroll registers, see https://www.nesdev.org/wiki/PPU_scrolling
+  //  v: current VRAM address (15 bits): 0yyy NNYY YYYX XXXX, fine Y scroll,
+  //     nametable, coarse Y, coarse X. Also the PPUDATA address.
+  //  t: temporary VRAM address, the top left of the screen. Copied into v
+  //     at the start of the frame (all bits) and of each scanline (X bits).
+  //  x: fine X scroll (3 bits)
+  //  w: first or second write toggle for PPUSCROLL/PPUADDR
+  uint16_t v_;
+  uint16_t t_;
+  uint8_t fine_x_;
+  bool w_;
+
+  bool suppress_output_;
+
   // Reading/writing internal ppu ram (only accessible from within PPU or via
   // PPUADDR/PPUDATA registers)
   uint8_t read(uint16_t addr);
   bool write(uint16_t addr, uint8_t data);
+
+  bool rendering_enabled();
+  // End of a visible scanline: move v down a line and clock the mapper
+  void advance_scanline();
+  int sprite_height();
+  void evaluate_sprite_lines();
+
+  // Mark the canvas tile rows showing a nametable byte as stale, in every
+  // logical nametable mirroring it
+  void invalidate_nametable(uint16_t addr);
+  void invalidate_canvas();
+  // Decode one tile row of a nametable into the canvas
+  void build_canvas_row(int nametable, int tile_row);
+
+  /**
+   * @brief Render the background of the scanline at v into palette indices (0
+   * means transparent) and a mask of its opaque pixels: copies the row out of
+   * the canvas.
+   */
+  void render_background_line(std::array<uint8_t, kScreenWidth>& row,
+                              line_mask_t& opaque);
+
+  /**
+   * @brief Render the sprites in secondary OAM into palette indices (relative
+   * to $3F10, 0 means transparent), a mask of pixels where the sprite is behind
+   * the background, and the opaque pixels of sprite 0 (if it is on the line).
+   */
+  void render_sprite_line(int line, int count, bool has_sprite_zero,
+                          std::array<uint8_t, kScreenWidth>& row,
+                          line_mask_t& behind, line_mask_t& sprite_zero);
+
+  // Convert screen_ to RGB, applying color emphasis
+  void to_rgb(frame_t& out);
+};
+
+/**
+ * @brief Receives each frame rendered by the PPU, e.g. to record it or hash it
+ * in headless runs.
+ */
+class FrameSink {
+ public:
+  virtual ~FrameSink() = default;
+
+  /**
+   * @brief Called once per rendered frame. The frame is only valid for the
+   * duration of the call; copy it if it is needed afterwards.
+   */
+  virtual void consume(const PPU::frame_t& frame) = 0;
 };
 
 }  // namespace ppu
@@ -0,0 +1,143 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace profiler {
+
+using symbol_error = std::runtime_error;
+
+/**
+ * @brief Names for guest code addresses, e.g. the labels of the ROM's
+ * assembly source.
+ */
+class SymbolMap {
+ public:
+  /**
+   * @brief Load the label file ld65 writes with -Ln (one "al 00C000 .reset"
+   * line per label), as the vendor Makefile does. Throws symbol_error if it
+   * can't be read.
+   */
+  static SymbolMap load(const std::string& path);
+
+  // Name addr, unless it already has a name
+  void add(uint16_t addr, std::string name);
+  // The label at addr, or addr in hex
+  std::string name(uint16_t addr) const;
+  // The nearest label at or before addr plus an offset, e.g. "reset+3", or
+  // addr in hex
+  std::string locate(uint16_t addr) const;
+  std::size_t size() const;
+
+ private:
+  std::map<uint16_t, std::string> labels_;
+};
+
+/**
+ * @brief Profiles guest code: counts the cycles spent at every PC and in
+ * every call stack, for reports and flame graphs.
+ *
+ * The call stack is rebuilt from the instructions as they run: JSR and
+ * interrupts push a frame and RTS and RTI pop back to the frame whose stack
+ * pointer they return to, so code that pushes its own return addresses (e.g.
+ * jump tables using RTS) doesn't unbalance it. An interrupt's own cycles are
+ * charged to its handler.
+ *
+ * Attach it with cpu::CPU::set_profiler. A detached profiler costs the CPU
+ * one branch per instruction.
+ */
+class Profiler {
+ public:
+  // Frames deeper than this aren't tracked; their cycles go to the deepest
+  // frame that is
+  static constexpr std::size_t kMaxDepth = 64;
+
+  explicit Profiler(SymbolMap symbols = {});
+
+  // Called by the CPU at the start of every instruction
+  void on_instruction(uint16_t pc, uint8_t opcode, uint8_t sp,
+                      uint64_t cycle);
+  /**
+   * @brief Called by the CPU when it takes an interrupt.
+   *
+   * @param return_pc Where the handler will return to
+   * @param handler The handler's address
+   * @param sp The stack pointer before the interrupt pushed anything
+   */
+  void on_interrupt(uint16_t return_pc, uint16_t handler, uint8_t sp,
+                    uint64_t cycle);
+
+  /**
+   * @brief Forget the instruction in flight and the call stack, e.g. because
+   * the profiler was detached for a while or the machine's state was loaded.
+   * What was counted is kept.
+   */
+  void resume();
+  // Forget everything counted
+  void reset();
+
+  // Cycles spent in the instruction at pc
+  uint64_t cycles(uint16_t pc) const;
+  uint64_t total_cycles() const;
+  const SymbolMap& symbols() const;
+
+  /**
+   * @brief Print the functions with the most self and total cycles, and the
+   * hottest instructions, rows of each.
+   */
+  void print_report(std::ostream& out, std::size_t rows = 20) const;
+
+  /**
+   * @brief Write every call stack with the cycles spent in it, one
+   * "outer;inner cycles" line each, as flamegraph.pl and speedscope read.
+   * Stacks start at "(root)", the code running when profiling started.
+   */
+  void write_collapsed(std::ostream& out) const;
+
+ private:
+  // A call stack: a function called from its parent's stack
+  struct Node {
+    uint32_t parent;
+    uint32_t function;  // entry address, or kRoot
+    uint64_t cycles;    // spent in this function with this stack
+  };
+  struct Frame {
+    uint32_t node;
+    uint8_t sp;  // the stack pointer before the call, and after its return
+  };
+
+  static constexpr uint32_t kRoot = 0x10000;
+
+  SymbolMap symbols_;
+  std::vector<uint64_t> flat_;  // cycles per PC
+  std::vector<Node> nodes_;     // nodes_[0] is the root
+  // Child nodes by parent << 17 | function
+  std::unordered_map<uint64_t, uint32_t> children_;
+  std::vector<Frame> stack_;
+  uint32_t node_;  // the current stack
+  uint64_t total_;
+
+  // The instruction in flight, which is charged when the next one starts
+  bool running_;
+  uint16_t pc_;
+  uint8_t opcode_;
+  uint8_t sp_;
+  uint64_t cycle_;
+
+  // Charge the instruction in flight for the cycles up to cycle
+  void charge(uint64_t cycle);
+  // Follow the instruction in flight's JSR, RTS or RTI, if it is one
+  void follow(uint16_t next_pc, uint8_t next_sp);
+  void call(uint16_t function, uint8_t sp);
+  void return_to(uint8_t sp);
+  std::string function_name(uint32_t function) const;
+};
+
+}  // namespace profiler
+
+#endif  // PROFILER_HPP
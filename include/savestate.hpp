@@ -0,0 +1,240 @@
+#ifndef SAVESTATE_HPP
+#define SAVESTATE_HPP
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace cpu {
+class CPU;
+}
+namespace ppu {
+class PPU;
+}
+namespace apu {
+class APU;
+}
+
+namespace savestate {
+
+using savestate_error = std::runtime_error;
+
+// "NESS", at the start of every state
+constexpr uint32_t kMagic = 0x5353454E;
+// Bumped whenever the state layout of any component changes. States from
+// other versions are rejected rather than converted.
+constexpr uint32_t kVersion = 3;
+
+/**
+ * @brief Serializes machine state into a caller-supplied buffer.
+ *
+ * Values are copied as raw bytes in host byte order: states are meant for
+ * checkpointing and forking sessions on one machine, not for exchange. Never
+ * allocates. A default-constructed writer only counts bytes, to size buffers.
+ */
+class StateWriter {
+ public:
+  StateWriter() : out_(), pos_(0) {}
+  explicit StateWriter(std::span<uint8_t> out) : out_(out), pos_(0) {}
+
+  template <typename T>
+  void write(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    write_bytes(&value, sizeof(T));
+  }
+
+  void write_bytes(const void *data, std::size_t size) {
+    if (out_.data() != nullptr) {
+      if (size > out_.size() - pos_) {
+        throw savestate_error("save state buffer is too small");
+      }
+      std::memcpy(out_.data() + pos_, data, size);
+    }
+    pos_ += size;
+  }
+
+  // Start a component's state with a four character tag, which the reader
+  // checks so a corrupt or misaligned state fails early
+  void begin_section(const char (&tag)[5]) { write_bytes(tag, 4); }
+
+  // Bytes written (or counted) so far
+  std::size_t size() const { return pos_; }
+
+ private:
+  std::span<uint8_t> out_;
+  std::size_t pos_;
+};
+
+/**
+ * @brief Reads back a state written by StateWriter. Throws savestate_error if
+ * the state is truncated or a section tag doesn't match.
+ */
+class StateReader {
+ public:
+  explicit StateReader(std::span<const uint8_t> in) : in_(in), pos_(0) {}
+
+  template <typename T>
+  void read(T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    read_bytes(&value, sizeof(T));
+  }
+
+  template <typename T>
+  T read() {
+    T value;
+    read(value);
+    return value;
+  }
+
+  void read_bytes(void *data, std::size_t size) {
+    if (size > in_.size() - pos_) {
+      throw savestate_error("save state is truncated");
+    }
+    std::memcpy(data, in_.data() + pos_, size);
+    pos_ += size;
+  }
+
+  void begin_section(const char (&tag)[5]) {
+    char found[4];
+    read_bytes(found, sizeof(found));
+    if (std::memcmp(found, tag, sizeof(found)) != 0) {
+      throw savestate_error(std::string("save state is corrupt: expected ") +
+                            tag + " section");
+    }
+  }
+
+  // Bytes read so far
+  std::size_t size() const { return pos_; }
+
+ private:
+  std::span<const uint8_t> in_;
+  std::size_t pos_;
+};
+
+/**
+ * @brief A bounded history of save states, newest first out.
+ *
+ * Each snapshot is stored as the XOR of it and the previous snapshot, which is
+ * mostly zeros because little of the machine changes between frames, run-
+ * length encoded into an arena allocated up front. When the arena or the
+ * snapshot limit is full, the oldest snapshots are dropped. The newest state
+ * is also kept uncompressed, so pushing costs one pass over the state and
+ * popping one pass over the delta.
+ */
+class RewindBuffer {
+ public:
+  /**
+   * @param state_size Size of every state pushed
+   * @param capacity Bytes of compressed snapshots to keep
+   * @param max_snapshots Number of snapshots to keep
+   */
+  RewindBuffer(std::size_t state_size, std::size_t capacity,
+               std::size_t max_snapshots);
+
+  void push(std::span<const uint8_t> state);
+
+  /**
+   * @brief Copy the newest snapshot into out and drop it.
+   *
+   * @return false if there are no snapshots left
+   */
+  bool pop(std::span<uint8_t> out);
+
+  void clear();
+
+  // Number of snapshots held
+  std::size_t size() const;
+  // Bytes of the arena used by compressed snapshots
+  std::size_t memory_used() const;
+
+ private:
+  struct Entry {
+    std::size_t offset;
+    std::size_t size;
+  };
+
+  std::vector<uint8_t> current_;  // newest snapshot, zeros when empty
+  std::vector<uint8_t> scratch_;  // one encoded delta
+  std::vector<uint8_t> arena_;
+  std::vector<Entry> entries_;  // ring, oldest at first_
+  std::size_t first_;
+  std::size_t count_;
+  std::size_t head_;  // where the next entry goes in the arena
+  std::size_t used_;
+
+  void drop_oldest();
+};
+
+/**
+ * @brief Runs a machine frame by frame with rewind: a snapshot is pushed every
+ * interval frames, and while rewinding every frame steps back one snapshot.
+ * Capturing costs a save state and one pass over it to encode the delta.
+ */
+class Rewinder {
+ public:
+  /**
+   * @param run_frame Runs one frame forwards, cpu.advance_frame() if not
+   * given (e.g. RunAhead::advance_frame)
+   */
+  Rewinder(cpu::CPU &cpu, std::size_t interval, std::size_t capacity,
+           std::size_t max_snapshots,
+           std::function<void()> run_frame = nullptr);
+
+  /**
+   * @brief Run one frame forwards, or (if rewind is true) load the previous
+   * snapshot and run the frame after it so it is shown. Once the oldest
+   * snapshot is reached, that frame is shown until rewind is released.
+   */
+  void advance_frame(bool rewind);
+
+  const RewindBuffer &buffer() const;
+
+ private:
+  cpu::CPU &cpu_;
+  std::function<void()> run_frame_;
+  std::size_t interval_;
+  std::size_t frames_since_snapshot_;
+  std::vector<uint8_t> state_;
+  bool have_state_;  // state_ holds the last snapshot rewound to
+  bool snapshotted_last_frame_;
+  RewindBuffer buffer_;
+};
+
+/**
+ * @brief Runs a machine ahead of the frame it shows, to hide the latency of
+ * games that react to input a frame or more after reading it.
+ *
+ * Each frame, the real frame is run with output suppressed and saved, then
+ * frames more are run with the same input and only the last is shown, and the
+ * saved state is restored. Input therefore shows up on screen that many frames
+ * sooner, at the cost of emulating frames + 1 frames per frame shown. Frame
+ * sinks see the frames shown, not the real ones, while audio comes from the
+ * real frames only.
+ */
+class RunAhead {
+ public:
+  /**
+   * @param frames Frames to run ahead, 0 to just run the real frame
+   * @param apu The machine's APU, if any, to mute while running ahead
+   */
+  RunAhead(cpu::CPU &cpu, ppu::PPU &ppu, std::size_t frames,
+           std::optional<std::reference_wrapper<apu::APU>> apu =
+               std::nullopt);
+
+  void advance_frame();
+
+ private:
+  cpu::CPU &cpu_;
+  ppu::PPU &ppu_;
+  std::optional<std::reference_wrapper<apu::APU>> apu_;
+  std::size_t frames_;
+  std::vector<uint8_t> state_;  // the real frame, allocated once
+};
+
+}  // namespace savestate
+#endif  // SAVESTATE_HPP
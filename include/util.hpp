@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <ios>
 #include <istream>
+#include <span>
 
 namespace util {
 
@@ -14,6 +15,12 @@ using log_level = boost::log::trivial::severity_level;
 void init_log_level();
 void set_log_level(boost::log::trivial::severity_level level);
 
+/**
+ * @brief Send log output to stderr instead of stdout, e.g. when stdout is used
+ * to stream binary data.
+ */
+void log_to_stderr();
+
 /**
  * @brief Format a given number to be pretty-printed in hex in the format
  * $XX or $XXXX depending on if the given number is a uint8_t or uint16_t.
@@ -22,6 +29,13 @@ std::string fmt_hex(uint8_t);
 std::string fmt_hex(uint16_t);
 std::string fmt_hex(uint32_t);
 
+/**
+ * @brief Fast non-cryptographic 64-bit hash of a byte string (XXH64-style:
+ * four independent multiply-rotate lanes over 32 byte stripes, the tail, then
+ * an avalanche).
+ */
+uint64_t hash_bytes(std::span<const uint8_t> bytes);
+
 /**
  * @brief Parse a number from given string. Works with decimal numbers and hex
  * numbers in the format "$X" where X is between one and four hex digits.
@@ -0,0 +1,136 @@
+#ifndef VIDEO_HPP
+#define VIDEO_HPP
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ppu.hpp"
+
+namespace video {
+
+using video_error = std::runtime_error;
+
+/**
+ * @brief Streams every frame it is given to a file or pipe, either as a
+ * YUV4MPEG2 (Y4M) video or as raw 8-bit RGB frames.
+ *
+ * All buffers are allocated up front; consuming a frame never allocates.
+ * Output goes through a large stdio buffer so the stream is written in big
+ * chunks rather than once per plane or line.
+ *
+ * Y4M output uses 4:4:4 full-range BT.601, so it can be piped straight into
+ * e.g. `ffmpeg -i - out.mp4`. Raw RGB output is 256x240x3 bytes per frame
+ * with no header.
+ */
+class StreamSink : public ppu::FrameSink {
+ public:
+  enum Format {
+    kY4M,
+    kRGB,
+  };
+
+  /**
+   * @brief Open the output stream.
+   *
+   * @param path File or named pipe to write to. "-" writes to stdout.
+   * @param format Container format of the stream
+   * @param drop_duplicates If true, a frame identical to the previously
+   * consumed one is not written. Note that this changes playback timing of the
+   * resulting video.
+   */
+  StreamSink(const std::string& path, Format format,
+             bool drop_duplicates = false);
+  ~StreamSink() override;
+
+  StreamSink(const StreamSink&) = delete;
+  StreamSink(StreamSink&&) = delete;
+  StreamSink& operator=(const StreamSink&) = delete;
+  StreamSink& operator=(StreamSink&&) = delete;
+
+  void consume(const ppu::PPU::frame_t& frame) override;
+
+  std::size_t frames_written() const;
+  std::size_t frames_dropped() const;
+
+  /**
+   * @brief Parse a format name ("y4m" or "rgb"). Throws video_error on an
+   * unknown name.
+   */
+  static Format format_from_string(const std::string& name);
+
+ private:
+  static constexpr std::size_t kPixels =
+      ppu::PPU::kScreenWidth * ppu::PPU::kScreenHeight;
+  static constexpr std::size_t kWriteBufferSize = 1 << 20;  // 1 MiB
+
+  std::FILE* out_;
+  bool owns_out_;  // false when writing to stdout
+  Format format_;
+  bool drop_duplicates_;
+
+  std::vector<char> write_buf_;     // backing buffer for out_
+  std::vector<uint8_t> planes_;     // Y, Cb, Cr planes (Y4M only)
+  std::unique_ptr<ppu::PPU::frame_t> last_frame_;
+  bool have_last_frame_;
+
+  std::size_t frames_written_;
+  std::size_t frames_dropped_;
+
+  void write_bytes(const void* data, std::size_t size);
+};
+
+/**
+ * @brief Hashes every frame it is given and optionally writes the hashes to a
+ * hash log: a text file with one 16 hex digit hash per line, where line N
+ * (counting from 0, ignoring '#' comment lines) is frame N.
+ *
+ * Comparing hash logs is a cheap way to check that rendering is unchanged
+ * over thousands of frames without storing the frames themselves.
+ */
+class HashSink : public ppu::FrameSink {
+ public:
+  // Only collect hashes in memory
+  HashSink();
+  // Also write each hash to the log at path
+  explicit HashSink(const std::string& path);
+  ~HashSink() override;
+
+  HashSink(const HashSink&) = delete;
+  HashSink(HashSink&&) = delete;
+  HashSink& operator=(const HashSink&) = delete;
+  HashSink& operator=(HashSink&&) = delete;
+
+  void consume(const ppu::PPU::frame_t& frame) override;
+
+  const std::vector<uint64_t>& hashes() const;
+
+ private:
+  std::FILE* out_;
+  std::vector<uint64_t> hashes_;
+};
+
+// Hash of a frame, as written to hash logs (util::hash_bytes)
+uint64_t hash_frame(const ppu::PPU::frame_t& frame);
+
+/**
+ * @brief Parse a hash log written by HashSink. Throws video_error on a
+ * malformed line.
+ */
+std::vector<uint64_t> read_hash_log(std::istream& in);
+
+/**
+ * @brief Convert interleaved 8-bit RGB pixels to planar full-range BT.601
+ * Y/Cb/Cr. Processes 16 pixels at a time with vector instructions.
+ *
+ * @param rgb 3 * count bytes of input
+ * @param y, cb, cr count bytes of output each
+ * @param count Number of pixels
+ */
+void rgb_to_yuv444(const uint8_t* rgb, uint8_t* y, uint8_t* cb, uint8_t* cr,
+                   std::size_t count);
+
+}  // namespace video
+#endif  // VIDEO_HPP
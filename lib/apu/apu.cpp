@@ -0,0 +1,287 @@
+#include "apu.hpp"
+
+#include <algorithm>
+#include <boost/log/trivial.hpp>
+
+#include "util.hpp"
+
+namespace apu {
+
+namespace {
+
+// Frame counter steps, in CPU clocks from the start of the sequence
+constexpr uint64_t kFourStepClocks[4] = {7457, 14913, 22371, 29829};
+constexpr uint64_t kFourStepPeriod = 29830;
+constexpr uint64_t kFiveStepClocks[5] = {7457, 14913, 22371, 29829, 37281};
+constexpr uint64_t kFiveStepPeriod = 37282;
+
+// Calls a callable with every field, for save states
+struct Writer {
+  savestate::StateWriter& out;
+  template <typename... T>
+  void operator()(const T&... fields) {
+    (out.write(fields), ...);
+  }
+};
+struct Reader {
+  savestate::StateReader& in;
+  template <typename... T>
+  void operator()(T&... fields) {
+    (in.read(fields), ...);
+  }
+};
+
+}  // namespace
+
+Core::Core()
+    : pulse1_(false),
+      pulse2_(true),
+      triangle_(),
+      noise_(),
+      dmc_(),
+      five_step_(false),
+      irq_inhibit_(false),
+      frame_irq_(false),
+      frame_step_(0),
+      frame_start_(0),
+      next_frame_step_(kFourStepClocks[0]),
+      synced_(0),
+      next_event_(0) {
+  schedule();
+}
+
+void Core::run_until(uint64_t clock, const Memory& memory,
+                     SampleBuffer* out) {
+  while (synced_ < clock) {
+    run_channels(std::min(clock, next_frame_step_), memory, out);
+    if (synced_ == next_frame_step_) {
+      clock_frame_counter();
+    }
+  }
+  schedule();
+}
+
+void Core::write(uint16_t addr, uint8_t data, const Memory& memory) {
+  switch (addr) {
+    case 0x4000 ... 0x4003:
+      pulse1_.write(addr & 0b11, data);
+      break;
+    case 0x4004 ... 0x4007:
+      pulse2_.write(addr & 0b11, data);
+      break;
+    case 0x4008 ... 0x400B:
+      triangle_.write(addr & 0b11, data);
+      break;
+    case 0x400C ... 0x400F:
+      noise_.write(addr & 0b11, data);
+      break;
+    case 0x4010 ... 0x4013:
+      dmc_.write(addr & 0b11, data);
+      break;
+    case 0x4015:
+      // Disabling a channel silences it by clearing its length counter
+      pulse1_.enabled = data & 0x01;
+      pulse2_.enabled = data & 0x02;
+      triangle_.enabled = data & 0x04;
+      noise_.enabled = data & 0x08;
+      if (!pulse1_.enabled) pulse1_.length = 0;
+      if (!pulse2_.enabled) pulse2_.length = 0;
+      if (!triangle_.enabled) triangle_.length = 0;
+      if (!noise_.enabled) noise_.length = 0;
+      dmc_.irq = false;
+      if (!(data & 0x10)) {
+        dmc_.bytes_remaining = 0;
+      } else if (dmc_.bytes_remaining == 0) {
+        dmc_.restart();
+        dmc_.fetch(memory);
+      }
+      break;
+    case 0x4017:
+      // Restart the sequence. The 3-4 clock delay of real hardware is
+      // ignored.
+      five_step_ = data & 0x80;
+      irq_inhibit_ = data & 0x40;
+      if (irq_inhibit_) {
+        frame_irq_ = false;
+      }
+      frame_step_ = 0;
+      frame_start_ = synced_;
+      next_frame_step_ = frame_start_ + kFourStepClocks[0];
+      if (five_step_) {
+        clock_quarter_frame();
+        clock_half_frame();
+      }
+      break;
+    default:
+      BOOST_LOG_TRIVIAL(debug)
+          << "Write to unknown APU register: " << util::fmt_hex(addr);
+      break;
+  }
+  schedule();
+}
+
+uint8_t Core::status() const {
+  return (pulse1_.length > 0) |              //
+         (pulse2_.length > 0) << 1 |         //
+         (triangle_.length > 0) << 2 |       //
+         (noise_.length > 0) << 3 |          //
+         (dmc_.bytes_remaining > 0) << 4 |  //
+         frame_irq_ << 6 |                   //
+         dmc_.irq << 7;
+}
+
+float Core::mix() const {
+  return (pulse1_.amp + pulse2_.amp) * kPulseWeight +
+         triangle_.amp * kTriangleWeight + noise_.amp * kNoiseWeight +
+         dmc_.amp * kDMCWeight;
+}
+
+void Core::save_state(savestate::StateWriter& out) { fields(Writer{out}); }
+
+void Core::load_state(savestate::StateReader& in) {
+  fields(Reader{in});
+  schedule();
+}
+
+void Core::run_channels(uint64_t clock, const Memory& memory,
+                        SampleBuffer* out) {
+  pulse1_.run(synced_, clock, out);
+  pulse2_.run(synced_, clock, out);
+  triangle_.run(synced_, clock, out);
+  noise_.run(synced_, clock, out);
+  dmc_.run(synced_, clock, out, memory);
+  synced_ = clock;
+}
+
+void Core::clock_frame_counter() {
+  bool quarter = true;
+  bool half = frame_step_ == 1;
+  if (five_step_) {
+    quarter = frame_step_ != 3;
+    half |= frame_step_ == 4;
+  } else if (frame_step_ == 3) {
+    half = true;
+    if (!irq_inhibit_) {
+      frame_irq_ = true;
+    }
+  }
+  if (quarter) {
+    clock_quarter_frame();
+  }
+  if (half) {
+    clock_half_frame();
+  }
+
+  frame_step_++;
+  if (frame_step_ == (five_step_ ? 5 : 4)) {
+    frame_step_ = 0;
+    frame_start_ += five_step_ ? kFiveStepPeriod : kFourStepPeriod;
+  }
+  next_frame_step_ = frame_start_ + (five_step_ ? kFiveStepClocks
+                                                : kFourStepClocks)[frame_step_];
+}
+
+void Core::clock_quarter_frame() {
+  pulse1_.envelope.clock();
+  pulse2_.envelope.clock();
+  triangle_.clock_quarter_frame();
+  noise_.envelope.clock();
+}
+
+void Core::clock_half_frame() {
+  pulse1_.clock_half_frame();
+  pulse2_.clock_half_frame();
+  if (triangle_.length > 0 && !triangle_.control) {
+    triangle_.length--;
+  }
+  if (noise_.length > 0 && !noise_.envelope.loop) {
+    noise_.length--;
+  }
+}
+
+void Core::schedule() {
+  next_event_ = std::min(next_frame_step_, dmc_.next_fetch(synced_));
+}
+
+APU::APU(cartridge::Cartridge& cart)
+    : cart_(cart),
+      core_(),
+      memory_([this](uint16_t addr) {
+        uint8_t data = cart_.cpu_read(addr);
+        if (Synthesizer* synth = listener()) {
+          synth->dmc_byte(data);
+        }
+        return data;
+      }),
+      synth_(),
+      suppressed_(false),
+      resumes_at_() {}
+
+APU::~APU() = default;
+
+void APU::write(uint16_t addr, uint8_t data, uint64_t clock) {
+  core_.run_until(clock, memory_, nullptr);
+  // Written here first, so the synthesizer gets any DMC byte this fetches
+  // ahead of the write that fetched it
+  core_.write(addr, data, memory_);
+  if (Synthesizer* synth = listener()) {
+    synth->write(addr, data, clock);
+  }
+}
+
+uint8_t APU::read_status(uint64_t clock) {
+  core_.run_until(clock, memory_, nullptr);
+  uint8_t status = core_.status();
+  core_.acknowledge_frame_irq();
+  if (Synthesizer* synth = listener()) {
+    synth->read_status(clock);
+  }
+  return status;
+}
+
+void APU::end_frame(uint64_t clock) {
+  core_.run_until(clock, memory_, nullptr);
+  if (Synthesizer* synth = listener()) {
+    synth->end_frame(clock);
+  }
+}
+
+void APU::attach_output(AudioOutput* output) {
+  synth_.reset();
+  if (output != nullptr) {
+    synth_ = std::make_unique<Synthesizer>(core_, *output);
+  }
+  resumes_at_ = core_;
+}
+
+void APU::suppress_output(bool suppress) {
+  if (suppress == suppressed_) {
+    return;
+  }
+  suppressed_ = suppress;
+  if (suppress) {
+    resumes_at_ = core_;
+  } else if (synth_ != nullptr && core_ != resumes_at_) {
+    // Run-ahead restores the state it suppressed output at first, so this is
+    // rare
+    synth_->reset(core_);
+  }
+}
+
+void APU::save_state(savestate::StateWriter& out) {
+  out.begin_section("APU ");
+  core_.save_state(out);
+}
+
+void APU::load_state(savestate::StateReader& in) {
+  in.begin_section("APU ");
+  Core previous = core_;
+  core_.load_state(in);
+  // What the synthesizer has queued belongs to another timeline, unless the
+  // state is where it already was
+  if (Synthesizer* synth = listener(); synth != nullptr && core_ != previous) {
+    synth->reset(core_);
+  }
+}
+
+}  // namespace apu
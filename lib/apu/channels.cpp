@@ -0,0 +1,327 @@
+#include <algorithm>
+
+#include "apu.hpp"
+
+namespace apu {
+
+namespace {
+
+// Pulse waveforms, read backwards as the sequencer counts down
+constexpr uint8_t kDutyTable[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},  // 12.5%
+    {0, 1, 1, 0, 0, 0, 0, 0},  // 25%
+    {0, 1, 1, 1, 1, 0, 0, 0},  // 50%
+    {1, 0, 0, 1, 1, 1, 1, 1},  // 25% negated
+};
+
+constexpr uint8_t kTriangleTable[32] = {
+    15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15};
+
+// Timer periods in CPU clocks (NTSC)
+constexpr uint16_t kNoisePeriods[16] = {4,   8,   16,  32,  64,  96,
+                                        128, 160, 202, 254, 380, 508,
+                                        762, 1016, 2034, 4068};
+constexpr uint16_t kDMCPeriods[16] = {428, 380, 340, 320, 286, 254,
+                                      226, 214, 190, 160, 142, 128,
+                                      106, 84,  72,  54};
+
+// Give the buffer the change in a channel's output, if there is one
+void set_amp(int& amp, int level, uint64_t clock, SampleBuffer* out,
+             float weight) {
+  if (level != amp) {
+    if (out != nullptr) {
+      out->add_delta(clock, (level - amp) * weight);
+    }
+    amp = level;
+  }
+}
+
+// Timer steps that happen in [t, end), for a timer next firing at t
+uint64_t steps_before(uint64_t t, uint64_t end, uint32_t period) {
+  return t < end ? (end - 1 - t) / period + 1 : 0;
+}
+
+}  // namespace
+
+void Envelope::clock() {
+  if (start) {
+    start = false;
+    decay = 15;
+    divider = period;
+  } else if (divider > 0) {
+    divider--;
+  } else {
+    divider = period;
+    if (decay > 0) {
+      decay--;
+    } else if (loop) {
+      decay = 15;
+    }
+  }
+}
+
+void Pulse::write(int reg, uint8_t data) {
+  switch (reg) {
+    case 0:
+      duty = data >> 6;
+      envelope.loop = data & 0x20;
+      envelope.constant = data & 0x10;
+      envelope.period = data & 0x0F;
+      break;
+    case 1:
+      sweep_enabled = data & 0x80;
+      sweep_period = (data >> 4) & 0b111;
+      sweep_negate = data & 0x08;
+      sweep_shift = data & 0b111;
+      sweep_reload = true;
+      break;
+    case 2:
+      period = (period & 0x700) | data;
+      break;
+    case 3:
+      period = (period & 0x0FF) | ((data & 0b111) << 8);
+      if (enabled) {
+        length = kLengthTable[data >> 3];
+      }
+      step = 0;
+      envelope.start = true;
+      break;
+  }
+}
+
+void Pulse::clock_half_frame() {
+  if (length > 0 && !envelope.loop) {
+    length--;
+  }
+  if (sweep_divider == 0 && sweep_enabled && sweep_shift > 0 && !muted()) {
+    period = sweep_target();
+  }
+  if (sweep_divider == 0 || sweep_reload) {
+    sweep_divider = sweep_period;
+    sweep_reload = false;
+  } else {
+    sweep_divider--;
+  }
+}
+
+uint16_t Pulse::sweep_target() const {
+  int change = period >> sweep_shift;
+  if (sweep_negate) {
+    return std::max(0, period - change - (ones_complement ? 1 : 0));
+  }
+  return period + change;
+}
+
+bool Pulse::muted() const {
+  // The sweep mutes the channel whenever its target overflows, even while
+  // disabled
+  return period < 8 || sweep_target() > 0x7FF;
+}
+
+void Pulse::run(uint64_t start, uint64_t end, SampleBuffer* out) {
+  uint32_t step_clocks = (period + 1) * 2;
+  int volume =
+      length == 0 || muted() ? 0 : static_cast<int>(envelope.volume());
+  set_amp(amp, kDutyTable[duty][step] ? volume : 0, start, out, kPulseWeight);
+
+  uint64_t t = start + timer;
+  if (volume == 0 || out == nullptr) {
+    // Silent throughout, or unheard: only the sequencer position matters
+    uint64_t steps = steps_before(t, end, step_clocks);
+    step = (step - steps) & 0b111;
+    t += steps * step_clocks;
+    amp = kDutyTable[duty][step] ? volume : 0;
+  } else {
+    for (; t < end; t += step_clocks) {
+      step = (step - 1) & 0b111;
+      set_amp(amp, kDutyTable[duty][step] ? volume : 0, t, out, kPulseWeight);
+    }
+  }
+  timer = t - end;
+}
+
+void Triangle::write(int reg, uint8_t data) {
+  switch (reg) {
+    case 0:
+      control = data & 0x80;
+      linear_period = data & 0x7F;
+      break;
+    case 2:
+      period = (period & 0x700) | data;
+      break;
+    case 3:
+      period = (period & 0x0FF) | ((data & 0b111) << 8);
+      if (enabled) {
+        length = kLengthTable[data >> 3];
+      }
+      linear_reload = true;
+      break;
+  }
+}
+
+void Triangle::clock_quarter_frame() {
+  if (linear_reload) {
+    linear = linear_period;
+  } else if (linear > 0) {
+    linear--;
+  }
+  if (!control) {
+    linear_reload = false;
+  }
+}
+
+void Triangle::run(uint64_t start, uint64_t end, SampleBuffer* out) {
+  uint32_t step_clocks = period + 1;
+  set_amp(amp, kTriangleTable[step], start, out, kTriangleWeight);
+
+  uint64_t t = start + timer;
+  // Games silence the triangle with ultrasonic periods; holding the output
+  // instead avoids their aliasing
+  if (linear == 0 || length == 0 || period < 2) {
+    t += steps_before(t, end, step_clocks) * step_clocks;
+  } else if (out == nullptr) {
+    uint64_t steps = steps_before(t, end, step_clocks);
+    step = (step + steps) & 0x1F;
+    t += steps * step_clocks;
+    amp = kTriangleTable[step];
+  } else {
+    for (; t < end; t += step_clocks) {
+      step = (step + 1) & 0x1F;
+      set_amp(amp, kTriangleTable[step], t, out, kTriangleWeight);
+    }
+  }
+  timer = t - end;
+}
+
+void Noise::write(int reg, uint8_t data) {
+  switch (reg) {
+    case 0:
+      envelope.loop = data & 0x20;
+      envelope.constant = data & 0x10;
+      envelope.period = data & 0x0F;
+      break;
+    case 2:
+      mode = data & 0x80;
+      period = kNoisePeriods[data & 0x0F];
+      break;
+    case 3:
+      if (enabled) {
+        length = kLengthTable[data >> 3];
+      }
+      envelope.start = true;
+      break;
+  }
+}
+
+void Noise::run(uint64_t start, uint64_t end, SampleBuffer* out) {
+  int volume = length == 0 ? 0 : static_cast<int>(envelope.volume());
+  set_amp(amp, (shift & 1) ? 0 : volume, start, out, kNoiseWeight);
+
+  // The shift register always runs, so it has to be stepped even when silent
+  int tap = mode ? 6 : 1;
+  uint64_t t = start + timer;
+  for (; t < end; t += period) {
+    uint16_t feedback = (shift ^ (shift >> tap)) & 1;
+    shift = (shift >> 1) | (feedback << 14);
+    if (volume != 0 && out != nullptr) {
+      set_amp(amp, (shift & 1) ? 0 : volume, t, out, kNoiseWeight);
+    }
+  }
+  if (out == nullptr) {
+    amp = (shift & 1) ? 0 : volume;
+  }
+  timer = t - end;
+}
+
+void DMC::write(int reg, uint8_t data) {
+  switch (reg) {
+    case 0:
+      irq_enabled = data & 0x80;
+      if (!irq_enabled) {
+        irq = false;
+      }
+      loop = data & 0x40;
+      period = kDMCPeriods[data & 0x0F];
+      break;
+    case 1:
+      level = data & 0x7F;
+      break;
+    case 2:
+      sample_address = 0xC000 + data * 64;
+      break;
+    case 3:
+      sample_length = data * 16 + 1;
+      break;
+  }
+}
+
+void DMC::restart() {
+  address = sample_address;
+  bytes_remaining = sample_length;
+}
+
+void DMC::fetch(const Memory& memory) {
+  if (buffer_full || bytes_remaining == 0) {
+    return;
+  }
+  buffer = memory(address);
+  buffer_full = true;
+  address = address == 0xFFFF ? 0x8000 : address + 1;
+  if (--bytes_remaining == 0) {
+    if (loop) {
+      restart();
+    } else if (irq_enabled) {
+      irq = true;
+    }
+  }
+}
+
+uint64_t DMC::next_fetch(uint64_t now) const {
+  if (bytes_remaining == 0) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  if (!buffer_full) {
+    return now;
+  }
+  // The buffer empties into the shift register when the last bit is out
+  return now + timer + (bits_remaining - 1) * uint64_t{period};
+}
+
+void DMC::run(uint64_t start, uint64_t end, SampleBuffer* out,
+              const Memory& memory) {
+  set_amp(amp, level, start, out, kDMCWeight);
+
+  uint64_t t = start + timer;
+  if (silence && !buffer_full && bytes_remaining == 0) {
+    // Idle: only the bit counter moves
+    uint64_t steps = steps_before(t, end, period);
+    bits_remaining = 8 - (8 - bits_remaining + steps) % 8;
+    t += steps * period;
+  }
+  for (; t < end; t += period) {
+    if (!silence) {
+      if (shift & 1) {
+        if (level <= 125) {
+          level += 2;
+        }
+      } else if (level >= 2) {
+        level -= 2;
+      }
+      set_amp(amp, level, t, out, kDMCWeight);
+    }
+    shift >>= 1;
+    if (--bits_remaining == 0) {
+      bits_remaining = 8;
+      silence = !buffer_full;
+      if (buffer_full) {
+        shift = buffer;
+        buffer_full = false;
+        fetch(memory);
+      }
+    }
+  }
+  timer = t - end;
+}
+
+}  // namespace apu
@@ -0,0 +1,116 @@
+#include <bit>
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <format>
+
+#include "apu.hpp"
+
+namespace apu {
+
+WavSink::WavSink(const std::string& path, int sample_rate)
+    : out_(std::fopen(path.c_str(), "wb")),
+      sample_rate_(sample_rate),
+      samples_written_(0) {
+  if (out_ == nullptr) {
+    throw audio_error(std::format("could not open audio output '{}': {}",
+                                  path, std::strerror(errno)));
+  }
+  write_header();
+}
+
+WavSink::~WavSink() {
+  // Now that the length is known, fill it in
+  std::fseek(out_, 0, SEEK_SET);
+  write_header();
+  std::fclose(out_);
+  BOOST_LOG_TRIVIAL(info) << "Audio stream closed: " << samples_written_
+                          << " samples written";
+}
+
+void WavSink::consume(std::span<const int16_t> samples) {
+  std::fwrite(samples.data(), sizeof(int16_t), samples.size(), out_);
+  samples_written_ += samples.size();
+}
+
+std::size_t WavSink::samples_written() const { return samples_written_; }
+
+void WavSink::write_header() {
+  static_assert(std::endian::native == std::endian::little,
+                "WAV output assumes a little-endian host");
+  uint32_t data_size = samples_written_ * sizeof(int16_t);
+  struct {
+    char riff[4] = {'R', 'I', 'F', 'F'};
+    uint32_t riff_size;
+    char wave[4] = {'W', 'A', 'V', 'E'};
+    char fmt[4] = {'f', 'm', 't', ' '};
+    uint32_t fmt_size = 16;
+    uint16_t format = 1;  // PCM
+    uint16_t channels = 1;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align = sizeof(int16_t);
+    uint16_t bits_per_sample = 16;
+    char data[4] = {'d', 'a', 't', 'a'};
+    uint32_t data_size;
+  } header;
+  static_assert(sizeof(header) == 44);
+  header.riff_size = 36 + data_size;
+  header.sample_rate = sample_rate_;
+  header.byte_rate = sample_rate_ * sizeof(int16_t);
+  header.data_size = data_size;
+  std::fwrite(&header, sizeof(header), 1, out_);
+}
+
+AudioOutput::AudioOutput(AudioSink& sink, std::size_t capacity)
+    : sink_(sink),
+      ring_(capacity),
+      pushes_(0),
+      pops_(0),
+      done_(false),
+      thread_(&AudioOutput::run, this) {}
+
+AudioOutput::~AudioOutput() {
+  done_.store(true, std::memory_order_release);
+  pushes_.fetch_add(1, std::memory_order_release);
+  pushes_.notify_one();
+  thread_.join();
+}
+
+void AudioOutput::write(std::span<const int16_t> samples) {
+  while (true) {
+    uint32_t pops = pops_.load(std::memory_order_acquire);
+    samples = samples.subspan(ring_.push(samples));
+    pushes_.fetch_add(1, std::memory_order_release);
+    pushes_.notify_one();
+    if (samples.empty()) {
+      return;
+    }
+    // Full: wait until the sink has taken some
+    pops_.wait(pops, std::memory_order_acquire);
+  }
+}
+
+double AudioOutput::fill() const {
+  return static_cast<double>(ring_.size()) / ring_.capacity();
+}
+
+void AudioOutput::run() {
+  std::vector<int16_t> block(4096);
+  while (true) {
+    uint32_t pushes = pushes_.load(std::memory_order_acquire);
+    std::size_t count = ring_.pop(block);
+    if (count > 0) {
+      pops_.fetch_add(1, std::memory_order_release);
+      pops_.notify_one();
+      sink_.consume(std::span(block).first(count));
+      continue;
+    }
+    if (done_.load(std::memory_order_acquire)) {
+      return;
+    }
+    pushes_.wait(pushes, std::memory_order_acquire);
+  }
+}
+
+}  // namespace apu
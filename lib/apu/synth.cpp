@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+#include "apu.hpp"
+
+namespace apu {
+
+namespace {
+
+// Samples buffered between flushes, a few frames' worth
+constexpr std::size_t kBufferSamples = 4096;
+
+// Band-limited step kernels, one per 1/kPhases of a sample, plus the first
+// one shifted by a whole sample to interpolate the last phase against
+constexpr int kPhaseBits = 5;
+constexpr int kPhases = 1 << kPhaseBits;
+constexpr std::size_t kWidth = SampleBuffer::kKernelWidth;
+// One kernel in 16 lanes of floats, mixed in with whole-vector arithmetic.
+// GCC/Clang lower it to SSE/AVX/NEON depending on the target.
+using Kernel = float __attribute__((vector_size(kWidth * sizeof(float))));
+
+// Stops just short of the output's Nyquist frequency, so the window's
+// transition band doesn't fold back into the audible range
+constexpr double kCutoff = 0.9;
+
+std::array<Kernel, kPhases + 1> make_kernels() {
+  std::array<Kernel, kPhases + 1> kernels;
+  constexpr double kHalf = kWidth / 2.0;
+  for (int phase = 0; phase <= kPhases; phase++) {
+    Kernel& kernel = kernels[phase];
+    double sum = 0;
+    for (std::size_t i = 0; i < kWidth; i++) {
+      // Distance from the step, centered between the two middle taps
+      double x = i - (kHalf - 1) - static_cast<double>(phase) / kPhases;
+      double sinc = x == 0 ? 1.0
+                           : std::sin(std::numbers::pi * kCutoff * x) /
+                                 (std::numbers::pi * kCutoff * x);
+      double window = 0.42 + 0.5 * std::cos(std::numbers::pi * x / kHalf) +
+                      0.08 * std::cos(2 * std::numbers::pi * x / kHalf);
+      kernel[i] = static_cast<float>(sinc * window);
+      sum += kernel[i];
+    }
+    // Each kernel adds exactly the step, so the integrated output settles at
+    // the new level
+    for (std::size_t i = 0; i < kWidth; i++) {
+      kernel[i] = static_cast<float>(kernel[i] / sum);
+    }
+  }
+  return kernels;
+}
+
+const std::array<Kernel, kPhases + 1> kKernels = make_kernels();
+
+// Events replayed per wakeup of the thread, at most
+constexpr std::size_t kEventBatch = 256;
+// Events queued before the emulation waits for the thread, many frames' worth
+constexpr std::size_t kEventCapacity = 1 << 14;
+
+}  // namespace
+
+SampleBuffer::SampleBuffer(double clock_rate, int sample_rate,
+                           std::size_t capacity)
+    : factor_(std::llround(sample_rate / clock_rate * 4294967296.0)),
+      offset_(0),
+      start_clock_(0),
+      deltas_(capacity + kKernelWidth),
+      level_(0),
+      hp_in_(0),
+      hp_out_(0),
+      hp_coef_(std::exp(-2 * std::numbers::pi * 90.0 / sample_rate)) {}
+
+void SampleBuffer::add_delta(uint64_t clock, float delta) {
+  uint64_t pos = offset_ + (clock - start_clock_) * factor_;
+  auto frac = static_cast<uint32_t>(pos);
+  uint32_t phase = frac >> (32 - kPhaseBits);
+  // What is left of the fraction below the phase, as a weight in [0, 1)
+  float interp = static_cast<uint32_t>(frac << kPhaseBits) * 0x1p-32f;
+  float early = delta * (1 - interp);
+  float late = delta * interp;
+  Kernel step = kKernels[phase] * early + kKernels[phase + 1] * late;
+  // The output isn't aligned to a kernel, so it is loaded and stored through
+  // memcpy, which compiles to unaligned vector moves
+  float* out = deltas_.data() + (pos >> 32);
+  Kernel mixed;
+  std::memcpy(&mixed, out, sizeof(mixed));
+  mixed += step;
+  std::memcpy(out, &mixed, sizeof(mixed));
+}
+
+void SampleBuffer::end_frame(uint64_t clock) {
+  offset_ += (clock - start_clock_) * factor_;
+  start_clock_ = clock;
+}
+
+uint64_t SampleBuffer::clock_limit() const {
+  uint64_t room = ((deltas_.size() - kKernelWidth) << 32) - offset_;
+  return start_clock_ + room / factor_ - 1;
+}
+
+std::size_t SampleBuffer::samples_avail() const { return offset_ >> 32; }
+
+std::size_t SampleBuffer::read_samples(std::span<int16_t> out) {
+  std::size_t avail = samples_avail();
+  std::size_t count = std::min(avail, out.size());
+  for (std::size_t i = 0; i < count; i++) {
+    level_ += deltas_[i];
+    hp_out_ = level_ - hp_in_ + hp_coef_ * hp_out_;
+    hp_in_ = level_;
+    float sample = std::clamp(hp_out_ * 32767.0f, -32768.0f, 32767.0f);
+    out[i] = static_cast<int16_t>(sample);
+  }
+  // Keep the deltas of the samples not read yet, including the partial one
+  // and the kernel tails past it
+  std::size_t kept = avail - count + kKernelWidth;
+  std::memmove(deltas_.data(), deltas_.data() + count, kept * sizeof(float));
+  std::fill(deltas_.begin() + kept, deltas_.begin() + avail + kKernelWidth,
+            0.0f);
+  offset_ -= uint64_t{count} << 32;
+  return count;
+}
+
+void SampleBuffer::clear(uint64_t clock, float level) {
+  std::fill(deltas_.begin(), deltas_.end(), 0.0f);
+  offset_ = 0;
+  start_clock_ = clock;
+  level_ = level;
+  hp_in_ = level;
+  hp_out_ = 0;
+}
+
+Synthesizer::Synthesizer(const Core& core, AudioOutput& output)
+    : output_(output),
+      events_(kEventCapacity),
+      pushed_(0),
+      replayed_(0),
+      wakeups_(0),
+      done_(false),
+      core_(core),
+      dmc_bytes_(),
+      memory_([this](uint16_t addr) -> uint8_t {
+        (void)addr;  // the emulation thread read it already
+        if (dmc_bytes_.empty()) {
+          return 0;
+        }
+        uint8_t data = dmc_bytes_.front();
+        dmc_bytes_.pop_front();
+        return data;
+      }),
+      buffer_(kClockRate, kSampleRate, kBufferSamples),
+      samples_(kBufferSamples),
+      thread_(&Synthesizer::run, this) {
+  buffer_.clear(core_.synced(), core_.mix());
+}
+
+Synthesizer::~Synthesizer() {
+  done_.store(true, std::memory_order_release);
+  wake();
+  thread_.join();
+}
+
+void Synthesizer::write(uint16_t addr, uint8_t data, uint64_t clock) {
+  push({clock, addr, data, Event::kWrite});
+}
+
+void Synthesizer::read_status(uint64_t clock) {
+  push({clock, 0x4015, 0, Event::kReadStatus});
+}
+
+void Synthesizer::dmc_byte(uint8_t data) {
+  push({0, 0, data, Event::kDMCByte});
+}
+
+void Synthesizer::end_frame(uint64_t clock) {
+  push({clock, 0, 0, Event::kEndFrame});
+  wake();
+}
+
+void Synthesizer::reset(const Core& core) {
+  wake();
+  uint32_t replayed = replayed_.load(std::memory_order_acquire);
+  while (replayed != pushed_) {
+    replayed_.wait(replayed, std::memory_order_acquire);
+    replayed = replayed_.load(std::memory_order_acquire);
+  }
+  // The thread is idle until the next push publishes these
+  core_ = core;
+  dmc_bytes_.clear();
+  buffer_.clear(core_.synced(), core_.mix());
+}
+
+void Synthesizer::push(const Event& event) {
+  while (events_.push(std::span(&event, 1)) == 0) {
+    // Full: wait for the thread to make room
+    uint32_t replayed = replayed_.load(std::memory_order_acquire);
+    wake();
+    if (events_.size() == events_.capacity()) {
+      replayed_.wait(replayed, std::memory_order_acquire);
+    }
+  }
+  pushed_++;
+}
+
+void Synthesizer::wake() {
+  wakeups_.fetch_add(1, std::memory_order_release);
+  wakeups_.notify_one();
+}
+
+void Synthesizer::run() {
+  std::vector<Event> batch(kEventBatch);
+  while (true) {
+    uint32_t wakeups = wakeups_.load(std::memory_order_acquire);
+    std::size_t count = events_.pop(batch);
+    if (count > 0) {
+      for (const Event& event : std::span(batch).first(count)) {
+        replay(event);
+      }
+      replayed_.fetch_add(count, std::memory_order_release);
+      replayed_.notify_one();
+      continue;
+    }
+    if (done_.load(std::memory_order_acquire)) {
+      // Everything pushed before the destructor ran is visible now
+      if (events_.size() == 0) {
+        return;
+      }
+      continue;
+    }
+    wakeups_.wait(wakeups, std::memory_order_acquire);
+  }
+}
+
+void Synthesizer::replay(const Event& event) {
+  switch (event.kind) {
+    case Event::kWrite:
+      run_until(event.clock);
+      core_.write(event.addr, event.data, memory_);
+      break;
+    case Event::kReadStatus:
+      run_until(event.clock);
+      core_.acknowledge_frame_irq();
+      break;
+    case Event::kDMCByte:
+      // Taken when the DMC here gets to the same fetch
+      dmc_bytes_.push_back(event.data);
+      break;
+    case Event::kEndFrame:
+      run_until(event.clock);
+      flush();
+      break;
+  }
+}
+
+void Synthesizer::run_until(uint64_t clock) {
+  while (core_.synced() < clock) {
+    if (buffer_.clock_limit() <= core_.synced()) {
+      flush();
+    }
+    core_.run_until(std::min(clock, buffer_.clock_limit()), memory_,
+                    &buffer_);
+  }
+}
+
+void Synthesizer::flush() {
+  buffer_.end_frame(core_.synced());
+  std::size_t count = buffer_.read_samples(samples_);
+  output_.write(std::span(samples_).first(count));
+}
+
+}  // namespace apu
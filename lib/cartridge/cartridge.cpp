@@ -5,114 +5,159 @@
 #include <format>
 #include <fstream>
 #include <memory>
+#include <span>
 #include <vector>
 
 namespace cartridge {
 
-void assert_cart(bool cond) {
-  if (!cond) {
-    throw new cartridge_error("Failed to open cartridge");
-  }
-}
+Mapper::Mapper()
+    : cpu_banks_({}),
+      prg_ram_write_bank_(nullptr),
+      chr_banks_({}),
+      chr_write_banks_({}),
+      irq_line_(false),
+      mirroring_(Mirroring::kHorizontal),
+      ciram_(nullptr),
+      four_screen_ram_(),
+      nametable_banks_({}) {}
 
-class Mapper0 : public Mapper {
- public:
-  Mapper0() = delete;
-
-  Mapper0(std::vector<uint8_t> &&prg_rom, std::vector<uint8_t> &&chr_rom)
-      : prg_rom_(prg_rom), chr_rom_(chr_rom) {}
+const uint8_t *Mapper::prg_page(uint16_t addr) {
+  // Pages never straddle banks
+  const uint8_t *bank = cpu_bank(addr);
+  return bank == nullptr ? nullptr : bank + addr % kCPUBankSize;
+}
+uint8_t Mapper::chr_read(uint16_t addr) {
+  (void)addr;
+  return 0;
+}
+void Mapper::chr_write(uint16_t addr, uint8_t data) {
+  (void)addr;
+  (void)data;
+}
 
-  uint8_t prg_read(uint16_t addr) override {
-    switch (addr) {
-      case 0x00 ... 0x5FFF:
-        // bad range
-        throw new cartridge_error(
-            std::format("bad memory address for mapper: {}", addr));
-        break;
-      case 0x6000 ... 0x7FFF:
-        // unsupported feature of cartridge
-        break;
-      case 0x8000 ... 0xFFFF:
-        if (prg_rom_.size() == 16 * (1 << 10)) {
-          addr -= 0x4000;
-        }
-        return prg_rom_[addr - 0x8000];
-    }
-    return 0xAA;
-  };
-  void prg_write(uint16_t addr, uint8_t data) override {
-    switch (addr) {
-      case 0x00 ... 0x5FFF:
-        // bad range
-        throw new cartridge_error(
-            std::format("bad memory address for mapper: {}", addr));
-        break;
-      case 0x6000 ... 0x7FFF:
-        // unsupported feature of cartridge
-        break;
-      case 0x8000 ... 0xFFFF:
-        if (prg_rom_.size() == 16 * (1 << 10)) {
-          addr -= 0x4000;
-        }
-        prg_rom_[addr - 0x8000] = data;
-        break;
-    }
-  };
+bool Mapper::attach_save_file(const std::string &path) {
+  (void)path;
+  return false;
+}
 
- private:
-  std::vector<uint8_t> prg_rom_;
-  std::vector<uint8_t> chr_rom_;
-};
+void Mapper::save_state(savestate::StateWriter &out) const {
+  out.write(mirroring_);
+  out.write(irq_line_);
+  out.write(four_screen_ram_.size());
+  out.write_bytes(four_screen_ram_.data(), four_screen_ram_.size());
+}
 
-Cartridge::Cartridge(std::istream &in) {
-  uint8_t header[16];
-  if (!in.read(reinterpret_cast<char *>(header), 16)) {
-    throw std::runtime_error("failed to read header from iNES ROM");
+void Mapper::load_state(savestate::StateReader &in) {
+  Mirroring mirroring = in.read<Mirroring>();
+  if (mirroring > Mirroring::kFourScreen) {
+    throw savestate::savestate_error("save state is corrupt: bad mirroring");
   }
-
-  // "NES\n"
-  if (!(header[0] == 0x4E && header[1] == 0x45 && header[2] == 0x53 &&
-        header[3] == 0x1A)) {
-    throw std::runtime_error(
-        "cartridge input doesn't appear to be an iNES ROM");
+  irq_line_ = in.read<bool>();
+  set_mirroring(mirroring);
+  if (in.read<std::size_t>() != four_screen_ram_.size()) {
+    throw savestate::savestate_error(
+        "save state is corrupt: four-screen RAM size mismatch");
   }
+  in.read_bytes(four_screen_ram_.data(), four_screen_ram_.size());
+}
 
-  std::size_t prg_rom_size_ = 16 * (1 << 10) * header[4];
-  std::size_t chr_rom_size_ = 8 * (1 << 10) * header[5];
+void Mapper::attach_ciram(uint8_t *ciram) {
+  ciram_ = ciram;
+  set_mirroring(mirroring_);
+}
+const Mapper::nametable_banks_t &Mapper::nametable_banks() const {
+  return nametable_banks_;
+}
+Mirroring Mapper::mirroring() const { return mirroring_; }
 
-  bool has_trainer = (header[6] & 0b00000100) > 0;
-  if (has_trainer) {
-    char trainer[512];
-    in.read(trainer, 512);
-    // discard >:3
+void Mapper::set_mirroring(Mirroring mirroring) {
+  mirroring_ = mirroring;
+  if (ciram_ == nullptr) {
+    // Applied once CIRAM is attached
+    return;
   }
+  uint8_t *lower = ciram_;
+  uint8_t *upper = ciram_ + kNametableSize;
+  switch (mirroring) {
+    case Mirroring::kHorizontal:
+      nametable_banks_ = {lower, lower, upper, upper};
+      break;
+    case Mirroring::kVertical:
+      nametable_banks_ = {lower, upper, lower, upper};
+      break;
+    case Mirroring::kSingleScreenLower:
+      nametable_banks_ = {lower, lower, lower, lower};
+      break;
+    case Mirroring::kSingleScreenUpper:
+      nametable_banks_ = {upper, upper, upper, upper};
+      break;
+    case Mirroring::kFourScreen:
+      four_screen_ram_.resize(2 * kNametableSize);
+      nametable_banks_ = {lower, upper, four_screen_ram_.data(),
+                          four_screen_ram_.data() + kNametableSize};
+      break;
+  }
+}
 
-  std::vector<uint8_t> prg_rom(prg_rom_size_);
-  std::vector<uint8_t> chr_rom(chr_rom_size_);
+Cartridge::Cartridge(std::istream &in) : Cartridge(RomImage::read(in)) {}
 
-  if (!in.read(reinterpret_cast<char *>(prg_rom.data()), prg_rom.size())) {
-    throw std::runtime_error("failed to read PRG from iNES ROM");
+Cartridge::Cartridge(std::shared_ptr<const RomImage> image)
+    : mapper_(), base_(nullptr) {
+  std::span<const uint8_t> rom = image->bytes();
+  Header header = parse_header(rom);
+
+  if (rom.size() < header.prg_offset() + header.prg_rom_size) {
+    throw cartridge_error("failed to read PRG from iNES ROM");
   }
-  if (!in.read(reinterpret_cast<char *>(chr_rom.data()), chr_rom.size())) {
-    throw std::runtime_error("failed to read CHR from iNES ROM");
+  if (rom.size() < header.chr_offset() + header.chr_rom_size) {
+    throw cartridge_error("failed to read CHR from iNES ROM");
   }
-
-  uint8_t mapper_number = (header[6] >> 4) || (header[7] && 0xFF00);
-  switch (mapper_number) {
+  switch (header.mapper) {
     case 0:
-      mapper_ =
-          std::make_unique<Mapper0>(std::move(prg_rom), std::move(chr_rom));
+      base_ = &mapper_.emplace<NROM>(std::move(image), header);
+      break;
+    case 1:
+      base_ = &mapper_.emplace<MMC1>(std::move(image), header);
+      break;
+    case 2:
+      base_ = &mapper_.emplace<UxROM>(std::move(image), header);
+      break;
+    case 3:
+      base_ = &mapper_.emplace<CNROM>(std::move(image), header);
+      break;
+    case 4:
+      base_ = &mapper_.emplace<MMC3>(std::move(image), header);
       break;
     default:
-      throw new cartridge_error(
-          std::format("given mapper number is unsupported: {}", mapper_number));
+      throw cartridge_error(
+          std::format("given mapper number is unsupported: {}", header.mapper));
   }
 }
-Cartridge::Cartridge(std::unique_ptr<Mapper> mapper) { mapper_.swap(mapper); };
+Cartridge::Cartridge(std::unique_ptr<Mapper> mapper)
+    : mapper_(std::move(mapper)),
+      base_(std::get<std::unique_ptr<Mapper>>(mapper_).get()) {}
 Cartridge::~Cartridge() = default;
-uint8_t Cartridge::cpu_read(uint16_t addr) { return mapper_->prg_read(addr); };
-void Cartridge::cpu_write(uint16_t addr, uint8_t data) {
-  mapper_->prg_write(addr, data);
+const uint8_t *Cartridge::cpu_page(uint16_t addr) {
+  return dispatch([addr](auto &mapper) { return mapper.prg_page(addr); });
+};
+void Cartridge::attach_ciram(uint8_t *ciram) { base_->attach_ciram(ciram); };
+const Mapper::nametable_banks_t &Cartridge::nametable_banks() const {
+  return base_->nametable_banks();
+};
+const Mapper::chr_banks_t &Cartridge::chr_banks() const {
+  return base_->chr_banks();
 };
+Mirroring Cartridge::mirroring() const { return base_->mirroring(); };
+bool Cartridge::attach_save_file(const std::string &path) {
+  return base_->attach_save_file(path);
+}
+void Cartridge::save_state(savestate::StateWriter &out) {
+  out.begin_section("CART");
+  dispatch([&out](auto &mapper) { mapper.save_state(out); });
+}
+void Cartridge::load_state(savestate::StateReader &in) {
+  in.begin_section("CART");
+  dispatch([&in](auto &mapper) { mapper.load_state(in); });
+}
 
 }  // namespace cartridge
\ No newline at end of file
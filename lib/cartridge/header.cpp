@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <bit>
+#include <boost/crc.hpp>
+
+#include "cartridge.hpp"
+
+namespace cartridge {
+
+constexpr std::size_t kPRGUnit = 16 * (1 << 10);
+constexpr std::size_t kCHRUnit = 8 * (1 << 10);
+
+// NES 2.0 ROM size: either a count of units with 4 extra high bits, or (when
+// the high bits are all set) an exponent-multiplier pair 2^E * (M * 2 + 1)
+std::size_t nes2_rom_size(uint8_t lsb, uint8_t msb, std::size_t unit) {
+  if (msb == 0x0F) {
+    std::size_t exponent = lsb >> 2;
+    std::size_t multiplier = lsb & 0b11;
+    return (std::size_t{1} << exponent) * (multiplier * 2 + 1);
+  }
+  return ((std::size_t{msb} << 8) | lsb) * unit;
+}
+
+// NES 2.0 RAM size: 0 for none, otherwise 64 << shift bytes
+std::size_t nes2_ram_size(uint8_t shift) {
+  return shift == 0 ? 0 : std::size_t{64} << shift;
+}
+
+Header parse_header(std::span<const uint8_t> rom) {
+  if (rom.size() < Header::kSize) {
+    throw cartridge_error("failed to read header from iNES ROM");
+  }
+  const uint8_t *h = rom.data();
+
+  // "NES\n"
+  if (!(h[0] == 0x4E && h[1] == 0x45 && h[2] == 0x53 && h[3] == 0x1A)) {
+    throw cartridge_error("cartridge input doesn't appear to be an iNES ROM");
+  }
+
+  Header header;
+  // NES 2.0 sets bits 2-3 of byte 7 to 0b10
+  header.format = (h[7] & 0b1100) == 0b1000 ? Header::kNES2 : Header::kINES;
+
+  // Byte 6: bit 0 is set for vertical mirroring, bit 3 for four-screen VRAM
+  // (which overrides bit 0)
+  header.mirroring =
+      (h[6] & 0b0001) ? Mirroring::kVertical : Mirroring::kHorizontal;
+  if (h[6] & 0b1000) {
+    header.mirroring = Mirroring::kFourScreen;
+  }
+  header.has_battery = h[6] & 0b0010;
+  header.has_trainer = h[6] & 0b0100;
+
+  // Mapper number: low nibble in byte 6, high nibble in byte 7
+  header.mapper = (h[6] >> 4) | (h[7] & 0xF0);
+  header.submapper = 0;
+
+  if (header.format == Header::kNES2) {
+    header.mapper |= (h[8] & 0x0F) << 8;
+    header.submapper = h[8] >> 4;
+    header.prg_rom_size = nes2_rom_size(h[4], h[9] & 0x0F, kPRGUnit);
+    header.chr_rom_size = nes2_rom_size(h[5], h[9] >> 4, kCHRUnit);
+    header.prg_ram_size = nes2_ram_size(h[10] & 0x0F);
+    header.prg_nvram_size = nes2_ram_size(h[10] >> 4);
+    header.chr_ram_size = nes2_ram_size(h[11] & 0x0F);
+    header.chr_nvram_size = nes2_ram_size(h[11] >> 4);
+    return header;
+  }
+
+  // Old dumping tools wrote their name into bytes 7-15 (e.g. "DiskDude!"), in
+  // which case byte 7 isn't part of the mapper number
+  if (h[12] != 0 || h[13] != 0 || h[14] != 0 || h[15] != 0) {
+    header.mapper &= 0x0F;
+  }
+  header.prg_rom_size = h[4] * kPRGUnit;
+  header.chr_rom_size = h[5] * kCHRUnit;
+  // Byte 8 is PRG RAM in 8KB units, where 0 means 8KB for compatibility
+  std::size_t prg_ram = (h[8] == 0 ? 1 : h[8]) * 8 * (1 << 10);
+  header.prg_ram_size = header.has_battery ? 0 : prg_ram;
+  header.prg_nvram_size = header.has_battery ? prg_ram : 0;
+  // Boards without CHR ROM have 8KB of CHR RAM
+  header.chr_ram_size = header.chr_rom_size == 0 ? kCHRUnit : 0;
+  header.chr_nvram_size = 0;
+  return header;
+}
+
+std::size_t Header::prg_offset() const {
+  return kSize + (has_trainer ? kTrainerSize : 0);
+}
+std::size_t Header::chr_offset() const { return prg_offset() + prg_rom_size; }
+
+uint32_t crc32(std::span<const uint8_t> data) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data.data(), data.size());
+  return crc.checksum();
+}
+
+RomInfo describe_rom(std::span<const uint8_t> rom) {
+  RomInfo info;
+  info.header = parse_header(rom);
+  const Header &header = info.header;
+  if (rom.size() < header.prg_offset() + header.prg_rom_size) {
+    throw cartridge_error("failed to read PRG from iNES ROM");
+  }
+  if (rom.size() < header.chr_offset() + header.chr_rom_size) {
+    throw cartridge_error("failed to read CHR from iNES ROM");
+  }
+  auto prg = rom.subspan(header.prg_offset(), header.prg_rom_size);
+  auto chr = rom.subspan(header.chr_offset(), header.chr_rom_size);
+  info.prg_crc32 = crc32(prg);
+  info.chr_crc32 = crc32(chr);
+  info.prg_sha1 = sha1(prg);
+  info.chr_sha1 = sha1(chr);
+  return info;
+}
+
+// SHA-1 (FIPS 180-4). Only used to identify ROM dumps, not for security.
+RomInfo::sha1_t sha1(std::span<const uint8_t> data) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+
+  auto process_block = [&h](const uint8_t *block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      const uint8_t *word = block + i * 4;
+      w[i] = (uint32_t{word[0]} << 24) | (uint32_t{word[1]} << 16) |
+             (uint32_t{word[2]} << 8) | word[3];
+    }
+    for (int i = 16; i < 80; ++i) {
+      w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = std::rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = std::rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  };
+
+  std::size_t full_blocks = data.size() / 64;
+  for (std::size_t i = 0; i < full_blocks; ++i) {
+    process_block(data.data() + i * 64);
+  }
+
+  // Padding: a 1 bit, zeros, then the message length in bits (big endian)
+  uint8_t tail[128] = {};
+  std::size_t rest = data.size() % 64;
+  std::copy_n(data.data() + full_blocks * 64, rest, tail);
+  tail[rest] = 0x80;
+  std::size_t tail_size = rest < 56 ? 64 : 128;
+  uint64_t bits = uint64_t{data.size()} * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[tail_size - 1 - i] = bits >> (i * 8);
+  }
+  for (std::size_t offset = 0; offset < tail_size; offset += 64) {
+    process_block(tail + offset);
+  }
+
+  RomInfo::sha1_t digest;
+  for (int i = 0; i < 5; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      digest[i * 4 + j] = h[i] >> (24 - j * 8);
+    }
+  }
+  return digest;
+}
+
+}  // namespace cartridge
@@ -0,0 +1,219 @@
+#include "cartridge.hpp"
+
+namespace cartridge {
+
+NROM::NROM(std::shared_ptr<const RomImage> image, const Header &header)
+    : BankedMapper(std::move(image), header) {
+  map_prg(0x8000, 0x8000, 0);
+  map_chr(0x0000, 0x2000, 0);
+}
+
+MMC1::MMC1(std::shared_ptr<const RomImage> image, const Header &header)
+    : BankedMapper(std::move(image), header),
+      shift_(kShiftReset),
+      control_(0x0C),
+      chr0_(0),
+      chr1_(0),
+      prg_(0) {
+  update_banks();
+}
+
+void MMC1::write_register(uint16_t addr, uint8_t data) {
+  if (data & 0x80) {
+    // Reset: clear the shift register and fix the last PRG bank at $C000
+    shift_ = kShiftReset;
+    control_ |= 0x0C;
+    update_banks();
+    return;
+  }
+  // 5 writes shift in one bit each, LSB first. The initial 1 bit marks when
+  // the register is full.
+  bool full = shift_ & 1;
+  shift_ = (shift_ >> 1) | ((data & 1) << 4);
+  if (!full) {
+    return;
+  }
+  switch ((addr >> 13) & 0b11) {
+    case 0:  // $8000-$9FFF
+      control_ = shift_;
+      break;
+    case 1:  // $A000-$BFFF
+      chr0_ = shift_;
+      break;
+    case 2:  // $C000-$DFFF
+      chr1_ = shift_;
+      break;
+    case 3:  // $E000-$FFFF
+      prg_ = shift_;
+      break;
+  }
+  shift_ = kShiftReset;
+  update_banks();
+}
+
+void MMC1::save_registers(savestate::StateWriter &out) const {
+  out.write(shift_);
+  out.write(control_);
+  out.write(chr0_);
+  out.write(chr1_);
+  out.write(prg_);
+}
+
+void MMC1::load_registers(savestate::StateReader &in) {
+  in.read(shift_);
+  in.read(control_);
+  in.read(chr0_);
+  in.read(chr1_);
+  in.read(prg_);
+}
+
+void MMC1::update_banks() {
+  switch (control_ & 0b11) {
+    case 0:
+      set_mirroring(Mirroring::kSingleScreenLower);
+      break;
+    case 1:
+      set_mirroring(Mirroring::kSingleScreenUpper);
+      break;
+    case 2:
+      set_mirroring(Mirroring::kVertical);
+      break;
+    case 3:
+      set_mirroring(Mirroring::kHorizontal);
+      break;
+  }
+
+  // 512KB boards (SUROM) use CHR bank bit 4 to select the 256KB PRG half
+  int outer = prg_rom_size() > 0x40000 ? (chr0_ & 0x10) : 0;
+  int bank = outer | (prg_ & 0x0F);
+  switch ((control_ >> 2) & 0b11) {
+    case 0:
+    case 1:  // 32KB, low bit ignored
+      map_prg(0x8000, 0x8000, bank >> 1);
+      break;
+    case 2:  // first bank fixed at $8000, switch $C000
+      map_prg(0x8000, 0x4000, outer);
+      map_prg(0xC000, 0x4000, bank);
+      break;
+    case 3:  // switch $8000, last bank fixed at $C000
+      map_prg(0x8000, 0x4000, bank);
+      map_prg(0xC000, 0x4000, outer | 0x0F);
+      break;
+  }
+
+  if (control_ & 0x10) {
+    // Two separate 4KB banks
+    map_chr(0x0000, 0x1000, chr0_);
+    map_chr(0x1000, 0x1000, chr1_);
+  } else {
+    // 8KB, low bit ignored
+    map_chr(0x0000, 0x2000, chr0_ >> 1);
+  }
+
+  // PRG bank bit 4 disables PRG RAM
+  bool ram_enabled = !(prg_ & 0x10);
+  map_prg_ram(ram_enabled, ram_enabled);
+}
+
+UxROM::UxROM(std::shared_ptr<const RomImage> image, const Header &header)
+    : BankedMapper(std::move(image), header) {
+  map_prg(0x8000, 0x4000, 0);
+  map_prg(0xC000, 0x4000, -1);
+  map_chr(0x0000, 0x2000, 0);
+}
+
+CNROM::CNROM(std::shared_ptr<const RomImage> image, const Header &header)
+    : BankedMapper(std::move(image), header) {
+  map_prg(0x8000, 0x8000, 0);
+  map_chr(0x0000, 0x2000, 0);
+}
+
+MMC3::MMC3(std::shared_ptr<const RomImage> image, const Header &header)
+    : BankedMapper(std::move(image), header),
+      bank_select_(0),
+      registers_({0, 2, 4, 5, 6, 7, 0, 1}),
+      irq_latch_(0),
+      irq_counter_(0),
+      irq_reload_(false),
+      irq_enabled_(false) {
+  update_banks();
+}
+
+void MMC3::write_register(uint16_t addr, uint8_t data) {
+  // Registers are selected by the address range and whether it is even
+  switch (addr & 0xE001) {
+    case 0x8000:  // Bank select
+      bank_select_ = data;
+      update_banks();
+      break;
+    case 0x8001:  // Bank data
+      registers_[bank_select_ & 0b111] = data;
+      update_banks();
+      break;
+    case 0xA000:  // Mirroring (hardwired on four-screen boards)
+      if (mirroring() != Mirroring::kFourScreen) {
+        set_mirroring((data & 1) ? Mirroring::kHorizontal
+                                 : Mirroring::kVertical);
+      }
+      break;
+    case 0xA001: {  // PRG RAM protect
+      bool enabled = data & 0x80;
+      bool write_protected = data & 0x40;
+      map_prg_ram(enabled, enabled && !write_protected);
+      break;
+    }
+    case 0xC000:  // IRQ latch
+      irq_latch_ = data;
+      break;
+    case 0xC001:  // IRQ reload
+      irq_counter_ = 0;
+      irq_reload_ = true;
+      break;
+    case 0xE000:  // IRQ disable, also acknowledges a pending IRQ
+      irq_enabled_ = false;
+      irq_line_ = false;
+      break;
+    case 0xE001:  // IRQ enable
+      irq_enabled_ = true;
+      break;
+  }
+}
+
+void MMC3::save_registers(savestate::StateWriter &out) const {
+  out.write(bank_select_);
+  out.write(registers_);
+  out.write(irq_latch_);
+  out.write(irq_counter_);
+  out.write(irq_reload_);
+  out.write(irq_enabled_);
+}
+
+void MMC3::load_registers(savestate::StateReader &in) {
+  in.read(bank_select_);
+  in.read(registers_);
+  in.read(irq_latch_);
+  in.read(irq_counter_);
+  in.read(irq_reload_);
+  in.read(irq_enabled_);
+}
+
+void MMC3::update_banks() {
+  // PRG: R6 and R7 are switchable, the second to last bank is fixed at $8000
+  // or $C000 depending on bit 6, and the last bank is fixed at $E000
+  bool prg_swap = bank_select_ & 0x40;
+  map_prg(prg_swap ? 0xC000 : 0x8000, 0x2000, registers_[6]);
+  map_prg(0xA000, 0x2000, registers_[7]);
+  map_prg(prg_swap ? 0x8000 : 0xC000, 0x2000, -2);
+  map_prg(0xE000, 0x2000, -1);
+
+  // CHR: two 2KB banks (R0, R1) and four 1KB banks (R2-R5), with the halves
+  // of the pattern table swapped when bit 7 is set
+  uint16_t inversion = (bank_select_ & 0x80) ? 0x1000 : 0x0000;
+  map_chr(0x0000 ^ inversion, 0x0800, registers_[0] >> 1);
+  map_chr(0x0800 ^ inversion, 0x0800, registers_[1] >> 1);
+  for (int i = 0; i < 4; i++) {
+    map_chr((0x1000 + i * 0x0400) ^ inversion, 0x0400, registers_[2 + i]);
+  }
+}
+
+}  // namespace cartridge
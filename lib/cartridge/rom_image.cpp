@@ -0,0 +1,188 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+
+#include "cartridge.hpp"
+#include "util.hpp"
+
+namespace cartridge {
+
+struct RomImage::Private {};
+
+namespace {
+
+// A file is assumed unchanged if it has the same identity, size and mtime
+using file_key_t = std::tuple<std::string, dev_t, ino_t, off_t, int64_t>;
+
+// Process-wide cache. Images are held weakly: the cache never keeps a ROM
+// alive on its own.
+struct Cache {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::weak_ptr<const RomImage>> by_hash;
+  std::map<file_key_t, std::weak_ptr<const RomImage>> by_file;
+};
+
+Cache &cache() {
+  static Cache instance;
+  return instance;
+}
+
+// Return the live cached image with the same content as (data, size), if any.
+// Must be called with the cache locked.
+std::shared_ptr<const RomImage> find_content(Cache &c, uint64_t hash,
+                                             const uint8_t *data,
+                                             std::size_t size) {
+  auto it = c.by_hash.find(hash);
+  if (it == c.by_hash.end()) {
+    return nullptr;
+  }
+  std::shared_ptr<const RomImage> image = it->second.lock();
+  if (image == nullptr) {
+    c.by_hash.erase(it);
+    return nullptr;
+  }
+  auto bytes = image->bytes();
+  if (bytes.size() != size || std::memcmp(bytes.data(), data, size) != 0) {
+    // Hash collision: don't share
+    return nullptr;
+  }
+  return image;
+}
+
+// Forget the images that have been destroyed. Lookups only drop the entries
+// they find expired, so without this a session loading many ROMs (e.g. an
+// index run) would keep one entry per ROM. Must be called with the cache
+// locked.
+void prune(Cache &c) {
+  std::erase_if(c.by_hash, [](const auto &entry) {
+    return entry.second.expired();
+  });
+  std::erase_if(c.by_file, [](const auto &entry) {
+    return entry.second.expired();
+  });
+}
+
+}  // namespace
+
+RomImage::RomImage(Private, const uint8_t *data, std::size_t size,
+                   bool mapped, std::vector<uint8_t> &&owned)
+    : data_(data),
+      size_(size),
+      // Collisions are harmless: a cache hit is only used after comparing the
+      // bytes
+      hash_(util::hash_bytes({data, size})),
+      mapped_(mapped),
+      owned_(std::move(owned)) {}
+
+RomImage::~RomImage() {
+  if (mapped_) {
+    munmap(const_cast<uint8_t *>(data_), size_);
+  }
+}
+
+std::span<const uint8_t> RomImage::bytes() const { return {data_, size_}; }
+uint64_t RomImage::hash() const { return hash_; }
+
+std::shared_ptr<const RomImage> RomImage::load(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw cartridge_error(
+        std::format("could not open ROM '{}': {}", path, std::strerror(errno)));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    throw cartridge_error(
+        std::format("could not stat ROM '{}': {}", path, std::strerror(err)));
+  }
+
+  Cache &c = cache();
+  file_key_t key{path, st.st_dev, st.st_ino, st.st_size,
+                 static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 +
+                     st.st_mtim.tv_nsec};
+  {
+    std::lock_guard<std::mutex> lock(c.mutex);
+    auto it = c.by_file.find(key);
+    if (it != c.by_file.end()) {
+      if (auto image = it->second.lock()) {
+        close(fd);
+        return image;
+      }
+      c.by_file.erase(it);
+    }
+  }
+
+  std::size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    throw cartridge_error(std::format("ROM '{}' is empty", path));
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  // The mapping stays valid after the file is closed
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw cartridge_error(
+        std::format("could not map ROM '{}': {}", path, std::strerror(err)));
+  }
+
+  auto image = std::make_shared<const RomImage>(
+      Private{}, static_cast<const uint8_t *>(data), size, true,
+      std::vector<uint8_t>());
+
+  std::lock_guard<std::mutex> lock(c.mutex);
+  prune(c);
+  if (auto existing = find_content(c, image->hash(), image->data_, size)) {
+    // Same ROM under another path (or a copy): share the existing mapping and
+    // drop ours
+    image = existing;
+  } else {
+    c.by_hash[image->hash()] = image;
+  }
+  c.by_file[key] = image;
+  BOOST_LOG_TRIVIAL(debug) << std::format("Loaded ROM image {:016x} ({} bytes)",
+                                          image->hash(), size);
+  return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::read(std::istream &in) {
+  std::vector<uint8_t> owned{std::istreambuf_iterator<char>(in),
+                             std::istreambuf_iterator<char>()};
+  const uint8_t *data = owned.data();
+  std::size_t size = owned.size();
+  auto image = std::make_shared<const RomImage>(Private{}, data, size, false,
+                                                std::move(owned));
+
+  Cache &c = cache();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  prune(c);
+  if (auto existing = find_content(c, image->hash(), data, size)) {
+    return existing;
+  }
+  c.by_hash[image->hash()] = image;
+  return image;
+}
+
+std::size_t RomImage::cached_images() {
+  Cache &c = cache();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  std::size_t live = 0;
+  for (const auto &[hash, image] : c.by_hash) {
+    live += !image.expired();
+  }
+  return live;
+}
+
+}  // namespace cartridge
@@ -0,0 +1,80 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+
+#include "cartridge.hpp"
+
+namespace cartridge {
+
+SaveFile::SaveFile(const std::string &path, std::size_t size)
+    : path_(path), data_(nullptr), size_(size), stopping_(false) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw cartridge_error(std::format("could not open save file '{}': {}",
+                                      path, std::strerror(errno)));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (static_cast<std::size_t>(st.st_size) < size &&
+       ftruncate(fd, size) != 0)) {
+    int err = errno;
+    close(fd);
+    throw cartridge_error(std::format("could not size save file '{}': {}",
+                                      path, std::strerror(err)));
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = errno;
+  // The mapping stays valid after the file is closed
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw cartridge_error(std::format("could not map save file '{}': {}", path,
+                                      std::strerror(err)));
+  }
+  data_ = static_cast<uint8_t *>(data);
+  flusher_ = std::thread(&SaveFile::flush_loop, this);
+  BOOST_LOG_TRIVIAL(info) << std::format("Using save file '{}' ({} bytes)",
+                                         path, size);
+}
+
+SaveFile::~SaveFile() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stop_cv_.notify_one();
+  flusher_.join();
+  flush();
+  munmap(data_, size_);
+}
+
+uint8_t *SaveFile::data() const { return data_; }
+std::size_t SaveFile::size() const { return size_; }
+
+void SaveFile::flush() {
+  // Only pages the game has written since the last flush are written back
+  if (msync(data_, size_, MS_SYNC) != 0) {
+    BOOST_LOG_TRIVIAL(error) << std::format(
+        "Failed to write save file '{}': {}", path_, std::strerror(errno));
+  }
+}
+
+void SaveFile::flush_loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto stopping = [this] { return stopping_; };
+  while (!stop_cv_.wait_for(lock, kFlushInterval, stopping)) {
+    flush();
+  }
+}
+
+std::string save_file_path(const std::string &rom_path) {
+  return std::filesystem::path(rom_path).replace_extension(".sav").string();
+}
+
+}  // namespace cartridge
@@ -1,71 +1,58 @@
 #include "controller.hpp"
 
-#include <GLFW/glfw3.h>
-
-#include <boost/log/trivial.hpp>
-#include <format>
-
-#include "util.hpp"
-
-struct Input {
-  bool A;
-  bool B;
-  bool Select;
-  bool Start;
-  bool Up;
-  bool Down;
-  bool Left;
-  bool Right;
-};
-
 namespace controller {
-Controller::Controller(GLFWwindow& window) : window_(window) {}
+Controller::Controller(InputSource& source)
+    : source_(source),
+      joy1_register_(0),
+      strobe_(false),
+      frame_input_(0),
+      frame_sampled_(false) {}
 Controller::~Controller() = default;
 
 void Controller::write_strobe(uint8_t value) {
   bool new_strobe = value & 0x01;
   // transition strobe from high to low
   if (strobe_ && !new_strobe) {
-    Input input;
-    input.A = glfwGetKey(&window_, GLFW_KEY_X) == GLFW_PRESS;
-    input.B = glfwGetKey(&window_, GLFW_KEY_Z) == GLFW_PRESS;
-    input.Select = glfwGetKey(&window_, GLFW_KEY_A) == GLFW_PRESS;
-    input.Start = glfwGetKey(&window_, GLFW_KEY_S) == GLFW_PRESS;
-    input.Up = glfwGetKey(&window_, GLFW_KEY_UP) == GLFW_PRESS;
-    input.Down = glfwGetKey(&window_, GLFW_KEY_DOWN) == GLFW_PRESS;
-    input.Left = glfwGetKey(&window_, GLFW_KEY_LEFT) == GLFW_PRESS;
-    input.Right = glfwGetKey(&window_, GLFW_KEY_RIGHT) == GLFW_PRESS;
-
-    joy1_register_ = input.A |              //
-                     (input.B << 1) |       //
-                     (input.Select << 2) |  //
-                     (input.Start << 3) |   //
-                     (input.Up << 4) |      //
-                     (input.Down << 5) |    //
-                     (input.Left << 6) |    //
-                     (input.Right << 7);
-
-    BOOST_LOG_TRIVIAL(debug)
-        << "polling controller with input: "
-        << std::format(
-               "A: {}, B: {}, Select: {}, "
-               "Start: {}, Up: {}, Down: {}, "
-               "Left: {}, Right: {}",
-               input.A, input.B, input.Select, input.Start, input.Up,
-               input.Down, input.Left, input.Right);
+    joy1_register_ = frame_input();
   }
-
-  BOOST_LOG_TRIVIAL(debug) << "~~~ write_strobe: val " << util::fmt_hex(value);
   strobe_ = new_strobe;
 };
 
 uint8_t Controller::read_joy1() {
   uint8_t bit = joy1_register_ & 0x01;
   joy1_register_ >>= 1;
-
-  BOOST_LOG_TRIVIAL(debug) << "~~~ read_joy1: bit is " << util::fmt_hex(bit);
-
   return bit;
 };
 
-}  // namespace controller
\ No newline at end of file
+uint8_t Controller::peek_joy1() const { return joy1_register_ & 0x01; }
+
+void Controller::end_frame() {
+  frame_input();
+  frame_sampled_ = false;
+}
+
+uint8_t Controller::frame_input() {
+  if (!frame_sampled_) {
+    frame_input_ = source_.next_frame();
+    frame_sampled_ = true;
+  }
+  return frame_input_;
+}
+
+void Controller::save_state(savestate::StateWriter& out) const {
+  out.begin_section("CTRL");
+  out.write(joy1_register_);
+  out.write(strobe_);
+  out.write(frame_input_);
+  out.write(frame_sampled_);
+}
+
+void Controller::load_state(savestate::StateReader& in) {
+  in.begin_section("CTRL");
+  in.read(joy1_register_);
+  in.read(strobe_);
+  in.read(frame_input_);
+  in.read(frame_sampled_);
+}
+
+}  // namespace controller
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iterator>
+
+#include "controller.hpp"
+
+namespace controller {
+
+namespace {
+
+// "NESM", at the start of every movie
+constexpr uint32_t kMovieMagic = 0x4D53454E;
+constexpr uint32_t kMovieVersion = 1;
+
+struct MovieHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t rom_hash;
+};
+static_assert(sizeof(MovieHeader) == 16);
+
+}  // namespace
+
+KeyboardInput::KeyboardInput(GLFWwindow& window)
+    : window_(window), buttons_(0) {
+  glfwSetWindowUserPointer(&window_, this);
+  glfwSetKeyCallback(&window_, [](GLFWwindow* window, int key, int scancode,
+                                  int action, int mods) {
+    (void)scancode;
+    (void)mods;
+    static_cast<KeyboardInput*>(glfwGetWindowUserPointer(window))
+        ->key_event(key, action);
+  });
+}
+
+KeyboardInput::~KeyboardInput() {
+  glfwSetKeyCallback(&window_, nullptr);
+  glfwSetWindowUserPointer(&window_, nullptr);
+}
+
+uint8_t KeyboardInput::next_frame() {
+  return buttons_.load(std::memory_order_relaxed);
+}
+
+void KeyboardInput::key_event(int key, int action) {
+  uint8_t button;
+  switch (key) {
+    case GLFW_KEY_X:
+      button = kButtonA;
+      break;
+    case GLFW_KEY_Z:
+      button = kButtonB;
+      break;
+    case GLFW_KEY_A:
+      button = kButtonSelect;
+      break;
+    case GLFW_KEY_S:
+      button = kButtonStart;
+      break;
+    case GLFW_KEY_UP:
+      button = kButtonUp;
+      break;
+    case GLFW_KEY_DOWN:
+      button = kButtonDown;
+      break;
+    case GLFW_KEY_LEFT:
+      button = kButtonLeft;
+      break;
+    case GLFW_KEY_RIGHT:
+      button = kButtonRight;
+      break;
+    default:
+      return;
+  }
+  if (action == GLFW_PRESS) {
+    buttons_.fetch_or(button, std::memory_order_relaxed);
+  } else if (action == GLFW_RELEASE) {
+    buttons_.fetch_and(~button, std::memory_order_relaxed);
+  }
+}
+
+MoviePlayer::MoviePlayer(const std::string& path, uint64_t rom_hash)
+    : frames_(), position_(0) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw input_error(std::format("could not open movie '{}': {}", path,
+                                  std::strerror(errno)));
+  }
+  MovieHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      header.magic != kMovieMagic) {
+    throw input_error(std::format("'{}' is not a movie", path));
+  }
+  if (header.version != kMovieVersion) {
+    throw input_error(std::format("movie '{}' has unsupported version {}",
+                                  path, header.version));
+  }
+  if (header.rom_hash != rom_hash) {
+    throw input_error(
+        std::format("movie '{}' was recorded on a different ROM", path));
+  }
+  frames_.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  BOOST_LOG_TRIVIAL(info) << "Playing movie of " << frames_.size()
+                          << " frames";
+}
+
+uint8_t MoviePlayer::next_frame() {
+  if (position_ == frames_.size()) {
+    return 0;
+  }
+  return frames_[position_++];
+}
+
+std::size_t MoviePlayer::frames() const { return frames_.size(); }
+std::size_t MoviePlayer::position() const { return position_; }
+bool MoviePlayer::finished() const { return position_ == frames_.size(); }
+
+MovieRecorder::MovieRecorder(InputSource& source, const std::string& path,
+                             uint64_t rom_hash)
+    : source_(source), out_(std::fopen(path.c_str(), "wb")), frames_(0) {
+  if (out_ == nullptr) {
+    throw input_error(std::format("could not open movie '{}': {}", path,
+                                  std::strerror(errno)));
+  }
+  MovieHeader header{kMovieMagic, kMovieVersion, rom_hash};
+  std::fwrite(&header, sizeof(header), 1, out_);
+}
+
+MovieRecorder::~MovieRecorder() {
+  std::fclose(out_);
+  BOOST_LOG_TRIVIAL(info) << "Movie closed: " << frames_ << " frames recorded";
+}
+
+uint8_t MovieRecorder::next_frame() {
+  uint8_t input = source_.next_frame();
+  std::fputc(input, out_);
+  frames_++;
+  return input;
+}
+
+std::size_t MovieRecorder::frames() const { return frames_; }
+
+InputLog::InputLog(InputSource& source)
+    : source_(source), frames_(), position_(0) {}
+
+uint8_t InputLog::next_frame() {
+  if (position_ == frames_.size()) {
+    frames_.push_back(source_.next_frame());
+  }
+  return frames_[position_++];
+}
+
+std::size_t InputLog::position() const { return position_; }
+
+void InputLog::seek(std::size_t position) {
+  position_ = std::min(position, frames_.size());
+}
+
+void InputLog::truncate() { frames_.resize(position_); }
+
+std::size_t InputLog::frames() const { return frames_.size(); }
+
+}  // namespace controller
@@ -475,39 +475,120 @@ void CPU::advance_instruction() {
 }
 
 void CPU::advance_frame() {
-  if (ppu_.has_value()) {
-    BOOST_LOG_TRIVIAL(debug) << "Rendering frame";
-    // Render a frame using the current cpu data
-    ppu_->get().render_to_window();
+  if (!ppu_.has_value()) {
+    // Want to advance the cycles regardless of if ppu attached
+    advance_cycles(kRenderCycles);
+    advance_cycles(kVBlankCycles);
+    end_frame();
+    return;
   }
 
-  // Want to advance the cycles regardless of if ppu attached
-  advance_cycles(kRenderCycles);
+  BOOST_LOG_TRIVIAL(debug) << "Rendering frame";
+  PPU& ppu = ppu_->get();
+  ppu.begin_frame();
+
+  // Interleave the CPU and PPU one scanline at a time, so that mid-frame
+  // register writes and sprite 0 hit polling see the right state. Line 0 is
+  // the pre-render line.
+  std::size_t cycles_done = 0;
+  for (int line = 0; line < kNumVisibleScanlines; ++line) {
+    if (line > 0) {
+      ppu.render_scanline(line - 1);
+    }
+    auto line_end =
+        static_cast<std::size_t>(kCPUCyclesPerScanline * (line + 1));
+    advance_cycles(line_end - cycles_done);
+    cycles_done = line_end;
+  }
+  ppu.end_frame();
 
-  if (ppu_.has_value() && ppu_->get().is_nmi_enabled()) {
+  if (ppu.is_nmi_enabled()) {
     trigger_nmi();
   }
 
   advance_cycles(kVBlankCycles);
+  end_frame();
+}
+
+void CPU::end_frame() {
+  if (controller_) {
+    controller_->get().end_frame();
+  }
+  if (apu_) {
+    apu_->get().end_frame(total_cycles_);
+  }
 }
 
 void CPU::cycle() {
+  total_cycles_++;
+  if (stall_cycles_ > 0) {
+    stall_cycles_--;
+    return;
+  }
   if (cycles_todo_ == 1) {
     execute(read(PC_));
   } else if (cycles_todo_ == 0) {
-    cycles_todo_ = cycle_count(read(PC_));
+    bool irq = cart_.irq();
+    if (apu_) {
+      // Only runs the APU when one of its events is due
+      APU& apu = apu_->get();
+      apu.sync(total_cycles_);
+      irq |= apu.irq();
+    }
+    if (irq && !get_interrupt_disable()) {
+      // The IRQ line is level triggered: it stays asserted until the mapper
+      // or APU is acknowledged, so it is simply sampled between instructions
+      trigger_irq();
+      // The interrupt sequence takes 7 cycles, this is the first
+      stall_cycles_ += 6;
+      return;
+    }
+    uint8_t opcode = read(PC_);
+    if (profiler_ != nullptr) {
+      profiler_->on_instruction(PC_, opcode, SP_, total_cycles_);
+    }
+    cycles_todo_ = cycle_count(opcode);
   }
   cycles_todo_--;
 }
 
+void CPU::set_profiler(profiler::Profiler* profiler) {
+  profiler_ = profiler;
+  if (profiler_ != nullptr) {
+    profiler_->resume();
+  }
+}
+
 void CPU::trigger_nmi() {
   // Program finishes current instruction before the interrupt happens
   if (cycles_todo_ > 1) {
     advance_cycles(cycles_todo_ - 1);
   }
+  uint16_t return_pc = PC_;
+  uint8_t sp = SP_;
   push_stack16(PC_);
   push_stack(P_);
   PC_ = read16(0xFFFA);
+  if (profiler_ != nullptr) {
+    profiler_->on_interrupt(return_pc, PC_, sp, total_cycles_);
+  }
+}
+
+void CPU::trigger_irq() {
+  // Program finishes current instruction before the interrupt happens
+  if (cycles_todo_ > 1) {
+    advance_cycles(cycles_todo_ - 1);
+  }
+  uint16_t return_pc = PC_;
+  uint8_t sp = SP_;
+  push_stack16(PC_);
+  // The B flag is only set in the copy of P pushed by BRK
+  push_stack((P_ & ~0b0001'0000) | 0b0010'0000);
+  set_interrupt_disable(true);
+  PC_ = read16(0xFFFE);
+  if (profiler_ != nullptr) {
+    profiler_->on_interrupt(return_pc, PC_, sp, total_cycles_);
+  }
 }
 
 bool CPU::get_carry() { return (P_ & 0x1) > 0; }
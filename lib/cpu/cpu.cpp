@@ -1,16 +1,16 @@
 #include "cpu.hpp"
 
 #include <boost/log/trivial.hpp>
-#include <chrono>
-#include <thread>
 
 namespace cpu {
 
 CPU::CPU(CPU::Cartridge& cartridge,
          std::optional<std::reference_wrapper<CPU::PPU>> ppu,
-         std::optional<std::reference_wrapper<CPU::Controller>> controller)
+         std::optional<std::reference_wrapper<CPU::Controller>> controller,
+         std::optional<std::reference_wrapper<CPU::APU>> apu)
     : ppu_(ppu),
       controller_(controller),
+      apu_(apu),
       cart_(cartridge),
       PC_(0),
       SP_(0xFD),
@@ -19,7 +19,12 @@ CPU::CPU(CPU::Cartridge& cartridge,
       Y_(0),
       P_(0x34),
       cycles_todo_(0),
-      ram_({}) {
+      stall_cycles_(0),
+      total_cycles_(0),
+      ram_({}),
+      watcher_(nullptr),
+      watch_pages_({}),
+      profiler_(nullptr) {
   // read reset vector to get entry point
   PC_ = read(0xFFFC) | (read(0xFFFD) << 8);
 };
@@ -31,6 +36,90 @@ uint8_t CPU::X() const { return X_; }
 uint8_t CPU::Y() const { return Y_; }
 uint8_t CPU::P() const { return P_; }
 
+std::size_t CPU::save_state(std::span<uint8_t> out) {
+  savestate::StateWriter writer(out);
+  save_state(writer);
+  return writer.size();
+}
+
+std::size_t CPU::state_size() {
+  savestate::StateWriter counter;
+  save_state(counter);
+  return counter.size();
+}
+
+void CPU::load_state(std::span<const uint8_t> in) {
+  savestate::StateReader reader(in);
+  load_state(reader);
+}
+
+void CPU::save_state(savestate::StateWriter& out) {
+  out.write(savestate::kMagic);
+  out.write(savestate::kVersion);
+  out.write(ppu_.has_value());
+  out.write(controller_.has_value());
+  out.write(apu_.has_value());
+
+  cart_.save_state(out);
+  out.begin_section("CPU ");
+  out.write(PC_);
+  out.write(SP_);
+  out.write(A_);
+  out.write(X_);
+  out.write(Y_);
+  out.write(P_);
+  out.write(cycles_todo_);
+  out.write(stall_cycles_);
+  out.write(total_cycles_);
+  out.write(ram_);
+  if (ppu_) {
+    ppu_->get().save_state(out);
+  }
+  if (controller_) {
+    controller_->get().save_state(out);
+  }
+  if (apu_) {
+    apu_->get().save_state(out);
+  }
+}
+
+void CPU::load_state(savestate::StateReader& in) {
+  if (in.read<uint32_t>() != savestate::kMagic) {
+    throw savestate::savestate_error("not a save state");
+  }
+  if (in.read<uint32_t>() != savestate::kVersion) {
+    throw savestate::savestate_error("save state is from another version");
+  }
+  if (in.read<bool>() != ppu_.has_value() ||
+      in.read<bool>() != controller_.has_value() ||
+      in.read<bool>() != apu_.has_value()) {
+    throw savestate::savestate_error(
+        "save state is from a machine with different components");
+  }
+
+  cart_.load_state(in);
+  in.begin_section("CPU ");
+  in.read(PC_);
+  in.read(SP_);
+  in.read(A_);
+  in.read(X_);
+  in.read(Y_);
+  in.read(P_);
+  in.read(cycles_todo_);
+  in.read(stall_cycles_);
+  in.read(total_cycles_);
+  in.read(ram_);
+  if (ppu_) {
+    ppu_->get().load_state(in);
+  }
+  if (controller_) {
+    controller_->get().load_state(in);
+  }
+  if (apu_) {
+    apu_->get().load_state(in);
+  }
+}
+
 void CPU::push_stack(uint8_t value) {
   if (SP_ == 0x00) {
     BOOST_LOG_TRIVIAL(fatal) << "Stack overflow detected\n";
@@ -67,18 +156,23 @@ uint16_t CPU::pop_stack16() {
 uint8_t CPU::peek_stack() { return read(0x0100 | (SP_ + 1)); }
 uint16_t CPU::peek_stack16() { return read16(0x0100 | (SP_ + 1)); }
 
-void CPU::begin_cpu_loop() {
+void CPU::begin_cpu_loop(std::function<void()> run_frame,
+                         pacing::Pacer* pacer) {
+  if (!run_frame) {
+    run_frame = [this]() { advance_frame(); };
+  }
+  std::optional<pacing::Pacer> default_pacer;
+  if (pacer == nullptr) {
+    pacer = &default_pacer.emplace(kFramerate);
+  }
   advance_cycles(kCyclesPerFrame);
 
-  while (1) {
-    // Each loop is one frame. Calculate how long the frame should take
-    const time_point frame_start = std::chrono::steady_clock::now();
-    const time_point frame_deadline = frame_start + kTimePerFrameMillis;
+  while (!pacer->stopped()) {
+    // Each loop is one frame, started when the pacer says it is due
+    pacer->wait();
 
     // Do all logic: CPU, PPU, etc.
-    advance_frame();
-
-    std::this_thread::sleep_until(frame_deadline);
+    run_frame();
   }
 }
 
@@ -4,6 +4,34 @@
 
 namespace cpu {
 uint8_t CPU::read(uint16_t addr) {
+  if (watch_pages_[addr >> 8] & kWatchRead) [[unlikely]] {
+    uint8_t value = read_bus(addr);
+    watcher_->on_read(addr, value);
+    return value;
+  }
+  return read_bus(addr);
+}
+
+bool CPU::write(uint16_t addr, uint8_t data) {
+  bool written = write_bus(addr, data);
+  if (watch_pages_[addr >> 8] & kWatchWrite) [[unlikely]] {
+    watcher_->on_write(addr, data);
+  }
+  return written;
+}
+
+void CPU::set_memory_watcher(MemoryWatcher* watcher) {
+  watcher_ = watcher;
+  if (watcher == nullptr) {
+    watch_pages_.fill(0);
+  }
+}
+
+void CPU::watch_page(uint8_t page, uint8_t flags) {
+  watch_pages_[page] = watcher_ != nullptr ? flags : 0;
+}
+
+uint8_t CPU::read_bus(uint16_t addr) {
   switch (addr) {
     case 0x0000 ... 0x1FFF:  // Internal RAM
       return ram_[addr % 0x800];
@@ -28,8 +56,16 @@ uint8_t CPU::read(uint16_t addr) {
           return 0xAA;
       };
     }
-    case 0x4000 ... 0x4015:  // Sound
-      BOOST_LOG_TRIVIAL(debug) << "Sound not implemented: " << addr;
+    case 0x4015:  // APU status
+      if (!apu_.has_value()) {
+        BOOST_LOG_TRIVIAL(debug)
+            << "Read from APU register without attached APU: " << addr;
+        return 0xAA;
+      }
+      return apu_->get().read_status(total_cycles_);
+    case 0x4000 ... 0x4014:  // Write-only APU registers and OAMDMA
+      BOOST_LOG_TRIVIAL(debug)
+          << "Read from write-only register: " << util::fmt_hex(addr);
       return 0xAA;
     case 0x4016: {
       if (!controller_.has_value()) {
@@ -55,7 +91,30 @@ uint8_t CPU::read(uint16_t addr) {
   }
 };
 
-bool CPU::write(uint16_t addr, uint8_t data) {
+uint8_t CPU::peek(uint16_t addr) {
+  switch (addr) {
+    case 0x0000 ... 0x1FFF:  // Internal RAM
+      return ram_[addr % 0x800];
+    case 0x2000 ... 0x3FFF:  // PPU Registers
+      if (ppu_.has_value() && addr % 8 == 0x02) {
+        return ppu_->get().peek_PPUSTATUS();
+      }
+      if (ppu_.has_value() && addr % 8 == 0x04) {
+        return ppu_->get().get_OAMDATA();
+      }
+      return 0xAA;
+    case 0x4016:
+      return controller_.has_value() ? controller_->get().peek_joy1() : 0xAA;
+    case 0x4017:
+      return 0x00;
+    case 0x4020 ... 0xFFFF:  // Cartridge space
+      return cart_.cpu_read(addr);
+    default:  // APU status and write-only registers
+      return 0xAA;
+  }
+}
+
+bool CPU::write_bus(uint16_t addr, uint8_t data) {
   switch (addr) {
     case 0x0000 ... 0x1FFF:  // Internal RAM
       ram_[addr % 0x800] = data;
@@ -92,9 +151,18 @@ bool CPU::write(uint16_t addr, uint8_t data) {
       };
       return false;
     }
-    case 0x4000 ... 0x4015:  // Sound
-      BOOST_LOG_TRIVIAL(trace) << "Sound not implemented: " << addr;
-      return false;
+    case 0x4000 ... 0x4013:  // APU
+    case 0x4015:
+      if (!apu_.has_value()) {
+        BOOST_LOG_TRIVIAL(trace)
+            << "Write to APU register without attached APU: " << addr;
+        return false;
+      }
+      apu_->get().write(addr, data, total_cycles_);
+      return true;
+    case 0x4014:  // OAMDMA
+      oam_dma(data);
+      return true;
     case 0x4016: {
       if (!controller_.has_value()) {
         BOOST_LOG_TRIVIAL(debug)
@@ -106,7 +174,10 @@ bool CPU::write(uint16_t addr, uint8_t data) {
       controller.write_strobe(data);
       return true;
     }
-    case 0x4017: {
+    case 0x4017: {  // APU frame counter
+      if (apu_.has_value()) {
+        apu_->get().write(addr, data, total_cycles_);
+      }
       return true;
     }
     case 0x4018 ... 0x401F:  // APU and I/O that is normally disabled
@@ -121,6 +192,36 @@ bool CPU::write(uint16_t addr, uint8_t data) {
   }
 }
 
+void CPU::oam_dma(uint8_t page) {
+  uint16_t base = page << 8;
+  const uint8_t* src = nullptr;
+  std::array<uint8_t, 0x100> io_page;
+
+  switch (base) {
+    case 0x0000 ... 0x1FFF:  // Internal RAM (pages never straddle a mirror)
+      src = &ram_[base % 0x800];
+      break;
+    case 0x4020 ... 0xFFFF:  // Cartridge space
+      src = cart_.cpu_page(base);
+      break;
+  }
+  if (src == nullptr || (watch_pages_[page] & kWatchRead)) {
+    // Registers or unmapped cartridge memory: every read may have side
+    // effects. Watched pages are read one at a time to report the reads.
+    for (std::size_t i = 0; i < io_page.size(); i++) {
+      io_page[i] = read(base + i);
+    }
+    src = io_page.data();
+  }
+
+  if (ppu_.has_value()) {
+    ppu_->get().write_OAMDMA(src);
+  }
+
+  // 1 dummy cycle (+1 alignment cycle on odd cycles) then 256 read/write pairs
+  stall_cycles_ += 513 + (total_cycles_ & 1);
+}
+
 uint16_t CPU::read16(uint16_t addr) {
   uint16_t lo = read(addr);
   uint16_t hi = read(addr + 1);
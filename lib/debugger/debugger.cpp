@@ -4,6 +4,7 @@
 #include <boost/log/trivial.hpp>
 #include <cstdint>
 #include <format>
+#include <fstream>
 #include <ios>
 #include <iostream>
 #include <sstream>
@@ -14,12 +15,27 @@
 namespace debugger {
 
 // Must construct from a ptr to an existing CPU
-Debugger::Debugger(cpu::CPU* cpu)
+Debugger::Debugger(cpu::CPU* cpu, controller::InputLog* input)
     : cpu_(cpu),
+      input_(input),
+      profiler_(nullptr),
+      profiling_(false),
       breakpoints_{},
+      breakpoint_actions_{},
+      read_watches_{},
+      write_watches_{},
+      watch_hit_(),
+      trace_out_(&std::cout),
       cycles_todo_in_frame_(cpu::CPU::kCyclesPerFrame),
+      position_(0),
+      checkpoints_(),
       frame_start_(std::chrono::steady_clock::now()),
-      frame_deadline_(frame_start_ + cpu::CPU::kTimePerFrameMillis) {}
+      frame_deadline_(frame_start_ + cpu::CPU::kTimePerFrameMillis) {
+  cpu_->set_memory_watcher(this);
+  checkpoint();
+}
+
+Debugger::~Debugger() { cpu_->set_memory_watcher(nullptr); }
 
 void Debugger::debug() {
   // Loop while debugging. Listen for a command and execute it.
@@ -37,38 +53,361 @@ void _unimplemented() {
   BOOST_LOG_TRIVIAL(info) << "Command not yet implemented\n";
 }
 
-bool Debugger::smart_execute_cycle() {
+bool Debugger::smart_execute_cycle(bool paced) {
   bool exited_vblank = false;
-  try {
-    if (cycles_todo_in_frame_ == 0) {
+  if (cycles_todo_in_frame_ == 0) {
+    if (paced) {
       std::this_thread::sleep_until(frame_deadline_);
-      frame_start_ = std::chrono::steady_clock::now();
-      frame_deadline_ = frame_start_ + cpu::CPU::kTimePerFrameMillis;
-      cycles_todo_in_frame_ = cpu::CPU::kCyclesPerFrame;
-
-      if (cpu_->ppu_.has_value()) {
-        // Render a frame using the current cpu data
-        cpu::CPU::PPU& ppu = cpu_->ppu_->get();
-        ppu.render_to_window();
-
-        // NMI. Program finishes current instruction before the interrupt
-        // happens
-        if (ppu.is_nmi_enabled()) {
-          cpu_->trigger_nmi();
-        }
+    }
+    frame_start_ = std::chrono::steady_clock::now();
+    frame_deadline_ = frame_start_ + cpu::CPU::kTimePerFrameMillis;
+    cycles_todo_in_frame_ = cpu::CPU::kCyclesPerFrame;
+    cpu_->end_frame();
+
+    if (cpu_->ppu_.has_value()) {
+      // Render a frame using the current cpu data
+      cpu::CPU::PPU& ppu = cpu_->ppu_->get();
+      ppu.render_frame();
+      if (ppu.has_window()) {
+        glfwPollEvents();
       }
 
-      exited_vblank = true;
+      // NMI. Program finishes current instruction before the interrupt
+      // happens
+      if (ppu.is_nmi_enabled()) {
+        cpu_->trigger_nmi();
+      }
     }
 
-    cpu_->cycle();
-    cycles_todo_in_frame_ -= 1;
-  } catch (std::exception& e) {
-    std::cout << e.what() << "\n";
+    exited_vblank = true;
+  }
+
+  cpu_->cycle();
+  cycles_todo_in_frame_ -= 1;
+  return exited_vblank;
+}
+
+bool Debugger::run_instruction(bool paced) {
+  bool exited_vblank = false;
+  do {
+    exited_vblank |= smart_execute_cycle(paced);
+  } while (cpu_->cycles_todo_ != 0 || cpu_->stall_cycles_ != 0);
+  position_++;
+  // Checkpoints further on are still there after going back
+  if (position_ % kCheckpointInterval == 0 &&
+      position_ > checkpoints_.back().position) {
+    checkpoint();
   }
   return exited_vblank;
 }
 
+void Debugger::checkpoint() {
+  Checkpoint next{position_, cycles_todo_in_frame_,
+                  input_ != nullptr ? input_->position() : 0, {}};
+  if (checkpoints_.size() == kMaxCheckpoints) {
+    // Reuse the oldest checkpoint's buffer
+    next.state = std::move(checkpoints_.front().state);
+    checkpoints_.pop_front();
+  }
+  next.state.resize(cpu_->state_size());
+  cpu_->save_state(next.state);
+  checkpoints_.push_back(std::move(next));
+}
+
+void Debugger::restore(const Checkpoint& checkpoint) {
+  cpu_->load_state(checkpoint.state);
+  cycles_todo_in_frame_ = checkpoint.cycles_todo_in_frame;
+  if (input_ != nullptr) {
+    input_->seek(checkpoint.input_position);
+  }
+  position_ = checkpoint.position;
+}
+
+void Debugger::restart_history() {
+  if (input_ != nullptr) {
+    input_->truncate();
+  }
+  checkpoints_.clear();
+  checkpoint();
+}
+
+void Debugger::suppress_output(bool suppress) {
+  if (cpu_->ppu_) {
+    cpu_->ppu_->get().suppress_output(suppress);
+  }
+  if (cpu_->apu_) {
+    cpu_->apu_->get().suppress_output(suppress);
+  }
+}
+
+std::optional<uint64_t> Debugger::replay(uint64_t target,
+                                         uint64_t stops_before) {
+  std::optional<uint64_t> stop;
+  std::optional<WatchHit> hit;
+  suppress_output(true);
+  // The past was already profiled
+  cpu_->set_profiler(nullptr);
+  try {
+    while (position_ < target) {
+      watch_hit_.reset();
+      run_instruction(false);
+      if (position_ < stops_before &&
+          (watch_hit_ || (breakpoints_[cpu_->PC()] && breakpoint_pauses()))) {
+        stop = position_;
+        hit = watch_hit_;
+      }
+    }
+  } catch (...) {
+    suppress_output(false);
+    cpu_->set_profiler(profiling_ ? profiler_ : nullptr);
+    throw;
+  }
+  suppress_output(false);
+  cpu_->set_profiler(profiling_ ? profiler_ : nullptr);
+  watch_hit_ = hit;
+  return stop;
+}
+
+void Debugger::seek(uint64_t target) {
+  auto after = std::upper_bound(
+      checkpoints_.begin(), checkpoints_.end(), target,
+      [](uint64_t position, const Checkpoint& checkpoint) {
+        return position < checkpoint.position;
+      });
+  const Checkpoint& from = *std::prev(after);
+  // Carrying on from the current position is quicker when it's on the way
+  if (position_ > target || position_ < from.position) {
+    restore(from);
+  }
+  replay(target);
+  watch_hit_.reset();
+}
+
+void Debugger::on_read(address_t addr, uint8_t value) {
+  if (read_watches_[addr] && !watch_hit_) {
+    watch_hit_ = WatchHit{addr, value, false};
+  }
+}
+
+void Debugger::on_write(address_t addr, uint8_t value) {
+  if (write_watches_[addr] && !watch_hit_) {
+    watch_hit_ = WatchHit{addr, value, true};
+  }
+}
+
+void Debugger::update_watch_page(uint8_t page) {
+  uint8_t flags = 0;
+  for (uint32_t addr = page << 8; addr < (page + 1u) << 8; addr++) {
+    flags |= (read_watches_[addr] ? cpu::kWatchRead : 0) |
+             (write_watches_[addr] ? cpu::kWatchWrite : 0);
+  }
+  cpu_->watch_page(page, flags);
+}
+
+bool Debugger::hit_breakpoint() {
+  const Breakpoint& breakpoint = breakpoint_actions_.at(cpu_->PC());
+  if (breakpoint.condition && breakpoint.condition->evaluate(*cpu_) == 0) {
+    return false;
+  }
+  if (breakpoint.trace) {
+    *trace_out_ << util::fmt_hex(cpu_->PC()) << ": "
+                << breakpoint.trace->format(*cpu_) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool Debugger::breakpoint_pauses() {
+  const Breakpoint& breakpoint = breakpoint_actions_.at(cpu_->PC());
+  return !breakpoint.trace && (!breakpoint.condition ||
+                               breakpoint.condition->evaluate(*cpu_) != 0);
+}
+
+Debugger::RunResult Debugger::run(uint64_t limit, bool stop_at_breakpoints) {
+  RunResult result{kStopLimit, 0, false};
+  watch_hit_.reset();
+  while (result.instructions < limit) {
+    result.frame_ended |= run_instruction(false);
+    result.instructions++;
+    if (watch_hit_) {
+      result.stop = kStopWatchpoint;
+      break;
+    }
+    if (stop_at_breakpoints && breakpoints_[cpu_->PC()] && hit_breakpoint()) {
+      result.stop = kStopBreakpoint;
+      break;
+    }
+  }
+  return result;
+}
+
+Debugger::RunResult Debugger::back(uint64_t count) {
+  uint64_t steps = std::min(count, position_ - history_start());
+  RunResult result{steps < count ? kStopHistoryStart : kStopLimit, steps,
+                   false};
+  seek(position_ - steps);
+  return result;
+}
+
+Debugger::RunResult Debugger::reverse_run() {
+  uint64_t start = position_;
+  uint64_t end = position_;
+  // Search the checkpoint intervals, newest first, for the last stop
+  for (std::size_t i = checkpoints_.size(); i-- > 0;) {
+    if (checkpoints_[i].position >= end) {
+      continue;
+    }
+    restore(checkpoints_[i]);
+    if (std::optional<uint64_t> stop = replay(end, start)) {
+      std::optional<WatchHit> hit = watch_hit_;
+      seek(*stop);
+      watch_hit_ = hit;
+      return {hit ? kStopWatchpoint : kStopBreakpoint, start - *stop, false};
+    }
+    end = checkpoints_[i].position;
+  }
+  restore(checkpoints_.front());
+  watch_hit_.reset();
+  return {kStopHistoryStart, start - position_, false};
+}
+
+uint64_t Debugger::position() const { return position_; }
+
+uint64_t Debugger::history_start() const {
+  return checkpoints_.front().position;
+}
+
+const std::optional<Debugger::WatchHit>& Debugger::watch_hit() const {
+  return watch_hit_;
+}
+
+void Debugger::set_trace_output(std::ostream& out) { trace_out_ = &out; }
+
+void Debugger::set_breakpoint(address_t addr,
+                              std::optional<Expression> condition,
+                              std::optional<TraceFormat> trace) {
+  breakpoints_.set(addr);
+  breakpoint_actions_.insert_or_assign(
+      addr, Breakpoint{std::move(condition), std::move(trace)});
+}
+
+bool Debugger::delete_breakpoint(address_t addr) {
+  if (!breakpoints_[addr]) {
+    return false;
+  }
+  breakpoints_.reset(addr);
+  breakpoint_actions_.erase(addr);
+  return true;
+}
+
+const Debugger::Breakpoint* Debugger::breakpoint(address_t addr) const {
+  auto found = breakpoint_actions_.find(addr);
+  return found == breakpoint_actions_.end() ? nullptr : &found->second;
+}
+
+std::vector<Debugger::address_t> Debugger::breakpoints() const {
+  std::vector<address_t> addrs;
+  for (uint32_t addr = 0; addr < breakpoints_.size(); addr++) {
+    if (breakpoints_[addr]) {
+      addrs.push_back(addr);
+    }
+  }
+  return addrs;
+}
+
+void Debugger::set_watchpoint(address_t addr, uint8_t flags) {
+  read_watches_[addr] = flags & cpu::kWatchRead;
+  write_watches_[addr] = flags & cpu::kWatchWrite;
+  update_watch_page(addr >> 8);
+}
+
+uint8_t Debugger::watchpoint(address_t addr) const {
+  return (read_watches_[addr] ? cpu::kWatchRead : 0) |
+         (write_watches_[addr] ? cpu::kWatchWrite : 0);
+}
+
+std::vector<Debugger::address_t> Debugger::watchpoints() const {
+  std::vector<address_t> addrs;
+  for (uint32_t addr = 0; addr < read_watches_.size(); addr++) {
+    if (read_watches_[addr] || write_watches_[addr]) {
+      addrs.push_back(addr);
+    }
+  }
+  return addrs;
+}
+
+void Debugger::clear() {
+  breakpoints_.reset();
+  breakpoint_actions_.clear();
+  read_watches_.reset();
+  write_watches_.reset();
+  for (uint32_t page = 0; page < 0x100; page++) {
+    cpu_->watch_page(page, 0);
+  }
+}
+
+void Debugger::set_register(Register reg, uint16_t value) {
+  switch (reg) {
+    case kRegPC:
+      cpu_->PC_ = value;
+      break;
+    case kRegSP:
+      cpu_->SP_ = value;
+      break;
+    case kRegA:
+      cpu_->A_ = value;
+      break;
+    case kRegX:
+      cpu_->X_ = value;
+      break;
+    case kRegY:
+      cpu_->Y_ = value;
+      break;
+    case kRegP:
+      cpu_->P_ = value;
+      break;
+  }
+  restart_history();
+}
+
+void Debugger::write(address_t addr, std::span<const uint8_t> data) {
+  for (std::size_t i = 0; i < data.size(); i++) {
+    cpu_->write_bus(static_cast<address_t>(addr + i), data[i]);
+  }
+  restart_history();
+}
+
+void Debugger::read(address_t addr, std::span<uint8_t> out,
+                    bool side_effects) {
+  bool io = false;
+  for (std::size_t i = 0; i < out.size(); i++) {
+    address_t at = static_cast<address_t>(addr + i);
+    out[i] = side_effects ? cpu_->read_bus(at) : cpu_->peek(at);
+    io |= at >= 0x2000 && at < 0x4020;
+  }
+  if (side_effects && io) {
+    restart_history();
+  }
+}
+
+cpu::CPU& Debugger::cpu() { return *cpu_; }
+
+void Debugger::set_profiler(profiler::Profiler* profiler) {
+  profiler_ = profiler;
+  profiling_ = false;
+  cpu_->set_profiler(nullptr);
+}
+
+void Debugger::report_watch_hit() {
+  if (watch_hit_) {
+    std::cout << "Watchpoint reached: "
+              << (watch_hit_->write ? "wrote " : "read ")
+              << util::fmt_hex(watch_hit_->value)
+              << (watch_hit_->write ? " to " : " from ")
+              << util::fmt_hex(watch_hit_->addr) << "\n";
+  }
+}
+
 bool cmd_is(const char* cmd, const char* name1, const char* name2) {
   return (strcmp(cmd, name1) == 0) || (strcmp(cmd, name2) == 0);
 }
@@ -77,6 +416,28 @@ bool cmd_is(const char* cmd, const char* name1) {
   return (strcmp(cmd, name1) == 0);
 }
 
+// Trim whitespace from both ends
+std::string_view trim(std::string_view str) {
+  std::size_t start = str.find_first_not_of(" \t");
+  if (start == std::string_view::npos) {
+    return {};
+  }
+  return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+}
+
+// Parse an optional "if <condition>". Throws expression_error.
+std::optional<Expression> parse_condition(std::string_view str) {
+  str = trim(str);
+  if (str.empty()) {
+    return std::nullopt;
+  }
+  if (!str.starts_with("if ")) {
+    throw expression_error(
+        std::format("Expected 'if <condition>', got '{}'", std::string(str)));
+  }
+  return Expression(str.substr(3));
+}
+
 void Debugger::read_command() {
   std::string input;
   std::cout << "> ";
@@ -117,6 +478,13 @@ void Debugger::read_command() {
   } else if (cmd_is(cmd, "continue", "c")) {
     cmd_continue();
 
+  } else if (cmd_is(cmd, "back", "b")) {
+    tmp_num = util::extract_num(input_stream);
+    cmd_back(tmp_num < 1 ? 1 : tmp_num);
+
+  } else if (cmd_is(cmd, "reverse-continue", "rc")) {
+    cmd_reverse_continue();
+
   } else if (cmd_is(cmd, "break")) {
     address_t addr;
     tmp_num = util::extract_num(input_stream);
@@ -126,7 +494,38 @@ void Debugger::read_command() {
     }
     addr = tmp_num;
 
-    cmd_break(addr);
+    std::string rest;
+    std::getline(input_stream, rest);
+    try {
+      cmd_break(addr, parse_condition(rest));
+    } catch (const expression_error& e) {
+      std::cout << e.what() << "\n";
+      return;
+    }
+
+  } else if (cmd_is(cmd, "trace")) {
+    tmp_num = util::extract_num(input_stream);
+    if (tmp_num == -1) {
+      std::cout << "Please specify an address to add a new tracepoint\n";
+      return;
+    }
+    address_t addr = tmp_num;
+
+    std::string rest;
+    std::getline(input_stream, rest);
+    std::string_view args = trim(rest);
+    std::size_t end = args.find('"', 1);
+    if (!args.starts_with('"') || end == std::string_view::npos) {
+      std::cout << "Please specify a message in double quotes\n";
+      return;
+    }
+    try {
+      cmd_trace(addr, TraceFormat(args.substr(1, end - 1)),
+                parse_condition(args.substr(end + 1)));
+    } catch (const expression_error& e) {
+      std::cout << e.what() << "\n";
+      return;
+    }
 
   } else if (cmd_is(cmd, "delete")) {
     address_t addr;
@@ -140,6 +539,40 @@ void Debugger::read_command() {
 
     cmd_delete(addr);
 
+  } else if (cmd_is(cmd, "watch")) {
+    tmp_num = util::extract_num(input_stream);
+    if (tmp_num == -1) {
+      std::cout << "Please specify an address to add a new watchpoint\n";
+      return;
+    }
+    address_t addr = tmp_num;
+
+    std::string mode = "w";
+    input_stream >> mode;
+    uint8_t flags;
+    if (mode == "r") {
+      flags = cpu::kWatchRead;
+    } else if (mode == "w") {
+      flags = cpu::kWatchWrite;
+    } else if (mode == "rw") {
+      flags = cpu::kWatchRead | cpu::kWatchWrite;
+    } else {
+      std::cout << "Watch mode must be r, w or rw\n";
+      return;
+    }
+
+    cmd_watch(addr, flags);
+
+  } else if (cmd_is(cmd, "unwatch")) {
+    tmp_num = util::extract_num(input_stream);
+    if (tmp_num == -1) {
+      std::cout << "Please specify the address where a watchpoint should be "
+                   "deleted\n";
+      return;
+    }
+
+    cmd_unwatch(tmp_num);
+
   } else if (cmd_is(cmd, "list", "l")) {
     cmd_list();
 
@@ -212,6 +645,12 @@ void Debugger::read_command() {
 
     cmd_set(reg_name, value);
 
+  } else if (cmd_is(cmd, "profile")) {
+    std::string action;
+    std::string path;
+    input_stream >> action >> path;
+    cmd_profile(action, path);
+
   } else if (cmd_is(cmd, "")) {
     // empty check for newline to allow spamming w/o error messages
     return;
@@ -233,54 +672,112 @@ void Debugger::cmd_step(uint num_to_step) {
     std::cout << "Stepping through: " << num_to_step << " instructions\n";
   }
 
-  for (uint step_count = 0; step_count < num_to_step; ++step_count) {
-    if (num_to_step != 1) std::cout << "\nStep " << step_count + 1 << "\n";
-
-    uint8_t opcode = cpu_->read(cpu_->PC());
-    std::cout << "opcode: " << cpu_->print_instruction() << "\n";
-    bool no_interrupt = true;
-
-    std::size_t i;
-    for (i = 0; (i < cpu_->cycle_count(opcode)) && no_interrupt; i++) {
-      no_interrupt = !smart_execute_cycle();
-    }
-
-    std::cout << "true cycles executed: " << i << "\n";
-    if (!no_interrupt) {
-      std::cout << "interrupt occurred\n";
+  watch_hit_.reset();
+  try {
+    for (uint step_count = 0; step_count < num_to_step; ++step_count) {
+      if (num_to_step != 1) std::cout << "\nStep " << step_count + 1 << "\n";
+
+      std::cout << "opcode: " << cpu_->print_instruction() << "\n";
+      uint64_t start = cpu_->total_cycles_;
+      // Whole instructions, so the history can count them
+      bool interrupt = run_instruction(true);
+
+      std::cout << "true cycles executed: " << cpu_->total_cycles_ - start
+                << "\n";
+      if (interrupt) {
+        std::cout << "interrupt occurred\n";
+      }
     }
+  } catch (std::exception& e) {
+    std::cout << e.what() << "\n";
   }
+  report_watch_hit();
   std::cout << "registers after instruction(s):\n";
   cmd_registers();
 }
 void Debugger::cmd_continue() {
-  bool frame_crossed = false;
+  RunResult result;
+  try {
+    result = run();
+  } catch (std::exception& e) {
+    std::cout << e.what() << "\n";
+    cmd_registers();
+    return;
+  }
+  report_stop(result);
+}
 
-  while (!breakpoints_.contains(cpu_->PC())) {
-    if (smart_execute_cycle()) {
-      frame_crossed = true;
-    }
+void Debugger::cmd_back(uint64_t num_to_step) {
+  RunResult result;
+  try {
+    result = back(num_to_step);
+  } catch (std::exception& e) {
+    std::cout << e.what() << "\n";
+    cmd_registers();
+    return;
   }
-  if (frame_crossed) {
+  std::cout << "Went back " << result.instructions << " instruction(s)\n";
+  report_stop(result);
+}
+
+void Debugger::cmd_reverse_continue() {
+  RunResult result;
+  try {
+    result = reverse_run();
+  } catch (std::exception& e) {
+    std::cout << e.what() << "\n";
+    cmd_registers();
+    return;
+  }
+  std::cout << "Went back " << result.instructions << " instruction(s)\n";
+  report_stop(result);
+}
+
+void Debugger::report_stop(const RunResult& result) {
+  if (result.frame_ended) {
     std::cout << "A frame ended and NMI was triggered during execution. Linear "
                  "execution may have been interrupted.\n";
   }
-  std::cout << "Breakpoint reached: " << util::fmt_hex(cpu_->PC()) << "\n";
+  switch (result.stop) {
+    case kStopBreakpoint:
+      std::cout << "Breakpoint reached: " << util::fmt_hex(cpu_->PC()) << "\n";
+      break;
+    case kStopWatchpoint:
+      report_watch_hit();
+      break;
+    case kStopHistoryStart:
+      std::cout << "Reached the start of the history\n";
+      break;
+    case kStopLimit:
+      break;
+  }
   cmd_registers();
 }
 
-void Debugger::cmd_break(address_t addr) {
-  auto res = breakpoints_.insert(addr);
-  if (res.second) {
+void Debugger::cmd_break(address_t addr,
+                         std::optional<Expression> condition) {
+  if (!breakpoints_[addr]) {
     std::cout << "Breakpoint added at address " << util::fmt_hex(addr) << "\n";
   } else {
-    std::cout << "Breakpoint already created for address "
+    std::cout << "Breakpoint replaced at address " << util::fmt_hex(addr)
+              << "\n";
+  }
+  set_breakpoint(addr, std::move(condition));
+}
+
+void Debugger::cmd_trace(address_t addr, TraceFormat trace,
+                         std::optional<Expression> condition) {
+  if (!breakpoints_[addr]) {
+    std::cout << "Tracepoint added at address " << util::fmt_hex(addr) << "\n";
+  } else {
+    std::cout << "Tracepoint replaced the breakpoint at address "
               << util::fmt_hex(addr) << "\n";
   }
+  set_breakpoint(addr, std::move(condition), std::move(trace));
 }
 
 void Debugger::cmd_delete(address_t addr) {
-  if (breakpoints_.erase(addr)) {
+  if (delete_breakpoint(addr)) {
     std::cout << "Breakpoint removed at address " << util::fmt_hex(addr)
               << "\n";
   } else {
@@ -288,27 +785,61 @@ void Debugger::cmd_delete(address_t addr) {
               << "\n";
   }
 }
+
+void Debugger::cmd_watch(address_t addr, uint8_t flags) {
+  set_watchpoint(addr, flags);
+  std::cout << "Watchpoint set on address " << util::fmt_hex(addr) << "\n";
+}
+
+void Debugger::cmd_unwatch(address_t addr) {
+  if (watchpoint(addr) != 0) {
+    set_watchpoint(addr, 0);
+    std::cout << "Watchpoint removed at address " << util::fmt_hex(addr)
+              << "\n";
+  } else {
+    std::cout << "No watchpoint exists at address " << util::fmt_hex(addr)
+              << "\n";
+  }
+}
+
 void Debugger::cmd_list() {
   std::cout << "Breakpoints: \n";
-  for (const address_t& addr : breakpoints_) {
-    std::cout << util::fmt_hex(addr) << "\n";
+  for (address_t addr : breakpoints()) {
+    const Breakpoint& breakpoint = *this->breakpoint(addr);
+    std::cout << util::fmt_hex(addr);
+    if (breakpoint.trace) {
+      std::cout << " trace \"" << breakpoint.trace->source() << "\"";
+    }
+    if (breakpoint.condition) {
+      std::cout << " if " << breakpoint.condition->source();
+    }
+    std::cout << "\n";
+  }
+  std::cout << "Watchpoints: \n";
+  for (address_t addr : watchpoints()) {
+    uint8_t flags = watchpoint(addr);
+    std::cout << util::fmt_hex(addr) << " "
+              << (flags & cpu::kWatchRead ? "r" : "")
+              << (flags & cpu::kWatchWrite ? "w" : "") << "\n";
   }
 }
 void Debugger::cmd_clear() {
-  breakpoints_.clear();
-  std::cout << "Breakpoints cleared\n";
+  clear();
+  std::cout << "Breakpoints and watchpoints cleared\n";
 }
 void Debugger::cmd_read(address_t addr, uint16_t bytes) {
+  std::vector<uint8_t> data(bytes);
+  read(addr, data);
   for (uint16_t offset = 0; offset < bytes; ++offset) {
     if (offset > 0 && offset % 8 == 0) std::cout << "\n";
-    std::cout << util::fmt_hex(cpu_->read(addr + offset)) << "\t";
+    std::cout << util::fmt_hex(data[offset]) << "\t";
   }
   std::cout << "\n";
 }
 void Debugger::cmd_write(address_t addr, uint8_t data) {
   std::cout << "Wrote " << util::fmt_hex(data) << " to " << util::fmt_hex(addr)
             << "\n";
-  cpu_->write(addr, data);
+  write(addr, std::span<const uint8_t>(&data, 1));
 }
 void Debugger::cmd_registers() {
   std::cout << "PC (16-bit): " << util::fmt_hex(cpu_->PC()) << "\n"  //
@@ -333,25 +864,31 @@ void Debugger::cmd_set(std::string reg_name, uint16_t value) {
   std::cout << std::hex << "Register " << reg_name << " set to "
             << util::fmt_hex(value) << "\n";
 
-  switch (reg) {
-    case kRegPC:
-      cpu_->PC_ = value;
-      break;
-    case kRegSP:
-      cpu_->SP_ = value;
-      break;
-    case kRegA:
-      cpu_->A_ = value;
-      break;
-    case kRegX:
-      cpu_->X_ = value;
-      break;
-    case kRegY:
-      cpu_->Y_ = value;
-      break;
-    case kRegP:
-      cpu_->P_ = value;
-      break;
+  set_register(reg, value);
+}
+void Debugger::cmd_profile(const std::string& action,
+                           const std::string& path) {
+  if (profiler_ == nullptr) {
+    std::cout << "No profiler available\n";
+  } else if (action == "on" || action == "off") {
+    profiling_ = action == "on";
+    cpu_->set_profiler(profiling_ ? profiler_ : nullptr);
+    std::cout << "Profiling " << action << "\n";
+  } else if (action == "reset") {
+    profiler_->reset();
+    std::cout << "Profile reset\n";
+  } else if (action == "report") {
+    profiler_->print_report(std::cout);
+  } else if (action == "save" && !path.empty()) {
+    std::ofstream out(path);
+    profiler_->write_collapsed(out);
+    if (!out) {
+      std::cout << "Could not write " << path << "\n";
+      return;
+    }
+    std::cout << "Call stacks written to " << path << "\n";
+  } else {
+    std::cout << "Usage: profile <on|off|reset|report|save <path>>\n";
   }
 }
-}  // namespace debugger
\ No newline at end of file
+}  // namespace debugger
@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <cctype>
+#include <format>
+
+#include "debugger.hpp"
+#include "util.hpp"
+
+namespace debugger {
+
+enum Expression::Op : uint8_t {
+  kPush,  // arg
+  kRegA,
+  kRegX,
+  kRegY,
+  kRegSP,
+  kRegP,
+  kRegPC,
+  kLoad,  // the byte at the address on top of the stack
+  kNot,
+  kNegate,
+  kOr,
+  kAnd,
+  kEqual,
+  kNotEqual,
+  kLess,
+  kLessEqual,
+  kGreater,
+  kGreaterEqual,
+  kBitAnd,
+  kBitOr,
+  kBitXor,
+  kAdd,
+  kSubtract,
+};
+
+/**
+ * @brief Recursive descent parser, emitting each operator after its operands
+ */
+class Expression::Parser {
+ public:
+  Parser(std::string_view source, std::vector<Instruction>& code)
+      : source_(source),
+        pos_(0),
+        code_(code),
+        depth_(0),
+        max_depth_(0),
+        nesting_(0) {}
+
+  void parse() {
+    parse_or();
+    skip_space();
+    if (pos_ != source_.size()) {
+      fail(std::format("unexpected '{}'", source_.substr(pos_, 1)));
+    }
+    if (max_depth_ > kMaxDepth) {
+      fail("too deeply nested");
+    }
+  }
+
+ private:
+  std::string_view source_;
+  std::size_t pos_;
+  std::vector<Instruction>& code_;
+  // Stack depth when the code emitted so far runs
+  std::size_t depth_;
+  std::size_t max_depth_;
+  // Parentheses, brackets and unary operators being parsed, to bound the
+  // recursion
+  std::size_t nesting_;
+
+  [[noreturn]] void fail(const std::string& what) {
+    throw expression_error(std::format("Bad expression '{}': {}",
+                                       std::string(source_), what));
+  }
+
+  void skip_space() {
+    while (pos_ < source_.size() && std::isspace(source_[pos_])) {
+      pos_++;
+    }
+  }
+
+  // Consume the operator if it is next. Doesn't take the start of a longer
+  // operator, e.g. "<" from "<=" or "&" from "&&".
+  bool accept(std::string_view op) {
+    skip_space();
+    if (!source_.substr(pos_).starts_with(op)) {
+      return false;
+    }
+    std::size_t end = pos_ + op.size();
+    if (end < source_.size()) {
+      char next = source_[end];
+      if ((op == "<" || op == ">" || op == "!") && next == '=') {
+        return false;
+      }
+      if ((op == "&" || op == "|") && next == op[0]) {
+        return false;
+      }
+    }
+    pos_ = end;
+    return true;
+  }
+
+  void emit(Op op, int32_t arg = 0) {
+    switch (op) {
+      case kPush:
+      case kRegA:
+      case kRegX:
+      case kRegY:
+      case kRegSP:
+      case kRegP:
+      case kRegPC:
+        max_depth_ = std::max(max_depth_, ++depth_);
+        break;
+      case kLoad:
+      case kNot:
+      case kNegate:
+        break;
+      default:  // binary
+        depth_--;
+        if (!code_.empty() && code_.back().op == kPush) {
+          // Comparing to a constant is the common case: fold the constant in
+          code_.back() = {op, true, code_.back().arg};
+          return;
+        }
+        break;
+    }
+    code_.push_back({op, false, arg});
+  }
+
+  void parse_or() {
+    parse_and();
+    while (accept("||")) {
+      parse_and();
+      emit(kOr);
+    }
+  }
+
+  void parse_and() {
+    parse_comparison();
+    while (accept("&&")) {
+      parse_comparison();
+      emit(kAnd);
+    }
+  }
+
+  void parse_comparison() {
+    parse_bitwise();
+    static constexpr std::pair<std::string_view, Op> kOps[] = {
+        {"==", kEqual},    {"!=", kNotEqual}, {"<=", kLessEqual},
+        {">=", kGreaterEqual}, {"<", kLess},  {">", kGreater}};
+    for (auto [text, op] : kOps) {
+      if (accept(text)) {
+        parse_bitwise();
+        emit(op);
+        return;
+      }
+    }
+  }
+
+  void parse_bitwise() {
+    parse_sum();
+    while (true) {
+      if (accept("&")) {
+        parse_sum();
+        emit(kBitAnd);
+      } else if (accept("|")) {
+        parse_sum();
+        emit(kBitOr);
+      } else if (accept("^")) {
+        parse_sum();
+        emit(kBitXor);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void parse_sum() {
+    parse_unary();
+    while (true) {
+      if (accept("+")) {
+        parse_unary();
+        emit(kAdd);
+      } else if (accept("-")) {
+        parse_unary();
+        emit(kSubtract);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void parse_unary() {
+    if (++nesting_ > kMaxDepth) {
+      fail("too deeply nested");
+    }
+    if (accept("!")) {
+      parse_unary();
+      emit(kNot);
+    } else if (accept("-")) {
+      parse_unary();
+      emit(kNegate);
+    } else {
+      parse_primary();
+    }
+    nesting_--;
+  }
+
+  void parse_primary() {
+    skip_space();
+    if (accept("(")) {
+      parse_or();
+      if (!accept(")")) {
+        fail("missing ')'");
+      }
+      return;
+    }
+    if (accept("[")) {
+      parse_or();
+      if (!accept("]")) {
+        fail("missing ']'");
+      }
+      emit(kLoad);
+      return;
+    }
+
+    std::size_t start = pos_;
+    while (pos_ < source_.size() &&
+           (std::isalnum(source_[pos_]) || source_[pos_] == '$')) {
+      pos_++;
+    }
+    std::string token(source_.substr(start, pos_ - start));
+    if (token.empty()) {
+      fail(pos_ < source_.size()
+               ? std::format("unexpected '{}'", source_.substr(pos_, 1))
+               : "unexpected end");
+    }
+    std::string name = token;
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    static const std::map<std::string, Op> kRegisters = {
+        {"A", kRegA},   {"X", kRegX}, {"Y", kRegY},
+        {"SP", kRegSP}, {"P", kRegP}, {"PC", kRegPC}};
+    if (auto reg = kRegisters.find(name); reg != kRegisters.end()) {
+      emit(reg->second);
+      return;
+    }
+    int32_t value = util::parse_num(token);
+    if (value < 0) {
+      fail(std::format("'{}' isn't a number or register", token));
+    }
+    emit(kPush, value);
+  }
+};
+
+Expression::Expression(std::string_view source) : source_(source), code_() {
+  Parser(source, code_).parse();
+}
+
+int32_t Expression::evaluate(cpu::CPU& cpu) const {
+  int32_t stack[kMaxDepth];
+  int32_t* top = stack - 1;
+  for (const Instruction& instr : code_) {
+    switch (instr.op) {
+      case kPush:
+        *++top = instr.arg;
+        break;
+      case kRegA:
+        *++top = cpu.A();
+        break;
+      case kRegX:
+        *++top = cpu.X();
+        break;
+      case kRegY:
+        *++top = cpu.Y();
+        break;
+      case kRegSP:
+        *++top = cpu.SP();
+        break;
+      case kRegP:
+        *++top = cpu.P();
+        break;
+      case kRegPC:
+        *++top = cpu.PC();
+        break;
+      case kLoad:
+        *top = cpu.peek(static_cast<uint16_t>(*top));
+        break;
+      case kNot:
+        *top = !*top;
+        break;
+      case kNegate:
+        *top = -*top;
+        break;
+      default: {
+        int32_t rhs = instr.immediate ? instr.arg : *top--;
+        int32_t& lhs = *top;
+        switch (instr.op) {
+          case kOr:
+            lhs = lhs || rhs;
+            break;
+          case kAnd:
+            lhs = lhs && rhs;
+            break;
+          case kEqual:
+            lhs = lhs == rhs;
+            break;
+          case kNotEqual:
+            lhs = lhs != rhs;
+            break;
+          case kLess:
+            lhs = lhs < rhs;
+            break;
+          case kLessEqual:
+            lhs = lhs <= rhs;
+            break;
+          case kGreater:
+            lhs = lhs > rhs;
+            break;
+          case kGreaterEqual:
+            lhs = lhs >= rhs;
+            break;
+          case kBitAnd:
+            lhs &= rhs;
+            break;
+          case kBitOr:
+            lhs |= rhs;
+            break;
+          case kBitXor:
+            lhs ^= rhs;
+            break;
+          case kAdd:
+            lhs += rhs;
+            break;
+          case kSubtract:
+            lhs -= rhs;
+            break;
+          default:
+            break;
+        }
+      }
+    }
+  }
+  return *top;
+}
+
+const std::string& Expression::source() const { return source_; }
+
+TraceFormat::TraceFormat(std::string_view source)
+    : source_(source), text_(1), fields_() {
+  for (std::size_t pos = 0; pos < source.size(); pos++) {
+    if (source[pos] != '{') {
+      text_.back() += source[pos];
+      continue;
+    }
+    std::size_t end = source.find('}', pos);
+    if (end == std::string_view::npos) {
+      throw expression_error(
+          std::format("Bad trace format '{}': missing '}}'", source_));
+    }
+    fields_.emplace_back(source.substr(pos + 1, end - pos - 1));
+    text_.emplace_back();
+    pos = end;
+  }
+}
+
+std::string TraceFormat::format(cpu::CPU& cpu) const {
+  std::string out = text_[0];
+  for (std::size_t i = 0; i < fields_.size(); i++) {
+    int32_t value = fields_[i].evaluate(cpu);
+    out += value >= 0 && value <= 0xFF
+               ? util::fmt_hex(static_cast<uint8_t>(value))
+               : util::fmt_hex(static_cast<uint16_t>(value));
+    out += text_[i + 1];
+  }
+  return out;
+}
+
+const std::string& TraceFormat::source() const { return source_; }
+
+}  // namespace debugger
@@ -0,0 +1,707 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <variant>
+
+#include "debugger.hpp"
+
+namespace debugger {
+
+namespace {
+
+using request_error = std::runtime_error;
+
+/**
+ * @brief A parsed JSON value. Numbers must be integers, which is all the
+ * protocol uses.
+ */
+struct Json {
+  using Array = std::vector<Json>;
+  using Object = std::vector<std::pair<std::string, Json>>;
+
+  std::variant<std::nullptr_t, bool, int64_t, std::string, Array, Object>
+      value;
+
+  // The member named key, or nullptr if it's missing or this isn't an object
+  const Json* get(std::string_view key) const {
+    if (const Object* object = std::get_if<Object>(&value)) {
+      for (const auto& [name, member] : *object) {
+        if (name == key) {
+          return &member;
+        }
+      }
+    }
+    return nullptr;
+  }
+};
+
+class JsonParser {
+ public:
+  explicit JsonParser(std::string_view text) : text_(text), pos_(0) {}
+
+  Json parse() {
+    Json value = parse_value(0);
+    skip_space();
+    if (pos_ != text_.size()) {
+      fail("trailing characters");
+    }
+    return value;
+  }
+
+ private:
+  static constexpr int kMaxNesting = 16;
+
+  std::string_view text_;
+  std::size_t pos_;
+
+  [[noreturn]] void fail(const std::string& what) {
+    throw request_error(std::format("Bad JSON at offset {}: {}", pos_, what));
+  }
+
+  void skip_space() {
+    while (pos_ < text_.size() &&
+           std::string_view(" \t\r\n").find(text_[pos_]) !=
+               std::string_view::npos) {
+      pos_++;
+    }
+  }
+
+  bool accept(char c) {
+    skip_space();
+    if (pos_ < text_.size() && text_[pos_] == c) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  bool accept_word(std::string_view word) {
+    if (!text_.substr(pos_).starts_with(word)) {
+      return false;
+    }
+    pos_ += word.size();
+    return true;
+  }
+
+  void expect(char c) {
+    if (!accept(c)) {
+      fail(std::format("expected '{}'", std::string(1, c)));
+    }
+  }
+
+  Json parse_value(int nesting) {
+    if (nesting > kMaxNesting) {
+      fail("too deeply nested");
+    }
+    skip_space();
+    if (pos_ == text_.size()) {
+      fail("unexpected end");
+    }
+    char c = text_[pos_];
+    if (c == '{') {
+      pos_++;
+      Json::Object object;
+      if (!accept('}')) {
+        do {
+          skip_space();
+          std::string key = parse_string();
+          expect(':');
+          object.emplace_back(std::move(key), parse_value(nesting + 1));
+        } while (accept(','));
+        expect('}');
+      }
+      return {std::move(object)};
+    }
+    if (c == '[') {
+      pos_++;
+      Json::Array array;
+      if (!accept(']')) {
+        do {
+          array.push_back(parse_value(nesting + 1));
+        } while (accept(','));
+        expect(']');
+      }
+      return {std::move(array)};
+    }
+    if (c == '"') {
+      return {parse_string()};
+    }
+    if (c == '-' || (c >= '0' && c <= '9')) {
+      return {parse_number()};
+    }
+    if (accept_word("true")) {
+      return {true};
+    }
+    if (accept_word("false")) {
+      return {false};
+    }
+    if (accept_word("null")) {
+      return {nullptr};
+    }
+    fail("unexpected character");
+  }
+
+  int64_t parse_number() {
+    bool negative = accept('-');
+    if (pos_ == text_.size() || text_[pos_] < '0' || text_[pos_] > '9') {
+      fail("expected a digit");
+    }
+    int64_t value = 0;
+    while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') {
+      if (value > (INT64_MAX - 9) / 10) {
+        fail("number too large");
+      }
+      value = value * 10 + (text_[pos_++] - '0');
+    }
+    if (pos_ < text_.size() &&
+        std::string_view(".eE").find(text_[pos_]) != std::string_view::npos) {
+      fail("numbers must be integers");
+    }
+    return negative ? -value : value;
+  }
+
+  std::string parse_string() {
+    if (pos_ == text_.size() || text_[pos_] != '"') {
+      fail("expected a string");
+    }
+    pos_++;
+    std::string out;
+    while (true) {
+      if (pos_ == text_.size()) {
+        fail("unterminated string");
+      }
+      char c = text_[pos_++];
+      if (c == '"') {
+        return out;
+      }
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (pos_ == text_.size()) {
+        fail("unterminated string");
+      }
+      switch (char escaped = text_[pos_++]) {
+        case 'n':
+          out += '\n';
+          break;
+        case 't':
+          out += '\t';
+          break;
+        case 'r':
+          out += '\r';
+          break;
+        case 'b':
+          out += '\b';
+          break;
+        case 'f':
+          out += '\f';
+          break;
+        case 'u': {
+          // Only ASCII is meaningful to the debugger
+          if (pos_ + 4 > text_.size()) {
+            fail("bad \\u escape");
+          }
+          unsigned code = 0;
+          for (char digit : text_.substr(pos_, 4)) {
+            if (!std::isxdigit(digit)) {
+              fail("bad \\u escape");
+            }
+            code = code * 16 + (std::isdigit(digit)
+                                    ? digit - '0'
+                                    : std::tolower(digit) - 'a' + 10);
+          }
+          pos_ += 4;
+          out += code < 0x80 ? static_cast<char>(code) : '?';
+          break;
+        }
+        default:
+          out += escaped;
+          break;
+      }
+    }
+  }
+};
+
+std::string quote(std::string_view str) {
+  std::string out = "\"";
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += std::format("\\u{:04x}", static_cast<int>(c));
+        } else {
+          out += c;
+        }
+        break;
+    }
+  }
+  return out + "\"";
+}
+
+std::string to_json(const Json& json) {
+  return std::visit(
+      [](const auto& value) -> std::string {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::nullptr_t>) {
+          return "null";
+        } else if constexpr (std::is_same_v<T, bool>) {
+          return value ? "true" : "false";
+        } else if constexpr (std::is_same_v<T, int64_t>) {
+          return std::to_string(value);
+        } else if constexpr (std::is_same_v<T, std::string>) {
+          return quote(value);
+        } else if constexpr (std::is_same_v<T, Json::Array>) {
+          std::string out = "[";
+          for (const Json& item : value) {
+            out += (out.size() > 1 ? "," : "") + to_json(item);
+          }
+          return out + "]";
+        } else {
+          std::string out = "{";
+          for (const auto& [key, member] : value) {
+            out += (out.size() > 1 ? "," : "") + quote(key) + ":" +
+                   to_json(member);
+          }
+          return out + "}";
+        }
+      },
+      json.value);
+}
+
+// Builds a JSON object one member at a time
+class ObjectWriter {
+ public:
+  ObjectWriter& add(std::string_view key, int64_t value) {
+    return raw(key, std::to_string(value));
+  }
+  ObjectWriter& add(std::string_view key, bool value) {
+    return raw(key, value ? "true" : "false");
+  }
+  ObjectWriter& add(std::string_view key, std::string_view value) {
+    return raw(key, quote(value));
+  }
+  ObjectWriter& add(std::string_view key, const char* value) {
+    return raw(key, quote(value));
+  }
+  // value is already JSON
+  ObjectWriter& raw(std::string_view key, std::string_view value) {
+    out_ += out_.empty() ? "{" : ",";
+    out_ += quote(key);
+    out_ += ':';
+    out_ += value;
+    return *this;
+  }
+  std::string str() const { return out_.empty() ? "{}" : out_ + "}"; }
+
+ private:
+  std::string out_;
+};
+
+int64_t integer(const Json& request, std::string_view key, int64_t min,
+                int64_t max, std::optional<int64_t> fallback = std::nullopt) {
+  const Json* member = request.get(key);
+  if (member == nullptr) {
+    if (fallback) {
+      return *fallback;
+    }
+    throw request_error(std::format("Missing \"{}\"", key));
+  }
+  const int64_t* value = std::get_if<int64_t>(&member->value);
+  if (value == nullptr || *value < min || *value > max) {
+    throw request_error(
+        std::format("\"{}\" must be an integer from {} to {}", key, min, max));
+  }
+  return *value;
+}
+
+Debugger::address_t address(const Json& request, std::string_view key) {
+  return integer(request, key, 0, 0xFFFF);
+}
+
+bool boolean(const Json& request, std::string_view key, bool fallback) {
+  const Json* member = request.get(key);
+  if (member == nullptr) {
+    return fallback;
+  }
+  const bool* value = std::get_if<bool>(&member->value);
+  if (value == nullptr) {
+    throw request_error(std::format("\"{}\" must be true or false", key));
+  }
+  return *value;
+}
+
+std::optional<std::string> string(const Json& request, std::string_view key) {
+  const Json* member = request.get(key);
+  if (member == nullptr) {
+    return std::nullopt;
+  }
+  const std::string* value = std::get_if<std::string>(&member->value);
+  if (value == nullptr) {
+    throw request_error(std::format("\"{}\" must be a string", key));
+  }
+  return *value;
+}
+
+std::optional<Expression> condition(const Json& request) {
+  std::optional<std::string> source = string(request, "if");
+  if (!source) {
+    return std::nullopt;
+  }
+  return Expression(*source);
+}
+
+std::string hex(std::span<const uint8_t> bytes) {
+  static constexpr char kDigits[] = "0123456789abcdef";
+  std::string out(bytes.size() * 2, '\0');
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    out[i * 2] = kDigits[bytes[i] >> 4];
+    out[i * 2 + 1] = kDigits[bytes[i] & 0xF];
+  }
+  return out;
+}
+
+std::vector<uint8_t> unhex(std::string_view str) {
+  auto digit = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    throw request_error("\"data\" must be a hex string");
+  };
+  if (str.size() % 2 != 0) {
+    throw request_error("\"data\" must have an even number of digits");
+  }
+  std::vector<uint8_t> bytes(str.size() / 2);
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = digit(str[i * 2]) << 4 | digit(str[i * 2 + 1]);
+  }
+  return bytes;
+}
+
+const char* mode_name(uint8_t flags) {
+  switch (flags) {
+    case cpu::kWatchRead:
+      return "r";
+    case cpu::kWatchWrite:
+      return "w";
+    default:
+      return "rw";
+  }
+}
+
+// Remove the socket a previous server left at path. Anything else there is
+// left alone: the path is likely a typo.
+void remove_socket(const std::string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    return;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    throw socket_error(std::format("{} exists and is not a socket", path));
+  }
+  unlink(path.c_str());
+}
+
+// Closes a file descriptor when it goes out of scope
+struct FileDescriptor {
+  int fd;
+  explicit FileDescriptor(int fd) : fd(fd) {}
+  ~FileDescriptor() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+};
+
+}  // namespace
+
+DebugServer::DebugServer(Debugger& debugger)
+    : debugger_(debugger), traces_(), exiting_(false) {
+  debugger_.set_trace_output(traces_);
+}
+
+DebugServer::~DebugServer() { debugger_.set_trace_output(std::cout); }
+
+bool DebugServer::exiting() const { return exiting_; }
+
+std::string DebugServer::handle(std::string_view line) {
+  Json requests;
+  try {
+    requests = JsonParser(line).parse();
+  } catch (const request_error& e) {
+    return ObjectWriter().add("ok", false).add("error", e.what()).str();
+  }
+
+  cpu::CPU& cpu = debugger_.cpu();
+  auto respond = [&](const Json& request) {
+    ObjectWriter response;
+    if (const Json* id = request.get("id")) {
+      response.raw("id", to_json(*id));
+    }
+    try {
+      std::optional<std::string> cmd = string(request, "cmd");
+      if (!cmd) {
+        throw request_error("Missing \"cmd\"");
+      }
+
+      if (*cmd == "step" || *cmd == "continue" || *cmd == "back" ||
+          *cmd == "reverse-continue") {
+        Debugger::RunResult result;
+        if (*cmd == "step") {
+          result =
+              debugger_.run(integer(request, "count", 1, INT64_MAX, 1), false);
+        } else if (*cmd == "continue") {
+          result =
+              debugger_.run(integer(request, "limit", 1, INT64_MAX, INT64_MAX));
+        } else if (*cmd == "back") {
+          result = debugger_.back(integer(request, "count", 1, INT64_MAX, 1));
+        } else {
+          result = debugger_.reverse_run();
+        }
+        static constexpr const char* kStops[] = {"breakpoint", "watchpoint",
+                                                 "limit", "history-start"};
+        response.add("ok", true)
+            .add("stop", kStops[result.stop])
+            .add("instructions", static_cast<int64_t>(result.instructions))
+            .add("pc", int64_t{cpu.PC()});
+        if (const auto& hit = debugger_.watch_hit()) {
+          response.raw("watch", ObjectWriter()
+                                    .add("addr", int64_t{hit->addr})
+                                    .add("value", int64_t{hit->value})
+                                    .add("write", hit->write)
+                                    .str());
+        }
+        if (!traces_.str().empty()) {
+          Json::Array lines;
+          std::istringstream traces(traces_.str());
+          for (std::string trace; std::getline(traces, trace);) {
+            lines.push_back({trace});
+          }
+          response.raw("trace", to_json({lines}));
+        }
+      } else if (*cmd == "registers") {
+        response.add("ok", true)
+            .add("pc", int64_t{cpu.PC()})
+            .add("sp", int64_t{cpu.SP()})
+            .add("a", int64_t{cpu.A()})
+            .add("x", int64_t{cpu.X()})
+            .add("y", int64_t{cpu.Y()})
+            .add("p", int64_t{cpu.P()});
+      } else if (*cmd == "set") {
+        static constexpr std::pair<const char*, Debugger::Register> kRegs[] =
+            {{"pc", Debugger::kRegPC}, {"sp", Debugger::kRegSP},
+             {"a", Debugger::kRegA},   {"x", Debugger::kRegX},
+             {"y", Debugger::kRegY},   {"p", Debugger::kRegP}};
+        // Checked first, so a bad value changes nothing
+        std::vector<std::pair<Debugger::Register, uint16_t>> values;
+        for (auto [name, reg] : kRegs) {
+          if (request.get(name) != nullptr) {
+            values.emplace_back(
+                reg, integer(request, name, 0,
+                             reg == Debugger::kRegPC ? 0xFFFF : 0xFF));
+          }
+        }
+        for (auto [reg, value] : values) {
+          debugger_.set_register(reg, value);
+        }
+        response.add("ok", true);
+      } else if (*cmd == "read") {
+        Debugger::address_t addr = address(request, "addr");
+        std::size_t len = integer(request, "len", 1, 0x10000, 1);
+        std::vector<uint8_t> bytes(len);
+        debugger_.read(addr, bytes, boolean(request, "side_effects", false));
+        response.add("ok", true).add("data", hex(bytes));
+      } else if (*cmd == "write") {
+        Debugger::address_t addr = address(request, "addr");
+        std::optional<std::string> data = string(request, "data");
+        if (!data) {
+          throw request_error("Missing \"data\"");
+        }
+        debugger_.write(addr, unhex(*data));
+        response.add("ok", true);
+      } else if (*cmd == "break" || *cmd == "trace") {
+        Debugger::address_t addr = address(request, "addr");
+        std::optional<TraceFormat> trace;
+        if (*cmd == "trace") {
+          std::optional<std::string> message = string(request, "message");
+          if (!message) {
+            throw request_error("Missing \"message\"");
+          }
+          trace.emplace(*message);
+        }
+        debugger_.set_breakpoint(addr, condition(request), std::move(trace));
+        response.add("ok", true);
+      } else if (*cmd == "delete") {
+        response.add("ok", true)
+            .add("deleted",
+                 debugger_.delete_breakpoint(address(request, "addr")));
+      } else if (*cmd == "watch") {
+        Debugger::address_t addr = address(request, "addr");
+        std::string mode = string(request, "mode").value_or("w");
+        uint8_t flags = mode == "r"    ? cpu::kWatchRead
+                        : mode == "w"  ? cpu::kWatchWrite
+                        : mode == "rw" ? cpu::kWatchRead | cpu::kWatchWrite
+                                       : 0;
+        if (flags == 0) {
+          throw request_error("\"mode\" must be r, w or rw");
+        }
+        debugger_.set_watchpoint(addr, flags);
+        response.add("ok", true);
+      } else if (*cmd == "unwatch") {
+        Debugger::address_t addr = address(request, "addr");
+        bool deleted = debugger_.watchpoint(addr) != 0;
+        debugger_.set_watchpoint(addr, 0);
+        response.add("ok", true).add("deleted", deleted);
+      } else if (*cmd == "list") {
+        std::string breakpoints = "[";
+        for (Debugger::address_t addr : debugger_.breakpoints()) {
+          const Debugger::Breakpoint& breakpoint = *debugger_.breakpoint(addr);
+          ObjectWriter entry;
+          entry.add("addr", int64_t{addr});
+          if (breakpoint.condition) {
+            entry.add("if", breakpoint.condition->source());
+          }
+          if (breakpoint.trace) {
+            entry.add("message", breakpoint.trace->source());
+          }
+          breakpoints += (breakpoints.size() > 1 ? "," : "") + entry.str();
+        }
+        std::string watchpoints = "[";
+        for (Debugger::address_t addr : debugger_.watchpoints()) {
+          watchpoints +=
+              (watchpoints.size() > 1 ? "," : "") +
+              ObjectWriter()
+                  .add("addr", int64_t{addr})
+                  .add("mode", mode_name(debugger_.watchpoint(addr)))
+                  .str();
+        }
+        response.add("ok", true)
+            .raw("breakpoints", breakpoints + "]")
+            .raw("watchpoints", watchpoints + "]");
+      } else if (*cmd == "clear") {
+        debugger_.clear();
+        response.add("ok", true);
+      } else if (*cmd == "exit") {
+        exiting_ = true;
+        response.add("ok", true);
+      } else {
+        throw request_error(std::format("Unknown command \"{}\"", *cmd));
+      }
+    } catch (const std::exception& e) {
+      // Request errors, bad expressions and CPU errors alike
+      response.add("ok", false).add("error", e.what());
+    }
+    traces_.str("");
+    return response.str();
+  };
+
+  if (const Json::Array* batch = std::get_if<Json::Array>(&requests.value)) {
+    std::string out = "[";
+    for (const Json& request : *batch) {
+      out += (out.size() > 1 ? "," : "") + respond(request);
+    }
+    return out + "]";
+  }
+  return respond(requests);
+}
+
+void DebugServer::serve(const std::string& path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw socket_error(std::format("Socket path too long: {}", path));
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  remove_socket(path);
+  FileDescriptor listener(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener.fd < 0 ||
+      bind(listener.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) <
+          0 ||
+      listen(listener.fd, 1) < 0) {
+    throw socket_error(std::format("Could not listen on {}: {}", path,
+                                   std::strerror(errno)));
+  }
+  BOOST_LOG_TRIVIAL(info) << "Debugger listening on " << path;
+
+  std::vector<char> chunk(1 << 16);
+  while (!exiting_) {
+    FileDescriptor client(accept(listener.fd, nullptr, nullptr));
+    if (client.fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw socket_error(
+          std::format("Could not accept a client: {}", std::strerror(errno)));
+    }
+    BOOST_LOG_TRIVIAL(debug) << "Debugger client connected";
+
+    std::string pending;
+    while (!exiting_) {
+      ssize_t received = recv(client.fd, chunk.data(), chunk.size(), 0);
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      if (received <= 0) {
+        break;
+      }
+      pending.append(chunk.data(), received);
+
+      // Answer every complete line, then send the answers together
+      std::string out;
+      std::size_t start = 0;
+      for (std::size_t end; (end = pending.find('\n', start)) !=
+                            std::string::npos;
+           start = end + 1) {
+        std::string_view line(pending.data() + start, end - start);
+        if (!line.empty() && line.back() == '\r') {
+          line.remove_suffix(1);
+        }
+        if (!line.empty()) {
+          out += handle(line);
+          out += '\n';
+        }
+      }
+      pending.erase(0, start);
+
+      for (std::size_t sent = 0; sent < out.size();) {
+        ssize_t n = send(client.fd, out.data() + sent, out.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          BOOST_LOG_TRIVIAL(info) << "Debugger client went away";
+          break;
+        }
+        sent += n;
+      }
+    }
+    BOOST_LOG_TRIVIAL(debug) << "Debugger client disconnected";
+  }
+  remove_socket(path);
+}
+
+}  // namespace debugger
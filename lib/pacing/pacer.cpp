@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <format>
+#include <string>
+#include <thread>
+
+#include "pacing.hpp"
+
+namespace pacing {
+
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+// Bounds on how long before a deadline to start spinning. Even a well-behaved
+// scheduler wakes a thread tens of microseconds late.
+constexpr Clock::duration kMinSpinMargin = microseconds(100);
+constexpr Clock::duration kMaxSpinMargin = microseconds(2000);
+// A frame that starts later than this after its deadline counts as late
+constexpr Clock::duration kLateThreshold = microseconds(1000);
+
+double millis(Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+}  // namespace
+
+void FrameTimeHistogram::add(Clock::duration frame_time) {
+  std::size_t bucket = static_cast<std::size_t>(
+      std::max(frame_time, Clock::duration::zero()) / kBucketWidth);
+  buckets_[std::min(bucket, kBuckets)]++;
+  count_++;
+  total_ += frame_time;
+  max_ = std::max(max_, frame_time);
+}
+
+std::size_t FrameTimeHistogram::count() const { return count_; }
+
+Clock::duration FrameTimeHistogram::mean() const {
+  return count_ == 0 ? Clock::duration::zero()
+                     : total_ / static_cast<Clock::rep>(count_);
+}
+
+Clock::duration FrameTimeHistogram::max() const { return max_; }
+
+Clock::duration FrameTimeHistogram::percentile(double fraction) const {
+  if (count_ == 0) {
+    return Clock::duration::zero();
+  }
+  std::size_t wanted = std::max<std::size_t>(
+      1, static_cast<std::size_t>(fraction * count_ + 0.5));
+  std::size_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= wanted) {
+      return kBucketWidth * (i + 1);
+    }
+  }
+  return max_;
+}
+
+void FrameTimeHistogram::print(std::ostream& out) const {
+  out << std::format(
+      "{} frames: mean {:.2f}ms, p50 {:.2f}ms, p99 {:.2f}ms, max {:.2f}ms\n",
+      count_, millis(mean()), millis(percentile(0.5)),
+      millis(percentile(0.99)), millis(max_));
+  std::size_t most = *std::max_element(buckets_.begin(), buckets_.end());
+  for (std::size_t i = 0; i <= kBuckets; i++) {
+    if (buckets_[i] == 0) {
+      continue;
+    }
+    std::string label =
+        i == kBuckets ? std::format(">{:.2f}ms", millis(kBucketWidth * i))
+                      : std::format("{:.2f}ms", millis(kBucketWidth * i));
+    std::size_t width = (buckets_[i] * 50 + most - 1) / most;
+    out << std::format("{:>9} {:>7} {}\n", label, buckets_[i],
+                       std::string(width, '#'));
+  }
+}
+
+Pacer::Pacer(double frame_rate, std::size_t max_catch_up)
+    : period_(duration_cast<Clock::duration>(
+          std::chrono::duration<double>(1.0 / frame_rate))),
+      max_catch_up_(max_catch_up),
+      started_(false),
+      deadline_(),
+      last_start_(),
+      spin_margin_(kMinSpinMargin),
+      fill_(),
+      histogram_(),
+      dropped_(0),
+      late_(0),
+      stopped_(false) {}
+
+void Pacer::wait() {
+  if (!started_) {
+    started_ = true;
+    last_start_ = deadline_ = Clock::now();
+    return;
+  }
+
+  Clock::duration period = period_;
+  if (fill_) {
+    // Fuller than half: the consumer is behind, so slow down, and vice versa
+    double error = std::clamp(fill_(), 0.0, 1.0) - 0.5;
+    period += duration_cast<Clock::duration>(period_ * (error * 2.0 *
+                                                        kMaxRateAdjust));
+  }
+  deadline_ += period;
+
+  Clock::time_point now = Clock::now();
+  if (now < deadline_) {
+    sleep_until(deadline_);
+    now = Clock::now();
+  } else if (now - deadline_ >
+             period * static_cast<Clock::rep>(max_catch_up_)) {
+    // Too far behind to catch up: forget the missed frames
+    dropped_ += static_cast<std::size_t>((now - deadline_) / period);
+    deadline_ = now;
+  }
+  if (now - deadline_ > kLateThreshold) {
+    late_++;
+  }
+
+  histogram_.add(now - last_start_);
+  last_start_ = now;
+}
+
+void Pacer::sleep_until(Clock::time_point deadline) {
+  Clock::time_point wake = deadline - spin_margin_;
+  if (Clock::now() < wake) {
+    std::this_thread::sleep_until(wake);
+    // Track how late sleeps wake up, with some headroom, so the spin is just
+    // long enough to cover it
+    Clock::duration overshoot = Clock::now() - wake;
+    spin_margin_ = std::clamp(
+        (spin_margin_ * 7 + std::max(overshoot * 2, Clock::duration::zero())) /
+            8,
+        kMinSpinMargin, kMaxSpinMargin);
+  }
+  while (Clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+}
+
+void Pacer::set_rate_control(std::function<double()> fill) {
+  fill_ = std::move(fill);
+}
+
+void Pacer::stop() { stopped_.store(true, std::memory_order_relaxed); }
+
+bool Pacer::stopped() const {
+  return stopped_.load(std::memory_order_relaxed);
+}
+
+const FrameTimeHistogram& Pacer::histogram() const { return histogram_; }
+
+std::size_t Pacer::dropped_frames() const { return dropped_; }
+
+std::size_t Pacer::late_frames() const { return late_; }
+
+}  // namespace pacing
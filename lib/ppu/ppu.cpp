@@ -3,17 +3,44 @@
 // #include <GL/gl.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <bit>
 #include <boost/log/trivial.hpp>
+#include <cstring>
 #include <format>
 
 #include "util.hpp"
 
 namespace ppu {
-PPU::PPU(GLFWwindow& window)
-    : nametables_({}),
+PPU::PPU(cartridge::Cartridge& cart,
+         std::optional<std::reference_wrapper<GLFWwindow>> window)
+    : ciram_({}),
       palette_ram_({}),
+      oam_({}),
       internal_frame_buf_(),
-      window_(window) {
+      screen_({}),
+      canvas_({}),
+      canvas_dirty_(),
+      canvas_banks_({}),
+      canvas_chr_banks_({}),
+      sprite_lines_({}),
+      sprite_lines_dirty_(true),
+      secondary_oam_({}),
+      cart_(cart),
+      nametable_banks_(cart.nametable_banks()),
+      window_(window),
+      frame_sinks_(),
+      PPUCTRL_(0),
+      PPUMASK_(0),
+      PPUSTATUS_(0),
+      OAMADDR_(0),
+      v_(0),
+      t_(0),
+      fine_x_(0),
+      w_(false),
+      suppress_output_(false) {
+  canvas_dirty_.set();
+  cart_.attach_ciram(ciram_.data());
   // Function called whenever glfw errors
   glfwSetErrorCallback([](int err, const char* desc) {
     BOOST_LOG_TRIVIAL(error) << "GLFW error" << err << ": " << desc << "\n";
@@ -25,27 +52,72 @@ PPU::~PPU() {
   glfwTerminate();
 }
 
+// PPUSTATUS flags
+constexpr uint8_t kVBlankFlag = 0b1000'0000;
+constexpr uint8_t kSpriteZeroHitFlag = 0b0100'0000;
+constexpr uint8_t kSpriteOverflowFlag = 0b0010'0000;
+
+// Reverse the bits of a byte, so that bit 0 is the leftmost pixel of a pattern
+// table row instead of bit 7
+uint8_t reverse_bits(uint8_t b) {
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+  return b;
+}
+
 // Note: sets vblank flag!
-void PPU::render_to_window() {
+void PPU::render_frame() {
+  begin_frame();
+  for (int line = 0; line < kScreenHeight; ++line) {
+    render_scanline(line);
+  }
+  end_frame();
+}
+
+void PPU::begin_frame() {
+  PPUSTATUS_ &= ~(kVBlankFlag | kSpriteZeroHitFlag | kSpriteOverflowFlag);
+  if (rendering_enabled()) {
+    // Scanline counters also count the pre-render line
+    cart_.clock_scanline();
+  }
+}
+
+// Note: sets vblank flag!
+void PPU::end_frame() {
+  PPUSTATUS_ |= kVBlankFlag;
+  if (suppress_output_) {
+    return;
+  }
+
   if (!internal_frame_buf_) {
     // Unallocated, allocate it
     try {
       internal_frame_buf_ = std::make_unique<frame_t>();
     } catch (const std::bad_alloc&) {
-      BOOST_LOG_TRIVIAL(error) << "render_to_window: Error when allocating "
+      BOOST_LOG_TRIVIAL(error) << "end_frame: Error when allocating "
                                   "memory for internal framebuffer\n";
       throw;
     }
   }
 
-  // Render current cpu data to internal buf
-  render_to_framebuffer(*internal_frame_buf_);
+  to_rgb(*internal_frame_buf_);
+
+  for (FrameSink* sink : frame_sinks_) {
+    sink->consume(*internal_frame_buf_);
+  }
+
+  if (!window_.has_value()) {
+    // Headless: nothing to draw
+    return;
+  }
+  GLFWwindow& window = window_->get();
 
   // Actual size of window
   int width, height;
 
   // Setup viewport (full window)
-  glfwGetFramebufferSize(&window_, &width, &height);
+  glfwGetFramebufferSize(&window, &width, &height);
   glViewport(0, 0, width, height);
 
   // Clear window contents
@@ -55,154 +127,496 @@ void PPU::render_to_window() {
                internal_frame_buf_->data());
 
   // glfw windows are double buffered
-  glfwSwapBuffers(&window_);
-  // process all waiting events
-  glfwPollEvents();  // TODO: window refresh callback as in fn hint
+  glfwSwapBuffers(&window);
 }
 
+bool PPU::has_window() const { return window_.has_value(); }
+
+void PPU::add_frame_sink(FrameSink& sink) { frame_sinks_.push_back(&sink); }
+
 // Note: sets vblank flag!
 void PPU::render_to_framebuffer(frame_t& out) {
+  begin_frame();
+  for (int line = 0; line < kScreenHeight; ++line) {
+    render_scanline(line);
+  }
+  PPUSTATUS_ |= kVBlankFlag;
+  to_rgb(out);
+}
+
+void PPU::render_scanline(int line) {
   // From wiki:
   //       $3F00 	Universal background color
   // $3F01-$3F03 	Background palette 0
   // $3F05-$3F07 	Background palette 1
   // $3F09-$3F0B 	Background palette 2
   // $3F0D-$3F0F 	Background palette 3
+  // $3F11-$3F1F  Sprite palettes 0-3 (same layout)
+
+  std::array<uint8_t, kScreenWidth> bg_row;
+  std::array<uint8_t, kScreenWidth> sprite_row;
+  line_mask_t bg_opaque;
+  line_mask_t sprite_behind;
+  line_mask_t sprite_zero;
+
+  if (rendering_enabled()) {
+    // At the end of the pre-render line all of t is copied into v. At the end
+    // of every other line only the horizontal bits are.
+    constexpr uint16_t kHorizontalBits = 0x041F;
+    if (line == 0) {
+      v_ = t_;
+    } else {
+      v_ = (v_ & ~kHorizontalBits) | (t_ & kHorizontalBits);
+    }
+  }
+
+  // Sprite evaluation: copy the first 8 sprites on this line to secondary OAM.
+  // Only happens while rendering is enabled.
+  int count = 0;
+  bool has_sprite_zero = false;
+  if (rendering_enabled()) {
+    if (sprite_lines_dirty_) {
+      evaluate_sprite_lines();
+    }
+    uint64_t on_line = sprite_lines_[line];
+    has_sprite_zero = on_line & 1;
+    while (on_line != 0 && count < kMaxSpritesPerLine) {
+      int sprite = std::countr_zero(on_line);
+      on_line &= on_line - 1;
+      std::memcpy(&secondary_oam_[count * 4], &oam_[sprite * 4], 4);
+      ++count;
+    }
+    // Note: real hardware has a buggy overflow check that can give false
+    // positives/negatives. We set the flag whenever more than 8 sprites are on
+    // the line.
+    if (on_line != 0) {
+      PPUSTATUS_ |= kSpriteOverflowFlag;
+    }
+  }
+
+  if (!show_sprites()) {
+    count = 0;
+    has_sprite_zero = false;
+  }
+
+  // With output suppressed, pixels are only needed to find a sprite 0 hit
+  bool test_sprite_zero =
+      has_sprite_zero && show_background() && !sprite_zero_hit();
+  if (suppress_output_ && !test_sprite_zero) {
+    advance_scanline();
+    return;
+  }
+
+  render_background_line(bg_row, bg_opaque);
+  render_sprite_line(line, count, has_sprite_zero, sprite_row, sprite_behind,
+                     sprite_zero);
+
+  // Sprite 0 hit: an opaque pixel of sprite 0 overlaps an opaque background
+  // pixel. Never happens at x = 255.
+  if (test_sprite_zero) {
+    line_mask_t hit = bg_opaque & sprite_zero;
+    hit.reset(kScreenWidth - 1);
+    if (hit.any()) {
+      PPUSTATUS_ |= kSpriteZeroHitFlag;
+    }
+  }
+  if (suppress_output_) {
+    advance_scanline();
+    return;
+  }
+
+  // from wiki: Greyscale is implemented as a bitwise AND with $30 on any
+  //  value read from PPU $3F00-$3FFF, both on the display and through
+  //  PPUDATA
+  uint8_t color_mask = greyscale() ? 0x30 : 0x3F;
+
+  pixel_t* out = &screen_[line * kScreenWidth];
+  for (int x = 0; x < kScreenWidth; ++x) {
+    uint8_t palette_idx = bg_row[x];  // 0 is the universal background color
+    if (sprite_row[x] != 0 && (bg_row[x] == 0 || !sprite_behind[x])) {
+      palette_idx = 0x10 | sprite_row[x];
+    }
+    out[x] = palette_ram_[palette_idx] & color_mask;
+  }
+  advance_scanline();
+}
+
+void PPU::advance_scanline() {
+  if (rendering_enabled()) {
+    // Move v down one line, wrapping from the last tile row of a nametable to
+    // the first of the one below it
+    if ((v_ & 0x7000) != 0x7000) {
+      v_ += 0x1000;  // fine Y
+    } else {
+      v_ &= ~0x7000;
+      int coarse_y = (v_ & 0x03E0) >> 5;
+      if (coarse_y == kTileRows_ - 1) {
+        coarse_y = 0;
+        v_ ^= 0x0800;  // switch vertical nametable
+      } else if (coarse_y == 31) {
+        // Out of bounds coarse Y (set through PPUSCROLL) wraps without
+        // switching nametables
+        coarse_y = 0;
+      } else {
+        coarse_y++;
+      }
+      v_ = (v_ & ~0x03E0) | (coarse_y << 5);
+    }
+    cart_.clock_scanline();
+  }
+}
+
+void PPU::render_background_line(std::array<uint8_t, kScreenWidth>& row,
+                                 line_mask_t& opaque) {
+  opaque.reset();
+  if (!show_background()) {
+    row.fill(0);
+    return;
+  }
+
+  // Position of the top left pixel of this line in the 512x480 canvas
+  int nametable = (v_ >> 10) & 0b11;
+  int coarse_x = v_ & 0x1F;
+  int coarse_y = (v_ >> 5) & 0x1F;
+  int fine_y = (v_ >> 12) & 0b111;
+  int x = (nametable & 1) * kScreenWidth + coarse_x * 8 + fine_x_;
+  // Note: coarse Y of 30 or 31 (only reachable through PPUSCROLL) reads the
+  // attribute table as tiles on hardware. We continue into the nametable below
+  // instead.
+  int y = ((nametable >> 1) * kScreenHeight + coarse_y * 8 + fine_y) %
+          kCanvasHeight_;
+
+  // The canvas is only valid for the nametable layout and background pattern
+  // table banks it was built with
+  const auto& chr_banks = cart_.chr_banks();
+  auto bg_chr = chr_banks.begin() + ((PPUCTRL_ & 0b1'0000) ? 4 : 0);
+  if (nametable_banks_ != canvas_banks_ ||
+      !std::equal(bg_chr, bg_chr + 4, canvas_chr_banks_.begin())) {
+    invalidate_canvas();
+    canvas_banks_ = nametable_banks_;
+    std::copy(bg_chr, bg_chr + 4, canvas_chr_banks_.begin());
+  }
 
-  for (int y = 0; y < kScreenHeight; ++y) {
-    for (int x = 0; x < kScreenWidth; ++x) {
-      int i = y * kScreenWidth + x;
-      // Calculate part of attribute table that corresponds to this pixel
-
-      // Width is 256 pixels, attribute table is 8x8 chunks. Each byte in the
-      // attribute table contains four colors for each of its four 16x16 px
-      // quadrants.
-      constexpr int byte_px_width = kScreenWidth / 8;
-
-      // Coordinates of the attribute table entry this pixel belongs to. Between
-      // 0 and 7
-      uint8_t attr_y = y / byte_px_width;
-      uint8_t attr_x = x / byte_px_width;
-      assert(attr_y < 8 && attr_x < 8);
-
-      // Coordinates of quadrant in byte; either 0 or 1
-      uint8_t quadrant_y = (y / 16) % 2;
-      uint8_t quadrant_x = (x / 16) % 2;
-      uint8_t quadrant_idx = quadrant_y * 2 + quadrant_x;
-
-      // Attribute table is 64 bytes at $23C0, a 8x8 byte array
-      constexpr uint16_t attr_table_start = 0x23C0;
-
-      // Nametable: indexes into pattern table
-      // There are 4 palettes for background: 0 to 3
-      // Attribute table selects which palette the given tile is using
-
-      // Hardcoded to 1; bit 1 of four in palette (0 is transparent). This data
-      // is from pattern table!
-      uint8_t index_into_palette = 0x01;
-
-      // Attribute is for palette selection. It's one byte for color selection
-      // for each 16x16px quadrant of the 32x32px tile from current palette (2
-      // bits for each quadrant)
-      uint8_t attribute = read(attr_table_start + i / 16);
-
-      // Mask color out of attribute depending on quadrant
-      pixel_t quadrant_color_idx = (attribute >> quadrant_idx) & 0b11;
-
-      // Use color index in current frame palette to find actual color.
-      // TODO: Lowest two bits are supposed to be for tile data but we don't
-      // implement tiles so hardcoded to index_into_palette
-      constexpr uint16_t palette_ram_start = 0x3F00;
-      uint8_t color_offset = (quadrant_color_idx << 2) & index_into_palette;
-      pixel_t nes_color = read(palette_ram_start + color_offset);
-
-      color_t color;
-      try {
-        color = kColorTable.at(nes_color);
-      } catch (...) {
-        BOOST_LOG_TRIVIAL(error) << "Bad color from CPU when rendering frame: "
-                                 << util::fmt_hex(nes_color) << "\n";
-        // default to black
-        color = 0x0;
+  // Both nametables this canvas row spans must be up to date
+  int top = (y / kScreenHeight) * 2;
+  int tile_row = (y % kScreenHeight) / 8;
+  for (int nt = top; nt < top + 2; ++nt) {
+    if (canvas_dirty_[nt * kTileRows_ + tile_row]) {
+      build_canvas_row(nt, tile_row);
+    }
+  }
+
+  // The line wraps around horizontally at most once
+  const uint8_t* src = &canvas_[y * kCanvasWidth_];
+  int first = std::min(kScreenWidth, kCanvasWidth_ - x);
+  std::memcpy(row.data(), src + x, first);
+  std::memcpy(row.data() + first, src, kScreenWidth - first);
+
+  if (!(PPUMASK_ & 0b10)) {
+    // Background hidden in the leftmost 8 pixels
+    std::fill_n(row.begin(), 8, 0);
+  }
+
+  // Packed 64 pixels at a time, so building the mask vectorizes
+  for (int word = kScreenWidth / 64 - 1; word >= 0; --word) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; ++i) {
+      bits |= static_cast<uint64_t>(row[word * 64 + i] != 0) << i;
+    }
+    opaque = (opaque << 64) | line_mask_t(bits);
+  }
+}
+
+void PPU::build_canvas_row(int nametable, int tile_row) {
+  uint16_t base = 0x2000 + nametable * kNametableSize_;
+  uint16_t pattern_table = (PPUCTRL_ & 0b1'0000) ? 0x1000 : 0x0000;
+  uint8_t* dst = &canvas_[((nametable >> 1) * kScreenHeight + tile_row * 8) *
+                              kCanvasWidth_ +
+                          (nametable & 1) * kScreenWidth];
+
+  for (int tile_x = 0; tile_x < kScreenWidth / 8; ++tile_x) {
+    uint8_t tile = read(base + tile_row * 32 + tile_x);
+
+    // The attribute table is 64 bytes after the 960 tile bytes. Each byte
+    // covers 4x4 tiles with 2 bits of palette selection for each 2x2 quadrant
+    uint8_t attribute = read(base + 0x3C0 + (tile_row / 4) * 8 + tile_x / 4);
+    uint8_t shift = ((tile_row & 0b10) << 1) | (tile_x & 0b10);
+    uint8_t palette = ((attribute >> shift) & 0b11) << 2;
+
+    // Pattern table: 16 bytes per tile, low bit plane then high bit plane
+    uint16_t pattern = pattern_table + tile * 16;
+    for (int fine_y = 0; fine_y < 8; ++fine_y) {
+      uint8_t lo = cart_.ppu_read(pattern + fine_y);
+      uint8_t hi = cart_.ppu_read(pattern + fine_y + 8);
+      uint8_t* px = dst + fine_y * kCanvasWidth_ + tile_x * 8;
+      for (int bit = 7; bit >= 0; --bit) {
+        uint8_t idx = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+        *px++ = idx == 0 ? 0 : palette | idx;
       }
+    }
+  }
+  canvas_dirty_.reset(nametable * kTileRows_ + tile_row);
+}
 
-      color_t r = (color >> 16) & 0xFF;
-      color_t g = (color >> 8) & 0xFF;
-      color_t b = color & 0xFF;
+void PPU::invalidate_nametable(uint16_t addr) {
+  int offset = addr % kNametableSize_;
+  int first_row = offset / 32;
+  int last_row = first_row + 1;
+  if (offset >= 0x3C0) {
+    // An attribute byte covers 4 tile rows
+    first_row = ((offset - 0x3C0) / 8) * 4;
+    last_row = std::min(first_row + 4, kTileRows_);
+  }
+  const uint8_t* bank = nametable_banks_[(addr >> 10) & 0b11];
+  for (int nametable = 0; nametable < 4; ++nametable) {
+    if (nametable_banks_[nametable] != bank) {
+      continue;
+    }
+    for (int row = first_row; row < last_row; ++row) {
+      canvas_dirty_.set(nametable * kTileRows_ + row);
+    }
+  }
+}
+
+void PPU::invalidate_canvas() { canvas_dirty_.set(); }
+
+void PPU::render_sprite_line(int line, int count, bool has_sprite_zero,
+                             std::array<uint8_t, kScreenWidth>& row,
+                             line_mask_t& behind, line_mask_t& sprite_zero) {
+  row.fill(0);
+  behind.reset();
+  sprite_zero.reset();
+
+  int height = sprite_height();
+  for (int i = 0; i < count; ++i) {
+    const uint8_t* sprite = &secondary_oam_[i * 4];
+    uint8_t y = sprite[0];
+    uint8_t tile = sprite[1];
+    uint8_t attributes = sprite[2];
+    uint8_t x = sprite[3];
+
+    // Sprites are drawn one line below their OAM Y coordinate
+    int sprite_y = line - 1 - y;
+    if (attributes & 0b1000'0000) {
+      // Vertical flip
+      sprite_y = height - 1 - sprite_y;
+    }
 
-      // Emphasis
-      if (PPUMASK_ & (1 << 5)) {
-        // red emph
-        r = 0xFA;
+    uint16_t pattern;
+    if (height == 16) {
+      // 8x16 sprites: bit 0 of the tile number selects the pattern table
+      pattern = ((tile & 1) ? 0x1000 : 0x0000) + (tile & 0xFE) * 16;
+      if (sprite_y >= 8) {
+        pattern += 16;
+        sprite_y -= 8;
       }
-      if (PPUMASK_ & (1 << 6)) {
-        // green emph
-        g = 0xFA;
+    } else {
+      pattern = ((PPUCTRL_ & 0b1000) ? 0x1000 : 0x0000) + tile * 16;
+    }
+    uint8_t lo = cart_.ppu_read(pattern + sprite_y);
+    uint8_t hi = cart_.ppu_read(pattern + sprite_y + 8);
+    if (!(attributes & 0b0100'0000)) {
+      // Not horizontally flipped: make bit 0 the leftmost pixel
+      lo = reverse_bits(lo);
+      hi = reverse_bits(hi);
+    }
+
+    uint8_t palette = attributes & 0b11;
+    bool is_behind = attributes & 0b0010'0000;
+    for (int px = 0; px < 8 && x + px < kScreenWidth; ++px) {
+      uint8_t idx = ((lo >> px) & 1) | (((hi >> px) & 1) << 1);
+      // Lower OAM indices have priority, even if they are behind the
+      // background
+      if (idx == 0 || row[x + px] != 0) {
+        continue;
       }
-      if (PPUMASK_ & (1 << 7)) {
-        // blue emph
-        b = 0xFA;
+      row[x + px] = (palette << 2) | idx;
+      if (is_behind) {
+        behind.set(x + px);
       }
+    }
 
-      // Update values in buffer
-      out[i * 3] = r;
-      out[i * 3 + 1] = g;
-      out[i * 3 + 2] = b;
+    if (i == 0 && has_sprite_zero) {
+      sprite_zero = line_mask_t(lo | hi) << x;
     }
   }
 
-  // When done rendering, set the vblank flag
-  PPUSTATUS_ |= 0b1000'0000;
+  if (!(PPUMASK_ & 0b100)) {
+    // Sprites hidden in the leftmost 8 pixels
+    std::fill_n(row.begin(), 8, 0);
+    sprite_zero &= ~line_mask_t(0xFF);
+  }
+}
+
+int PPU::sprite_height() { return (PPUCTRL_ & 0b10'0000) ? 16 : 8; }
+
+void PPU::evaluate_sprite_lines() {
+  // One pass over OAM marking the range of lines each sprite covers, instead
+  // of comparing all 64 Y coordinates on each of the 240 lines
+  sprite_lines_.fill(0);
+  int height = sprite_height();
+  for (int sprite = 0; sprite < 64; ++sprite) {
+    int top = oam_[sprite * 4] + 1;
+    int bottom = std::min(top + height, kScreenHeight);
+    uint64_t bit = uint64_t{1} << sprite;
+    for (int line = top; line < bottom; ++line) {
+      sprite_lines_[line] |= bit;
+    }
+  }
+  sprite_lines_dirty_ = false;
+}
+
+void PPU::to_rgb(frame_t& out) {
+  // Flatten the color table into an array once
+  static const std::array<color_t, 64> colors = [] {
+    std::array<color_t, 64> table{};
+    for (const auto& [nes_color, color] : kColorTable) {
+      table[nes_color] = color;
+    }
+    return table;
+  }();
+
+  // Per-frame lookup tables with emphasis applied
+  std::array<uint8_t, 64> reds, greens, blues;
+  for (std::size_t i = 0; i < colors.size(); ++i) {
+    reds[i] = (PPUMASK_ & (1 << 5)) ? 0xFA : (colors[i] >> 16) & 0xFF;
+    greens[i] = (PPUMASK_ & (1 << 6)) ? 0xFA : (colors[i] >> 8) & 0xFF;
+    blues[i] = (PPUMASK_ & (1 << 7)) ? 0xFA : colors[i] & 0xFF;
+  }
+
+  for (std::size_t i = 0; i < screen_.size(); ++i) {
+    // The two most significant bits of a color are ignored
+    pixel_t nes_color = screen_[i] & 0x3F;
+    out[i * 3] = reds[nes_color];
+    out[i * 3 + 1] = greens[nes_color];
+    out[i * 3 + 2] = blues[nes_color];
+  }
 }
 
 void PPU::set_PPUCTRL(uint8_t val) {
   BOOST_LOG_TRIVIAL(debug) << "PPUCTRL set to " << util::fmt_hex(val) << "\n";
+  if ((PPUCTRL_ ^ val) & 0b10'0000) {
+    // Sprite size changed
+    sprite_lines_dirty_ = true;
+  }
+  if ((PPUCTRL_ ^ val) & 0b1'0000) {
+    // Background pattern table changed
+    invalidate_canvas();
+  }
   PPUCTRL_ = val;
+  // Base nametable bits go to t
+  t_ = (t_ & ~0x0C00) | ((val & 0b11) << 10);
 }
 void PPU::set_PPUMASK(uint8_t val) { PPUMASK_ = val; }
 uint8_t PPU::get_PPUSTATUS() {
   BOOST_LOG_TRIVIAL(debug) << "PPUSTATUS read as " << util::fmt_hex(PPUSTATUS_);
   // Reading ppustatus clears bit 7
   uint8_t status = PPUSTATUS_;
-  PPUSTATUS_ &= 0b0111'1111;
+  PPUSTATUS_ &= ~kVBlankFlag;
+  w_ = false;
   return status;
 }
+uint8_t PPU::peek_PPUSTATUS() const { return PPUSTATUS_; }
 void PPU::set_OAMADDR(uint8_t val) { OAMADDR_ = val; }
-void PPU::set_OAMDATA(uint8_t val) { OAMDATA_ = val; }
-uint8_t PPU::get_OAMDATA() { return OAMDATA_; }
-void PPU::set_PPUSCROLL(uint8_t val) { PPUSCROLL_ = val; }
-void PPU::set_PPUADDR(uint8_t val) { PPUADDR_ = (PPUADDR_ << 8) | val; }
+void PPU::set_OAMDATA(uint8_t val) {
+  // Writes increment OAMADDR, reads don't
+  oam_[OAMADDR_++] = val;
+  sprite_lines_dirty_ = true;
+}
+uint8_t PPU::get_OAMDATA() { return oam_[OAMADDR_]; }
+void PPU::write_OAMDMA(const uint8_t* page) {
+  // The copy starts at OAMADDR and wraps around to the start of OAM
+  std::size_t first = kOAMSize_ - OAMADDR_;
+  std::memcpy(oam_.data() + OAMADDR_, page, first);
+  std::memcpy(oam_.data(), page + first, OAMADDR_);
+  sprite_lines_dirty_ = true;
+}
+void PPU::set_PPUSCROLL(uint8_t val) {
+  if (!w_) {
+    // X scroll: coarse X in t, fine X in x
+    t_ = (t_ & ~0x001F) | (val >> 3);
+    fine_x_ = val & 0b111;
+  } else {
+    // Y scroll: coarse Y and fine Y in t
+    t_ = (t_ & ~0x73E0) | ((val & 0b111) << 12) | ((val & 0xF8) << 2);
+  }
+  w_ = !w_;
+}
+void PPU::set_PPUADDR(uint8_t val) {
+  if (!w_) {
+    // High byte. Bit 14 of t is cleared.
+    t_ = (t_ & 0x00FF) | ((val & 0x3F) << 8);
+  } else {
+    t_ = (t_ & 0xFF00) | val;
+    v_ = t_;
+  }
+  w_ = !w_;
+}
 uint8_t PPU::get_PPUDATA() {
   // wiki: After access, the video memory address will increment by an amount
   // determined by bit 2 of $2000 (1 if 0, 32 if 1)
-  uint8_t val = read(PPUADDR_);
+  uint8_t val = read(v_ & 0x3FFF);
   bool address_inc_bit = PPUCTRL_ & 0b100;
-  PPUADDR_ += address_inc_bit ? 32 : 1;
+  v_ = (v_ + (address_inc_bit ? 32 : 1)) & 0x7FFF;
   return val;
 }
 void PPU::set_PPUDATA(uint8_t val) {
   // wiki: After access, the video memory address will increment by an amount
   // determined by bit 2 of $2000 (1 if 0, 32 if 1)
-  write(PPUADDR_, val);
+  write(v_ & 0x3FFF, val);
   bool address_inc_bit = PPUCTRL_ & 0b100;
-  PPUADDR_ += address_inc_bit ? 32 : 1;
+  v_ = (v_ + (address_inc_bit ? 32 : 1)) & 0x7FFF;
+}
+
+void PPU::suppress_output(bool suppress) { suppress_output_ = suppress; }
+
+void PPU::save_state(savestate::StateWriter& out) const {
+  out.begin_section("PPU ");
+  out.write(ciram_);
+  out.write(palette_ram_);
+  out.write(oam_);
+  out.write(PPUCTRL_);
+  out.write(PPUMASK_);
+  out.write(PPUSTATUS_);
+  out.write(OAMADDR_);
+  out.write(v_);
+  out.write(t_);
+  out.write(fine_x_);
+  out.write(w_);
+}
+
+void PPU::load_state(savestate::StateReader& in) {
+  in.begin_section("PPU ");
+  in.read(ciram_);
+  in.read(palette_ram_);
+  in.read(oam_);
+  in.read(PPUCTRL_);
+  in.read(PPUMASK_);
+  in.read(PPUSTATUS_);
+  in.read(OAMADDR_);
+  in.read(v_);
+  in.read(t_);
+  in.read(fine_x_);
+  in.read(w_);
+  invalidate_canvas();
+  sprite_lines_dirty_ = true;
 }
 
 bool PPU::greyscale() { return PPUMASK_ & 0b1; }
 bool PPU::show_background() { return PPUMASK_ & 0b1000; }
-bool PPU::in_vblank() { return PPUSTATUS_ & 0b1000'0000; }
+bool PPU::in_vblank() { return PPUSTATUS_ & kVBlankFlag; }
 bool PPU::is_nmi_enabled() { return PPUCTRL_ & 0b1000'0000; }
+bool PPU::show_sprites() { return PPUMASK_ & 0b1'0000; }
+bool PPU::sprite_zero_hit() { return PPUSTATUS_ & kSpriteZeroHitFlag; }
+bool PPU::sprite_overflow() { return PPUSTATUS_ & kSpriteOverflowFlag; }
+bool PPU::rendering_enabled() { return show_background() || show_sprites(); }
 
 uint8_t PPU::read(uint16_t addr) {
   switch (addr) {
-    case 0x0000 ... 0x1FFF:  // Pattern table 0
-      BOOST_LOG_TRIVIAL(debug)
-          << "Pattern tables not implemented: " << util::fmt_hex(addr);
-      return 0xAA;
-    case 0x2000 ... 0x2FFF:  // Nametables
-      return nametables_[addr - 0x2000];
-    case 0x3000 ... 0x3EFF:  // Nametable mirror
-      return nametables_[addr - 0x3000];
+    case 0x0000 ... 0x1FFF:  // Pattern tables (cartridge CHR)
+      return cart_.ppu_read(addr);
+    case 0x2000 ... 0x3EFF:  // Nametables & mirror
+      return nametable_banks_[(addr >> 10) & 0b11][addr % kNametableSize_];
     case 0x3F00 ... 0x3FFF: {  // Palette RAM
       // from wiki: Greyscale is implemented as a bitwise AND with $30 on any
       //  value read from PPU $3F00-$3FFF, both on the display and through
@@ -222,15 +636,14 @@ uint8_t PPU::read(uint16_t addr) {
 
 bool PPU::write(uint16_t addr, uint8_t data) {
   switch (addr) {
-    case 0x0000 ... 0x1FFF:  // Pattern table 0
-      BOOST_LOG_TRIVIAL(debug)
-          << "Pattern tables not implemented: " << util::fmt_hex(addr);
-      return false;
-    case 0x2000 ... 0x2FFF:  // Nametables
-      nametables_[addr - 0x2000] = data;
+    case 0x0000 ... 0x1FFF:  // Pattern tables (cartridge CHR)
+      cart_.ppu_write(addr, data);
+      // Only CHR-RAM is writable, but any tile may have changed
+      invalidate_canvas();
       return true;
-    case 0x3000 ... 0x3EFF:  // Nametable mirror
-      nametables_[addr - 0x3000] = data;
+    case 0x2000 ... 0x3EFF:  // Nametables & mirror
+      nametable_banks_[(addr >> 10) & 0b11][addr % kNametableSize_] = data;
+      invalidate_nametable(addr);
       return true;
     case 0x3F00 ... 0x3FFF:  // Palette RAM & mirror
       palette_ram_[addr % 32] = data;
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <format>
+
+#include "cpu.hpp"
+#include "profiler.hpp"
+
+namespace profiler {
+
+Profiler::Profiler(SymbolMap symbols)
+    : symbols_(std::move(symbols)),
+      flat_(0x10000),
+      nodes_{{0, kRoot, 0}},
+      children_(),
+      stack_(),
+      node_(0),
+      total_(0),
+      running_(false),
+      pc_(0),
+      opcode_(0),
+      sp_(0),
+      cycle_(0) {}
+
+void Profiler::on_instruction(uint16_t pc, uint8_t opcode, uint8_t sp,
+                              uint64_t cycle) {
+  if (running_ && cycle < cycle_) {
+    // The clock went backwards, so a state was loaded
+    resume();
+  }
+  if (running_) {
+    charge(cycle);
+    follow(pc, sp);
+  }
+  running_ = true;
+  pc_ = pc;
+  opcode_ = opcode;
+  sp_ = sp;
+  cycle_ = cycle;
+}
+
+void Profiler::on_interrupt(uint16_t return_pc, uint16_t handler, uint8_t sp,
+                            uint64_t cycle) {
+  if (running_ && cycle >= cycle_) {
+    charge(cycle);
+    // An interrupt can cut in before the instruction in flight has run, in
+    // which case it runs again after the handler returns
+    if (return_pc != pc_) {
+      follow(return_pc, sp);
+    }
+  } else {
+    resume();
+  }
+  call(handler, sp);
+  // Until the handler's first instruction starts, cycles are the
+  // interrupt's own
+  running_ = true;
+  pc_ = handler;
+  opcode_ = cpu::kNOP;
+  sp_ = sp;
+  cycle_ = cycle;
+}
+
+void Profiler::charge(uint64_t cycle) {
+  uint64_t spent = cycle - cycle_;
+  flat_[pc_] += spent;
+  nodes_[node_].cycles += spent;
+  total_ += spent;
+}
+
+void Profiler::follow(uint16_t next_pc, uint8_t next_sp) {
+  switch (opcode_) {
+    case cpu::kJSR_ABS:
+      call(next_pc, sp_);
+      break;
+    case cpu::kRTS:
+    case cpu::kRTI:
+      return_to(next_sp);
+      break;
+    default:
+      break;
+  }
+}
+
+void Profiler::call(uint16_t function, uint8_t sp) {
+  if (stack_.size() == kMaxDepth) {
+    // Its return will find nothing to pop, as its stack pointer is below
+    // every tracked frame's
+    return;
+  }
+  uint64_t key = static_cast<uint64_t>(node_) << 17 | function;
+  auto [child, added] = children_.try_emplace(key, nodes_.size());
+  if (added) {
+    nodes_.push_back({node_, function, 0});
+  }
+  stack_.push_back({child->second, sp});
+  node_ = child->second;
+}
+
+void Profiler::return_to(uint8_t sp) {
+  while (!stack_.empty() && stack_.back().sp <= sp) {
+    stack_.pop_back();
+  }
+  node_ = stack_.empty() ? 0 : stack_.back().node;
+}
+
+void Profiler::resume() {
+  running_ = false;
+  stack_.clear();
+  node_ = 0;
+}
+
+void Profiler::reset() {
+  std::fill(flat_.begin(), flat_.end(), 0);
+  nodes_.resize(1);
+  nodes_[0].cycles = 0;
+  children_.clear();
+  total_ = 0;
+  resume();
+}
+
+uint64_t Profiler::cycles(uint16_t pc) const { return flat_[pc]; }
+
+uint64_t Profiler::total_cycles() const { return total_; }
+
+const SymbolMap& Profiler::symbols() const { return symbols_; }
+
+std::string Profiler::function_name(uint32_t function) const {
+  return function == kRoot ? "(root)"
+                           : symbols_.name(static_cast<uint16_t>(function));
+}
+
+void Profiler::print_report(std::ostream& out, std::size_t rows) const {
+  auto percent = [&](uint64_t cycles) {
+    return total_ == 0 ? 0.0 : 100.0 * cycles / total_;
+  };
+  out << std::format("Profiled {} cycles\n", total_);
+
+  // A function's total counts every stack it is on once, even if it recurses
+  std::map<uint32_t, std::pair<uint64_t, uint64_t>> functions;  // self, total
+  std::vector<uint32_t> on_stack;
+  for (const Node& node : nodes_) {
+    if (node.cycles == 0) {
+      continue;
+    }
+    functions[node.function].first += node.cycles;
+    on_stack.clear();
+    for (const Node* frame = &node;; frame = &nodes_[frame->parent]) {
+      if (std::find(on_stack.begin(), on_stack.end(), frame->function) ==
+          on_stack.end()) {
+        on_stack.push_back(frame->function);
+        functions[frame->function].second += node.cycles;
+      }
+      if (frame == &nodes_[0]) {
+        break;
+      }
+    }
+  }
+  std::vector<std::pair<uint32_t, std::pair<uint64_t, uint64_t>>> by_self(
+      functions.begin(), functions.end());
+  std::sort(by_self.begin(), by_self.end(), [](const auto& a, const auto& b) {
+    return a.second.first > b.second.first;
+  });
+  out << "Functions by self cycles:\n"
+      << std::format("{:>8} {:>8}  {}\n", "self", "total", "function");
+  for (std::size_t i = 0; i < std::min(rows, by_self.size()); i++) {
+    const auto& [function, cycles] = by_self[i];
+    out << std::format("{:>7.2f}% {:>7.2f}%  {}\n", percent(cycles.first),
+                       percent(cycles.second), function_name(function));
+  }
+
+  std::vector<uint16_t> pcs;
+  for (uint32_t pc = 0; pc < flat_.size(); pc++) {
+    if (flat_[pc] != 0) {
+      pcs.push_back(pc);
+    }
+  }
+  std::size_t shown = std::min(rows, pcs.size());
+  std::partial_sort(
+      pcs.begin(), pcs.begin() + shown, pcs.end(),
+      [&](uint16_t a, uint16_t b) { return flat_[a] > flat_[b]; });
+  out << "Hottest instructions:\n"
+      << std::format("{:>8} {:>12}  {}\n", "cycles", "", "location");
+  for (std::size_t i = 0; i < shown; i++) {
+    out << std::format("{:>7.2f}% {:>12}  {}\n", percent(flat_[pcs[i]]),
+                       flat_[pcs[i]], symbols_.locate(pcs[i]));
+  }
+}
+
+void Profiler::write_collapsed(std::ostream& out) const {
+  std::vector<std::string> path;
+  for (const Node& node : nodes_) {
+    if (node.cycles == 0) {
+      continue;
+    }
+    path.clear();
+    for (const Node* frame = &node;; frame = &nodes_[frame->parent]) {
+      path.push_back(function_name(frame->function));
+      if (frame == &nodes_[0]) {
+        break;
+      }
+    }
+    for (auto name = path.rbegin(); name != path.rend(); ++name) {
+      out << *name << (name + 1 == path.rend() ? " " : ";");
+    }
+    out << node.cycles << "\n";
+  }
+}
+
+}  // namespace profiler
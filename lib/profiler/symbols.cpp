@@ -0,0 +1,68 @@
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <sstream>
+
+#include "profiler.hpp"
+#include "util.hpp"
+
+namespace profiler {
+
+SymbolMap SymbolMap::load(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    throw symbol_error(std::format("could not open symbols '{}': {}", path,
+                                   std::strerror(errno)));
+  }
+  SymbolMap symbols;
+  for (std::string line; std::getline(in, line);) {
+    std::istringstream fields(line);
+    std::string kind;
+    std::string addr;
+    std::string name;
+    if (!(fields >> kind >> addr >> name) || kind != "al") {
+      continue;
+    }
+    if (name.starts_with('.')) {
+      name.erase(0, 1);
+    }
+    // Linker-generated symbols (e.g. __STARTUP_LOAD__) would hide the code's
+    // own labels
+    if (name.starts_with("__")) {
+      continue;
+    }
+    try {
+      symbols.add(static_cast<uint16_t>(std::stoul(addr, nullptr, 16)),
+                  std::move(name));
+    } catch (const std::logic_error&) {
+      throw symbol_error(
+          std::format("bad address '{}' in symbols '{}'", addr, path));
+    }
+  }
+  return symbols;
+}
+
+void SymbolMap::add(uint16_t addr, std::string name) {
+  labels_.try_emplace(addr, std::move(name));
+}
+
+std::string SymbolMap::name(uint16_t addr) const {
+  auto label = labels_.find(addr);
+  return label == labels_.end() ? util::fmt_hex(addr) : label->second;
+}
+
+std::string SymbolMap::locate(uint16_t addr) const {
+  auto after = labels_.upper_bound(addr);
+  if (after == labels_.begin()) {
+    return util::fmt_hex(addr);
+  }
+  auto label = std::prev(after);
+  return addr == label->first
+             ? label->second
+             : std::format("{}+{}", label->second, addr - label->first);
+}
+
+std::size_t SymbolMap::size() const { return labels_.size(); }
+
+}  // namespace profiler
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "cpu.hpp"
+#include "savestate.hpp"
+
+namespace savestate {
+
+namespace {
+
+// Deltas are a sequence of runs: a varint count of unchanged bytes, a varint
+// count of changed bytes, then the changed bytes XORed with their old values
+
+uint8_t *put_varint(uint8_t *out, std::size_t value) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+const uint8_t *get_varint(const uint8_t *in, std::size_t &value) {
+  value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = *in++;
+    value |= std::size_t{byte & 0x7Fu} << shift;
+    if (!(byte & 0x80)) {
+      return in;
+    }
+  }
+}
+
+// Upper bound on the encoded size of a delta of n bytes. Every run of changed
+// bytes but the first is preceded by at least two unchanged ones, which pay
+// for its two counts, so this is generous.
+std::size_t max_encoded_size(std::size_t n) { return n + n / 2 + 32; }
+
+// Encode a ^ b (both n bytes) into out, returning the encoded size
+std::size_t encode_delta(const uint8_t *a, const uint8_t *b, std::size_t n,
+                         uint8_t *out) {
+  uint8_t *p = out;
+  std::size_t i = 0;
+  while (i < n) {
+    // Unchanged bytes, a word at a time
+    std::size_t start = i;
+    while (i + 8 <= n && std::memcmp(a + i, b + i, 8) == 0) {
+      i += 8;
+    }
+    while (i < n && a[i] == b[i]) {
+      i++;
+    }
+    std::size_t unchanged = i - start;
+
+    // Changed bytes, up to the next pair of unchanged ones (a single
+    // unchanged byte costs less as a literal than as a new run)
+    start = i;
+    while (i < n && !(a[i] == b[i] && (i + 1 == n || a[i + 1] == b[i + 1]))) {
+      i++;
+    }
+    p = put_varint(p, unchanged);
+    p = put_varint(p, i - start);
+    for (std::size_t j = start; j < i; j++) {
+      *p++ = a[j] ^ b[j];
+    }
+  }
+  return p - out;
+}
+
+// XOR an encoded delta into state
+void apply_delta(const uint8_t *in, std::size_t size, uint8_t *state) {
+  const uint8_t *end = in + size;
+  std::size_t i = 0;
+  while (in < end) {
+    std::size_t unchanged, changed;
+    in = get_varint(in, unchanged);
+    in = get_varint(in, changed);
+    i += unchanged;
+    for (std::size_t j = 0; j < changed; j++) {
+      state[i++] ^= *in++;
+    }
+  }
+}
+
+}  // namespace
+
+RewindBuffer::RewindBuffer(std::size_t state_size, std::size_t capacity,
+                           std::size_t max_snapshots)
+    : current_(state_size),
+      scratch_(max_encoded_size(state_size)),
+      arena_(capacity),
+      entries_(std::max<std::size_t>(1, max_snapshots)),
+      first_(0),
+      count_(0),
+      head_(0),
+      used_(0) {}
+
+void RewindBuffer::push(std::span<const uint8_t> state) {
+  if (state.size() != current_.size()) {
+    throw savestate_error("rewind snapshot has the wrong size");
+  }
+  std::size_t size = encode_delta(state.data(), current_.data(), state.size(),
+                                  scratch_.data());
+  if (size > arena_.size()) {
+    // Too big to keep at all. The deltas before it would be unreachable, so
+    // start over.
+    clear();
+    return;
+  }
+  std::memcpy(current_.data(), state.data(), state.size());
+
+  if (count_ == entries_.size()) {
+    drop_oldest();
+  }
+  if (head_ + size > arena_.size()) {
+    // The oldest entries are the previous lap's, at or after head_, and
+    // nothing is written after head_ this lap
+    while (count_ > 0 && entries_[first_].offset >= head_) {
+      drop_oldest();
+    }
+    head_ = 0;
+  }
+  // Entries follow head_ in the arena oldest first, so dropping the oldest
+  // frees the space the new entry needs
+  while (count_ > 0 && entries_[first_].offset < head_ + size &&
+         head_ < entries_[first_].offset + entries_[first_].size) {
+    drop_oldest();
+  }
+  std::memcpy(arena_.data() + head_, scratch_.data(), size);
+  entries_[(first_ + count_) % entries_.size()] = {head_, size};
+  count_++;
+  head_ += size;
+  used_ += size;
+}
+
+bool RewindBuffer::pop(std::span<uint8_t> out) {
+  if (out.size() != current_.size()) {
+    throw savestate_error("rewind snapshot has the wrong size");
+  }
+  if (count_ == 0) {
+    return false;
+  }
+  std::memcpy(out.data(), current_.data(), current_.size());
+  const Entry &newest = entries_[(first_ + count_ - 1) % entries_.size()];
+  apply_delta(arena_.data() + newest.offset, newest.size, current_.data());
+  head_ = newest.offset;
+  used_ -= newest.size;
+  count_--;
+  return true;
+}
+
+void RewindBuffer::clear() {
+  std::fill(current_.begin(), current_.end(), 0);
+  first_ = 0;
+  count_ = 0;
+  head_ = 0;
+  used_ = 0;
+}
+
+std::size_t RewindBuffer::size() const { return count_; }
+std::size_t RewindBuffer::memory_used() const { return used_; }
+
+void RewindBuffer::drop_oldest() {
+  used_ -= entries_[first_].size;
+  first_ = (first_ + 1) % entries_.size();
+  count_--;
+}
+
+Rewinder::Rewinder(cpu::CPU &cpu, std::size_t interval, std::size_t capacity,
+                   std::size_t max_snapshots,
+                   std::function<void()> run_frame)
+    : cpu_(cpu),
+      run_frame_(run_frame ? std::move(run_frame)
+                           : [&cpu]() { cpu.advance_frame(); }),
+      interval_(std::max<std::size_t>(1, interval)),
+      frames_since_snapshot_(0),
+      state_(cpu.state_size()),
+      have_state_(false),
+      snapshotted_last_frame_(false),
+      buffer_(state_.size(), capacity, max_snapshots) {}
+
+void Rewinder::advance_frame(bool rewind) {
+  // Snapshots are taken at the start of a frame, so loading one and running
+  // the frame shows that frame again
+  if (rewind) {
+    if (!have_state_ && snapshotted_last_frame_ && buffer_.size() > 1) {
+      // The newest snapshot is of the frame on screen: start from the one
+      // before
+      buffer_.pop(state_);
+    }
+    have_state_ |= buffer_.pop(state_);
+    if (have_state_) {
+      cpu_.load_state(state_);
+      run_frame_();
+      // Resume recording from this frame once rewind is released
+      frames_since_snapshot_ = 0;
+      snapshotted_last_frame_ = false;
+      return;
+    }
+  }
+  have_state_ = false;
+
+  snapshotted_last_frame_ = frames_since_snapshot_ == 0;
+  if (snapshotted_last_frame_) {
+    cpu_.save_state(state_);
+    buffer_.push(state_);
+  }
+  run_frame_();
+  frames_since_snapshot_ = (frames_since_snapshot_ + 1) % interval_;
+}
+
+const RewindBuffer &Rewinder::buffer() const { return buffer_; }
+
+}  // namespace savestate
@@ -0,0 +1,39 @@
+#include "apu.hpp"
+#include "cpu.hpp"
+#include "ppu.hpp"
+#include "savestate.hpp"
+
+namespace savestate {
+
+RunAhead::RunAhead(cpu::CPU &cpu, ppu::PPU &ppu, std::size_t frames,
+                   std::optional<std::reference_wrapper<apu::APU>> apu)
+    : cpu_(cpu),
+      ppu_(ppu),
+      apu_(apu),
+      frames_(frames),
+      state_(cpu.state_size()) {}
+
+void RunAhead::advance_frame() {
+  if (frames_ == 0) {
+    cpu_.advance_frame();
+    return;
+  }
+  ppu_.suppress_output(true);
+  cpu_.advance_frame();
+  cpu_.save_state(state_);
+  if (apu_) {
+    apu_->get().suppress_output(true);
+  }
+  for (std::size_t frame = 1; frame < frames_; frame++) {
+    cpu_.advance_frame();
+  }
+  ppu_.suppress_output(false);
+  cpu_.advance_frame();
+  cpu_.load_state(state_);
+  // Back where output was suppressed, so the sound carries on seamlessly
+  if (apu_) {
+    apu_->get().suppress_output(false);
+  }
+}
+
+}  // namespace savestate
@@ -0,0 +1,66 @@
+#include <bit>
+#include <cstring>
+
+#include "util.hpp"
+
+namespace util {
+
+namespace {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+uint64_t hash_round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = std::rotl(acc, 31);
+  return acc * kPrime1;
+}
+
+}  // namespace
+
+uint64_t hash_bytes(std::span<const uint8_t> bytes) {
+  uint64_t v1 = kPrime1 + kPrime2;
+  uint64_t v2 = kPrime2;
+  uint64_t v3 = 0;
+  uint64_t v4 = -kPrime1;
+
+  const uint8_t* p = bytes.data();
+  const uint8_t* end = p + bytes.size();
+  for (; end - p >= 32; p += 32) {
+    uint64_t words[4];
+    std::memcpy(words, p, sizeof(words));
+    v1 = hash_round(v1, words[0]);
+    v2 = hash_round(v2, words[1]);
+    v3 = hash_round(v3, words[2]);
+    v4 = hash_round(v4, words[3]);
+  }
+
+  uint64_t h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+               std::rotl(v4, 18);
+  h += bytes.size();
+
+  // The tail that doesn't fill a stripe, a word and then a byte at a time
+  for (; end - p >= 8; p += 8) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    h ^= hash_round(0, word);
+    h = std::rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * kPrime5;
+    h = std::rotl(h, 11) * kPrime1;
+  }
+
+  // Avalanche so that every input bit affects every output bit
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h ^ kPrime4;
+}
+
+}  // namespace util
@@ -1,12 +1,17 @@
+#include <boost/core/null_deleter.hpp>
 #include <boost/log/core.hpp>
 #include <boost/log/expressions.hpp>
+#include <boost/log/sinks/sync_frontend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
 #include <boost/log/trivial.hpp>
+#include <boost/make_shared.hpp>
 #include <cstdlib>
 #include <format>
+#include <iostream>
 
 #include "util.hpp"
 
-namespace log = boost::log;
+namespace logging = boost::log;
 
 namespace util {
 void init_log_level() {
@@ -15,40 +20,56 @@ void init_log_level() {
     log_level = "INFO";
   }
 
-  log::trivial::severity_level level = log::trivial::info;
+  logging::trivial::severity_level level = logging::trivial::info;
 
   switch (log_level[0]) {
     case 't':
     case 'T':
-      level = log::trivial::trace;
+      level = logging::trivial::trace;
       break;
     case 'd':
     case 'D':
-      level = log::trivial::debug;
+      level = logging::trivial::debug;
       break;
     case 'i':
     case 'I':
-      level = log::trivial::info;
+      level = logging::trivial::info;
       break;
     case 'w':
     case 'W':
-      level = log::trivial::warning;
+      level = logging::trivial::warning;
       break;
     case 'e':
     case 'E':
-      level = log::trivial::error;
+      level = logging::trivial::error;
       break;
     case 'f':
     case 'F':
-      level = log::trivial::fatal;
+      level = logging::trivial::fatal;
       break;
   }
-  log::core::get()->set_filter(log::trivial::severity >= level);
+  logging::core::get()->set_filter(logging::trivial::severity >= level);
   return;
 }
 
-void set_log_level(log::trivial::severity_level level) {
-  log::core::get()->set_filter(log::trivial::severity >= level);
+void set_log_level(logging::trivial::severity_level level) {
+  logging::core::get()->set_filter(logging::trivial::severity >= level);
   return;
 }
+
+void log_to_stderr() {
+  using backend_t = logging::sinks::text_ostream_backend;
+  auto backend = boost::make_shared<backend_t>();
+  backend->add_stream(
+      boost::shared_ptr<std::ostream>(&std::clog, boost::null_deleter()));
+  backend->auto_flush(true);
+
+  auto sink = boost::make_shared<logging::sinks::synchronous_sink<backend_t>>(
+      backend);
+  sink->set_formatter(logging::expressions::stream
+                      << "[" << logging::trivial::severity << "]\t"
+                      << logging::expressions::smessage);
+  // Adding a sink replaces the default (stdout) one
+  logging::core::get()->add_sink(sink);
+}
 }  // namespace util
\ No newline at end of file
@@ -0,0 +1,205 @@
+#include "video.hpp"
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <string>
+
+#include "util.hpp"
+
+namespace video {
+
+// Frame rate written to the Y4M header, as a ratio (60.0988 Hz)
+constexpr char kY4MHeader[] =
+    "YUV4MPEG2 W256 H240 F60099:1000 Ip A1:1 C444 XCOLORRANGE=FULL\n";
+constexpr char kY4MFrameHeader[] = "FRAME\n";
+
+StreamSink::StreamSink(const std::string& path, Format format,
+                       bool drop_duplicates)
+    : out_(nullptr),
+      owns_out_(path != "-"),
+      format_(format),
+      drop_duplicates_(drop_duplicates),
+      write_buf_(kWriteBufferSize),
+      planes_(format == kY4M ? kPixels * 3 : 0),
+      last_frame_(drop_duplicates ? std::make_unique<ppu::PPU::frame_t>()
+                                  : nullptr),
+      have_last_frame_(false),
+      frames_written_(0),
+      frames_dropped_(0) {
+  out_ = owns_out_ ? std::fopen(path.c_str(), "wb") : stdout;
+  if (out_ == nullptr) {
+    throw video_error(std::format("could not open video output '{}': {}", path,
+                                  std::strerror(errno)));
+  }
+  // Fully buffered: the stream is flushed in kWriteBufferSize chunks
+  std::setvbuf(out_, write_buf_.data(), _IOFBF, write_buf_.size());
+
+  if (format_ == kY4M) {
+    write_bytes(kY4MHeader, sizeof(kY4MHeader) - 1);
+  }
+}
+
+StreamSink::~StreamSink() {
+  std::fflush(out_);
+  if (owns_out_) {
+    std::fclose(out_);
+  } else {
+    // Detach our buffer from stdout before it is freed
+    std::setvbuf(out_, nullptr, _IOFBF, BUFSIZ);
+  }
+  BOOST_LOG_TRIVIAL(info) << "Video stream closed: " << frames_written_
+                          << " frames written, " << frames_dropped_
+                          << " duplicate frames dropped";
+}
+
+void StreamSink::consume(const ppu::PPU::frame_t& frame) {
+  if (drop_duplicates_) {
+    if (have_last_frame_ &&
+        std::memcmp(last_frame_->data(), frame.data(), frame.size()) == 0) {
+      ++frames_dropped_;
+      return;
+    }
+    std::memcpy(last_frame_->data(), frame.data(), frame.size());
+    have_last_frame_ = true;
+  }
+
+  switch (format_) {
+    case kY4M: {
+      uint8_t* y = planes_.data();
+      uint8_t* cb = y + kPixels;
+      uint8_t* cr = cb + kPixels;
+      rgb_to_yuv444(frame.data(), y, cb, cr, kPixels);
+      write_bytes(kY4MFrameHeader, sizeof(kY4MFrameHeader) - 1);
+      write_bytes(planes_.data(), planes_.size());
+      break;
+    }
+    case kRGB:
+      write_bytes(frame.data(), frame.size());
+      break;
+  }
+  ++frames_written_;
+}
+
+std::size_t StreamSink::frames_written() const { return frames_written_; }
+std::size_t StreamSink::frames_dropped() const { return frames_dropped_; }
+
+StreamSink::Format StreamSink::format_from_string(const std::string& name) {
+  if (name == "y4m") {
+    return kY4M;
+  } else if (name == "rgb") {
+    return kRGB;
+  }
+  throw video_error(std::format("unknown video format '{}'", name));
+}
+
+void StreamSink::write_bytes(const void* data, std::size_t size) {
+  if (std::fwrite(data, 1, size, out_) != size) {
+    BOOST_LOG_TRIVIAL(error) << "Failed to write video stream: "
+                             << std::strerror(errno);
+  }
+}
+
+HashSink::HashSink() : out_(nullptr), hashes_() {}
+
+HashSink::HashSink(const std::string& path) : HashSink() {
+  out_ = std::fopen(path.c_str(), "w");
+  if (out_ == nullptr) {
+    throw video_error(std::format("could not open hash log '{}': {}", path,
+                                  std::strerror(errno)));
+  }
+  std::fputs("# nesemu frame hash log v1\n", out_);
+}
+
+HashSink::~HashSink() {
+  if (out_ != nullptr) {
+    std::fclose(out_);
+  }
+}
+
+void HashSink::consume(const ppu::PPU::frame_t& frame) {
+  uint64_t hash = hash_frame(frame);
+  hashes_.push_back(hash);
+  if (out_ != nullptr) {
+    std::fprintf(out_, "%016llx\n", static_cast<unsigned long long>(hash));
+  }
+}
+
+const std::vector<uint64_t>& HashSink::hashes() const { return hashes_; }
+
+uint64_t hash_frame(const ppu::PPU::frame_t& frame) {
+  return util::hash_bytes(frame);
+}
+
+std::vector<uint64_t> read_hash_log(std::istream& in) {
+  std::vector<uint64_t> hashes;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::size_t parsed = 0;
+    uint64_t hash = 0;
+    try {
+      hash = std::stoull(line, &parsed, 16);
+    } catch (const std::logic_error&) {
+      parsed = 0;
+    }
+    if (parsed != line.size()) {
+      throw video_error(std::format("malformed hash log line: '{}'", line));
+    }
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+// 16 lanes of 16-bit integers. GCC/Clang lower these to SSE2/AVX2/NEON
+// depending on the target, so no per-ISA code paths are needed.
+using u16x16 = uint16_t __attribute__((vector_size(32)));
+using i16x16 = int16_t __attribute__((vector_size(32)));
+using u8x16 = uint8_t __attribute__((vector_size(16)));
+constexpr std::size_t kLanes = 16;
+
+void rgb_to_yuv444(const uint8_t* rgb, uint8_t* y, uint8_t* cb, uint8_t* cr,
+                   std::size_t count) {
+  // Fixed point (x256) full-range BT.601 coefficients:
+  //   Y  =  0.299 R + 0.587 G + 0.114 B
+  //   Cb = -0.169 R - 0.331 G + 0.500 B + 128
+  //   Cr =  0.500 R - 0.419 G - 0.081 B + 128
+  // The Y sum is at most 256 * 255 so it fits in unsigned 16 bits, and the
+  // chroma sums lie within +-128 * 255 so they fit in signed 16 bits.
+  std::size_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    u16x16 r, g, b;
+    const uint8_t* px = rgb + i * 3;
+    for (std::size_t lane = 0; lane < kLanes; ++lane) {
+      r[lane] = px[lane * 3];
+      g[lane] = px[lane * 3 + 1];
+      b[lane] = px[lane * 3 + 2];
+    }
+
+    u16x16 luma = (r * 77 + g * 150 + b * 29 + 128) >> 8;
+
+    i16x16 sr = (i16x16)r, sg = (i16x16)g, sb = (i16x16)b;
+    i16x16 chroma_b = ((sb * 128 - sr * 43 - sg * 85) >> 8) + 128;
+    i16x16 chroma_r = ((sr * 128 - sg * 107 - sb * 21) >> 8) + 128;
+
+    u8x16 y8 = __builtin_convertvector(luma, u8x16);
+    u8x16 cb8 = __builtin_convertvector(chroma_b, u8x16);
+    u8x16 cr8 = __builtin_convertvector(chroma_r, u8x16);
+    std::memcpy(y + i, &y8, kLanes);
+    std::memcpy(cb + i, &cb8, kLanes);
+    std::memcpy(cr + i, &cr8, kLanes);
+  }
+
+  // Scalar tail (never taken for full frames, which are a multiple of 16)
+  for (; i < count; ++i) {
+    int r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+    y[i] = (r * 77 + g * 150 + b * 29 + 128) >> 8;
+    cb[i] = ((b * 128 - r * 43 - g * 85) >> 8) + 128;
+    cr[i] = ((r * 128 - g * 107 - b * 21) >> 8) + 128;
+  }
+}
+
+}  // namespace video